@@ -10,6 +10,7 @@
 //
 // コンパイル方法:
 // g++ -std=c++11 ConfigSynchronizer.cpp -o ConfigSynchronizer -liniparser -lpthread
+// （main() を除いたライブラリ libconfigsync は make lib、クライアントSDKは make client）
 
 #include <iostream>
 #include <string>
@@ -23,24 +24,840 @@
 #include <atomic>
 #include <set>
 #include <algorithm>
+#include <cmath>
+#include <deque>
+#include <functional>
+#include <future>
+#include <condition_variable>
+#include <memory>
+#include <type_traits>
+#include <cstdio>
+#include <ctime>
 
 // Linux用のソケットライブラリ
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <cstring>
+#include <strings.h>
 #include <signal.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 // iniparserライブラリ（Raspberry Piで利用可能）
 #include <iniparser/iniparser.h>
 
+#include "configsync.h"
+
+// ---------------------------------------------------------------------------
+// 静的トレースポイント（USDT）
+// sys/sdt.h（systemtap-sdt-dev）があれば、プロバイダ configsync のプローブとして
+// nop命令とELFノートを埋め込む。プローブが無効な間のコストはnop 1命令だけで、
+// perf probe / bpftrace から有効化してメッセージごとの時系列を再構成できる。
+//   例: bpftrace -e 'usdt:./ConfigSynchronizer:configsync:commit { printf("%d %d\n", arg0, arg1); }'
+// ヘッダーがない環境や -DCONFIGSYNC_NO_PROBES の場合は何も埋め込まない（引数も評価しない）。
+//
+// プローブ一覧（引数は順に arg0, arg1, ...）
+//   accept(conn_id, is_local, peer)                 接続を受け付けた
+//   header_parsed(conn_id, body_length)             フレームのヘッダーを読んだ
+//   body_received(conn_id, bytes, is_query)         本体を受信し終えた
+//   update_parsed(conn_id, staged_keys)             更新をパースし終えた（コミット前）
+//   commit(conn_id, version, changed_keys)          更新をコミットした（conn_id=0 は接続以外から）
+//   save_start(target, version)                     保存を開始した（target: 0=ジャーナル, 1=設定ファイル）
+//   save_end(target, version, bytes, ok)            保存を終えた
+//   outbound_connect(conn_id, port, version)        送信用の接続を開始した
+//   outbound_send_complete(conn_id, bytes, version, ok)  送信を終えた（成功/失敗）
+// conn_id は受信・送信で共通の通し番号。
+// ---------------------------------------------------------------------------
+#if !defined(CONFIGSYNC_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define CONFIGSYNC_HAVE_SDT 1
+#endif
+#endif
+
+#ifdef CONFIGSYNC_HAVE_SDT
+#define TRACE_PROBE2(name, a1, a2) DTRACE_PROBE2(configsync, name, a1, a2)
+#define TRACE_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(configsync, name, a1, a2, a3)
+#define TRACE_PROBE4(name, a1, a2, a3, a4) DTRACE_PROBE4(configsync, name, a1, a2, a3, a4)
+#else
+#define TRACE_PROBE2(name, a1, a2) do { if (false) { (void)(a1); (void)(a2); } } while (0)
+#define TRACE_PROBE3(name, a1, a2, a3) do { if (false) { (void)(a1); (void)(a2); (void)(a3); } } while (0)
+#define TRACE_PROBE4(name, a1, a2, a3, a4) \
+    do { if (false) { (void)(a1); (void)(a2); (void)(a3); (void)(a4); } } while (0)
+#endif
+
+enum SaveTarget {
+    SAVE_TARGET_JOURNAL = 0,
+    SAVE_TARGET_CONFIG_FILE = 1
+};
+
+// 受信・送信の接続に振る通し番号（トレースで1つのメッセージを追うため）
+std::atomic<uint64_t> g_next_connection_id{1};
+// 現在のスレッドが処理中の受信接続の番号（接続以外から呼ばれた場合は0）
+thread_local uint64_t t_trace_connection_id = 0;
+
+// ---------------------------------------------------------------------------
+// 計測（メトリクス）
+// 記録は固定サイズの配列へのアトミック加算だけで行い、常時有効にしておける。
+// ---------------------------------------------------------------------------
+
+/**
+ * @brief HDR方式のレイテンシヒストグラム（ナノ秒単位）
+ *
+ * 2のべき乗ごとの区間をさらに16分割した対数線形のバケットに数える。
+ * 相対誤差は約6%で、1ナノ秒から数百年までを固定サイズで扱える。
+ * record()はロックを取らず、複数スレッドから同時に呼べる。
+ */
+class LatencyHistogram {
+public:
+    static const int SUB_BUCKET_BITS = 4;
+    static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static const int BUCKETS = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+    LatencyHistogram() : count_(0), sum_ns_(0), max_ns_(0) {
+        for (int i = 0; i < BUCKETS; ++i) {
+            buckets_[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void record(uint64_t ns) {
+        buckets_[bucket_of(ns)].fetch_add(1, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+        sum_ns_.fetch_add(ns, std::memory_order_relaxed);
+        uint64_t max = max_ns_.load(std::memory_order_relaxed);
+        while (ns > max && !max_ns_.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {
+        }
+    }
+
+    uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+    uint64_t sum_ns() const { return sum_ns_.load(std::memory_order_relaxed); }
+    uint64_t max_ns() const { return max_ns_.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief 記録を消す（同時に記録されている値は一部が残ることがある）
+     */
+    void reset() {
+        for (int i = 0; i < BUCKETS; ++i) {
+            buckets_[i].store(0, std::memory_order_relaxed);
+        }
+        count_.store(0, std::memory_order_relaxed);
+        sum_ns_.store(0, std::memory_order_relaxed);
+        max_ns_.store(0, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief 分位点（0〜1）の値を返す（バケット内の最大値で近似）
+     */
+    uint64_t quantile_ns(double q) const {
+        uint64_t total = 0;
+        std::vector<uint64_t> counts(BUCKETS);
+        for (int i = 0; i < BUCKETS; ++i) {
+            counts[i] = buckets_[i].load(std::memory_order_relaxed);
+            total += counts[i];
+        }
+        if (total == 0) {
+            return 0;
+        }
+        uint64_t target = std::max<uint64_t>(1, (uint64_t)std::ceil(q * total));
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; ++i) {
+            seen += counts[i];
+            if (seen >= target) {
+                return std::min(highest_equivalent(i), max_ns());
+            }
+        }
+        return max_ns();
+    }
+
+private:
+    static int bucket_of(uint64_t value) {
+        if (value < (uint64_t)SUB_BUCKETS) {
+            return (int)value;
+        }
+        int msb = 63 - __builtin_clzll(value);
+        int shift = msb - SUB_BUCKET_BITS;
+        return (shift + 1) * SUB_BUCKETS + (int)((value >> shift) & (SUB_BUCKETS - 1));
+    }
+
+    static uint64_t highest_equivalent(int index) {
+        if (index < SUB_BUCKETS) {
+            return index;
+        }
+        int shift = index / SUB_BUCKETS - 1;
+        uint64_t lower = (uint64_t)(SUB_BUCKETS + index % SUB_BUCKETS) << shift;
+        return lower + ((uint64_t)1 << shift) - 1;
+    }
+
+    std::atomic<uint64_t> buckets_[BUCKETS];
+    std::atomic<uint64_t> count_;
+    std::atomic<uint64_t> sum_ns_;
+    std::atomic<uint64_t> max_ns_;
+};
+
+/**
+ * @brief スコープを抜けるまでの時間をヒストグラムに記録する
+ */
+class ScopedLatency {
+public:
+    explicit ScopedLatency(LatencyHistogram& histogram)
+        : histogram_(histogram), start_(std::chrono::steady_clock::now()) {}
+    ~ScopedLatency() {
+        histogram_.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start_).count());
+    }
+
+private:
+    LatencyHistogram& histogram_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+// ロックの呼び出し元ごとの計測（CONFIGSYNC_LOCK_PROFILE=0 でビルドすると呼び出し元の登録ごと無くなる）
+#ifndef CONFIGSYNC_LOCK_PROFILE
+#define CONFIGSYNC_LOCK_PROFILE 1
+#endif
+
+// 呼び出し元ごとの計測を行うか（CONFIG_SYNC:LOCK_PROFILE または対話コマンド "l on" で有効にする）
+std::atomic<bool> g_lock_profiling{false};
+
+/**
+ * @brief ロックの呼び出し元1か所の統計
+ *
+ * LOCK_SITE() で呼び出し元ごとに静的に1つ作られ、作られた順に一覧へつながる。
+ * 記録はアトミック加算だけで行う。
+ */
+class LockSite {
+public:
+    LockSite(const char* function, int line) : function_(function), line_(line), contended_(0), caused_wait_ns_(0) {
+        next_ = head().load();
+        while (!head().compare_exchange_weak(next_, this)) {
+        }
+    }
+
+    static std::atomic<LockSite*>& head() {
+        static std::atomic<LockSite*> first{nullptr};
+        return first;
+    }
+
+    void record_wait(uint64_t wait_ns) {
+        contended_.fetch_add(1, std::memory_order_relaxed);
+        wait_.record(wait_ns);
+    }
+
+    // この呼び出し元が保持している間に、他のスレッドが待たされた時間
+    void record_caused_wait(uint64_t wait_ns) {
+        caused_wait_ns_.fetch_add(wait_ns, std::memory_order_relaxed);
+    }
+
+    void record_hold(uint64_t hold_ns) {
+        hold_.record(hold_ns);
+    }
+
+    void reset() {
+        contended_.store(0, std::memory_order_relaxed);
+        caused_wait_ns_.store(0, std::memory_order_relaxed);
+        wait_.reset();
+        hold_.reset();
+    }
+
+    const char* function() const { return function_; }
+    int line() const { return line_; }
+    LockSite* next() const { return next_; }
+    uint64_t acquisitions() const { return hold_.count(); }
+    uint64_t contended() const { return contended_.load(std::memory_order_relaxed); }
+    uint64_t caused_wait_ns() const { return caused_wait_ns_.load(std::memory_order_relaxed); }
+    const LatencyHistogram& wait_histogram() const { return wait_; }
+    const LatencyHistogram& hold_histogram() const { return hold_; }
+
+private:
+    const char* function_;
+    int line_;
+    LockSite* next_;
+    std::atomic<uint64_t> contended_;
+    std::atomic<uint64_t> caused_wait_ns_;
+    LatencyHistogram wait_;
+    LatencyHistogram hold_;
+};
+
+#if CONFIGSYNC_LOCK_PROFILE
+// 呼び出し元ごとに1つの LockSite を返す（関数内の静的変数なので初回だけ登録される）
+#define LOCK_SITE() ([](const char* function) -> LockSite* { \
+        static LockSite site(function, __LINE__); \
+        return &site; \
+    }(__func__))
+#else
+#define LOCK_SITE() static_cast<LockSite*>(nullptr)
+#endif
+
+/**
+ * @brief 待ち時間を計測するミューテックス（std::mutexと同じ使い方ができる）
+ *
+ * まずtry_lock()を試し、取れなかったときだけ時刻を測って待つため、
+ * 競合が無いときのコストはstd::mutexとほぼ変わらない。
+ * lock_at()で呼び出し元を渡すと、計測が有効な間は呼び出し元ごとの
+ * 待ち時間・保持時間・競合回数と、待たせた側の呼び出し元も記録する。
+ */
+class TimedMutex {
+public:
+    TimedMutex() : acquisitions_(0), contended_(0), holder_(nullptr) {}
+
+    void lock() {
+        lock_at(nullptr);
+    }
+
+    void lock_at(LockSite* site) {
+        acquisitions_.fetch_add(1, std::memory_order_relaxed);
+        bool profiling = site != nullptr && g_lock_profiling.load(std::memory_order_relaxed);
+        if (!mutex_.try_lock()) {
+            // 待たされた相手（その時点の保持者）も覚えておく
+            LockSite* blocker = holder_.load(std::memory_order_relaxed);
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            mutex_.lock();
+            uint64_t wait_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+            contended_.fetch_add(1, std::memory_order_relaxed);
+            wait_.record(wait_ns);
+            if (profiling) {
+                site->record_wait(wait_ns);
+                if (blocker != nullptr) {
+                    blocker->record_caused_wait(wait_ns);
+                }
+            }
+        }
+        if (profiling) {
+            hold_start_ = std::chrono::steady_clock::now();
+            holder_.store(site, std::memory_order_relaxed);
+        }
+    }
+
+    bool try_lock() {
+        if (!mutex_.try_lock()) {
+            return false;
+        }
+        acquisitions_.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    void unlock() {
+        LockSite* site = holder_.load(std::memory_order_relaxed);
+        if (site != nullptr) {
+            holder_.store(nullptr, std::memory_order_relaxed);
+            site->record_hold(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - hold_start_).count());
+        }
+        mutex_.unlock();
+    }
+
+    uint64_t acquisitions() const { return acquisitions_.load(std::memory_order_relaxed); }
+    uint64_t contended() const { return contended_.load(std::memory_order_relaxed); }
+    const LatencyHistogram& wait_histogram() const { return wait_; }
+
+private:
+    std::mutex mutex_;
+    std::atomic<uint64_t> acquisitions_;
+    std::atomic<uint64_t> contended_;
+    LatencyHistogram wait_;
+    std::atomic<LockSite*> holder_;                  // 計測中の保持者（保持者だけが書く）
+    std::chrono::steady_clock::time_point hold_start_;
+};
+
+/**
+ * @brief 呼び出し元を付けてロックを取るガード（std::unique_lockと同様に途中で外せる）
+ */
+class SiteLockGuard {
+public:
+    SiteLockGuard(TimedMutex& mutex, LockSite* site) : mutex_(mutex), owns_(true) {
+        mutex_.lock_at(site);
+    }
+    ~SiteLockGuard() {
+        if (owns_) {
+            mutex_.unlock();
+        }
+    }
+
+    void unlock() {
+        mutex_.unlock();
+        owns_ = false;
+    }
+
+private:
+    SiteLockGuard(const SiteLockGuard&);
+    SiteLockGuard& operator=(const SiteLockGuard&);
+
+    TimedMutex& mutex_;
+    bool owns_;
+};
+
+// 所要時間を計測する処理段階
+enum MetricStage {
+    STAGE_LOAD_CONFIG,
+    STAGE_SERIALIZE_CONFIG,
+    STAGE_RECEIVE_MESSAGE,    // ヘッダー受信後、フレーム全体を受信するまで
+    STAGE_UPDATE_FROM_STRING,
+    STAGE_COMMIT_UPDATE,
+    STAGE_QUERY,
+    STAGE_SAVE_CONFIG,
+    STAGE_JOURNAL_APPEND,
+    STAGE_PUSH_SEND,          // WPFへの送信（接続開始から送信完了まで）
+    STAGE_PRESET_ACTIVATE,    // プリセットの適用（コミットと送信の依頼まで）
+    STAGE_ROLLOUT,            // 複数ノードへのロールアウト（準備から全ノードのコミット確認まで）
+    STAGE_COUNT
+};
+
+/**
+ * @brief 処理段階ごとのヒストグラムと、接続相手ごとの送受信カウンタ
+ */
+class Metrics {
+public:
+    struct PeerCounters {
+        uint64_t bytes_received = 0;
+        uint64_t bytes_sent = 0;
+        uint64_t messages_received = 0;
+        uint64_t messages_sent = 0;
+    };
+
+    LatencyHistogram& stage(MetricStage stage) {
+        return stages_[stage];
+    }
+
+    static const char* stage_name(int stage) {
+        static const char* const names[STAGE_COUNT] = {
+            "load_config", "serialize_config", "receive_message", "update_config_from_string",
+            "commit_update", "query", "save_config", "journal_append", "push_send",
+            "preset_activate", "rollout"
+        };
+        return names[stage];
+    }
+
+    void add_peer_traffic(const std::string& peer, const PeerCounters& delta) {
+        std::lock_guard<std::mutex> lock(peers_mutex_);
+        PeerCounters& counters = peers_[peer];
+        counters.bytes_received += delta.bytes_received;
+        counters.bytes_sent += delta.bytes_sent;
+        counters.messages_received += delta.messages_received;
+        counters.messages_sent += delta.messages_sent;
+    }
+
+    std::map<std::string, PeerCounters> peers() {
+        std::lock_guard<std::mutex> lock(peers_mutex_);
+        return peers_;
+    }
+
+private:
+    LatencyHistogram stages_[STAGE_COUNT];
+    std::mutex peers_mutex_;
+    std::map<std::string, PeerCounters> peers_;
+};
+
+Metrics g_metrics;
+
+/**
+ * @brief 1つの接続で送受信した量を数え、接続の終わりにまとめて記録する
+ */
+class PeerTraffic {
+public:
+    explicit PeerTraffic(const std::string& peer) : peer_(peer) {}
+    ~PeerTraffic() {
+        g_metrics.add_peer_traffic(peer_, counters_);
+    }
+
+    void received(size_t bytes) { counters_.bytes_received += bytes; }
+    void message_received() { counters_.messages_received++; }
+    void sent(size_t bytes) {
+        counters_.bytes_sent += bytes;
+        counters_.messages_sent++;
+    }
+
+private:
+    std::string peer_;
+    Metrics::PeerCounters counters_;
+};
+
+// ---------------------------------------------------------------------------
+// 非同期ログ
+// 通信や更新の処理中は、固定長のレコードをロックフリーのリングバッファに積むだけにし、
+// 文字列への整形と出力はバックグラウンドのスレッドが行う。
+// ---------------------------------------------------------------------------
+
+// これより低いレベルのログはコンパイル時に取り除かれる（0:DEBUG 1:INFO 2:WARN 3:ERROR）
+#ifndef CONFIGSYNC_MIN_LOG_LEVEL
+#define CONFIGSYNC_MIN_LOG_LEVEL 1
+#endif
+
+enum LogLevel {
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR
+};
+
+/**
+ * @brief ログ1件分の固定長レコード
+ *
+ * formatは文字列リテラルを指す。"%s" は text に NUL 区切りで詰めた文字列を、
+ * "%d" と "%f" は values を先頭から順に取り出して埋める。
+ */
+struct LogRecord {
+    static const int MAX_VALUES = 4;
+    static const int TEXT_SIZE = 120;
+
+    union Value {
+        int64_t i;
+        double d;
+    };
+
+    uint64_t time_us;
+    const char* format;
+    uint8_t level;
+    uint8_t value_count;
+    uint8_t text_length;
+    Value values[MAX_VALUES];
+    char text[TEXT_SIZE];
+};
+
+inline void pack_log_arg(LogRecord& record, const char* text) {
+    size_t length = strlen(text);
+    size_t room = LogRecord::TEXT_SIZE - record.text_length;
+    if (room == 0) {
+        return;
+    }
+    if (length >= room) {
+        // 入りきらない分は切り詰める（UTF-8の文字の途中では切らない）
+        length = room - 1;
+        while (length > 0 && (text[length] & 0xC0) == 0x80) {
+            length--;
+        }
+    }
+    memcpy(record.text + record.text_length, text, length);
+    record.text_length += length;
+    record.text[record.text_length++] = '\0';
+}
+
+inline void pack_log_arg(LogRecord& record, const std::string& text) {
+    pack_log_arg(record, text.c_str());
+}
+
+inline void pack_log_arg(LogRecord& record, double value) {
+    if (record.value_count < LogRecord::MAX_VALUES) {
+        record.values[record.value_count++].d = value;
+    }
+}
+
+template <typename T>
+inline typename std::enable_if<std::is_integral<T>::value>::type pack_log_arg(LogRecord& record, T value) {
+    if (record.value_count < LogRecord::MAX_VALUES) {
+        record.values[record.value_count++].i = (int64_t)value;
+    }
+}
+
+inline void pack_log_args(LogRecord&) {}
+
+template <typename First, typename... Rest>
+inline void pack_log_args(LogRecord& record, const First& first, const Rest&... rest) {
+    pack_log_arg(record, first);
+    pack_log_args(record, rest...);
+}
+
+/**
+ * @brief 複数の書き手と1つの読み手のための、ロックフリーの有界リングバッファ
+ *
+ * 各スロットの通し番号で空きと書き込み済みを区別する（Vyukovの方式）。
+ * 満杯のときは待たずにレコードを捨て、捨てた件数だけを数える。
+ */
+class AsyncLogger {
+public:
+    static const size_t CAPACITY = 4096;  // 2のべき乗
+
+    AsyncLogger()
+        : slots_(new Slot[CAPACITY]), enqueue_pos_(0), dequeue_pos_(0), dropped_(0),
+          out_(stdout), err_(stderr), running_(false) {
+        for (size_t i = 0; i < CAPACITY; ++i) {
+            slots_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    ~AsyncLogger() {
+        stop();
+    }
+
+    /**
+     * @brief 書き出しスレッドを開始する
+     * @param out INFO以下の出力先
+     * @param err WARN以上の出力先
+     */
+    void start(FILE* out = stdout, FILE* err = stderr) {
+        if (running_.load()) {
+            return;
+        }
+        out_ = out;
+        err_ = err;
+        running_.store(true);
+        thread_ = std::thread(&AsyncLogger::run, this);
+    }
+
+    /**
+     * @brief 残っているレコードを書き出してからスレッドを止める
+     */
+    void stop() {
+        if (!running_.exchange(false)) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(wake_mutex_);
+        }
+        wake_cv_.notify_all();
+        thread_.join();
+    }
+
+    bool try_push(const LogRecord& record) {
+        size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+        while (true) {
+            Slot& slot = slots_[pos & (CAPACITY - 1)];
+            size_t sequence = slot.sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+            if (diff == 0) {
+                if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    slot.record = record;
+                    slot.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            } else {
+                pos = enqueue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    uint64_t dropped() const {
+        return dropped_.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct Slot {
+        std::atomic<size_t> sequence;
+        LogRecord record;
+    };
+
+    bool try_pop(LogRecord& record) {
+        Slot& slot = slots_[dequeue_pos_ & (CAPACITY - 1)];
+        size_t sequence = slot.sequence.load(std::memory_order_acquire);
+        if ((intptr_t)sequence - (intptr_t)(dequeue_pos_ + 1) < 0) {
+            return false;
+        }
+        record = slot.record;
+        slot.sequence.store(dequeue_pos_ + CAPACITY, std::memory_order_release);
+        dequeue_pos_++;
+        return true;
+    }
+
+    static void format(const LogRecord& record, std::string& line) {
+        char stamp[32];
+        time_t seconds = (time_t)(record.time_us / 1000000);
+        struct tm local;
+        localtime_r(&seconds, &local);
+        size_t length = strftime(stamp, sizeof(stamp), "[%H:%M:%S", &local);
+        snprintf(stamp + length, sizeof(stamp) - length, ".%03d] ", (int)(record.time_us / 1000 % 1000));
+        line += stamp;
+
+        const char* text = record.text;
+        const char* text_end = record.text + record.text_length;
+        int value_index = 0;
+        char number[32];
+        for (const char* p = record.format; *p; ++p) {
+            if (*p != '%' || p[1] == '\0') {
+                line += *p;
+                continue;
+            }
+            ++p;
+            if (*p == 's') {
+                if (text < text_end) {
+                    line += text;
+                    text += strlen(text) + 1;
+                }
+            } else if (*p == 'd' && value_index < record.value_count) {
+                snprintf(number, sizeof(number), "%lld", (long long)record.values[value_index++].i);
+                line += number;
+            } else if (*p == 'f' && value_index < record.value_count) {
+                snprintf(number, sizeof(number), "%.1f", record.values[value_index++].d);
+                line += number;
+            } else if (*p == '%') {
+                line += '%';
+            }
+        }
+        line += '\n';
+    }
+
+    void run() {
+        std::string out_buffer;
+        std::string err_buffer;
+        uint64_t reported_dropped = 0;
+        LogRecord record;
+        while (true) {
+            bool stopping = !running_.load();
+            while (try_pop(record)) {
+                format(record, record.level >= LOG_LEVEL_WARN ? err_buffer : out_buffer);
+            }
+            uint64_t dropped = dropped_.load(std::memory_order_relaxed);
+            if (dropped != reported_dropped) {
+                err_buffer += "警告: ログが溢れたため " + std::to_string(dropped - reported_dropped) +
+                              " 件を破棄しました。\n";
+                reported_dropped = dropped;
+            }
+            if (!out_buffer.empty()) {
+                fwrite(out_buffer.data(), 1, out_buffer.size(), out_);
+                fflush(out_);
+                out_buffer.clear();
+            }
+            if (!err_buffer.empty()) {
+                fwrite(err_buffer.data(), 1, err_buffer.size(), err_);
+                fflush(err_);
+                err_buffer.clear();
+            }
+            if (stopping) {
+                return;
+            }
+            // 書き手は起こさない（ロックを取らせない）ので、短い間隔で見に行く
+            std::unique_lock<std::mutex> lock(wake_mutex_);
+            wake_cv_.wait_for(lock, std::chrono::milliseconds(20));
+        }
+    }
+
+    std::unique_ptr<Slot[]> slots_;
+    std::atomic<size_t> enqueue_pos_;
+    size_t dequeue_pos_;  // 読み手（書き出しスレッド）だけが触る
+    std::atomic<uint64_t> dropped_;
+    FILE* out_;
+    FILE* err_;
+    std::atomic<bool> running_;
+    std::thread thread_;
+    std::mutex wake_mutex_;
+    std::condition_variable wake_cv_;
+};
+
+AsyncLogger g_logger;
+
+/**
+ * @brief ログを1件積む（整形は書き出しスレッドが行う）
+ * @param format 文字列リテラル（%s, %d, %f を使える）
+ */
+template <typename... Args>
+void log_event(LogLevel level, const char* format, const Args&... args) {
+    LogRecord record;
+    record.time_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    record.format = format;
+    record.level = level;
+    record.value_count = 0;
+    record.text_length = 0;
+    pack_log_args(record, args...);
+    g_logger.try_push(record);
+}
+
+#define LOG_DEBUG(...) do { if (CONFIGSYNC_MIN_LOG_LEVEL <= 0) log_event(LOG_LEVEL_DEBUG, __VA_ARGS__); } while (0)
+#define LOG_INFO(...) do { if (CONFIGSYNC_MIN_LOG_LEVEL <= 1) log_event(LOG_LEVEL_INFO, __VA_ARGS__); } while (0)
+#define LOG_WARN(...) do { if (CONFIGSYNC_MIN_LOG_LEVEL <= 2) log_event(LOG_LEVEL_WARN, __VA_ARGS__); } while (0)
+#define LOG_ERROR(...) log_event(LOG_LEVEL_ERROR, __VA_ARGS__)
+
 // グローバル変数: 設定データと、スレッドセーフなアクセスのためのミューテックス
-std::map<std::string, std::map<std::string, std::string>> g_config_data;
-std::mutex g_config_mutex;
+typedef std::map<std::string, std::map<std::string, std::string>> ConfigData;
+ConfigData g_config_data;
+TimedMutex g_config_mutex;
 std::atomic<bool> g_shutdown_flag{false};
+// 設定ファイルのパス（ジャーナルなど関連ファイルの基準）
+std::string g_config_path = "config.ini";
+// 設定のバージョン（変更がコミットされるたびに1増える）
+std::atomic<uint64_t> g_config_version{0};
+
+/**
+ * @brief ハイブリッド論理時計（HLC）
+ *
+ * 上位48ビットが壁時計のミリ秒、下位16ビットが同じミリ秒の中の順番。
+ * 他のノードの時刻を observe() すると、以降の now() はそれより必ず大きくなるため、
+ * ノード間で時計がずれていても、因果的に後の書き込みほど大きな値になる。
+ */
+class HybridClock {
+public:
+    HybridClock() : last_(0) {}
+
+    uint64_t now() {
+        uint64_t physical = (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count() << 16;
+        std::lock_guard<std::mutex> lock(mutex_);
+        last_ = std::max(last_ + 1, physical);
+        return last_;
+    }
+
+    void observe(uint64_t remote) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        last_ = std::max(last_, remote);
+    }
+
+private:
+    std::mutex mutex_;
+    uint64_t last_;
+};
+
+/**
+ * @brief 項目ごとの最終書き込みの時刻（レプリケーションの後勝ち判定に使う）
+ *
+ * 設定ファイルから読んだだけの項目は {0, 0}。時刻が同じ場合はノード番号の大きい方、
+ * それも同じなら値を比べて決めるので、どのノードでも同じ結果になる。
+ */
+struct ReplicaStamp {
+    uint64_t hlc = 0;
+    uint32_t node = 0;
+};
+
+typedef std::map<std::pair<std::string, std::string>, ReplicaStamp> ReplicaStamps;
+
+HybridClock g_hybrid_clock;
+std::atomic<uint32_t> g_node_id{0};  // CONFIG_SYNC:NODE_ID のハッシュ（start_config_server で決める）
+// 項目ごとの最終書き込みの時刻（g_config_mutex で保護する）
+ReplicaStamps g_config_stamps;
+
+// 64ビットFNV-1aハッシュ（hash に途中の値を渡すと続きから計算する）
+uint64_t fnv1a64(const std::string& data, uint64_t hash = 1469598103934665603ULL) {
+    for (unsigned char c : data) {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// 時刻 a（値のハッシュ hash_a）が b より後の書き込みならtrue。
+// 時刻もノードも同じなら値のハッシュで決める（値を持たない相手とも同じ結論になる）
+bool stamp_newer(const ReplicaStamp& a, uint64_t hash_a, const ReplicaStamp& b, uint64_t hash_b) {
+    if (a.hlc != b.hlc) {
+        return a.hlc > b.hlc;
+    }
+    if (a.node != b.node) {
+        return a.node > b.node;
+    }
+    return hash_a > hash_b;
+}
+
+// a（値 value_a）が b（値 value_b）より後の書き込みならtrue
+bool replica_newer(const ReplicaStamp& a, const std::string& value_a, const ReplicaStamp& b,
+                   const std::string& value_b) {
+    return stamp_newer(a, fnv1a64(value_a), b, fnv1a64(value_b));
+}
+
+// このノードでの書き込みとして時刻を付ける（g_config_mutex を保持して呼ぶ）
+void stamp_local_write(const std::string& section, const std::string& key) {
+    ReplicaStamp& stamp = g_config_stamps[std::make_pair(section, key)];
+    stamp.hlc = g_hybrid_clock.now();
+    stamp.node = g_node_id.load();
+}
 
 // シグナルハンドラー用
 void signal_handler(int signum) {
@@ -48,20 +865,25 @@ void signal_handler(int signum) {
     g_shutdown_flag.store(true);
 }
 
+void publish_config_reload(uint64_t version); // プロトタイプ宣言
+
 /**
  * @brief iniファイルから設定を読み込む (改良版)
  * @param filename config.iniのパス
  * @return 読み込みが成功した場合はtrue
  */
 bool load_config(const std::string& filename) {
+    ScopedLatency timer(g_metrics.stage(STAGE_LOAD_CONFIG));
     dictionary* ini = iniparser_load(filename.c_str());
     if (ini == nullptr) {
         std::cerr << "エラー: '" << filename << "' を読み込めません。\n";
         return false;
     }
 
-    std::lock_guard<std::mutex> lock(g_config_mutex);
-    g_config_data.clear();
+    SiteLockGuard lock(g_config_mutex, LOCK_SITE());
+    // 読み直しで値が変わった項目は、このノードでの書き込みとして扱う（起動時の読み込みは除く）
+    ConfigData previous;
+    previous.swap(g_config_data);
 
     // セクション数を取得
     int n_sections = iniparser_getnsec(ini);
@@ -78,7 +900,16 @@ bool load_config(const std::string& filename) {
         // より包括的なキーリストを定義
         std::vector<std::string> common_keys = {
             // CONFIG_SYNC section
-            "WPF_HOST", "WPF_RECV_PORT", "CPP_RECV_PORT",
+            "WPF_HOST", "WPF_RECV_PORT", "CPP_RECV_PORT", "UDS_PATH", "UDS_ALLOWED_UIDS",
+            "HEARTBEAT_INTERVAL_MS", "HEARTBEAT_MISS_LIMIT",
+            "ADMISSION_MAX_CONNECTIONS", "ADMISSION_PEER_CONNECT_RATE",
+            "ADMISSION_PEER_UPDATE_RATE", "ADMISSION_GLOBAL_UPDATE_RATE", "ADMISSION_MAX_SUBSCRIPTIONS",
+            "PUSH_DEBOUNCE_MS", "PUSH_MAX_DELAY_MS", "SAVE_DURABILITY",
+            "PERSIST_GROUP_COMMIT_MS", "JOURNAL_ENABLED", "JOURNAL_COMPACT_BYTES",
+            "JOURNAL_COMPACT_INTERVAL_SEC",
+            "BACKUP_RING_SIZE", "METRICS_PORT", "METRICS_BIND", "LOCK_PROFILE",
+            "NODE_ID", "REPLICATION_PEERS", "REPLICATION_SECTIONS", "REPLICATION_INTERVAL_MS",
+            "ROLLOUT_PEERS", "ROLLOUT_TIMEOUT_MS",
             // PWM section
             "PWM_MIN", "PWM_NEUTRAL", "PWM_NORMAL_MAX", "PWM_BOOST_MAX", "PWM_FREQUENCY",
             // JOYSTICK section
@@ -108,6 +939,19 @@ bool load_config(const std::string& filename) {
     }
 
     iniparser_freedict(ini);
+    if (!previous.empty()) {
+        for (const auto& section_pair : g_config_data) {
+            auto old_section = previous.find(section_pair.first);
+            for (const auto& key_value_pair : section_pair.second) {
+                if (old_section == previous.end() || old_section->second.count(key_value_pair.first) == 0 ||
+                    old_section->second.at(key_value_pair.first) != key_value_pair.second) {
+                    stamp_local_write(section_pair.first, key_value_pair.first);
+                }
+            }
+        }
+    }
+    // 読み直した内容は差分で表せないため、購読者には全体を送り直させる
+    publish_config_reload(g_config_version.fetch_add(1) + 1);
     std::cout << "設定ファイルを " << filename << " から読み込みました。\n";
     return true;
 }
@@ -119,8 +963,8 @@ bool load_config(const std::string& filename) {
  * @param default_value デフォルト値
  * @return 設定値またはデフォルト値
  */
-std::string get_config_value(const std::string& section, const std::string& key, const std::string& default_value = "") {
-    std::lock_guard<std::mutex> lock(g_config_mutex);
+std::string get_config_value(const std::string& section, const std::string& key, const std::string& default_value) {
+    SiteLockGuard lock(g_config_mutex, LOCK_SITE());
     auto section_it = g_config_data.find(section);
     if (section_it == g_config_data.end()) {
         return default_value;
@@ -133,14 +977,27 @@ std::string get_config_value(const std::string& section, const std::string& key,
 }
 
 /**
- * @brief 設定値を安全に設定する
- * @param section セクション名
- * @param key キー名
- * @param value 設定する値
+ * @brief メッセージ本体に長さヘッダーを付ける
+ *
+ * 確実なTCP通信のため、[メッセージ長]\n[メッセージ本体] という形式で送信する
+ * @param content メッセージ本体
+ * @return フレーム化されたメッセージ
+ */
+std::string frame_message(const std::string& content) {
+    return std::to_string(content.length()) + "\n" + content;
+}
+
+/**
+ * @brief 1項目を [SECTION]KEY=VALUE\n の形式で追記する
  */
-void set_config_value(const std::string& section, const std::string& key, const std::string& value) {
-    std::lock_guard<std::mutex> lock(g_config_mutex);
-    g_config_data[section][key] = value;
+void append_config_entry(std::string& out, const std::string& section, const std::string& key, const std::string& value) {
+    out += '[';
+    out += section;
+    out += ']';
+    out += key;
+    out += '=';
+    out += value;
+    out += '\n';
 }
 
 /**
@@ -148,80 +1005,648 @@ void set_config_value(const std::string& section, const std::string& key, const
  * @return シリアライズされた設定文字列
  */
 std::string serialize_config() {
-    std::lock_guard<std::mutex> lock(g_config_mutex);
-    std::stringstream ss;
-    std::stringstream content_ss;
+    ScopedLatency timer(g_metrics.stage(STAGE_SERIALIZE_CONFIG));
+    SiteLockGuard lock(g_config_mutex, LOCK_SITE());
+    std::string content;
     for (const auto& section_pair : g_config_data) {
         for (const auto& key_value_pair : section_pair.second) {
             // フォーマット: [SECTION]KEY=VALUE\n
-            content_ss << "[" << section_pair.first << "]"
-               << key_value_pair.first << "=" << key_value_pair.second << "\n";
+            append_config_entry(content, section_pair.first, key_value_pair.first, key_value_pair.second);
         }
     }
-    // 確実なTCP通信のため、[メッセージ長]\n[メッセージ本体] という形式で送信する
-    std::string content = content_ss.str();
-    ss << content.length() << "\n" << content;
-    return ss.str();
+    return frame_message(content);
 }
 
 /**
- * @brief WPFから受信した文字列をパースして設定データを更新する
- * @param data 受信した文字列データ
+ * @brief [SECTION]KEY 形式の文字列をセクションとキーに分解する
+ * @return 形式が正しければtrue
  */
-void update_config_from_string(const std::string& data) {
-    std::stringstream ss(data);
-    std::string line;
-    int updates_count = 0;
+bool split_section_key(const std::string& token, std::string& section, std::string& key) {
+    size_t section_end = token.find(']');
+    if (token.empty() || token[0] != '[' || section_end == std::string::npos) {
+        return false;
+    }
+    section = token.substr(1, section_end - 1);
+    key = token.substr(section_end + 1);
+    return true;
+}
 
-    while (std::getline(ss, line)) {
-        if (line.empty() || line[0] != '[') continue;
+/**
+ * @brief 設定項目を変えたとき、読む側に何が必要になるか
+ *
+ * 値が大きいほど重い。バッチ全体の影響はコンポーネント（セクション）ごとの最大値で表す。
+ */
+enum ChangeImpact {
+    IMPACT_LIVE = 0,               // 動作中にそのまま反映できる
+    IMPACT_RESTART_COMPONENT = 1,  // そのセクションを使う部品（カメラのパイプラインなど）の作り直しが必要
+    IMPACT_RESTART_PROCESS = 2     // プロセスの再起動が必要
+};
 
-        size_t section_end = line.find(']');
-        size_t equals_pos = line.find('=', section_end);
+const char* impact_name(ChangeImpact impact) {
+    switch (impact) {
+        case IMPACT_LIVE: return "live";
+        case IMPACT_RESTART_COMPONENT: return "restart-component";
+        default: return "restart-process";
+    }
+}
 
-        if (section_end != std::string::npos && equals_pos != std::string::npos) {
-            std::string section = line.substr(1, section_end - 1);
-            std::string key = line.substr(section_end + 1, equals_pos - (section_end + 1));
-            std::string value = line.substr(equals_pos + 1);
+/**
+ * @brief 項目ごとの影響の分類表（上から順に最初に一致した規則を使う）
+ *
+ * section の末尾が '*' なら前方一致、key が "*" ならそのセクションの残りすべてに一致する。
+ * セクション名は大文字小文字を区別しない（iniparserが小文字にするため）。
+ * どの規則にも一致しない項目は、読む側が分からないためプロセスの再起動扱いにする。
+ */
+struct ImpactRule {
+    const char* section;
+    const char* key;
+    ChangeImpact impact;
+};
 
-            // 改行コードなど、末尾の空白文字を削除
-            value.erase(value.find_last_not_of(" \n\r\t") + 1);
+const ImpactRule IMPACT_RULES[] = {
+    // スラスター・LED・ジョイスティックの値は制御ループが毎周読む
+    {"PWM", "PWM_FREQUENCY", IMPACT_RESTART_COMPONENT},  // PWMデバイスの初期化で設定する
+    {"PWM", "*", IMPACT_LIVE},
+    {"JOYSTICK", "*", IMPACT_LIVE},
+    {"LED", "CHANNEL", IMPACT_RESTART_COMPONENT},
+    {"LED", "*", IMPACT_LIVE},
+    {"THRUSTER_CONTROL", "*", IMPACT_LIVE},
+    {"APPLICATION", "*", IMPACT_LIVE},
+    // UDPソケットは起動時に開く
+    {"NETWORK", "*", IMPACT_RESTART_COMPONENT},
+    // エンコーダのビットレートとSPS/PPSの送信間隔は動作中のパイプラインに設定できる
+    {"GSTREAMER_CAMERA_*", "X264_BITRATE", IMPACT_LIVE},
+    {"GSTREAMER_CAMERA_*", "RTP_CONFIG_INTERVAL", IMPACT_LIVE},
+    {"GSTREAMER_CAMERA_*", "*", IMPACT_RESTART_COMPONENT},
+    // 設定同期サーバー自身: 待ち受けと受付制御は start_config_server() で読む
+    {"CONFIG_SYNC", "CPP_RECV_PORT", IMPACT_RESTART_COMPONENT},
+    {"CONFIG_SYNC", "UDS_PATH", IMPACT_RESTART_COMPONENT},
+    {"CONFIG_SYNC", "METRICS_PORT", IMPACT_RESTART_COMPONENT},
+    {"CONFIG_SYNC", "METRICS_BIND", IMPACT_RESTART_COMPONENT},
+    {"CONFIG_SYNC", "ADMISSION_*", IMPACT_RESTART_COMPONENT},
+    {"CONFIG_SYNC", "NODE_ID", IMPACT_RESTART_COMPONENT},
+    {"CONFIG_SYNC", "JOURNAL_ENABLED", IMPACT_RESTART_PROCESS},  // ジャーナルは起動時にだけ再生する
+    {"CONFIG_SYNC", "*", IMPACT_LIVE},
+};
 
-            // 値が変更された場合のみ更新ログを出力
-            std::string old_value = get_config_value(section, key);
-            if (old_value != value) {
-                set_config_value(section, key, value);
-                std::cout << "設定更新: [" << section << "] " << key << " = " << value;
-                if (!old_value.empty()) {
-                    std::cout << " (旧値: " << old_value << ")";
-                }
-                std::cout << std::endl;
-                updates_count++;
-            }
-        }
+// pattern の末尾が '*' なら前方一致
+bool impact_pattern_matches(const char* pattern, const std::string& name, bool ignore_case) {
+    size_t length = strlen(pattern);
+    bool prefix = length > 0 && pattern[length - 1] == '*';
+    if (prefix) {
+        length--;
+    } else if (name.size() != length) {
+        return false;
     }
-    
-    if (updates_count > 0) {
-        std::cout << "合計 " << updates_count << " 項目の設定を更新しました。\n";
-    } else {
-        std::cout << "設定に変更はありませんでした。\n";
+    if (name.size() < length) {
+        return false;
     }
+    return (ignore_case ? strncasecmp(name.c_str(), pattern, length) : strncmp(name.c_str(), pattern, length)) == 0;
 }
 
 /**
- * @brief ソケットのノンブロッキングモードを設定する
- * @param sock ソケットディスクリプタ
- * @param non_blocking trueでノンブロッキング、falseでブロッキング
- * @return 成功時true
+ * @brief 項目の影響を分類表から引く
  */
-bool set_socket_non_blocking(int sock, bool non_blocking) {
-    int flags = fcntl(sock, F_GETFL, 0);
-    if (flags == -1) {
-        return false;
+ChangeImpact classify_change(const std::string& section, const std::string& key) {
+    for (const ImpactRule& rule : IMPACT_RULES) {
+        if (impact_pattern_matches(rule.section, section, true) && impact_pattern_matches(rule.key, key, false)) {
+            return rule.impact;
+        }
     }
-    
-    if (non_blocking) {
-        flags |= O_NONBLOCK;
+    return IMPACT_RESTART_PROCESS;
+}
+
+/**
+ * @brief 問い合わせ要求（本体が '?' で始まるメッセージ）に応答する
+ *
+ * 1行に1つの問い合わせを書く。全体をダンプせず、ストアの索引から該当項目だけを返す。
+ *   ?GET [SECTION]KEY              1項目
+ *   ?MGET [SECTION]KEY [SECTION]KEY ...  複数項目
+ *   ?SECTION SECTION              1セクション
+ *   ?PREFIX [SECTION_PREFIX       セクション名の前方一致
+ *   ?PREFIX [SECTION]KEY_PREFIX   セクション内のキー名の前方一致
+ *   ?SNAPSHOT_FD                  全設定をmemfdで受け取る（UNIXソケット接続のみ）
+ *   ?PING TOKEN                   ハートビート。"!PONG TOKEN" を返す
+ *   ?SYNC                         それまでの変更が保存されるまで待ち、"!DURABLE VERSION" を返す
+ *   ?HISTORY [PREFIX] [LIMIT]     ジャーナルの変更履歴（"!CHANGE\tVERSION\tTIME_MS\t[SECTION]KEY\tOLD\tNEW"）
+ *   ?METRICS                      計測値（Prometheusのテキスト形式）
+ *   ?IMPACT [[SECTION]KEY ...]    項目ごとの変更時の影響（"[SECTION]KEY=live" など。省略時は全項目）
+ *   ?AE_ROOT / ?AE_TREE / ?AE_SYNC  ノード間のレプリケーション（Replicator を参照）
+ *   ?AE_STATS                     レプリケーションの統計とルートハッシュ
+ *   ?PRESETS                      プリセットの一覧（"名前\t項目数"）
+ *   ?PRESET NAME                  プリセットを適用する（更新として受付制御される）。"!PRESET NAME 版" を返す
+ *   ?ROLLOUT + [SECTION]KEY=VALUE 行  ROLLOUT_PEERS の全ノードへ一斉に反映する（ConfigRollout を参照）。
+ *                                 "!TX_COMMITTED ID 版 ノード数" か "!TX_ABORTED ID 理由" を返す
+ *   ?TX_PREPARE / ?TX_COMMIT / ?TX_ABORT  ロールアウトの準備と決定（ノード間で使う）
+ *   ?TX_STATS                     ロールアウトの統計
+ * 応答は通常の設定送信と同じ [SECTION]KEY=VALUE 行をフレーム化したもの。存在しない項目は含まれない。
+ * @param request 受信したメッセージ本体
+ * @return フレーム化された応答
+ */
+std::string query_config(const std::string& request) {
+    ScopedLatency timer(g_metrics.stage(STAGE_QUERY));
+    std::stringstream ss(request);
+    std::string line;
+    std::string content;
+
+    SiteLockGuard lock(g_config_mutex, LOCK_SITE());
+    while (std::getline(ss, line)) {
+        line.erase(line.find_last_not_of(" \n\r\t") + 1);
+        if (line.empty() || line[0] != '?') continue;
+
+        std::stringstream words(line);
+        std::string command;
+        words >> command;
+
+        if (command == "?GET" || command == "?MGET") {
+            std::string token, section, key;
+            while (words >> token) {
+                if (!split_section_key(token, section, key)) continue;
+                auto section_it = g_config_data.find(section);
+                if (section_it == g_config_data.end()) continue;
+                auto key_it = section_it->second.find(key);
+                if (key_it == section_it->second.end()) continue;
+                append_config_entry(content, section, key, key_it->second);
+            }
+        } else if (command == "?SECTION") {
+            std::string section;
+            while (words >> section) {
+                auto section_it = g_config_data.find(section);
+                if (section_it == g_config_data.end()) continue;
+                for (const auto& key_value_pair : section_it->second) {
+                    append_config_entry(content, section, key_value_pair.first, key_value_pair.second);
+                }
+            }
+        } else if (command == "?PREFIX") {
+            std::string prefix;
+            words >> prefix;
+            if (prefix.empty() || prefix[0] != '[') continue;
+            std::string section, key_prefix;
+            if (split_section_key(prefix, section, key_prefix)) {
+                // セクションが確定している: キーの前方一致
+                auto section_it = g_config_data.find(section);
+                if (section_it == g_config_data.end()) continue;
+                const auto& keys = section_it->second;
+                for (auto it = keys.lower_bound(key_prefix);
+                     it != keys.end() && it->first.compare(0, key_prefix.size(), key_prefix) == 0; ++it) {
+                    append_config_entry(content, section, it->first, it->second);
+                }
+            } else {
+                // セクション名の前方一致
+                std::string section_prefix = prefix.substr(1);
+                for (auto it = g_config_data.lower_bound(section_prefix);
+                     it != g_config_data.end() && it->first.compare(0, section_prefix.size(), section_prefix) == 0; ++it) {
+                    for (const auto& key_value_pair : it->second) {
+                        append_config_entry(content, it->first, key_value_pair.first, key_value_pair.second);
+                    }
+                }
+            }
+        } else if (command == "?IMPACT") {
+            // 値の代わりに、その項目を変えたときの影響を返す
+            std::string token, section, key;
+            bool any = false;
+            while (words >> token) {
+                any = true;
+                if (split_section_key(token, section, key)) {
+                    append_config_entry(content, section, key, impact_name(classify_change(section, key)));
+                }
+            }
+            if (!any) {
+                for (const auto& section_pair : g_config_data) {
+                    for (const auto& key_value_pair : section_pair.second) {
+                        append_config_entry(content, section_pair.first, key_value_pair.first,
+                                            impact_name(classify_change(section_pair.first, key_value_pair.first)));
+                    }
+                }
+            }
+        } else if (command == "?PING") {
+            // ハートビート: トークンをそのまま返す（相手側のRTT測定用）
+            std::string token;
+            words >> token;
+            content += "!PONG " + token + "\n";
+        } else {
+            LOG_WARN("警告: 不明な問い合わせです: %s", command);
+        }
+    }
+    return frame_message(content);
+}
+
+// 受信データの逐次パースに関する制限
+const size_t MAX_UPDATE_LINE_LENGTH = 64 * 1024;         // 1行の最大長（行をまたぐ持ち越しバッファの上限）
+const size_t MAX_UPDATE_MESSAGE_SIZE = 256 * 1024 * 1024; // 更新メッセージの最大サイズ
+const size_t MAX_UPDATE_STAGED_ENTRIES = 65536;           // 1回の更新で積める項目数の上限
+const size_t MAX_UPDATE_STAGED_BYTES = 16 * 1024 * 1024;  // 1回の更新で積める項目（セクション・キー・値）の合計バイト数の上限
+const size_t MAX_CONFIG_NAME_LENGTH = UINT16_MAX;         // セクション名・キー名の最大長（ジャーナルに u16 で記録するため）
+const size_t MAX_QUERY_MESSAGE_SIZE = 64 * 1024;          // 問い合わせメッセージの最大サイズ
+
+/**
+ * @brief コミットされた1項目分の変更
+ */
+struct ConfigChange {
+    uint64_t version;
+    std::string section;
+    std::string key;
+    std::string old_value;
+    std::string value;
+    ChangeImpact impact;
+};
+
+/**
+ * @brief 変更のまとまりを、コンポーネント（セクション）ごとの最も重い影響に集約する
+ */
+std::map<std::string, ChangeImpact> summarize_impact(const std::vector<ConfigChange>& changes) {
+    std::map<std::string, ChangeImpact> summary;
+    for (const ConfigChange& change : changes) {
+        auto inserted = summary.insert(std::make_pair(change.section, change.impact));
+        if (!inserted.second && change.impact > inserted.first->second) {
+            inserted.first->second = change.impact;
+        }
+    }
+    return summary;
+}
+
+/**
+ * @brief 集約した影響を "SECTION=live, SECTION=restart-component" の形にする（ログ用）
+ */
+std::string format_impact_summary(const std::map<std::string, ChangeImpact>& summary) {
+    std::string text;
+    for (const auto& component : summary) {
+        if (!text.empty()) {
+            text += ", ";
+        }
+        text += component.first + "=" + impact_name(component.second);
+    }
+    return text;
+}
+
+void journal_config_changes(const std::vector<ConfigChange>& changes); // プロトタイプ宣言
+
+/**
+ * @brief コミットされた変更を購読者（?SUBSCRIBE）へ配るための直近の変更履歴
+ *
+ * publish系は g_config_mutex を持ったまま呼ばれるため、版の順に並ぶ。
+ * 購読者が追いつけないほど遅れた場合や、設定ファイルが読み直された場合は
+ * changes_since() が false を返し、購読者は設定全体を送り直す。
+ */
+class ChangeFeed {
+public:
+    static const size_t MAX_RECENT = 4096;
+
+    ChangeFeed() : latest_version_(0), reload_version_(0) {}
+
+    void publish(const std::vector<ConfigChange>& changes) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (const ConfigChange& change : changes) {
+                recent_.push_back(change);
+            }
+            while (recent_.size() > MAX_RECENT) {
+                recent_.pop_front();
+            }
+            latest_version_ = changes.back().version;
+        }
+        cv_.notify_all();
+    }
+
+    void publish_reload(uint64_t version) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            recent_.clear();
+            latest_version_ = version;
+            reload_version_ = version;
+        }
+        cv_.notify_all();
+    }
+
+    /**
+     * @brief after より新しい版が出るまで待つ
+     * @return 新しい版があればtrue（タイムアウトや終了時はfalse）
+     */
+    bool wait_newer(uint64_t after, int timeout_ms) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait_for(lock, std::chrono::milliseconds(timeout_ms),
+                     [this, after]() { return latest_version_ > after || g_shutdown_flag.load(); });
+        return latest_version_ > after;
+    }
+
+    /**
+     * @brief after より新しい変更を古い順に集める
+     * @param latest 集めた時点の最新の版
+     * @return 差分で表せない場合（読み直し・履歴切れ）はfalse
+     */
+    bool changes_since(uint64_t after, std::vector<ConfigChange>& out, uint64_t& latest) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        latest = latest_version_;
+        if (after < reload_version_) {
+            return false;
+        }
+        if (latest_version_ > after && (recent_.empty() || recent_.front().version > after + 1)) {
+            return false;
+        }
+        for (const ConfigChange& change : recent_) {
+            if (change.version > after) {
+                out.push_back(change);
+            }
+        }
+        return true;
+    }
+
+    // 終了時に待っている購読者を起こす
+    void wake_all() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+        }
+        cv_.notify_all();
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<ConfigChange> recent_;
+    uint64_t latest_version_;
+    uint64_t reload_version_;
+};
+
+ChangeFeed g_change_feed;
+
+void publish_config_reload(uint64_t version) {
+    g_change_feed.publish_reload(version);
+}
+
+// コミット待ちの変更（(セクション, キー) ごとの最新値）
+typedef std::map<std::pair<std::string, std::string>, std::string> StagedChanges;
+
+/**
+ * @brief 受信データをチャンク単位で逐次パースし、変更を保留中のトランザクションに積む
+ *
+ * チャンク境界で途切れた行は次のチャンクに持ち越す。積まれた変更はcommit()で
+ * 1回のロックでまとめて反映されるため、途中で切断された場合は何も反映されない。
+ * メモリ使用量は持ち越し中の1行と、キーごとの最新値だけに抑えられる。キーごとの最新値も
+ * MAX_UPDATE_STAGED_ENTRIES 項目・MAX_UPDATE_STAGED_BYTES バイトを超えた時点で失敗とする。
+ */
+class ConfigUpdateParser {
+public:
+    ConfigUpdateParser() : staged_bytes_(0), failed_(false) {}
+
+    /**
+     * @brief 受信したチャンクを投入する
+     * @return 行が長すぎる場合、積んだ項目が上限を超えた場合はfalse（以降のデータは無視される）
+     */
+    bool feed(const char* data, size_t length) {
+        if (failed_) {
+            return false;
+        }
+        const char* end = data + length;
+        while (data < end) {
+            const char* newline = static_cast<const char*>(memchr(data, '\n', end - data));
+            size_t piece = (newline == nullptr ? end : newline) - data;
+            // 持ち越す前に長さを確かめ、上限を超える行はバッファに貯めない
+            if (partial_.size() + piece > MAX_UPDATE_LINE_LENGTH) {
+                fail_line_too_long(partial_.size() + piece);
+                return false;
+            }
+            if (newline == nullptr) {
+                partial_.append(data, piece);
+                break;
+            }
+            if (partial_.empty()) {
+                parse_line(data, piece);
+            } else {
+                partial_.append(data, piece);
+                parse_line(partial_.data(), partial_.size());
+                partial_.clear();
+            }
+            if (failed_) {
+                return false;
+            }
+            data = newline + 1;
+        }
+        return true;
+    }
+
+    /**
+     * @brief 改行で終わっていない最後の行を処理する
+     * @return 失敗している場合はfalse（積まれた変更は捨てられている）
+     */
+    bool finish() {
+        if (!failed_ && !partial_.empty()) {
+            parse_line(partial_.data(), partial_.size());
+        }
+        partial_.clear();
+        return !failed_;
+    }
+
+    /**
+     * @brief 保留中の変更を1回のロックで反映する
+     * @param applied 実際に反映された変更を受け取る（省略可）
+     * @return 実際に値が変わった項目数
+     */
+    int commit(std::vector<ConfigChange>* applied = nullptr) {
+        int count = commit_changes(staged_, applied);
+        staged_.clear();
+        staged_bytes_ = 0;
+        return count;
+    }
+
+    /**
+     * @brief 変更のまとまりを1回のロック・1つの版で反映する（プリセットの適用でも使う）
+     *
+     * セクション名・キー名が MAX_CONFIG_NAME_LENGTH を超える項目はジャーナルに正しく記録できないため、
+     * どの経路から来ても反映しない。
+     * @param applied 実際に反映された変更を受け取る（省略可）
+     * @param stamps 他のノードから届いた変更の書き込み時刻（レプリケーション用。省略時はこのノードでの書き込み）
+     * @return 実際に値が変わった項目数
+     */
+    static int commit_changes(const StagedChanges& staged, std::vector<ConfigChange>* applied,
+                              const ReplicaStamps* stamps = nullptr) {
+        ScopedLatency timer(g_metrics.stage(STAGE_COMMIT_UPDATE));
+        std::vector<ConfigChange> changes;
+        size_t rejected_names = 0;
+        {
+            SiteLockGuard lock(g_config_mutex, LOCK_SITE());
+            uint64_t version = g_config_version.load() + 1;
+            for (const auto& entry : staged) {
+                if (entry.first.first.size() > MAX_CONFIG_NAME_LENGTH ||
+                    entry.first.second.size() > MAX_CONFIG_NAME_LENGTH) {
+                    rejected_names++;
+                    continue;
+                }
+                std::string& current = g_config_data[entry.first.first][entry.first.second];
+                if (stamps != nullptr) {
+                    // 後勝ち: 手元より後の書き込みだけを採り、その時刻を引き継ぐ（値が同じでも時刻は揃える）
+                    const ReplicaStamp& incoming = stamps->at(entry.first);
+                    ReplicaStamp& local = g_config_stamps[entry.first];
+                    if (!replica_newer(incoming, entry.second, local, current)) {
+                        continue;
+                    }
+                    local = incoming;
+                    g_hybrid_clock.observe(incoming.hlc);
+                } else if (current != entry.second) {
+                    stamp_local_write(entry.first.first, entry.first.second);
+                }
+                if (current != entry.second) {
+                    ConfigChange change;
+                    change.version = version;
+                    change.section = entry.first.first;
+                    change.key = entry.first.second;
+                    change.old_value = current;
+                    change.value = entry.second;
+                    change.impact = classify_change(change.section, change.key);
+                    current = entry.second;
+                    changes.push_back(change);
+                }
+            }
+            if (!changes.empty()) {
+                g_config_version.store(version);
+                // 版の順序どおりにジャーナルと購読者へ積むため、ロックを持ったまま渡す
+                journal_config_changes(changes);
+                g_change_feed.publish(changes);
+            }
+        }
+        if (!changes.empty()) {
+            TRACE_PROBE3(commit, t_trace_connection_id, changes[0].version, changes.size());
+        }
+
+        if (rejected_names > 0) {
+            LOG_WARN("警告: セクション名かキー名が長すぎる項目を %d 件無視しました（最大 %d バイト）", rejected_names,
+                     MAX_CONFIG_NAME_LENGTH);
+        }
+        // ログはロックの外で積む。項目ごとの記録はDEBUGのみで、通常は1件の要約にまとめる
+        // （個々の変更はジャーナルの変更履歴で確認できる）
+        for (const ConfigChange& change : changes) {
+            LOG_DEBUG("設定更新: [%s] %s = %s (旧値: %s)", change.section, change.key, change.value, change.old_value);
+        }
+        if (changes.size() == 1) {
+            LOG_INFO("設定を更新しました（版 %d）: [%s] %s = %s（影響: %s）", changes[0].version, changes[0].section,
+                     changes[0].key, changes[0].value, impact_name(changes[0].impact));
+        } else if (!changes.empty()) {
+            LOG_INFO("設定を更新しました（版 %d）: %d 項目（[%s] %s など。影響: %s）", changes[0].version,
+                     changes.size(), changes[0].section, changes[0].key,
+                     format_impact_summary(summarize_impact(changes)));
+        }
+        int count = (int)changes.size();
+        if (applied != nullptr) {
+            applied->swap(changes);
+        }
+        return count;
+    }
+
+    bool failed() const { return failed_; }
+
+    size_t staged_count() const { return staged_.size(); }
+
+    const StagedChanges& staged() const { return staged_; }
+
+private:
+    void parse_line(const char* line, size_t length) {
+        if (length > MAX_UPDATE_LINE_LENGTH) {
+            fail_line_too_long(length);
+            return;
+        }
+        if (length == 0 || line[0] != '[') return;
+
+        const char* line_end = line + length;
+        const char* section_end = static_cast<const char*>(memchr(line, ']', length));
+        if (section_end == nullptr) return;
+        const char* equals_pos = static_cast<const char*>(memchr(section_end, '=', line_end - section_end));
+        if (equals_pos == nullptr) return;
+
+        // 改行コードなど、末尾の空白文字を削除
+        const char* value_end = line_end;
+        while (value_end > equals_pos + 1 && strchr(" \n\r\t", value_end[-1]) != nullptr) {
+            value_end--;
+        }
+
+        std::pair<std::string, std::string> section_key(std::string(line + 1, section_end),
+                                                        std::string(section_end + 1, equals_pos));
+        auto inserted = staged_.insert(std::make_pair(section_key, std::string()));
+        std::string& value = inserted.first->second;
+        if (inserted.second) {
+            staged_bytes_ += section_key.first.size() + section_key.second.size();
+        }
+        staged_bytes_ = staged_bytes_ - value.size() + (value_end - (equals_pos + 1));
+        value.assign(equals_pos + 1, value_end);
+        if (staged_.size() > MAX_UPDATE_STAGED_ENTRIES || staged_bytes_ > MAX_UPDATE_STAGED_BYTES) {
+            LOG_ERROR("エラー: 1回の更新の項目が多すぎます（%d 項目, %d バイト）", staged_.size(), staged_bytes_);
+            fail();
+        }
+    }
+
+    void fail_line_too_long(size_t length) {
+        LOG_ERROR("エラー: 1行が長すぎます（%d バイト、最大 %d バイト）", length, MAX_UPDATE_LINE_LENGTH);
+        fail();
+    }
+
+    // 以降のデータを無視し、積んだ変更を捨てる
+    void fail() {
+        failed_ = true;
+        staged_.clear();
+        staged_bytes_ = 0;
+        partial_.clear();
+    }
+
+    std::string partial_;
+    StagedChanges staged_;
+    size_t staged_bytes_;  // staged_ のセクション・キー・値の合計バイト数
+    bool failed_;
+};
+
+int rollout_config_changes(const StagedChanges& staged, std::vector<ConfigChange>* applied,
+                           std::string* outcome); // プロトタイプ宣言
+
+/**
+ * @brief WPFから受信した文字列をパースして設定データを更新する
+ *
+ * ROLLOUT_PEERS が設定されていれば、挙げた全ノードと一斉に反映する（ConfigRollout を参照）。
+ * @param data 受信した文字列データ
+ * @return 実際に値が変わった項目数（ロールアウトが中止された場合は0）
+ */
+int update_config_from_string(const std::string& data) {
+    ScopedLatency timer(g_metrics.stage(STAGE_UPDATE_FROM_STRING));
+    ConfigUpdateParser parser;
+    parser.feed(data.data(), data.size());
+    parser.finish();
+    int updates_count = std::max(0, rollout_config_changes(parser.staged(), nullptr, nullptr));
+    if (updates_count == 0) {
+        LOG_DEBUG("設定に変更はありませんでした。");
+    }
+    return updates_count;
+}
+
+/**
+ * @brief 設定値を1項目変更する
+ *
+ * 受信した更新と同じ経路（版の更新・ジャーナル・購読者への通知・ロールアウト）で反映する。
+ * @param section セクション名
+ * @param key キー名
+ * @param value 設定する値
+ * @return 値が変わった場合は1、同じ値なら0、ロールアウトが中止されて反映されなかった場合は-1
+ */
+int set_config_value(const std::string& section, const std::string& key, const std::string& value) {
+    StagedChanges staged;
+    staged[std::make_pair(section, key)] = value;
+    std::string outcome;
+    int count = rollout_config_changes(staged, nullptr, &outcome);
+    if (count < 0) {
+        LOG_WARN("警告: [%s] %s の変更を反映しませんでした（%s）", section, key, outcome);
+    }
+    return count;
+}
+
+/**
+ * @brief ソケットのノンブロッキングモードを設定する
+ * @param sock ソケットディスクリプタ
+ * @param non_blocking trueでノンブロッキング、falseでブロッキング
+ * @return 成功時true
+ */
+bool set_socket_non_blocking(int sock, bool non_blocking) {
+    int flags = fcntl(sock, F_GETFL, 0);
+    if (flags == -1) {
+        return false;
+    }
+    
+    if (non_blocking) {
+        flags |= O_NONBLOCK;
     } else {
         flags &= ~O_NONBLOCK;
     }
@@ -229,14 +1654,110 @@ bool set_socket_non_blocking(int sock, bool non_blocking) {
     return fcntl(sock, F_SETFL, flags) != -1;
 }
 
+// RTTが未測定の場合に使うタイムアウト（従来の固定値）
+const int DEFAULT_CONNECT_TIMEOUT_MS = 5000;  // 接続完了までの最大待ち時間
+const int DEFAULT_SEND_TIMEOUT_MS = 5000;     // 送信が進まない状態の最大待ち時間
+const int DEFAULT_READ_TIMEOUT_MS = 10000;    // 受信が進まない状態の最大待ち時間
+
+// RTTから導出するタイムアウトの下限（ミリ秒）
+const int MIN_CONNECT_TIMEOUT_MS = 200;
+const int MIN_READ_TIMEOUT_MS = 500;
+
+/**
+ * @brief RTTの平滑化推定器（TCPのRTO計算 RFC 6298 と同じ方式）
+ *
+ * SRTT = 7/8 SRTT + 1/8 R, RTTVAR = 3/4 RTTVAR + 1/4 |SRTT - R|,
+ * RTO = SRTT + max(G, 4 * RTTVAR)
+ */
+class RttEstimator {
+public:
+    RttEstimator() : samples_(0), srtt_ms_(0.0), rttvar_ms_(0.0) {}
+
+    /**
+     * @brief RTTの測定値を1つ加える
+     * @param rtt_ms 測定したRTT（ミリ秒）
+     */
+    void add_sample(double rtt_ms) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (samples_ == 0) {
+            srtt_ms_ = rtt_ms;
+            rttvar_ms_ = rtt_ms / 2.0;
+        } else {
+            rttvar_ms_ = 0.75 * rttvar_ms_ + 0.25 * std::abs(srtt_ms_ - rtt_ms);
+            srtt_ms_ = 0.875 * srtt_ms_ + 0.125 * rtt_ms;
+        }
+        samples_++;
+    }
+
+    /**
+     * @brief RTOを元にしたタイムアウトを返す
+     * @param multiplier RTOに掛ける倍率
+     * @param min_ms 下限
+     * @param fallback_ms 未測定時の値（上限も兼ねる）
+     */
+    int timeout_ms(double multiplier, int min_ms, int fallback_ms) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (samples_ == 0) {
+            return fallback_ms;
+        }
+        double rto = srtt_ms_ + std::max(1.0, 4.0 * rttvar_ms_);
+        return std::max(min_ms, std::min(fallback_ms, (int)(rto * multiplier)));
+    }
+
+    /**
+     * @brief 現在の推定値を文字列で返す
+     */
+    std::string describe() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (samples_ == 0) {
+            return "未測定";
+        }
+        std::stringstream ss;
+        ss << "SRTT=" << srtt_ms_ << "ms RTTVAR=" << rttvar_ms_ << "ms RTO="
+           << srtt_ms_ + std::max(1.0, 4.0 * rttvar_ms_) << "ms (" << samples_ << " サンプル)";
+        return ss.str();
+    }
+
+private:
+    mutable std::mutex mutex_;
+    uint64_t samples_;
+    double srtt_ms_;
+    double rttvar_ms_;
+};
+
+// 通信相手ごとのRTT推定器（要素は削除しないため参照は常に有効）
+std::map<std::string, RttEstimator> g_peer_rtt;
+std::mutex g_peer_rtt_mutex;
+
+/**
+ * @brief 通信相手のRTT推定器を取得する
+ * @param host 相手のIPアドレス
+ */
+RttEstimator& rtt_for_peer(const std::string& host) {
+    std::lock_guard<std::mutex> lock(g_peer_rtt_mutex);
+    return g_peer_rtt[host];
+}
+
+/**
+ * @brief 接続済みTCPソケットについてカーネルが推定したRTT（TCP_INFO）を取得する
+ * @return 取得できた場合はミリ秒、できなければ負の値
+ */
+double kernel_rtt_ms(int sock) {
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &len) < 0 || info.tcpi_rtt == 0) {
+        return -1.0;
+    }
+    return info.tcpi_rtt / 1000.0;
+}
+
 /**
- * @brief WPFアプリケーションに現在の設定を送信する (改良版)
+ * @brief 設定からWPFの送信先を取得する
+ * @return ポート番号が正しければtrue
  */
-void send_config_to_wpf() {
-    std::string host = get_config_value("CONFIG_SYNC", "WPF_HOST", "192.168.4.10");
+bool get_wpf_target(std::string& host, int& port) {
+    host = get_config_value("CONFIG_SYNC", "WPF_HOST", "192.168.4.10");
     std::string port_str = get_config_value("CONFIG_SYNC", "WPF_RECV_PORT", "12347");
-    
-    int port;
     try {
         port = std::stoi(port_str);
         if (port <= 0 || port > 65535) {
@@ -244,394 +1765,4925 @@ void send_config_to_wpf() {
         }
     } catch (const std::exception& e) {
         std::cerr << "エラー: 不正なポート番号: " << port_str << " (" << e.what() << ")" << std::endl;
-        return;
+        return false;
     }
+    return true;
+}
 
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) {
-        std::cerr << "エラー: 送信用ソケットを作成できませんでした。" << strerror(errno) << std::endl;
-        return;
+/**
+ * @brief 設定から整数値を取得する（不正な値ならデフォルト値）
+ */
+int get_config_int(const std::string& section, const std::string& key, int default_value) {
+    std::string value = get_config_value(section, key);
+    try {
+        return value.empty() ? default_value : std::stoi(value);
+    } catch (const std::exception&) {
+        return default_value;
     }
+}
 
-    // ソケットタイムアウトを設定
-    struct timeval timeout;
-    timeout.tv_sec = 5;
-    timeout.tv_usec = 0;
-    if (setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0) {
-        std::cerr << "警告: 送信タイムアウトの設定に失敗しました。\n";
+/**
+ * @brief 送信ジョブの結果
+ */
+struct SendResult {
+    bool success;
+    size_t bytes_sent;
+    std::string error;
+};
+
+typedef std::function<void(const SendResult&)> SendCallback;
+
+/**
+ * @brief 外向きの送信をすべて受け持つ送信スレッド
+ *
+ * enqueue()は呼び出し元をブロックせずにジョブを積むだけで、接続・送信は
+ * 送信スレッドがepollで書き込み可能を待ちながら行う。完了はfutureと
+ * コールバック（任意）の両方で通知する。
+ *
+ * HEARTBEAT_INTERVAL_MS を設定した場合は、送信が無い間はWPFへハートビート（?PING）を送り、
+ * 接続時間と応答時間からRTTを測定し続ける。?PING を理解しないWPFアプリケーションもあるため、
+ * 既定では送らない。タイムアウトはすべてこのRTT推定値（未測定なら既定値）から導出する。ハートビートが
+ * 失敗するとRTO間隔で再試行し、HEARTBEAT_MISS_LIMIT 回連続で失敗したら相手を
+ * 切断状態とみなす。復帰したときは取りこぼしを防ぐため全設定を再送する。
+ *
+ * push_changes()/push_full() による通知はまとめて送る。最後の通知から
+ * PUSH_DEBOUNCE_MS 経過するか、最初の通知から PUSH_MAX_DELAY_MS 経過した時点で、
+ * キーごとの最新値だけを1つの更新として送信する。
+ */
+class OutboundSender {
+public:
+    OutboundSender()
+        : epoll_fd_(-1), wake_fd_(-1), running_(false), push_pending_(false), push_full_(false),
+          push_debounce_ms_(20), push_max_delay_ms_(100), push_events_(0), push_sends_(0),
+          heartbeat_seq_(0), heartbeat_in_flight_(false), heartbeat_misses_(0), peer_alive_(true) {}
+    ~OutboundSender() { stop(); }
+
+    /**
+     * @brief 送信スレッドを開始する
+     * @return 成功時true
+     */
+    bool start() {
+        epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd_ < 0) {
+            std::cerr << "エラー: epollを作成できませんでした。 " << strerror(errno) << std::endl;
+            return false;
+        }
+        wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (wake_fd_ < 0) {
+            std::cerr << "エラー: eventfdを作成できませんでした。 " << strerror(errno) << std::endl;
+            close(epoll_fd_);
+            epoll_fd_ = -1;
+            return false;
+        }
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = wake_fd_;
+        epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &ev);
+
+        next_heartbeat_ = std::chrono::steady_clock::now();
+        running_.store(true);
+        thread_ = std::thread(&OutboundSender::run, this);
+        return true;
     }
-    if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
-        std::cerr << "警告: 受信タイムアウトの設定に失敗しました。\n";
+
+    /**
+     * @brief 送信スレッドを停止する。未完了のジョブはキャンセル扱いで完了させる
+     */
+    void stop() {
+        if (!running_.exchange(false)) {
+            return;
+        }
+        wake();
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+        close(wake_fd_);
+        close(epoll_fd_);
+        wake_fd_ = -1;
+        epoll_fd_ = -1;
     }
 
-    struct sockaddr_in server_addr;
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
-    
-    if (inet_pton(AF_INET, host.c_str(), &server_addr.sin_addr) <= 0) {
-        std::cerr << "エラー: 不正なIPアドレス: " << host << std::endl;
-        close(sock);
-        return;
+    /**
+     * @brief 送信ジョブを積む（呼び出し元はブロックしない）
+     * @param host 送信先IPアドレス
+     * @param port 送信先ポート
+     * @param payload 送信するデータ（フレーム済み）
+     * @param callback 完了時に送信スレッド上で呼ばれるコールバック（省略可）
+     * @return 送信結果を受け取るfuture
+     */
+    std::future<SendResult> enqueue(const std::string& host, int port, std::string payload,
+                                    SendCallback callback = SendCallback()) {
+        std::shared_ptr<Job> job(new Job());
+        job->host = host;
+        job->port = port;
+        job->payload.swap(payload);
+        job->callback = callback;
+        std::future<SendResult> result = job->promise.get_future();
+
+        if (!running_.load()) {
+            complete(job, false, "送信スレッドが停止しています");
+            return result;
+        }
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex_);
+            queue_.push_back(job);
+        }
+        wake();
+        return result;
     }
 
-    // ソケットをノンブロッキングモードに設定
-    if (!set_socket_non_blocking(sock, true)) {
-        std::cerr << "エラー: ソケットをノンブロッキングモードに設定できませんでした。\n";
-        close(sock);
-        return;
+    /**
+     * @brief 変更されたキーをWPFへの送信待ちに加える（まとめて送られる）
+     */
+    void push_changes(const std::vector<ConfigChange>& changes) {
+        if (changes.empty()) {
+            return;
+        }
+        int debounce_ms, max_delay_ms;
+        read_push_windows(debounce_ms, max_delay_ms);
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        for (const ConfigChange& change : changes) {
+            push_delta_[std::make_pair(change.section, change.key)] = change.value;
+        }
+        note_push_locked(debounce_ms, max_delay_ms);
     }
 
-    std::cout << "WPFアプリケーション(" << host << ":" << port << ")に接続を試行中...\n";
-    
-    int ret = connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr));
-    if (ret < 0) {
-        if (errno == EINPROGRESS) {
-            // ノンブロッキング接続が進行中。select()で完了を待つ
-            fd_set writefds;
-            FD_ZERO(&writefds);
-            FD_SET(sock, &writefds);
-
-            // 接続タイムアウトを設定
-            struct timeval connect_timeout;
-            connect_timeout.tv_sec = 5;
-            connect_timeout.tv_usec = 0;
-
-            int activity = select(sock + 1, nullptr, &writefds, nullptr, &connect_timeout);
-            if (activity > 0) {
-                // ソケットが書き込み可能になった。接続結果を確認する
-                int so_error;
-                socklen_t len = sizeof(so_error);
-                getsockopt(sock, SOL_SOCKET, SO_ERROR, &so_error, &len);
-                if (so_error != 0) {
-                    std::cerr << "エラー: WPFアプリケーション(" << host << ":" << port << ")に接続できませんでした。 " 
-                              << strerror(so_error) << std::endl;
-                    close(sock);
-                    return;
-                }
-                // 接続成功
-            } else {
-                // select()が0を返した場合はタイムアウト、-1の場合はエラー
-                std::cerr << "エラー: WPFアプリケーション(" << host << ":" << port << ")への接続がタイムアウトまたは失敗しました。" << std::endl;
-                close(sock);
-                return;
+    /**
+     * @brief 組み立て済みの更新をまとめを待たずにWPFへ送る（プリセットの適用用）
+     * @param payload フレーム済みの更新
+     * @param covered payload に含まれる項目。まとめて送る予定の古い値は送らないようにする
+     */
+    void send_payload(const std::string& payload, const StagedChanges& covered) {
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex_);
+            for (const auto& entry : covered) {
+                push_delta_.erase(entry.first);
             }
-        } else {
-            // EINPROGRESS以外の即時エラー
-            std::cerr << "エラー: WPFアプリケーション(" << host << ":" << port << ")に接続できませんでした。 " 
-                      << strerror(errno) << std::endl;
-            close(sock);
-            return;
+        }
+        std::string host;
+        int port;
+        if (get_wpf_target(host, port)) {
+            enqueue(host, port, payload);
         }
     }
-    // ret == 0 の場合、即座に接続が完了した
 
-    std::cout << "WPFアプリケーションに接続しました。設定を送信します...\n";
-    std::string config_str = serialize_config();
-    
-    ssize_t total_sent = 0;
-    const char* data_ptr = config_str.c_str();
-    size_t data_len = config_str.length();
+    /**
+     * @brief 全設定の送信を予約する（まとめて送られる）
+     */
+    void push_full() {
+        int debounce_ms, max_delay_ms;
+        read_push_windows(debounce_ms, max_delay_ms);
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        push_full_ = true;
+        note_push_locked(debounce_ms, max_delay_ms);
+    }
 
-    while (total_sent < (ssize_t)data_len && !g_shutdown_flag.load()) {
-        ssize_t bytes_sent = send(sock, data_ptr + total_sent, data_len - total_sent, 0);
-        if (bytes_sent < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                // 一時的な送信不可、少し待って再試行
-                std::this_thread::sleep_for(std::chrono::milliseconds(10));
-                continue;
-            }
-            std::cerr << "エラー: データ送信に失敗しました。 " << strerror(errno) << std::endl;
-            close(sock);
-            return;
+    /**
+     * @brief WPFが応答可能とみなされているか
+     */
+    bool peer_alive() const { return peer_alive_.load(); }
+
+    /**
+     * @brief 送信のまとめ状況を表示する
+     */
+    void print_push_stats() {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        std::cout << "WPFへの送信: 通知 " << push_events_ << " 件を " << push_sends_ << " 回の送信にまとめました"
+                  << "（待機 " << push_debounce_ms_ << "ms, 最大遅延 " << push_max_delay_ms_ << "ms）\n";
+    }
+
+private:
+    struct Job {
+        std::string host;
+        int port;
+        std::string payload;
+        SendCallback callback;
+        std::promise<SendResult> promise;
+        int sock = -1;
+        uint64_t trace_id = 0;   // トレース用の接続番号
+        uint64_t version = 0;    // 接続開始時点の設定の版（トレース用）
+        bool connected = false;
+        bool heartbeat = false;  // trueなら送信後に応答（!PONG）を待つ
+        size_t sent = 0;
+        std::string reply;
+        std::chrono::steady_clock::time_point started;
+        std::chrono::steady_clock::time_point sent_at;
+        std::chrono::steady_clock::time_point deadline;
+    };
+
+    static double elapsed_ms(std::chrono::steady_clock::time_point since) {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - since).count();
+    }
+
+    // まとめる待ち時間を設定から読む。g_config_mutex を取るため、queue_mutex_ を持つ前に呼ぶ
+    static void read_push_windows(int& debounce_ms, int& max_delay_ms) {
+        debounce_ms = std::max(0, get_config_int("CONFIG_SYNC", "PUSH_DEBOUNCE_MS", 20));
+        max_delay_ms = std::max(debounce_ms, get_config_int("CONFIG_SYNC", "PUSH_MAX_DELAY_MS", 100));
+    }
+
+    void note_push_locked(int debounce_ms, int max_delay_ms) {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        push_debounce_ms_ = debounce_ms;
+        push_max_delay_ms_ = max_delay_ms;
+        if (!push_pending_) {
+            push_pending_ = true;
+            push_first_ = now;
         }
-        total_sent += bytes_sent;
+        push_last_ = now;
+        push_events_++;
+        wake();
     }
 
-    if (g_shutdown_flag.load()) {
-        std::cout << "送信がキャンセルされました。\n";
+    // まとめた通知を送信する時刻（queue_mutex_を保持して呼ぶ）
+    std::chrono::steady_clock::time_point push_due_locked() const {
+        return std::min(push_last_ + std::chrono::milliseconds(push_debounce_ms_),
+                        push_first_ + std::chrono::milliseconds(push_max_delay_ms_));
+    }
+
+    // 期限が来ていれば、まとめた通知を1つの送信ジョブにする
+    void maybe_flush_push() {
+        bool full;
+        StagedChanges delta;
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex_);
+            if (!push_pending_ || std::chrono::steady_clock::now() < push_due_locked()) {
+                return;
+            }
+            full = push_full_;
+            delta.swap(push_delta_);
+            push_full_ = false;
+            push_pending_ = false;
+            push_sends_++;
+        }
+
+        std::string host;
+        int port;
+        if (!get_wpf_target(host, port)) {
+            return;
+        }
+        std::shared_ptr<Job> job(new Job());
+        job->host = host;
+        job->port = port;
+        if (full) {
+            job->payload = serialize_config();
+        } else {
+            std::string content;
+            for (const auto& entry : delta) {
+                append_config_entry(content, entry.first.first, entry.first.second, entry.second);
+            }
+            job->payload = frame_message(content);
+        }
+        begin(job);
+    }
+
+    void wake() {
+        uint64_t one = 1;
+        ssize_t ret = write(wake_fd_, &one, sizeof(one));
+        (void)ret;
+    }
+
+    void set_deadline(const std::shared_ptr<Job>& job, int timeout_ms) {
+        job->deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    }
+
+    void complete(const std::shared_ptr<Job>& job, bool success, const std::string& error) {
+        Metrics::PeerCounters traffic;
+        traffic.bytes_sent = job->sent;
+        traffic.messages_sent = (job->sent > 0 && job->sent == job->payload.size()) ? 1 : 0;
+        traffic.bytes_received = job->reply.size();
+        traffic.messages_received = job->reply.empty() ? 0 : 1;
+        g_metrics.add_peer_traffic(job->host, traffic);
+        if (job->trace_id != 0) {
+            TRACE_PROBE4(outbound_send_complete, job->trace_id, job->sent, job->version, success ? 1 : 0);
+        }
+        if (success && !job->heartbeat) {
+            g_metrics.stage(STAGE_PUSH_SEND).record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - job->started).count());
+        }
+        if (job->sock >= 0) {
+            // fd番号は再利用されるため、closeする前に管理表から外す
+            auto it = active_.find(job->sock);
+            if (it != active_.end() && it->second == job) {
+                active_.erase(it);
+            }
+            if (epoll_fd_ >= 0) {
+                epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, job->sock, nullptr);
+            }
+            close(job->sock);
+            job->sock = -1;
+        }
+        if (job->heartbeat) {
+            on_heartbeat_done(job, success, error);
+        } else if (success) {
+            LOG_INFO("設定を送信しました（%d バイト）", job->sent);
+        } else {
+            LOG_ERROR("エラー: WPFアプリケーション(%s:%d)への送信に失敗しました。 %s", job->host, job->port, error);
+        }
+        SendResult result;
+        result.success = success;
+        result.bytes_sent = job->sent;
+        result.error = error;
+        if (job->callback) {
+            job->callback(result);
+        }
+        job->promise.set_value(result);
+    }
+
+    // 新しいジョブの接続を開始する
+    void begin(const std::shared_ptr<Job>& job) {
+        struct sockaddr_in server_addr;
+        memset(&server_addr, 0, sizeof(server_addr));
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_port = htons(job->port);
+        if (inet_pton(AF_INET, job->host.c_str(), &server_addr.sin_addr) <= 0) {
+            complete(job, false, "不正なIPアドレス: " + job->host);
+            return;
+        }
+
+        job->sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (job->sock < 0) {
+            complete(job, false, std::string("送信用ソケットを作成できませんでした。") + strerror(errno));
+            return;
+        }
+
+        if (!job->heartbeat) {
+            LOG_DEBUG("WPFアプリケーション(%s:%d)に接続を試行中...", job->host, job->port);
+        }
+        job->trace_id = g_next_connection_id.fetch_add(1);
+        job->version = g_config_version.load();
+        TRACE_PROBE3(outbound_connect, job->trace_id, job->port, job->version);
+        job->started = std::chrono::steady_clock::now();
+        int ret = connect(job->sock, (struct sockaddr*)&server_addr, sizeof(server_addr));
+        if (ret < 0 && errno != EINPROGRESS) {
+            complete(job, false, std::string("接続できませんでした。") + strerror(errno));
+            return;
+        }
+        job->connected = (ret == 0);
+        // 接続タイムアウトはRTOの2倍（未測定なら従来の5秒）
+        set_deadline(job, rtt_for_peer(job->host).timeout_ms(2.0, MIN_CONNECT_TIMEOUT_MS, DEFAULT_CONNECT_TIMEOUT_MS));
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLOUT;
+        ev.data.fd = job->sock;
+        if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, job->sock, &ev) < 0) {
+            complete(job, false, std::string("epollへの登録に失敗しました。") + strerror(errno));
+            return;
+        }
+        active_[job->sock] = job;
+    }
+
+    // ソケットにイベントがあったときの処理。完了したらtrueを返す（管理表からはcomplete()が外す）
+    bool on_event(const std::shared_ptr<Job>& job, uint32_t events) {
+        if (!job->connected) {
+            int so_error = 0;
+            socklen_t len = sizeof(so_error);
+            getsockopt(job->sock, SOL_SOCKET, SO_ERROR, &so_error, &len);
+            if (so_error != 0) {
+                complete(job, false, std::string("接続できませんでした。") + strerror(so_error));
+                return true;
+            }
+            job->connected = true;
+            // 3ウェイハンドシェイクの所要時間は1RTTの測定値になる
+            rtt_for_peer(job->host).add_sample(elapsed_ms(job->started));
+            if (!job->heartbeat) {
+                LOG_DEBUG("WPFアプリケーション(%s:%d)に接続しました。設定を送信します...", job->host, job->port);
+            }
+        }
+
+        if (job->sent < job->payload.size()) {
+            return on_writable(job);
+        }
+        if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+            return on_readable(job);
+        }
+        return false;
+    }
+
+    bool on_writable(const std::shared_ptr<Job>& job) {
+        RttEstimator& rtt = rtt_for_peer(job->host);
+        while (job->sent < job->payload.size()) {
+            ssize_t bytes_sent = send(job->sock, job->payload.data() + job->sent,
+                                      job->payload.size() - job->sent, MSG_NOSIGNAL);
+            if (bytes_sent < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    // 送信バッファが空くまでepollで待つ
+                    set_deadline(job, rtt.timeout_ms(4.0, MIN_READ_TIMEOUT_MS, DEFAULT_SEND_TIMEOUT_MS));
+                    return false;
+                }
+                if (errno == EINTR) {
+                    continue;
+                }
+                complete(job, false, std::string("データ送信に失敗しました。") + strerror(errno));
+                return true;
+            }
+            job->sent += bytes_sent;
+        }
+
+        if (!job->heartbeat) {
+            complete(job, true, "");
+            return true;
+        }
+
+        // ハートビートは応答（または相手による切断）を待つ
+        job->sent_at = std::chrono::steady_clock::now();
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.fd = job->sock;
+        epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, job->sock, &ev);
+        set_deadline(job, rtt.timeout_ms(3.0, MIN_CONNECT_TIMEOUT_MS, DEFAULT_CONNECT_TIMEOUT_MS));
+        return false;
+    }
+
+    bool on_readable(const std::shared_ptr<Job>& job) {
+        char buffer[256];
+        while (true) {
+            ssize_t n = recv(job->sock, buffer, sizeof(buffer), 0);
+            if (n > 0) {
+                job->reply.append(buffer, n);
+                if (job->reply.find("!PONG") != std::string::npos && job->reply.find('\n', job->reply.find("!PONG")) != std::string::npos) {
+                    break;
+                }
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return false;
+            }
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            break;  // 相手が切断した、またはエラー
+        }
+        if (job->reply.find("!PONG") != std::string::npos) {
+            // アプリケーション層の往復時間もRTTの測定値として使う
+            rtt_for_peer(job->host).add_sample(
+                std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - job->sent_at).count());
+        }
+        // ?PINGを理解しない相手でも、接続できて正常に閉じたなら生存とみなす
+        complete(job, true, "");
+        return true;
+    }
+
+    // 必要ならハートビートを開始する
+    void maybe_start_heartbeat() {
+        int interval_ms = get_config_int("CONFIG_SYNC", "HEARTBEAT_INTERVAL_MS", 0);
+        if (interval_ms <= 0 || heartbeat_in_flight_ || !active_.empty()) {
+            return;
+        }
+        if (std::chrono::steady_clock::now() < next_heartbeat_) {
+            return;
+        }
+        std::string host;
+        int port;
+        if (!get_wpf_target(host, port)) {
+            next_heartbeat_ = std::chrono::steady_clock::now() + std::chrono::milliseconds(interval_ms);
+            return;
+        }
+
+        std::shared_ptr<Job> job(new Job());
+        job->host = host;
+        job->port = port;
+        job->heartbeat = true;
+        job->payload = frame_message("?PING " + std::to_string(++heartbeat_seq_) + "\n");
+        heartbeat_in_flight_ = true;
+        begin(job);
+    }
+
+    void on_heartbeat_done(const std::shared_ptr<Job>& job, bool success, const std::string& error) {
+        heartbeat_in_flight_ = false;
+        RttEstimator& rtt = rtt_for_peer(job->host);
+        int interval_ms = std::max(1, get_config_int("CONFIG_SYNC", "HEARTBEAT_INTERVAL_MS", 0));
+        int miss_limit = std::max(1, get_config_int("CONFIG_SYNC", "HEARTBEAT_MISS_LIMIT", 3));
+
+        if (success) {
+            heartbeat_misses_ = 0;
+            next_heartbeat_ = std::chrono::steady_clock::now() + std::chrono::milliseconds(interval_ms);
+            if (!peer_alive_.exchange(true)) {
+                LOG_INFO("WPFアプリケーション(%s:%d)が復帰しました。%s 全設定を再送します。", job->host, job->port,
+                         rtt.describe());
+                std::shared_ptr<Job> resend(new Job());
+                resend->host = job->host;
+                resend->port = job->port;
+                resend->payload = serialize_config();
+                begin(resend);
+            }
+            return;
+        }
+
+        // 失敗した場合は、通常間隔を待たずRTO間隔で再試行して素早く判定する
+        heartbeat_misses_++;
+        next_heartbeat_ = std::chrono::steady_clock::now() + std::chrono::milliseconds(
+            std::min(interval_ms, rtt.timeout_ms(1.0, MIN_CONNECT_TIMEOUT_MS, interval_ms)));
+        if (heartbeat_misses_ >= miss_limit && peer_alive_.exchange(false)) {
+            LOG_WARN("警告: WPFアプリケーション(%s:%d)からの応答が %d 回連続で途絶えました。切断状態とみなします。 (%s)",
+                     job->host, job->port, heartbeat_misses_, error);
+        }
+    }
+
+    void run() {
+        std::vector<struct epoll_event> events(16);
+        while (running_.load()) {
+            // 最も近い期限（ハートビート含む）までをepoll_waitのタイムアウトにする
+            int timeout_ms = 1000;
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            for (const auto& entry : active_) {
+                long long remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    entry.second->deadline - now).count();
+                timeout_ms = std::max(0, std::min(timeout_ms, (int)remaining + 1));
+            }
+            // ハートビートが無効なときや送信中のジョブがあるときは、期限を過ぎていても待たない
+            // （maybe_start_heartbeat()が何もしないため、タイムアウト0で空回りしてしまう）
+            if (!heartbeat_in_flight_ && active_.empty() &&
+                get_config_int("CONFIG_SYNC", "HEARTBEAT_INTERVAL_MS", 0) > 0) {
+                long long remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    next_heartbeat_ - now).count();
+                timeout_ms = std::max(0, std::min(timeout_ms, (int)remaining + 1));
+            }
+            {
+                std::lock_guard<std::mutex> lock(queue_mutex_);
+                if (push_pending_) {
+                    long long remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        push_due_locked() - now).count();
+                    timeout_ms = std::max(0, std::min(timeout_ms, (int)remaining + 1));
+                }
+            }
+
+            int n = epoll_wait(epoll_fd_, events.data(), (int)events.size(), timeout_ms);
+            if (n < 0 && errno != EINTR) {
+                std::cerr << "エラー: epoll_waitに失敗しました。 " << strerror(errno) << std::endl;
+                break;
+            }
+
+            for (int i = 0; i < n; i++) {
+                int fd = events[i].data.fd;
+                if (fd == wake_fd_) {
+                    uint64_t value;
+                    while (read(wake_fd_, &value, sizeof(value)) > 0) {
+                    }
+                    continue;
+                }
+                auto it = active_.find(fd);
+                if (it == active_.end()) {
+                    continue;
+                }
+                std::shared_ptr<Job> job = it->second;
+                on_event(job, events[i].events);
+            }
+
+            // 新しいジョブを取り込む
+            std::deque<std::shared_ptr<Job> > pending;
+            {
+                std::lock_guard<std::mutex> lock(queue_mutex_);
+                pending.swap(queue_);
+            }
+            for (const auto& job : pending) {
+                begin(job);
+            }
+
+            // 期限切れのジョブを失敗として完了させる
+            now = std::chrono::steady_clock::now();
+            std::vector<std::shared_ptr<Job> > expired;
+            for (const auto& entry : active_) {
+                if (entry.second->deadline <= now) {
+                    expired.push_back(entry.second);
+                }
+            }
+            for (const auto& job : expired) {
+                complete(job, false, job->connected ? "送信がタイムアウトしました。" : "接続がタイムアウトしました。");
+            }
+
+            maybe_flush_push();
+            maybe_start_heartbeat();
+        }
+
+        // 終了時: 未完了のジョブをすべてキャンセルする
+        std::deque<std::shared_ptr<Job> > pending;
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex_);
+            pending.swap(queue_);
+        }
+        for (const auto& job : pending) {
+            complete(job, false, "送信がキャンセルされました。");
+        }
+        while (!active_.empty()) {
+            std::shared_ptr<Job> job = active_.begin()->second;
+            complete(job, false, "送信がキャンセルされました。");
+        }
+    }
+
+    int epoll_fd_;
+    int wake_fd_;
+    std::atomic<bool> running_;
+    std::thread thread_;
+    std::mutex queue_mutex_;
+    std::deque<std::shared_ptr<Job> > queue_;
+    // 送信待ちの通知（queue_mutex_で保護）
+    bool push_pending_;
+    bool push_full_;
+    StagedChanges push_delta_;
+    std::chrono::steady_clock::time_point push_first_;
+    std::chrono::steady_clock::time_point push_last_;
+    int push_debounce_ms_;
+    int push_max_delay_ms_;
+    uint64_t push_events_;
+    uint64_t push_sends_;
+    // 以下は送信スレッドのみが触る
+    std::map<int, std::shared_ptr<Job> > active_;
+    uint64_t heartbeat_seq_;
+    bool heartbeat_in_flight_;
+    int heartbeat_misses_;
+    std::atomic<bool> peer_alive_;
+    std::chrono::steady_clock::time_point next_heartbeat_;
+};
+
+OutboundSender g_outbound_sender;
+
+/**
+ * @brief WPFアプリケーションに現在の設定を送信する（非同期）
+ *
+ * 設定のスナップショットを取って送信スレッドに積むだけで、すぐに戻る。
+ * @param callback 完了時に呼ばれるコールバック（省略可）
+ * @return 送信結果を受け取るfuture
+ */
+std::future<SendResult> send_config_to_wpf(SendCallback callback = SendCallback()) {
+    std::string host;
+    int port;
+    if (!get_wpf_target(host, port)) {
+        std::promise<SendResult> failed;
+        SendResult result;
+        result.success = false;
+        result.bytes_sent = 0;
+        result.error = "不正なポート番号";
+        if (callback) {
+            callback(result);
+        }
+        failed.set_value(result);
+        return failed.get_future();
+    }
+
+    return g_outbound_sender.enqueue(host, port, serialize_config(), callback);
+}
+
+/**
+ * @brief WPFからの設定更新を待ち受けるサーバーとして動作する (別スレッドで実行)
+ */
+void handle_client_connection(int client_sock, const std::string& peer, bool is_local = false,
+                              uint64_t conn_id = 0); // プロトタイプ宣言
+void save_config(const std::string& filename); // プロトタイプ宣言を追加
+uint64_t request_config_save(); // プロトタイプ宣言
+std::string format_config_history(const std::string& prefix, size_t limit); // プロトタイプ宣言
+std::string format_metrics(); // プロトタイプ宣言
+std::string format_lock_profile(); // プロトタイプ宣言
+std::string format_config_presets(); // プロトタイプ宣言
+int activate_config_preset(const std::string& name, uint64_t& version); // プロトタイプ宣言
+std::string handle_replication_query(const std::string& request, const std::string& peer); // プロトタイプ宣言
+void serve_rollout_request(int sock, const std::string& request, const std::string& peer,
+                           PeerTraffic& traffic); // プロトタイプ宣言
+void run_metrics_listener(int listen_sock); // プロトタイプ宣言
+bool wait_config_durable(uint64_t version, int timeout_ms); // プロトタイプ宣言
+size_t send_message_on_existing_socket(int sock, const std::string& message); // プロトタイプ宣言
+
+/**
+ * @brief UNIXソケットのパスで、動作中の別のプロセスが待ち受けているかを調べる
+ *
+ * 実際に接続してみて、応答があれば使用中とみなす（残っているだけのソケットファイルは
+ * ECONNREFUSED になる）。
+ * @param path ソケットファイルのパス
+ * @return 接続できた場合true
+ */
+bool unix_socket_in_use(const std::string& path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+        return false;
+    }
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        return false;
+    }
+    bool in_use = connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+    close(sock);
+    return in_use;
+}
+
+/**
+ * @brief ローカルプロセス向けのUNIXドメインソケットを開いて待ち受ける
+ * @param path ソケットファイルのパス
+ * @return 待ち受けソケット。失敗時は-1（別のプロセスが待ち受けている場合も-1）
+ */
+int open_unix_listener(const std::string& path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "エラー: 不正なUNIXソケットのパス: " << path << std::endl;
+        return -1;
+    }
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+    // 前回の実行で残ったソケットファイルのみ削除する（通常ファイルや、動作中の別のプロセスのソケットは消さない）
+    struct stat st;
+    if (lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+        if (unix_socket_in_use(path)) {
+            std::cerr << "エラー: " << path << " は別のプロセスが使用中です。" << std::endl;
+            return -1;
+        }
+        unlink(path.c_str());
+    }
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        std::cerr << "エラー: UNIXソケットを作成できませんでした。 " << strerror(errno) << std::endl;
+        return -1;
+    }
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        std::cerr << "エラー: " << path << " にバインドできませんでした。 " << strerror(errno) << std::endl;
+        close(sock);
+        return -1;
+    }
+    // 所有者とグループのみ接続可能にする（実際の許可はSO_PEERCREDで判定）
+    chmod(path.c_str(), 0660);
+    if (listen(sock, 5) < 0) {
+        std::cerr << "エラー: UNIXソケットのlistenに失敗しました。 " << strerror(errno) << std::endl;
+        close(sock);
+        unlink(path.c_str());
+        return -1;
+    }
+    return sock;
+}
+
+/**
+ * @brief UNIXソケットの接続相手の資格情報（SO_PEERCRED）を確認する
+ *
+ * rootと自プロセスと同じUIDは常に許可し、それ以外は CONFIG_SYNC:UDS_ALLOWED_UIDS
+ * （カンマ区切り）に含まれるUIDのみ許可する。
+ * @param sock 接続済みのUNIXソケット
+ * @param peer 接続相手の識別名（"uds:UID"）を受け取る
+ * @return 許可された場合true
+ */
+bool check_unix_peer(int sock, std::string& peer) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+        LOG_ERROR("エラー: 接続相手の資格情報を取得できませんでした。 %s", strerror(errno));
+        return false;
+    }
+
+    peer = "uds:" + std::to_string(cred.uid);
+    bool allowed = (cred.uid == 0 || cred.uid == geteuid());
+    if (!allowed) {
+        std::stringstream ss(get_config_value("CONFIG_SYNC", "UDS_ALLOWED_UIDS", ""));
+        std::string item;
+        while (std::getline(ss, item, ',')) {
+            try {
+                if (!item.empty() && (uid_t)std::stoul(item) == cred.uid) {
+                    allowed = true;
+                    break;
+                }
+            } catch (const std::exception&) {
+                // 不正な値は無視する
+            }
+        }
+    }
+
+    if (allowed) {
+        LOG_DEBUG("ローカルプロセス (pid=%d, uid=%d) から接続を受信しました。", cred.pid, cred.uid);
+    } else {
+        LOG_WARN("警告: ローカルプロセス (pid=%d, uid=%d) は許可されていないため拒否します。", cred.pid, cred.uid);
+    }
+    return allowed;
+}
+
+/**
+ * @brief 現在の設定のスナップショットをmemfdに書き出し、SCM_RIGHTSで渡す
+ *
+ * 応答本体は "!SNAPSHOT SIZE VERSION" の1行で、ファイルディスクリプタが添付される。
+ * memfdは書き込み禁止にシールされるため、受け取った側は安全にmmapして読める。
+ * @param sock 接続済みのUNIXソケット
+ * @return 送信できたバイト数（fdの中身は含まない）
+ */
+size_t send_config_snapshot_fd(int sock) {
+    uint64_t version = g_config_version.load();
+    std::string snapshot = serialize_config();
+
+    int fd = memfd_create("config_snapshot", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        LOG_ERROR("エラー: memfdを作成できませんでした。 %s", strerror(errno));
+        return 0;
+    }
+    size_t written = 0;
+    while (written < snapshot.size()) {
+        ssize_t n = write(fd, snapshot.data() + written, snapshot.size() - written);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            LOG_ERROR("エラー: スナップショットの書き込みに失敗しました。 %s", strerror(errno));
+            close(fd);
+            return 0;
+        }
+        written += n;
+    }
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+
+    std::string message = frame_message("!SNAPSHOT " + std::to_string(snapshot.size()) + " " +
+                                        std::to_string(version) + "\n");
+    struct iovec iov;
+    iov.iov_base = const_cast<char*>(message.data());
+    iov.iov_len = message.size();
+
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    ssize_t sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    size_t total_sent = 0;
+    if (sent < 0) {
+        LOG_ERROR("エラー: スナップショットの送信に失敗しました。 %s", strerror(errno));
+    } else {
+        total_sent = sent;
+        if ((size_t)sent < message.size()) {
+            // fdは最初の送信で渡し済み。残りの本体を送る
+            total_sent += send_message_on_existing_socket(sock, message.substr(sent));
+        }
+        LOG_INFO("設定スナップショットをfdで渡しました（%d バイト, バージョン %d）", snapshot.size(), version);
+    }
+    close(fd);
+    return total_sent;
+}
+
+/**
+ * @brief トークンバケット（rate_per_sec で補充され、最大 burst まで貯まる）
+ */
+class TokenBucket {
+public:
+    TokenBucket() : tokens_(0.0), last_(std::chrono::steady_clock::now()), initialized_(false) {}
+
+    /**
+     * @brief トークンを1つ消費する
+     * @return 消費できた場合true
+     */
+    bool try_take(double rate_per_sec, double burst) {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if (!initialized_) {
+            tokens_ = burst;
+            initialized_ = true;
+        } else {
+            double elapsed = std::chrono::duration<double>(now - last_).count();
+            tokens_ = std::min(burst, tokens_ + elapsed * rate_per_sec);
+        }
+        last_ = now;
+        if (tokens_ < 1.0) {
+            return false;
+        }
+        tokens_ -= 1.0;
+        return true;
+    }
+
+    /**
+     * @brief 満タンまで回復しているか（使われていないバケットの掃除用）
+     */
+    bool is_full(double rate_per_sec, double burst) const {
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - last_).count();
+        return tokens_ + elapsed * rate_per_sec >= burst;
+    }
+
+private:
+    double tokens_;
+    std::chrono::steady_clock::time_point last_;
+    bool initialized_;
+};
+
+/**
+ * @brief 更新ポートの受付制御
+ *
+ * 同時接続数の上限、相手ごとの接続レート、相手ごと・全体の更新レートを
+ * トークンバケットで制限する。更新は本体を読む前（ヘッダー直後）に判定するため、
+ * 暴走したクライアントがファイル保存やCPUを使い潰すことを防げる。
+ */
+class AdmissionController {
+public:
+    AdmissionController()
+        : max_connections_(8), max_subscriptions_(16), peer_conn_rate_(50.0), peer_update_rate_(5.0),
+          global_update_rate_(20.0), active_connections_(0), active_subscriptions_(0), accepted_(0),
+          shed_connections_(0), shed_subscriptions_(0), shed_peer_connect_(0), shed_peer_update_(0),
+          shed_global_update_(0) {}
+
+    /**
+     * @brief 設定から制限値を読み込む（バーストはレートの2倍）
+     */
+    void configure() {
+        // 設定の読み出しは g_config_mutex を取るため、mutex_ を持つ前に済ませる
+        int max_connections = std::max(1, get_config_int("CONFIG_SYNC", "ADMISSION_MAX_CONNECTIONS", 8));
+        int peer_conn_rate = std::max(1, get_config_int("CONFIG_SYNC", "ADMISSION_PEER_CONNECT_RATE", 50));
+        int peer_update_rate = std::max(1, get_config_int("CONFIG_SYNC", "ADMISSION_PEER_UPDATE_RATE", 5));
+        int global_update_rate = std::max(1, get_config_int("CONFIG_SYNC", "ADMISSION_GLOBAL_UPDATE_RATE", 20));
+        int max_subscriptions = std::max(0, get_config_int("CONFIG_SYNC", "ADMISSION_MAX_SUBSCRIPTIONS", 16));
+        std::lock_guard<std::mutex> lock(mutex_);
+        max_connections_ = max_connections;
+        max_subscriptions_ = max_subscriptions;
+        peer_conn_rate_ = peer_conn_rate;
+        peer_update_rate_ = peer_update_rate;
+        global_update_rate_ = global_update_rate;
+    }
+
+    /**
+     * @brief 新しい接続を受け付けるか判定する。許可した場合は release_connection() を必ず呼ぶこと
+     */
+    bool try_admit_connection(const std::string& peer) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (active_connections_ >= max_connections_) {
+            shed_connections_++;
+            peers_[peer].shed++;
+            return false;
+        }
+        if (!peers_[peer].connect_bucket.try_take(peer_conn_rate_, peer_conn_rate_ * 2)) {
+            shed_peer_connect_++;
+            peers_[peer].shed++;
+            return false;
+        }
+        active_connections_++;
+        accepted_++;
+        return true;
+    }
+
+    /**
+     * @brief 更新メッセージの本体を読む前に、受け付けるか判定する
+     */
+    bool try_admit_update(const std::string& peer) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        PeerState& state = peers_[peer];
+        if (!state.update_bucket.try_take(peer_update_rate_, peer_update_rate_ * 2)) {
+            shed_peer_update_++;
+            state.shed++;
+            return false;
+        }
+        if (!global_update_bucket_.try_take(global_update_rate_, global_update_rate_ * 2)) {
+            shed_global_update_++;
+            state.shed++;
+            return false;
+        }
+        return true;
+    }
+
+    void release_connection() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        active_connections_--;
+        prune_locked();
+        idle_cv_.notify_all();
+    }
+
+    /**
+     * @brief 受け付けた接続を購読（?SUBSCRIBE）に切り替える
+     *
+     * 購読は長く続くため、更新用の同時接続数の枠を返し、購読用の枠（ADMISSION_MAX_SUBSCRIPTIONS）を使う。
+     * 許可した場合は、購読を終えたら end_subscription() を必ず呼ぶこと
+     * @return 購読用の枠が空いていればtrue
+     */
+    bool begin_subscription() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (active_subscriptions_ >= max_subscriptions_) {
+            shed_subscriptions_++;
+            return false;
+        }
+        active_subscriptions_++;
+        active_connections_--;
+        idle_cv_.notify_all();
+        return true;
+    }
+
+    /**
+     * @brief 購読を終え、接続の枠に戻す（その後の release_connection() で返される）
+     */
+    void end_subscription() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        active_subscriptions_--;
+        active_connections_++;
+    }
+
+    /**
+     * @brief 処理中の接続と購読がすべて終わるまで待つ
+     */
+    void wait_idle() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        idle_cv_.wait(lock, [this]() { return active_connections_ == 0 && active_subscriptions_ == 0; });
+    }
+
+    /**
+     * @brief 受付・拒否の統計を表示する
+     */
+    void print_stats() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::cout << "受付制御: 処理中 " << active_connections_ << "/" << max_connections_ << " 接続, 購読 "
+                  << active_subscriptions_ << "/" << max_subscriptions_ << ", 受付 " << accepted_ << " 件\n";
+        std::cout << "  拒否: 同時接続数超過 " << shed_connections_ << ", 購読数超過 " << shed_subscriptions_
+                  << ", 接続レート超過 " << shed_peer_connect_
+                  << ", 更新レート超過(相手ごと) " << shed_peer_update_ << ", 更新レート超過(全体) "
+                  << shed_global_update_ << "\n";
+        for (const auto& entry : peers_) {
+            if (entry.second.shed > 0) {
+                std::cout << "  " << entry.first << ": 拒否 " << entry.second.shed << " 件\n";
+            }
+        }
+    }
+
+private:
+    struct PeerState {
+        TokenBucket connect_bucket;
+        TokenBucket update_bucket;
+        uint64_t shed = 0;
+    };
+
+    // 相手が多くなりすぎたら、満タンに戻っていて拒否履歴のない相手を削除する
+    void prune_locked() {
+        if (peers_.size() < 1024) {
+            return;
+        }
+        for (auto it = peers_.begin(); it != peers_.end();) {
+            if (it->second.shed == 0 && it->second.connect_bucket.is_full(peer_conn_rate_, peer_conn_rate_ * 2) &&
+                it->second.update_bucket.is_full(peer_update_rate_, peer_update_rate_ * 2)) {
+                it = peers_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable idle_cv_;
+    int max_connections_;
+    int max_subscriptions_;
+    double peer_conn_rate_;
+    double peer_update_rate_;
+    double global_update_rate_;
+    int active_connections_;
+    int active_subscriptions_;
+    std::map<std::string, PeerState> peers_;
+    TokenBucket global_update_bucket_;
+    uint64_t accepted_;
+    uint64_t shed_connections_;
+    uint64_t shed_subscriptions_;
+    uint64_t shed_peer_connect_;
+    uint64_t shed_peer_update_;
+    uint64_t shed_global_update_;
+};
+
+AdmissionController g_admission;
+
+/**
+ * @brief 受付制御を通過した接続を別スレッドで処理する
+ */
+void dispatch_client_connection(int client_sock, const std::string& peer, bool is_local) {
+    if (!g_admission.try_admit_connection(peer)) {
+        LOG_WARN("警告: %s からの接続を拒否しました（受付制限）。", peer);
+        close(client_sock);
+        return;
+    }
+    uint64_t conn_id = g_next_connection_id.fetch_add(1);
+    TRACE_PROBE3(accept, conn_id, is_local ? 1 : 0, peer.c_str());
+    try {
+        std::thread([client_sock, peer, is_local, conn_id]() {
+            handle_client_connection(client_sock, peer, is_local, conn_id);
+            g_admission.release_connection();
+        }).detach();
+    } catch (const std::exception& e) {
+        LOG_ERROR("エラー: 接続処理スレッドを開始できませんでした: %s", e.what());
+        close(client_sock);
+        g_admission.release_connection();
+    }
+}
+
+void receive_config_updates() {
+    std::string port_str = get_config_value("CONFIG_SYNC", "CPP_RECV_PORT", "12348");
+
+    int port;
+    try {
+        port = std::stoi(port_str);
+        if (port <= 0 || port > 65535) {
+            throw std::out_of_range("ポート番号が範囲外です");
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "エラー: 不正なポート番号: " << port_str << " (" << e.what() << ")" << std::endl;
+        return;
+    }
+
+    int listen_sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_sock < 0) {
+        std::cerr << "エラー: 受信用ソケットを作成できませんでした。 " << strerror(errno) << std::endl;
+        return;
+    }
+
+    // ソケットオプション設定（アドレス再利用）
+    int opt = 1;
+    if (setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+        std::cerr << "エラー: SO_REUSEADDRの設定に失敗しました。 " << strerror(errno) << std::endl;
+    }
+
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(port);
+
+    if (bind(listen_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        std::cerr << "エラー: ポート " << port << " にバインドできませんでした。 " << strerror(errno) << std::endl;
+        close(listen_sock);
+        return;
+    }
+
+    if (listen(listen_sock, 5) < 0) {
+        std::cerr << "エラー: listenに失敗しました。 " << strerror(errno) << std::endl;
+        close(listen_sock);
+        return;
+    }
+
+    std::cout << "ポート " << port << " でWPFからの設定更新を待機しています...\n";
+    g_admission.configure();
+
+    // Prometheus向けのメトリクスをHTTPで提供する（0なら無効）。認証が無いため、
+    // METRICS_BIND でアドレスを指定しない限りループバックだけで待ち受ける
+    int metrics_port = get_config_int("CONFIG_SYNC", "METRICS_PORT", 0);
+    std::string metrics_bind = get_config_value("CONFIG_SYNC", "METRICS_BIND", "127.0.0.1");
+    int metrics_sock = -1;
+    if (metrics_port > 0 && metrics_port <= 65535) {
+        struct sockaddr_in metrics_addr = server_addr;
+        metrics_addr.sin_port = htons(metrics_port);
+        if (inet_pton(AF_INET, metrics_bind.c_str(), &metrics_addr.sin_addr) <= 0) {
+            std::cerr << "警告: METRICS_BIND のアドレスが不正です。ループバックで待ち受けます: " << metrics_bind << std::endl;
+            metrics_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            metrics_bind = "127.0.0.1";
+        }
+        metrics_sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        setsockopt(metrics_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        if (metrics_sock < 0 || bind(metrics_sock, (struct sockaddr*)&metrics_addr, sizeof(metrics_addr)) < 0 ||
+            listen(metrics_sock, 5) < 0) {
+            std::cerr << "警告: メトリクス用のポート " << metrics_port << " を開けませんでした。 " << strerror(errno) << std::endl;
+            if (metrics_sock >= 0) {
+                close(metrics_sock);
+            }
+            metrics_sock = -1;
+        } else {
+            std::cout << metrics_bind << ":" << metrics_port << " でメトリクス（/metrics）を提供しています...\n";
+        }
+    }
+    // メトリクスの応答は専用のスレッドで行い、遅い取得元が更新の受け付けを止めないようにする
+    std::thread metrics_thread;
+    if (metrics_sock >= 0) {
+        metrics_thread = std::thread(run_metrics_listener, metrics_sock);
+    }
+
+    // ローカルプロセス向けに同じプロトコルをUNIXドメインソケットでも提供する（空なら無効）
+    std::string uds_path = get_config_value("CONFIG_SYNC", "UDS_PATH", "/tmp/config_sync.sock");
+    int uds_sock = -1;
+    if (!uds_path.empty()) {
+        uds_sock = open_unix_listener(uds_path);
+        if (uds_sock >= 0) {
+            std::cout << uds_path << " でローカルプロセスからの接続を待機しています...\n";
+        }
+    }
+
+    while (!g_shutdown_flag.load()) {
+        fd_set readfds;
+        FD_ZERO(&readfds);
+        FD_SET(listen_sock, &readfds);
+        if (uds_sock >= 0) {
+            FD_SET(uds_sock, &readfds);
+        }
+        
+        struct timeval timeout;
+        timeout.tv_sec = 1;
+        timeout.tv_usec = 0;
+        
+        int max_fd = std::max(listen_sock, uds_sock);
+        int activity = select(max_fd + 1, &readfds, nullptr, nullptr, &timeout);
+        
+        if (activity < 0) {
+            if (errno != EINTR) {
+                std::cerr << "エラー: selectに失敗しました。 " << strerror(errno) << std::endl;
+            }
+            break;
+        }
+        
+        if (activity == 0) {
+            // タイムアウト、継続
+            continue;
+        }
+        
+        if (FD_ISSET(listen_sock, &readfds)) {
+            struct sockaddr_in client_addr;
+            socklen_t client_len = sizeof(client_addr);
+            int client_sock = accept(listen_sock, (struct sockaddr*)&client_addr, &client_len);
+            
+            if (client_sock < 0) {
+                if (!g_shutdown_flag.load()) {
+                    LOG_ERROR("エラー: acceptに失敗しました。 %s", strerror(errno));
+                }
+                continue;
+            }
+
+            char client_ip[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
+            LOG_DEBUG("クライアント %s:%d から接続を受信しました。", client_ip, ntohs(client_addr.sin_port));
+
+            // 受付制御を通過したら、接続処理を別スレッドに委譲
+            dispatch_client_connection(client_sock, client_ip, false);
+        }
+
+        if (uds_sock >= 0 && FD_ISSET(uds_sock, &readfds)) {
+            int client_sock = accept4(uds_sock, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client_sock < 0) {
+                if (!g_shutdown_flag.load()) {
+                    LOG_ERROR("エラー: acceptに失敗しました。 %s", strerror(errno));
+                }
+                continue;
+            }
+            std::string peer;
+            if (!check_unix_peer(client_sock, peer)) {
+                close(client_sock);
+                continue;
+            }
+            dispatch_client_connection(client_sock, peer, true);
+        }
+    }
+
+    if (metrics_thread.joinable()) {
+        metrics_thread.join();
+    }
+    if (metrics_sock >= 0) {
+        close(metrics_sock);
+    }
+    if (uds_sock >= 0) {
+        close(uds_sock);
+        unlink(uds_path.c_str());
+    }
+    close(listen_sock);
+
+    // 処理中の接続スレッドが終わるのを待つ
+    g_admission.wait_idle();
+    std::cout << "設定更新受信スレッドを終了しました。\n";
+}
+
+/**
+ * @brief 既存のソケットを通じてフレーム化済みのメッセージを送信する
+ * @param sock 既に接続済みのクライアントソケット
+ * @param message 送信するメッセージ
+ * @return 送信できたバイト数
+ */
+size_t send_message_on_existing_socket(int sock, const std::string& message) {
+    ssize_t total_sent = 0;
+    const char* data_ptr = message.c_str();
+    size_t data_len = message.length();
+
+    // handle_client_connectionではノンブロッキングに設定していないため、sendはブロックするはず
+    while (total_sent < (ssize_t)data_len && !g_shutdown_flag.load()) {
+        ssize_t bytes_sent = send(sock, data_ptr + total_sent, data_len - total_sent, MSG_NOSIGNAL);
+        if (bytes_sent < 0) {
+            // EAGAIN/EWOULDBLOCKはブロッキングソケットでは通常発生しないが、念のため
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                continue;
+            }
+            LOG_ERROR("エラー: 設定の返信に失敗しました。 %s", strerror(errno));
+            return total_sent;
+        }
+        total_sent += bytes_sent;
+    }
+
+    if (g_shutdown_flag.load()) {
+        LOG_INFO("設定の返信がキャンセルされました。");
+    } else {
+        LOG_DEBUG("設定を返信しました（%d バイト）", total_sent);
+    }
+    return total_sent;
+}
+
+/**
+ * @brief 既存のソケットを通じて現在の設定を送信する
+ * @param sock 既に接続済みのクライアントソケット
+ * @return 送信できたバイト数
+ */
+size_t send_config_on_existing_socket(int sock) {
+    return send_message_on_existing_socket(sock, serialize_config());
+}
+
+/**
+ * @brief 購読者に送る設定全体（"!SNAPSHOT 版" の行に続けて全項目）を作る
+ * @param version 送る内容の版を受け取る
+ */
+std::string config_snapshot_message(uint64_t& version) {
+    SiteLockGuard lock(g_config_mutex, LOCK_SITE());
+    version = g_config_version.load();
+    std::string message = "!SNAPSHOT " + std::to_string(version) + "\n";
+    for (const auto& section_pair : g_config_data) {
+        for (const auto& key_value_pair : section_pair.second) {
+            append_config_entry(message, section_pair.first, key_value_pair.first, key_value_pair.second);
+        }
+    }
+    return frame_message(message);
+}
+
+/**
+ * @brief 購読（?SUBSCRIBE）に応える。接続が切れるか終了するまで戻らない
+ *
+ * 最初に設定全体を送り、以降はコミットごとに "!CHANGED 版" の行と変わった項目を送る。
+ * 続けて、変わったコンポーネント（セクション）ごとに "!IMPACT SECTION 影響" の行を送る。
+ * 差分で表せないとき（設定ファイルの読み直し、大きく遅れた場合）は全体を送り直す。
+ * 購読中の接続は受付制御の購読数の上限（ADMISSION_MAX_SUBSCRIPTIONS）に数えられ、更新用の同時接続数には数えない。
+ */
+void serve_config_subscription(int sock, PeerTraffic& traffic) {
+    const int POLL_INTERVAL_MS = 500;
+    uint64_t sent_version = 0;
+    bool need_snapshot = true;
+    std::vector<ConfigChange> changes;
+    while (!g_shutdown_flag.load()) {
+        std::string message;
+        if (need_snapshot) {
+            message = config_snapshot_message(sent_version);
+            need_snapshot = false;
+        } else {
+            if (!g_change_feed.wait_newer(sent_version, POLL_INTERVAL_MS)) {
+                // 変更がない間は、相手が切断していないかだけ確かめる
+                char probe;
+                ssize_t n = recv(sock, &probe, 1, MSG_PEEK | MSG_DONTWAIT);
+                if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                    return;
+                }
+                continue;
+            }
+            changes.clear();
+            uint64_t latest = 0;
+            if (!g_change_feed.changes_since(sent_version, changes, latest)) {
+                need_snapshot = true;
+                continue;
+            }
+            std::string body = "!CHANGED " + std::to_string(latest) + "\n";
+            for (const ConfigChange& change : changes) {
+                append_config_entry(body, change.section, change.key, change.value);
+            }
+            // 送った変更全体について、コンポーネントごとに必要な対応を添える
+            for (const auto& component : summarize_impact(changes)) {
+                body += "!IMPACT " + component.first + " " + impact_name(component.second) + "\n";
+            }
+            message = frame_message(body);
+            sent_version = latest;
+        }
+        size_t sent = send_message_on_existing_socket(sock, message);
+        traffic.sent(sent);
+        if (sent < message.size()) {
+            return;
+        }
+    }
+}
+
+/**
+ * @brief クライアントからの接続を処理し、完全なメッセージを受信する (改良版)
+ * @param client_sock クライアントのソケットディスクリプタ
+ * @param peer 接続相手の識別名（IPアドレス、またはUNIXソケットなら "uds:UID"）
+ * @param is_local UNIXドメインソケット経由の接続ならtrue（fd渡しが使える）
+ */
+void handle_client_connection(int client_sock, const std::string& peer, bool is_local, uint64_t conn_id) {
+    t_trace_connection_id = conn_id;
+    // クライアントソケットにもタイムアウトを設定
+    // 相手のRTT（カーネルがハンドシェイクで測定した値）から導出し、未測定なら従来の10秒
+    int read_timeout_ms = DEFAULT_READ_TIMEOUT_MS;
+    if (!is_local) {
+        RttEstimator& rtt = rtt_for_peer(peer);
+        double sample_ms = kernel_rtt_ms(client_sock);
+        if (sample_ms > 0) {
+            rtt.add_sample(sample_ms);
+        }
+        read_timeout_ms = rtt.timeout_ms(4.0, MIN_READ_TIMEOUT_MS, DEFAULT_READ_TIMEOUT_MS);
+    }
+    struct timeval timeout;
+    timeout.tv_sec = read_timeout_ms / 1000;
+    timeout.tv_usec = (read_timeout_ms % 1000) * 1000;
+    setsockopt(client_sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    // この接続で送受信した量は、関数を抜けるときに接続相手ごとのカウンタへ加える
+    PeerTraffic traffic(peer);
+
+    try {
+        // 1. ヘッダー（メッセージ長）を改行まで読み込む
+        std::string header;
+        char c;
+        int header_read_count = 0;
+        const int MAX_HEADER_LENGTH = 20; // ヘッダーの最大長を制限
+
+        while (recv(client_sock, &c, 1, 0) > 0 && !g_shutdown_flag.load()) {
+            if (c == '\n') {
+                break;
+            }
+            header += c;
+            header_read_count++;
+            
+            // 異常に長いヘッダーを防ぐ
+            if (header_read_count > MAX_HEADER_LENGTH) {
+                LOG_ERROR("エラー: %s からのヘッダーが長すぎます。", peer);
+                close(client_sock);
+                return;
+            }
+        }
+
+        if (header.empty() || g_shutdown_flag.load()) {
+            close(client_sock);
+            return;
+        }
+
+        // 2. メッセージ長をパースし、その長さのデータを受信する
+        traffic.received(header.size() + 1);
+        size_t expected_length = std::stoull(header);
+        TRACE_PROBE2(header_parsed, conn_id, expected_length);
+        
+        // 0バイトデータは「設定要求」として扱う
+        if (expected_length == 0) {
+            traffic.message_received();
+            LOG_INFO("%s から設定要求（0バイト）を受信しました。現在の設定を返信します。", peer);
+            traffic.sent(send_config_on_existing_socket(client_sock));
+            close(client_sock);
+            return;
+        }
+
+        // 異常に大きなメッセージサイズを防ぐ
+        if (expected_length > MAX_UPDATE_MESSAGE_SIZE) {
+            LOG_ERROR("エラー: メッセージサイズが大きすぎます: %d bytes", expected_length);
+            close(client_sock);
+            return;
+        }
+        
+        // 本体は受信したチャンクごとにパースし、全体をバッファリングしない。
+        // 先頭が '?' の場合のみ問い合わせとして小さなバッファに貯める
+        ConfigUpdateParser parser;
+        std::string query_data;
+        bool is_query = false;
+
+        // 更新（先頭が '?' 以外）は本体を読む前にレート制限を判定する
+        char first_byte = 0;
+        if (recv(client_sock, &first_byte, 1, MSG_PEEK) == 1 && first_byte != '?' &&
+            !g_admission.try_admit_update(peer)) {
+            LOG_WARN("警告: %s からの更新を拒否しました（更新レート超過）。", peer);
+            traffic.sent(send_message_on_existing_socket(client_sock, frame_message("!REJECTED RATE_LIMIT\n")));
+            close(client_sock);
+            return;
+        }
+        
+        std::vector<char> buffer(4096);
+        size_t total_received = 0;
+        std::chrono::steady_clock::time_point receive_start = std::chrono::steady_clock::now();
+
+        while (total_received < expected_length && !g_shutdown_flag.load()) {
+            size_t to_read = std::min(buffer.size(), expected_length - total_received);
+            ssize_t bytes_received = recv(client_sock, buffer.data(), to_read, 0);
+            
+            if (bytes_received <= 0) {
+                if (bytes_received == 0) {
+                    LOG_ERROR("エラー: クライアント %s が接続を閉じました。", peer);
+                } else {
+                    LOG_ERROR("エラー: データ受信中にエラーが発生しました: %s", strerror(errno));
+                }
+                close(client_sock);
+                return;
+            }
+            
+            if (total_received == 0 && buffer[0] == '?') {
+                if (expected_length > MAX_QUERY_MESSAGE_SIZE) {
+                    LOG_ERROR("エラー: 問い合わせが大きすぎます: %d bytes", expected_length);
+                    close(client_sock);
+                    return;
+                }
+                is_query = true;
+            }
+            
+            if (is_query) {
+                query_data.append(buffer.data(), bytes_received);
+            } else if (!parser.feed(buffer.data(), bytes_received)) {
+                traffic.sent(send_message_on_existing_socket(client_sock, frame_message("!REJECTED TOO_LARGE\n")));
+                close(client_sock);
+                return;
+            }
+            total_received += bytes_received;
+            traffic.received(bytes_received);
+        }
+        
+        if (g_shutdown_flag.load()) {
+            close(client_sock);
+            return;
+        }
+        traffic.message_received();
+        TRACE_PROBE3(body_received, conn_id, total_received, is_query ? 1 : 0);
+        g_metrics.stage(STAGE_RECEIVE_MESSAGE).record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - receive_start).count());
+        
+        if (is_query && is_local && query_data.compare(0, 12, "?SNAPSHOT_FD") == 0) {
+            traffic.sent(send_config_snapshot_fd(client_sock));
+            close(client_sock);
+            return;
+        }
+
+        if (is_query && query_data.compare(0, 5, "?SYNC") == 0) {
+            // それまでの変更がディスクに保存されるまで待ってから応答する
+            uint64_t version = request_config_save();
+            bool durable = wait_config_durable(version, DEFAULT_READ_TIMEOUT_MS);
+            traffic.sent(send_message_on_existing_socket(client_sock, frame_message(
+                (durable ? "!DURABLE " : "!NOT_DURABLE ") + std::to_string(version) + "\n")));
+            close(client_sock);
+            return;
+        }
+
+        if (is_query && query_data.compare(0, 8, "?HISTORY") == 0) {
+            // ジャーナルから変更履歴を返す: ?HISTORY [[SECTION]KEY_PREFIX] [件数]
+            std::stringstream words(query_data.substr(8));
+            std::string prefix;
+            size_t limit = 100;
+            words >> prefix >> limit;
+            traffic.sent(send_message_on_existing_socket(client_sock,
+                                                         frame_message(format_config_history(prefix, limit))));
+            close(client_sock);
+            return;
+        }
+
+        if (is_query && query_data.compare(0, 10, "?SUBSCRIBE") == 0) {
+            // 接続を保ったまま、設定全体とその後の変更を送り続ける（クライアントSDKが使う）
+            // 購読は購読用の枠で数え、更新用の同時接続数の枠は空ける
+            if (!g_admission.begin_subscription()) {
+                LOG_WARN("警告: %s からの購読を拒否しました（購読数の上限）。", peer);
+                traffic.sent(send_message_on_existing_socket(client_sock,
+                                                             frame_message("!REJECTED SUBSCRIPTION_LIMIT\n")));
+                close(client_sock);
+                return;
+            }
+            serve_config_subscription(client_sock, traffic);
+            g_admission.end_subscription();
+            close(client_sock);
+            return;
+        }
+
+        if (is_query && query_data.compare(0, 6, "?LOCKS") == 0) {
+            // 設定ロックの呼び出し元ごとの統計を返す
+            traffic.sent(send_message_on_existing_socket(client_sock, frame_message(format_lock_profile())));
+            close(client_sock);
+            return;
+        }
+
+        if (is_query && query_data.compare(0, 4, "?AE_") == 0) {
+            // 他のノードとのレプリケーション（ハッシュの突き合わせと差分の受け渡し）
+            traffic.sent(send_message_on_existing_socket(client_sock, handle_replication_query(query_data, peer)));
+            close(client_sock);
+            return;
+        }
+
+        if (is_query && (query_data.compare(0, 4, "?TX_") == 0 || query_data.compare(0, 8, "?ROLLOUT") == 0)) {
+            // 複数ノードへのロールアウト（?TX_PREPARE は決定が届くまで接続を保つ）
+            serve_rollout_request(client_sock, query_data, peer, traffic);
+            close(client_sock);
+            return;
+        }
+
+        if (is_query && query_data.compare(0, 8, "?PRESETS") == 0) {
+            traffic.sent(send_message_on_existing_socket(client_sock, frame_message(format_config_presets())));
+            close(client_sock);
+            return;
+        }
+
+        if (is_query && query_data.compare(0, 8, "?PRESET ") == 0) {
+            // プリセットの適用は更新なので、更新と同じレート制限を受ける
+            std::string name;
+            std::stringstream(query_data.substr(8)) >> name;
+            std::string reply;
+            uint64_t version = 0;
+            if (!g_admission.try_admit_update(peer)) {
+                LOG_WARN("警告: %s からのプリセット適用を拒否しました（更新レート超過）。", peer);
+                reply = "!REJECTED RATE_LIMIT\n";
+            } else {
+                int changed = activate_config_preset(name, version);
+                if (changed == -1) {
+                    reply = "!NO_PRESET " + name + "\n";
+                } else if (changed < 0) {
+                    reply = "!REJECTED ROLLOUT_ABORTED\n";
+                } else {
+                    reply = "!PRESET " + name + " " + std::to_string(version) + "\n";
+                }
+            }
+            traffic.sent(send_message_on_existing_socket(client_sock, frame_message(reply)));
+            close(client_sock);
+            return;
+        }
+
+        if (is_query && query_data.compare(0, 8, "?METRICS") == 0) {
+            // メトリクスをPrometheusのテキスト形式で返す
+            traffic.sent(send_message_on_existing_socket(client_sock, frame_message(format_metrics())));
+            close(client_sock);
+            return;
+        }
+
+        if (is_query) {
+            traffic.sent(send_message_on_existing_socket(client_sock, query_config(query_data)));
+            close(client_sock);
+            return;
+        }
+
+        // フレームが揃ったので、保留中の変更をまとめてコミットする
+        LOG_DEBUG("%s から設定データを受信しました（%d バイト）", peer, total_received);
+        if (!parser.finish()) {
+            traffic.sent(send_message_on_existing_socket(client_sock, frame_message("!REJECTED TOO_LARGE\n")));
+            close(client_sock);
+            return;
+        }
+        TRACE_PROBE2(update_parsed, conn_id, parser.staged_count());
+        std::vector<ConfigChange> changes;
+        std::string outcome;
+        int updates_count = rollout_config_changes(parser.staged(), &changes, &outcome);
+        if (updates_count < 0) {
+            // 他のノードのどれかが反映できないため、どのノードにも反映していない
+            LOG_WARN("警告: %s からの更新を反映しませんでした（%s）。", peer, outcome);
+            traffic.sent(send_message_on_existing_socket(client_sock, frame_message("!REJECTED ROLLOUT_ABORTED\n")));
+            close(client_sock);
+            return;
+        }
+        if (updates_count > 0) {
+            // 保存（ジャーナルへの追記）はコミット時に書き込みスレッドへ依頼済みで、ここでは待たない
+            // WPF以外（ローカルツールなど）からの変更はWPFにも知らせる
+            if (peer != get_config_value("CONFIG_SYNC", "WPF_HOST", "192.168.4.10")) {
+                g_outbound_sender.push_changes(changes);
+            }
+        } else {
+            LOG_DEBUG("%s からの設定データに変更はありませんでした。", peer);
+        }
+        
+    } catch (const std::exception& e) {
+        LOG_ERROR("エラー: クライアント接続処理中に例外が発生しました: %s", e.what());
+    }
+    
+    close(client_sock);
+}
+
+// 保存時の耐久性レベル（CONFIG_SYNC:SAVE_DURABILITY）
+enum SaveDurability {
+    DURABILITY_NONE,  // fsyncしない（ページキャッシュ任せ）
+    DURABILITY_FILE,  // 一時ファイルをfsyncしてからrenameする
+    DURABILITY_FULL   // さらにディレクトリもfsyncし、renameを確定させる
+};
+
+/**
+ * @brief 設定から保存時の耐久性レベルを取得する
+ */
+SaveDurability get_save_durability() {
+    std::string level = get_config_value("CONFIG_SYNC", "SAVE_DURABILITY", "full");
+    if (level == "none") {
+        return DURABILITY_NONE;
+    }
+    if (level == "file") {
+        return DURABILITY_FILE;
+    }
+    return DURABILITY_FULL;
+}
+
+/**
+ * @brief ファイルを含むディレクトリのパスを返す
+ */
+std::string directory_of(const std::string& path) {
+    size_t slash = path.find_last_of('/');
+    if (slash == std::string::npos) {
+        return ".";
+    }
+    return slash == 0 ? "/" : path.substr(0, slash);
+}
+
+/**
+ * @brief ディレクトリをfsyncし、直前のrename/linkを確定させる
+ */
+bool fsync_directory(const std::string& dir) {
+    int dir_fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) {
+        return false;
+    }
+    bool ok = fsync(dir_fd) == 0;
+    close(dir_fd);
+    return ok;
+}
+
+/**
+ * @brief 同じディレクトリの一時ファイルに書き込み、renameで置き換える
+ *
+ * 書き込み途中で電源が落ちても、元のファイルか新しいファイルのどちらかが必ず残る。
+ * @param filename 保存先ファイル名
+ * @param content 書き込む内容
+ * @param durability 耐久性レベル
+ * @return 成功時true
+ */
+bool write_file_atomically(const std::string& filename, const std::string& content,
+                           SaveDurability durability) {
+    std::string tmp_path = filename + ".tmp.XXXXXX";
+    std::vector<char> tmp_name(tmp_path.begin(), tmp_path.end());
+    tmp_name.push_back('\0');
+    int fd = mkstemp(tmp_name.data());
+    if (fd < 0) {
+        std::cerr << "エラー: 一時ファイルを作成できませんでした。 " << strerror(errno) << std::endl;
+        return false;
+    }
+    tmp_path = tmp_name.data();
+
+    // 元のファイルのパーミッションを引き継ぐ
+    struct stat st;
+    if (stat(filename.c_str(), &st) == 0) {
+        fchmod(fd, st.st_mode & 07777);
+    } else {
+        fchmod(fd, 0644);
+    }
+
+    size_t written = 0;
+    while (written < content.size()) {
+        ssize_t n = write(fd, content.data() + written, content.size() - written);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            std::cerr << "エラー: 一時ファイルへの書き込みに失敗しました。 " << strerror(errno) << std::endl;
+            close(fd);
+            unlink(tmp_path.c_str());
+            return false;
+        }
+        written += n;
+    }
+    if (durability >= DURABILITY_FILE && fsync(fd) != 0) {
+        std::cerr << "エラー: 一時ファイルのfsyncに失敗しました。 " << strerror(errno) << std::endl;
+        close(fd);
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    close(fd);
+
+    if (rename(tmp_path.c_str(), filename.c_str()) != 0) {
+        std::cerr << "エラー: " << filename << " を置き換えられませんでした。 " << strerror(errno) << std::endl;
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    if (durability >= DURABILITY_FULL && !fsync_directory(directory_of(filename))) {
+        std::cerr << "警告: ディレクトリのfsyncに失敗しました。 " << strerror(errno) << std::endl;
+    }
+    return true;
+}
+
+/**
+ * @brief 項目ごとの書き込み時刻を設定ファイルのヘッダー行（# CONFIG_STAMP [SECTION]KEY=HLC ノード）にする
+ *
+ * 圧縮でジャーナルを退避した後も、再起動後のレプリケーションで後勝ちの判定ができるように残す。
+ * 設定ファイルから読んだだけの項目（時刻 0）は書かない。
+ */
+std::string format_config_stamps(const ReplicaStamps& stamps) {
+    std::string out;
+    for (const auto& entry : stamps) {
+        if (entry.second.hlc == 0) {
+            continue;
+        }
+        out += "# CONFIG_STAMP [" + entry.first.first + "]" + entry.first.second + "=" +
+               std::to_string(entry.second.hlc) + " " + std::to_string(entry.second.node) + "\n";
+    }
+    return out;
+}
+
+/**
+ * @brief 設定ファイル全体を新しく生成する（既存のファイルが無い場合に使う）
+ */
+std::string render_config_file(const ConfigData& data, const ReplicaStamps& stamps, uint64_t version) {
+    std::stringstream file;
+    // コメントヘッダーを追加
+    file << "# Navigator C++制御アプリケーションの設定ファイル\n";
+    file << "# ConfigSynchronizerによって自動生成されました\n";
+    file << "# CONFIG_VERSION=" << version << "\n";
+    file << format_config_stamps(stamps) << "\n";
+    for (const auto& section_pair : data) {
+        file << "[" << section_pair.first << "]\n";
+        for (const auto& key_value_pair : section_pair.second) {
+            file << key_value_pair.first << "=" << key_value_pair.second << "\n";
+        }
+        file << "\n";
+    }
+    return file.str();
+}
+
+/**
+ * @brief 設定ファイルの行索引（セクション・キーごとの値のバイト範囲）
+ *
+ * 元のファイルの内容を保持し、保存時は値が変わった範囲だけを差し替える。
+ * 新しいキーはセクションの最後のキーの後ろに、新しいセクションは末尾に追加する。
+ * セクション名・キー名は iniparser と同様に大文字小文字を区別しない。
+ */
+class ConfigFileIndex {
+public:
+    ConfigFileIndex()
+        : size_(0), mtime_ns_(0), version_begin_(std::string::npos), version_end_(0),
+          stamps_begin_(std::string::npos), stamps_end_(0) {}
+
+    /**
+     * @brief ファイルが前回から変わっていれば読み直す
+     * @return ファイルが存在し、索引が使える場合true
+     */
+    bool refresh(const std::string& filename) {
+        struct stat st;
+        if (stat(filename.c_str(), &st) != 0) {
+            filename_.clear();
+            return false;
+        }
+        long long mtime_ns = (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+        if (filename == filename_ && (off_t)size_ == st.st_size && mtime_ns == mtime_ns_) {
+            return true;
+        }
+        std::ifstream file(filename, std::ios::binary);
+        if (!file.good()) {
+            return false;
+        }
+        std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        build(text);
+        filename_ = filename;
+        size_ = st.st_size;
+        mtime_ns_ = mtime_ns;
+        return true;
+    }
+
+    /**
+     * @brief 書き込んだ内容を新しい基準として取り込む
+     */
+    void adopt(const std::string& filename, const std::string& text) {
+        build(text);
+        struct stat st;
+        if (stat(filename.c_str(), &st) == 0) {
+            filename_ = filename;
+            size_ = st.st_size;
+            mtime_ns_ = (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+        } else {
+            filename_.clear();
+        }
+    }
+
+    /**
+     * @brief 設定値の変わった範囲だけを差し替えた内容を返す
+     * @param data 保存する設定
+     * @param stamps ヘッダーに記録する項目ごとの書き込み時刻
+     * @param version ヘッダーに記録する版
+     * @param values_changed 値（版・時刻以外）に変更があったかどうかを受け取る
+     */
+    std::string patch(const ConfigData& data, const ReplicaStamps& stamps, uint64_t version,
+                      bool& values_changed) const {
+        // 差し替え: 開始位置 → (終了位置, 新しい文字列)
+        std::map<size_t, std::pair<size_t, std::string> > edits;
+        std::string appended_sections;
+        values_changed = false;
+
+        for (const auto& section_pair : data) {
+            std::string section_lower = lower(section_pair.first);
+            auto section_it = sections_.find(section_lower);
+            if (section_it == sections_.end()) {
+                appended_sections += "\n[" + section_pair.first + "]\n";
+                for (const auto& key_value_pair : section_pair.second) {
+                    appended_sections += key_value_pair.first + "=" + key_value_pair.second + "\n";
+                }
+                values_changed = true;
+                continue;
+            }
+
+            std::string inserted;
+            for (const auto& key_value_pair : section_pair.second) {
+                auto entry_it = entries_.find(std::make_pair(section_lower, lower(key_value_pair.first)));
+                if (entry_it == entries_.end()) {
+                    inserted += key_value_pair.first + "=" + key_value_pair.second + "\n";
+                    continue;
+                }
+                const Span& span = entry_it->second;
+                if (text_.compare(span.begin, span.end - span.begin, key_value_pair.second) != 0) {
+                    edits[span.begin] = std::make_pair(span.end, key_value_pair.second);
+                    values_changed = true;
+                }
+            }
+            if (!inserted.empty()) {
+                size_t at = section_it->second;
+                if (at > 0 && text_[at - 1] != '\n') {
+                    inserted = "\n" + inserted;
+                }
+                edits[at].second.append(inserted);
+                edits[at].first = at;
+                values_changed = true;
+            }
+        }
+
+        // 版のヘッダー行（無ければ先頭に追加）と、その直後の書き込み時刻の行
+        std::string version_str = std::to_string(version);
+        std::string stamp_lines = format_config_stamps(stamps);
+        if (version_begin_ != std::string::npos) {
+            if (text_.compare(version_begin_, version_end_ - version_begin_, version_str) != 0) {
+                edits[version_begin_] = std::make_pair(version_end_, version_str);
+            }
+        } else {
+            edits[0].first = 0;
+            edits[0].second.insert(0, "# CONFIG_VERSION=" + version_str + "\n");
+        }
+        if (stamps_begin_ != std::string::npos) {
+            if (text_.compare(stamps_begin_, stamps_end_ - stamps_begin_, stamp_lines) != 0) {
+                edits[stamps_begin_] = std::make_pair(stamps_end_, stamp_lines);
+            }
+        } else if (!stamp_lines.empty()) {
+            size_t at = 0;
+            if (version_begin_ != std::string::npos) {
+                at = text_.find('\n', version_end_);
+                at = (at == std::string::npos) ? text_.size() : at + 1;
+                if (at == text_.size() && (text_.empty() || text_[at - 1] != '\n')) {
+                    stamp_lines.insert(0, "\n");
+                }
+            }
+            edits[at].first = std::max(edits[at].first, at);
+            edits[at].second.append(stamp_lines);
+        }
+
+        std::string out;
+        out.reserve(text_.size() + appended_sections.size() + 64);
+        size_t pos = 0;
+        for (const auto& edit : edits) {
+            out.append(text_, pos, edit.first - pos);
+            out += edit.second.second;
+            pos = edit.second.first;
+        }
+        out.append(text_, pos, std::string::npos);
+        if (!appended_sections.empty() && !out.empty() && out[out.size() - 1] != '\n') {
+            out += '\n';
+        }
+        out += appended_sections;
+        return out;
+    }
+
+    const std::string& text() const {
+        return text_;
+    }
+
+private:
+    struct Span {
+        size_t begin;
+        size_t end;
+    };
+
+    static std::string lower(std::string s) {
+        std::transform(s.begin(), s.end(), s.begin(), ::tolower);
+        return s;
+    }
+
+    static bool is_space(char c) {
+        return c == ' ' || c == '\t' || c == '\r';
+    }
+
+    void build(const std::string& text) {
+        text_ = text;
+        entries_.clear();
+        sections_.clear();
+        version_begin_ = std::string::npos;
+        stamps_begin_ = std::string::npos;
+
+        std::string current_section;
+        size_t pos = 0;
+        while (pos < text_.size()) {
+            size_t line_end = text_.find('\n', pos);
+            size_t next = (line_end == std::string::npos) ? text_.size() : line_end + 1;
+            if (line_end == std::string::npos) {
+                line_end = text_.size();
+            }
+
+            size_t begin = pos;
+            while (begin < line_end && is_space(text_[begin])) begin++;
+            size_t end = line_end;
+            while (end > begin && is_space(text_[end - 1])) end--;
+
+            if (begin < end && text_.compare(begin, 17, "# CONFIG_VERSION=") == 0) {
+                version_begin_ = begin + 17;
+                version_end_ = end;
+            } else if (begin < end && text_.compare(begin, 15, "# CONFIG_STAMP ") == 0 && sections_.empty()) {
+                // 書き込み時刻の行はまとめて1つの範囲として差し替える
+                if (stamps_begin_ == std::string::npos) {
+                    stamps_begin_ = pos;
+                }
+                stamps_end_ = next;
+            } else if (begin < end && text_[begin] == '[') {
+                size_t close = text_.find(']', begin);
+                if (close != std::string::npos && close < end) {
+                    current_section = lower(text_.substr(begin + 1, close - begin - 1));
+                    sections_[current_section] = next;
+                }
+            } else if (begin < end && text_[begin] != '#' && text_[begin] != ';' && !current_section.empty()) {
+                size_t equals = text_.find('=', begin);
+                if (equals != std::string::npos && equals < end) {
+                    size_t key_end = equals;
+                    while (key_end > begin && is_space(text_[key_end - 1])) key_end--;
+                    size_t value_begin = equals + 1;
+                    while (value_begin < end && is_space(text_[value_begin])) value_begin++;
+                    Span span = {value_begin, std::max(value_begin, end)};
+                    entries_[std::make_pair(current_section, lower(text_.substr(begin, key_end - begin)))] = span;
+                    // 新しいキーはセクション内の最後のキーの後ろに追加する
+                    sections_[current_section] = next;
+                }
+            }
+            pos = next;
+        }
+    }
+
+    std::string filename_;
+    size_t size_;
+    long long mtime_ns_;
+    std::string text_;
+    std::map<std::pair<std::string, std::string>, Span> entries_;
+    std::map<std::string, size_t> sections_;  // セクション → 新しいキーを挿入する位置
+    size_t version_begin_;
+    size_t version_end_;
+    size_t stamps_begin_;  // 書き込み時刻の行の範囲（行頭から最後の行の改行の後まで）
+    size_t stamps_end_;
+};
+
+// 保存先ファイルの行索引（g_save_mutexで保護）
+ConfigFileIndex g_config_file_index;
+
+/**
+ * @brief 設定ファイルの過去の版を残す内容アドレス方式のバックアップリング
+ *
+ * 保存した内容をセクション単位の断片に分け、断片のハッシュを名前にして
+ * <設定ファイル>.backups/objects/ に一度だけ書く。各版は断片ハッシュの並びとして
+ * index に記録するため、変わっていないセクションは版の間で共有され、
+ * 保存ごとのコストは新しい断片の分だけになる。版の数は BACKUP_RING_SIZE で打ち切り、
+ * どの版からも参照されなくなった断片は削除する。
+ */
+class ConfigBackupRing {
+public:
+    struct Entry {
+        uint64_t version;
+        long long time_ms;
+        std::vector<std::string> chunks;  // 断片ハッシュ（ファイル内の順）
+    };
+
+    ConfigBackupRing() : loaded_(false), objects_written_(0), bytes_written_(0), bytes_deduplicated_(0) {}
+
+    /**
+     * @brief 設定ファイルの内容を新しい版として記録する（g_save_mutexを保持して呼ぶ）
+     * @param filename 設定ファイル名（バックアップの置き場所を決める）
+     * @param content 設定ファイルの内容
+     * @param durability 断片と索引の書き込みに使う耐久性
+     * @return 新しい版として記録した場合true（最新の版と同じ内容なら記録しない）
+     */
+    bool record(const std::string& filename, const std::string& content, SaveDurability durability) {
+        if (!open(filename)) {
+            return false;
+        }
+
+        uint64_t version = 0;
+        std::vector<std::string> pieces = split_chunks(content, version);
+        Entry entry;
+        entry.version = version;
+        entry.time_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        for (const std::string& piece : pieces) {
+            entry.chunks.push_back(hash_hex(piece));
+        }
+        if (!entries_.empty() && entries_.back().chunks == entry.chunks) {
+            return false;  // 同じ状態は二度記録しない
+        }
+
+        std::set<std::string> referenced = referenced_chunks();
+        for (size_t i = 0; i < pieces.size(); ++i) {
+            const std::string& hash = entry.chunks[i];
+            if (!referenced.insert(hash).second) {
+                bytes_deduplicated_ += pieces[i].size();
+                continue;
+            }
+            std::string path = objects_dir() + "/" + hash;
+            struct stat st;
+            if (stat(path.c_str(), &st) == 0) {
+                bytes_deduplicated_ += pieces[i].size();
+                continue;  // 以前の版が残した断片
+            }
+            if (!write_file_atomically(path, pieces[i], durability)) {
+                std::cerr << "警告: バックアップの断片 " << path << " を書き込めませんでした。\n";
+                return false;
+            }
+            objects_written_++;
+            bytes_written_ += pieces[i].size();
+        }
+
+        entries_.push_back(entry);
+        size_t limit = (size_t)std::max(1, get_config_int("CONFIG_SYNC", "BACKUP_RING_SIZE", 32));
+        std::vector<Entry> dropped;
+        while (entries_.size() > limit) {
+            dropped.push_back(entries_.front());
+            entries_.pop_front();
+        }
+        if (!write_index(durability)) {
+            return false;
+        }
+
+        // どの版からも参照されなくなった断片を削除する
+        if (!dropped.empty()) {
+            std::set<std::string> still_referenced = referenced_chunks();
+            for (const Entry& old_entry : dropped) {
+                for (const std::string& hash : old_entry.chunks) {
+                    if (!still_referenced.count(hash)) {
+                        unlink((objects_dir() + "/" + hash).c_str());
+                    }
+                }
+            }
+        }
+        return true;
+    }
+
+    /**
+     * @brief 記録されている版の一覧（古い順）
+     */
+    std::vector<Entry> list(const std::string& filename) {
+        if (!open(filename)) {
+            return std::vector<Entry>();
+        }
+        return std::vector<Entry>(entries_.begin(), entries_.end());
+    }
+
+    /**
+     * @brief 指定した版の設定ファイルの内容を組み立てる
+     * @return 見つかった場合true
+     */
+    bool restore(const std::string& filename, uint64_t version, std::string& content) {
+        if (!open(filename)) {
+            return false;
+        }
+        for (auto it = entries_.rbegin(); it != entries_.rend(); ++it) {
+            if (it->version != version) {
+                continue;
+            }
+            content.clear();
+            for (const std::string& hash : it->chunks) {
+                std::ifstream object(objects_dir() + "/" + hash, std::ios::binary);
+                if (!object.good()) {
+                    std::cerr << "エラー: バックアップの断片 " << hash << " が見つかりません。\n";
+                    return false;
+                }
+                content.append(std::istreambuf_iterator<char>(object), std::istreambuf_iterator<char>());
+            }
+            return true;
+        }
+        return false;
+    }
+
+    void print_stats(const std::string& filename) {
+        if (!open(filename)) {
+            return;
+        }
+        std::cout << "バックアップ: " << entries_.size() << " 版を保持（断片 " << referenced_chunks().size()
+                  << " 個, 新規書き込み " << objects_written_ << " 個 / " << bytes_written_ << " バイト, 重複で省略 "
+                  << bytes_deduplicated_ << " バイト）\n";
+    }
+
+private:
+    /**
+     * @brief 内容をセクションごとの断片に分ける（先頭のコメント部分は1つ目の断片）
+     *
+     * 版のヘッダー行は保存のたびに変わるので断片からは除き、索引に記録する。
+     * 書き込み時刻の行も保存のたびに変わり、戻すときには使わないので除く。
+     */
+    static std::vector<std::string> split_chunks(const std::string& content, uint64_t& version) {
+        std::vector<std::string> pieces(1);
+        size_t pos = 0;
+        while (pos < content.size()) {
+            size_t next = content.find('\n', pos);
+            next = (next == std::string::npos) ? content.size() : next + 1;
+            if (content.compare(pos, 17, "# CONFIG_VERSION=") == 0 && pieces.size() == 1) {
+                version = std::strtoull(content.c_str() + pos + 17, nullptr, 10);
+            } else if (content.compare(pos, 15, "# CONFIG_STAMP ") == 0 && pieces.size() == 1) {
+                // 断片に含めない
+            } else {
+                if (content[pos] == '[' && !pieces.back().empty()) {
+                    pieces.push_back(std::string());
+                }
+                pieces.back().append(content, pos, next - pos);
+            }
+            pos = next;
+        }
+        return pieces;
+    }
+
+    // 64ビットFNV-1aハッシュの16進表記
+    static std::string hash_hex(const std::string& data) {
+        char buf[17];
+        snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)fnv1a64(data));
+        return buf;
+    }
+
+    std::string objects_dir() const {
+        return dir_ + "/objects";
+    }
+
+    std::set<std::string> referenced_chunks() const {
+        std::set<std::string> referenced;
+        for (const Entry& entry : entries_) {
+            referenced.insert(entry.chunks.begin(), entry.chunks.end());
+        }
+        return referenced;
+    }
+
+    /**
+     * @brief バックアップの置き場所を用意し、初回は索引を読み込む
+     */
+    bool open(const std::string& filename) {
+        std::string dir = filename + ".backups";
+        if (loaded_ && dir == dir_) {
+            return true;
+        }
+        if ((mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) ||
+            (mkdir((dir + "/objects").c_str(), 0755) != 0 && errno != EEXIST)) {
+            std::cerr << "警告: バックアップディレクトリ " << dir << " を作成できません: " << strerror(errno) << "\n";
+            return false;
+        }
+        dir_ = dir;
+        entries_.clear();
+
+        // 索引の1行は「版 時刻(ms) 断片ハッシュ,断片ハッシュ,...」
+        std::ifstream index(dir_ + "/index");
+        std::string line;
+        while (std::getline(index, line)) {
+            std::istringstream fields(line);
+            Entry entry;
+            std::string chunks;
+            if (!(fields >> entry.version >> entry.time_ms >> chunks)) {
+                continue;
+            }
+            std::istringstream chunk_list(chunks);
+            std::string hash;
+            while (std::getline(chunk_list, hash, ',')) {
+                entry.chunks.push_back(hash);
+            }
+            entries_.push_back(entry);
+        }
+        loaded_ = true;
+        return true;
+    }
+
+    bool write_index(SaveDurability durability) {
+        std::stringstream index;
+        for (const Entry& entry : entries_) {
+            index << entry.version << " " << entry.time_ms << " ";
+            for (size_t i = 0; i < entry.chunks.size(); ++i) {
+                index << (i ? "," : "") << entry.chunks[i];
+            }
+            index << "\n";
+        }
+        if (!write_file_atomically(dir_ + "/index", index.str(), durability)) {
+            std::cerr << "警告: バックアップの索引を書き込めませんでした。\n";
+            return false;
+        }
+        return true;
+    }
+
+    bool loaded_;
+    std::string dir_;
+    std::deque<Entry> entries_;
+    uint64_t objects_written_;
+    uint64_t bytes_written_;
+    uint64_t bytes_deduplicated_;
+};
+
+// 設定ファイルのバックアップリング（g_save_mutexで保護）
+ConfigBackupRing g_backup_ring;
+
+// 保存処理同士を直列化する（古い内容が新しい内容を上書きしないように）
+std::mutex g_save_mutex;
+
+bool save_config_snapshot(const std::string& filename, const ConfigData& data, const ReplicaStamps& stamps,
+                          uint64_t version); // プロトタイプ宣言
+
+/**
+ * @brief 設定ファイルに現在の設定を同期的に保存する (改良版)
+ *
+ * 設定のロックはスナップショットを取る間だけ持ち、ディスクへの書き込みはロックの外で行う。
+ * @param filename 保存先ファイル名
+ */
+void save_config(const std::string& filename) {
+    ConfigData snapshot;
+    ReplicaStamps stamps;
+    uint64_t version;
+    {
+        SiteLockGuard lock(g_config_mutex, LOCK_SITE());
+        snapshot = g_config_data;
+        stamps = g_config_stamps;
+        version = g_config_version.load();
+    }
+    save_config_snapshot(filename, snapshot, stamps, version);
+}
+
+/**
+ * @brief 設定のスナップショットを設定ファイルに保存する
+ * @param filename 保存先ファイル名
+ * @param data 保存する設定
+ * @param stamps data と同時に取った項目ごとの書き込み時刻（ヘッダーに記録する）
+ * @param version 保存する設定の版（ジャーナル再生の起点としてヘッダーに記録する）
+ * @return 成功時true
+ */
+bool save_config_snapshot(const std::string& filename, const ConfigData& data, const ReplicaStamps& stamps,
+                          uint64_t version) {
+    std::lock_guard<std::mutex> save_lock(g_save_mutex);
+    ScopedLatency timer(g_metrics.stage(STAGE_SAVE_CONFIG));
+    TRACE_PROBE2(save_start, SAVE_TARGET_CONFIG_FILE, version);
+    SaveDurability durability = get_save_durability();
+
+    // 既存のファイルがあれば、変わった値の部分だけを書き換える（コメントや並び順は保たれる）
+    std::string content;
+    if (g_config_file_index.refresh(filename)) {
+        // 外部で編集された内容や初回の内容もバックアップに残しておく
+        g_backup_ring.record(filename, g_config_file_index.text(), durability);
+        bool values_changed = false;
+        content = g_config_file_index.patch(data, stamps, version, values_changed);
+        // 値が同じでも版の行（# CONFIG_VERSION=）が違えば書き直す。書き直さないと、圧縮でジャーナルを
+        // 退避した後に再起動したとき版が戻ってしまう
+        if (!values_changed && content == g_config_file_index.text()) {
+            LOG_DEBUG("設定ファイル %s の内容に変更がないため、書き込みを省略しました。", filename);
+            TRACE_PROBE4(save_end, SAVE_TARGET_CONFIG_FILE, version, 0, 1);
+            return true;
+        }
+    } else {
+        content = render_config_file(data, stamps, version);
+    }
+
+    if (!write_file_atomically(filename, content, durability)) {
+        LOG_ERROR("エラー: 設定ファイル %s を保存できませんでした。", filename);
+        TRACE_PROBE4(save_end, SAVE_TARGET_CONFIG_FILE, version, 0, 0);
+        return false;
+    }
+    TRACE_PROBE4(save_end, SAVE_TARGET_CONFIG_FILE, version, content.size(), 1);
+    g_config_file_index.adopt(filename, content);
+    g_backup_ring.record(filename, content, durability);
+    LOG_INFO("設定を %s に保存しました。（版 %d をバックアップに記録）", filename, version);
+    return true;
+}
+
+/**
+ * @brief CRC-32（IEEE 802.3）を計算する
+ */
+uint32_t crc32_of(const char* data, size_t length) {
+    static uint32_t table[256];
+    static bool initialized = false;
+    if (!initialized) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
+            }
+            table[i] = c;
+        }
+        initialized = true;
+    }
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < length; i++) {
+        crc = table[(crc ^ (uint8_t)data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+/**
+ * @brief ジャーナルの1レコード（コミットされた1項目の変更）
+ *
+ * ファイル上の形式: [本体長 u32][CRC-32 u32][本体]
+ * 本体: [版 u64][時刻ms u64][セクション長 u16][セクション][キー長 u16][キー]
+ *       [旧値長 u32][旧値][新値長 u32][新値][書き込み時刻HLC u64][書き込み元ノード u32]
+ * 書き込み時刻と書き込み元は後から加えたもので、古いレコードには無い（時刻msから補う）。
+ */
+struct JournalRecord {
+    uint64_t version;
+    uint64_t timestamp_ms;
+    std::string section;
+    std::string key;
+    std::string old_value;
+    std::string value;
+    ReplicaStamp stamp;
+};
+
+const size_t MAX_JOURNAL_RECORD_SIZE = 16 * 1024 * 1024;
+
+template <typename T>
+void put_le(std::string& out, T value) {
+    for (size_t i = 0; i < sizeof(T); i++) {
+        out += (char)((value >> (8 * i)) & 0xFF);
+    }
+}
+
+template <typename T>
+bool get_le(const std::string& in, size_t& pos, T& value) {
+    if (pos + sizeof(T) > in.size()) {
+        return false;
+    }
+    value = 0;
+    for (size_t i = 0; i < sizeof(T); i++) {
+        value |= (T)(uint8_t)in[pos + i] << (8 * i);
+    }
+    pos += sizeof(T);
+    return true;
+}
+
+template <typename LengthType>
+bool get_bytes(const std::string& in, size_t& pos, std::string& value) {
+    LengthType length;
+    if (!get_le(in, pos, length) || pos + length > in.size()) {
+        return false;
+    }
+    value.assign(in, pos, length);
+    pos += length;
+    return true;
+}
+
+/**
+ * @brief レコードをジャーナルのバイト列に変換して追記する
+ *
+ * セクション名・キー名は u16 で記録する。長すぎる名前は commit_changes() で弾いているため、
+ * ここに来るレコードは必ず収まる。
+ */
+void encode_journal_record(std::string& out, const JournalRecord& record) {
+    std::string body;
+    put_le<uint64_t>(body, record.version);
+    put_le<uint64_t>(body, record.timestamp_ms);
+    put_le<uint16_t>(body, (uint16_t)record.section.size());
+    body += record.section;
+    put_le<uint16_t>(body, (uint16_t)record.key.size());
+    body += record.key;
+    put_le<uint32_t>(body, (uint32_t)record.old_value.size());
+    body += record.old_value;
+    put_le<uint32_t>(body, (uint32_t)record.value.size());
+    body += record.value;
+    put_le<uint64_t>(body, record.stamp.hlc);
+    put_le<uint32_t>(body, record.stamp.node);
+
+    put_le<uint32_t>(out, (uint32_t)body.size());
+    put_le<uint32_t>(out, crc32_of(body.data(), body.size()));
+    out += body;
+}
+
+/**
+ * @brief ジャーナルファイルを先頭から読み、正しいレコードを順に返す
+ *
+ * 途中で電源が落ちて末尾が壊れている場合は、最後の正しいレコードまでを返す。
+ * @param path ジャーナルファイルのパス
+ * @param records 読み込んだレコード
+ * @return 正しいレコードが終わる位置（バイト）
+ */
+size_t read_journal(const std::string& path, std::vector<JournalRecord>& records) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.good()) {
+        return 0;
+    }
+    std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    size_t pos = 0;
+    while (pos < data.size()) {
+        size_t header = pos;
+        uint32_t length, crc;
+        if (!get_le(data, header, length) || !get_le(data, header, crc) ||
+            length > MAX_JOURNAL_RECORD_SIZE || header + length > data.size() ||
+            crc32_of(data.data() + header, length) != crc) {
+            break;
+        }
+        std::string body = data.substr(header, length);
+        size_t p = 0;
+        JournalRecord record;
+        if (!get_le(body, p, record.version) || !get_le(body, p, record.timestamp_ms) ||
+            !get_bytes<uint16_t>(body, p, record.section) || !get_bytes<uint16_t>(body, p, record.key) ||
+            !get_bytes<uint32_t>(body, p, record.old_value) || !get_bytes<uint32_t>(body, p, record.value)) {
+            break;
+        }
+        if (p < body.size()) {
+            if (!get_le(body, p, record.stamp.hlc) || !get_le(body, p, record.stamp.node)) {
+                break;
+            }
+        } else {
+            // 書き込み時刻を持たない古いレコード
+            record.stamp.hlc = record.timestamp_ms << 16;
+            record.stamp.node = 0;
+        }
+        records.push_back(record);
+        pos = header + length;
+    }
+    return pos;
+}
+
+/**
+ * @brief 設定ファイルのヘッダーに記録された版（# CONFIG_VERSION=N）を読む
+ * @return 記録が無ければ0
+ */
+uint64_t read_config_file_version(const std::string& filename) {
+    std::ifstream file(filename);
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.compare(0, 17, "# CONFIG_VERSION=") == 0) {
+            try {
+                return std::stoull(line.substr(17));
+            } catch (const std::exception&) {
+                return 0;
+            }
+        }
+        if (!line.empty() && line[0] == '[') {
+            break;  // ヘッダーは最初のセクションより前にしかない
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief 設定ファイルのヘッダーに記録された項目ごとの書き込み時刻（# CONFIG_STAMP 行）を読む
+ */
+ReplicaStamps read_config_file_stamps(const std::string& filename) {
+    ReplicaStamps stamps;
+    std::ifstream file(filename);
+    std::string line;
+    while (std::getline(file, line)) {
+        if (!line.empty() && line[0] == '[') {
+            break;  // ヘッダーは最初のセクションより前にしかない
+        }
+        if (line.compare(0, 16, "# CONFIG_STAMP [") != 0) {
+            continue;
+        }
+        size_t close = line.find(']', 16);
+        size_t equals = close == std::string::npos ? std::string::npos : line.find('=', close);
+        if (equals == std::string::npos) {
+            continue;
+        }
+        ReplicaStamp stamp;
+        std::istringstream fields(line.substr(equals + 1));
+        if (fields >> stamp.hlc >> stamp.node) {
+            stamps[std::make_pair(line.substr(16, close - 16), line.substr(close + 1, equals - close - 1))] = stamp;
+        }
+    }
+    return stamps;
+}
+
+/**
+ * @brief ジャーナルを使うかどうか（CONFIG_SYNC:JOURNAL_ENABLED）
+ */
+bool journal_enabled() {
+    return get_config_value("CONFIG_SYNC", "JOURNAL_ENABLED", "true") != "false";
+}
+
+/**
+ * @brief 起動時に、最後に圧縮された設定ファイルの上へジャーナルの続きを再生する
+ *
+ * load_config()の直後に呼ぶ。設定ファイルに記録された版より新しいレコードだけを適用し、
+ * 末尾の壊れたレコードは切り詰める。項目ごとの書き込み時刻は、設定ファイルのヘッダーに
+ * 記録されたものにジャーナルのレコードのものを重ねて戻す。
+ * @param filename 設定ファイル名
+ * @return 再生したレコード数
+ */
+size_t replay_config_journal(const std::string& filename) {
+    uint64_t base_version = read_config_file_version(filename);
+    std::string journal_path = filename + ".journal";
+    std::vector<JournalRecord> records;
+    size_t valid_bytes = read_journal(journal_path, records);
+
+    struct stat st;
+    if (stat(journal_path.c_str(), &st) == 0 && (size_t)st.st_size > valid_bytes) {
+        std::cerr << "警告: ジャーナル末尾の壊れたレコードを切り詰めます（" << st.st_size - valid_bytes << " バイト）\n";
+        if (truncate(journal_path.c_str(), valid_bytes) != 0) {
+            std::cerr << "警告: ジャーナルを切り詰められませんでした。 " << strerror(errno) << std::endl;
+        }
+    }
+
+    ReplicaStamps file_stamps = read_config_file_stamps(filename);
+    size_t replayed = 0;
+    uint64_t version = base_version;
+    {
+        SiteLockGuard lock(g_config_mutex, LOCK_SITE());
+        for (const auto& entry : file_stamps) {
+            g_config_stamps[entry.first] = entry.second;
+            g_hybrid_clock.observe(entry.second.hlc);
+        }
+        for (const JournalRecord& record : records) {
+            if (record.version <= base_version) {
+                continue;  // 圧縮済み
+            }
+            g_config_data[record.section][record.key] = record.value;
+            g_config_stamps[std::make_pair(record.section, record.key)] = record.stamp;
+            g_hybrid_clock.observe(record.stamp.hlc);
+            version = std::max(version, record.version);
+            replayed++;
+        }
+        // 版は再起動をまたいで単調増加させる
+        g_config_version.store(std::max(version, g_config_version.load()));
+        publish_config_reload(g_config_version.load());
+    }
+    if (replayed > 0) {
+        std::cout << "ジャーナルから " << replayed << " 件の変更を再生しました（版 " << base_version << " → "
+                  << version << "）\n";
+    }
+    return replayed;
+}
+
+/**
+ * @brief ジャーナル（圧縮前の現行分と、1つ前の世代）から変更履歴を整形する
+ * @param prefix "[SECTION]KEY" の前方一致で絞り込む（空なら全件）
+ * @param limit 新しいものから最大何件返すか
+ * @return 1行1件の履歴
+ */
+std::string format_config_history(const std::string& prefix, size_t limit) {
+    std::vector<JournalRecord> records;
+    read_journal(g_config_path + ".journal.old", records);
+    read_journal(g_config_path + ".journal", records);
+
+    std::vector<std::string> lines;
+    for (auto it = records.rbegin(); it != records.rend() && lines.size() < limit; ++it) {
+        std::string name = "[" + it->section + "]" + it->key;
+        if (name.compare(0, prefix.size(), prefix) != 0) {
+            continue;
+        }
+        lines.push_back("!CHANGE\t" + std::to_string(it->version) + "\t" + std::to_string(it->timestamp_ms) + "\t" +
+                        name + "\t" + it->old_value + "\t" + it->value + "\n");
+    }
+    std::string out;
+    for (auto it = lines.rbegin(); it != lines.rend(); ++it) {
+        out += *it;
+    }
+    return out;
+}
+
+/**
+ * @brief 設定ファイルへの保存を受け持つ書き込みスレッド（ライトビハインド）
+ *
+ * コミットされた変更は journal_changes() でレコードとして積まれ、書き込みスレッドが
+ * PERSIST_GROUP_COMMIT_MS だけ後続を待ってから、まとめてジャーナルに追記して1回fsyncする。
+ * config.ini 自体は、ジャーナルが JOURNAL_COMPACT_BYTES を超えたとき、
+ * JOURNAL_COMPACT_INTERVAL_SEC ごと、明示的な保存要求、終了時にだけ書き直す（圧縮）。
+ * 圧縮ではスナップショットを取り（ロックはコピーの間だけ）、アトミックに保存した後、
+ * ジャーナルを1世代前として残して新しく始める。
+ * ジャーナルが無効なら、従来どおり毎回 config.ini を書き直す。
+ * 保存の完了を待ちたい呼び出し元は wait_durable() を使う。
+ */
+class PersistenceWriter {
+public:
+    PersistenceWriter()
+        : running_(false), journal_fd_(-1), requested_version_(0), durable_version_(0), compact_requested_(false),
+          compact_tickets_(0), compacted_ticket_(0), requests_(0), writes_(0), journal_appends_(0), compactions_(0), failures_(0) {}
+    ~PersistenceWriter() { stop(); }
+
+    /**
+     * @brief 書き込みスレッドを開始する。現在の版は保存済みとみなす
+     */
+    void start(const std::string& filename) {
+        filename_ = filename;
+        journal_path_ = filename + ".journal";
+        durable_version_ = requested_version_ = g_config_version.load();
+        if (journal_enabled()) {
+            journal_fd_ = open(journal_path_.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (journal_fd_ < 0) {
+                std::cerr << "警告: ジャーナル " << journal_path_ << " を開けませんでした。毎回設定ファイルを書き直します。 "
+                          << strerror(errno) << std::endl;
+            }
+        }
+        last_compaction_ = std::chrono::steady_clock::now();
+        running_ = true;
+        thread_ = std::thread(&PersistenceWriter::run, this);
+    }
+
+    /**
+     * @brief 保存待ちの変更を書き出し、設定ファイルを圧縮してから停止する
+     */
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!running_) {
+                return;
+            }
+            running_ = false;
+            compact_requested_ = true;
+        }
+        cv_.notify_all();
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+        if (journal_fd_ >= 0) {
+            close(journal_fd_);
+            journal_fd_ = -1;
+        }
+    }
+
+    /**
+     * @brief コミットされた変更をジャーナルへの追記待ちに積む
+     */
+    void journal_changes(const std::vector<ConfigChange>& changes) {
+        uint64_t now_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (const ConfigChange& change : changes) {
+                JournalRecord record;
+                record.version = change.version;
+                record.timestamp_ms = now_ms;
+                record.section = change.section;
+                record.key = change.key;
+                record.old_value = change.old_value;
+                record.value = change.value;
+                // コミット中（g_config_mutex を保持している）なので、付けたばかりの時刻を読める
+                auto stamp_it = g_config_stamps.find(std::make_pair(change.section, change.key));
+                if (stamp_it != g_config_stamps.end()) {
+                    record.stamp = stamp_it->second;
+                }
+                pending_records_.push_back(record);
+                requested_version_ = std::max(requested_version_, change.version);
+            }
+            requests_++;
+        }
+        cv_.notify_all();
+    }
+
+    /**
+     * @brief 現在コミット済みの版の保存を依頼する
+     * @return 保存される版（wait_durable()に渡せる）
+     */
+    uint64_t request_save() {
+        uint64_t version = g_config_version.load();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            requests_++;
+            requested_version_ = std::max(requested_version_, version);
+            version = requested_version_;
+        }
+        cv_.notify_all();
+        return version;
+    }
+
+    /**
+     * @brief 現在の版の保存に加え、設定ファイル自体の書き直しを依頼する
+     *
+     * 明示的な書き直しは版が進んでいなくても必ず行う。版とは別の通し番号で追う。
+     * @return 書き直しの受付番号（wait_compacted()に渡せる）
+     */
+    uint64_t request_compaction() {
+        uint64_t version = g_config_version.load();
+        uint64_t ticket;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            requests_++;
+            requested_version_ = std::max(requested_version_, version);
+            compact_requested_ = true;
+            ticket = ++compact_tickets_;
+        }
+        cv_.notify_all();
+        return ticket;
+    }
+
+    /**
+     * @brief 指定した版以降が保存されるまで待つ
+     * @param timeout_ms 最大待ち時間（負なら無期限）
+     * @return 保存済みならtrue
+     */
+    bool wait_durable(uint64_t version, int timeout_ms) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto done = [this, version]() { return durable_version_ >= version || !running_; };
+        if (timeout_ms < 0) {
+            durable_cv_.wait(lock, done);
+        } else {
+            durable_cv_.wait_for(lock, std::chrono::milliseconds(timeout_ms), done);
+        }
+        return durable_version_ >= version;
+    }
+
+    /**
+     * @brief request_compaction() で受け付けた書き直しが終わるまで待つ
+     * @param timeout_ms 最大待ち時間（負なら無期限）
+     * @return 書き直せていればtrue
+     */
+    bool wait_compacted(uint64_t ticket, int timeout_ms) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto done = [this, ticket]() { return compacted_ticket_ >= ticket || !running_; };
+        if (timeout_ms < 0) {
+            durable_cv_.wait(lock, done);
+        } else {
+            durable_cv_.wait_for(lock, std::chrono::milliseconds(timeout_ms), done);
+        }
+        return compacted_ticket_ >= ticket;
+    }
+
+    /**
+     * @brief 保存の統計を表示する
+     */
+    void print_stats() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::cout << "保存: 依頼 " << requests_ << " 件を " << writes_ << " 回の書き込みにまとめました（ジャーナル追記 "
+                  << journal_appends_ << " 回, 圧縮 " << compactions_ << " 回, 失敗 " << failures_
+                  << " 回, 保存済みの版 " << durable_version_ << "）\n";
+    }
+
+private:
+    // ジャーナルに追記する。成功時true
+    bool append_records(const std::vector<JournalRecord>& records) {
+        ScopedLatency timer(g_metrics.stage(STAGE_JOURNAL_APPEND));
+        uint64_t version = records.empty() ? 0 : records.back().version;
+        TRACE_PROBE2(save_start, SAVE_TARGET_JOURNAL, version);
+        std::string buffer;
+        for (const JournalRecord& record : records) {
+            encode_journal_record(buffer, record);
+        }
+        size_t written = 0;
+        bool ok = true;
+        while (written < buffer.size()) {
+            ssize_t n = write(journal_fd_, buffer.data() + written, buffer.size() - written);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                LOG_ERROR("エラー: ジャーナルへの追記に失敗しました。 %s", strerror(errno));
+                ok = false;
+                break;
+            }
+            written += n;
+        }
+        if (ok && get_save_durability() >= DURABILITY_FILE && fdatasync(journal_fd_) != 0) {
+            LOG_ERROR("エラー: ジャーナルのfsyncに失敗しました。 %s", strerror(errno));
+            ok = false;
+        }
+        TRACE_PROBE4(save_end, SAVE_TARGET_JOURNAL, version, written, ok ? 1 : 0);
+        return ok;
+    }
+
+    // 設定ファイルを書き直し、ジャーナルを新しく始める。成功時は保存した版を返す（失敗時0）
+    uint64_t compact() {
+        ConfigData snapshot;
+        ReplicaStamps stamps;
+        uint64_t snapshot_version;
+        {
+            SiteLockGuard config_lock(g_config_mutex, LOCK_SITE());
+            snapshot = g_config_data;
+            stamps = g_config_stamps;
+            snapshot_version = g_config_version.load();
+        }
+        if (!save_config_snapshot(filename_, snapshot, stamps, snapshot_version)) {
+            return 0;
+        }
+        if (journal_fd_ >= 0) {
+            // 圧縮済みのジャーナルは履歴として1世代だけ残す
+            std::string old_path = journal_path_ + ".old";
+            if (rename(journal_path_.c_str(), old_path.c_str()) != 0) {
+                std::cerr << "警告: ジャーナルを退避できませんでした。 " << strerror(errno) << std::endl;
+            }
+            close(journal_fd_);
+            journal_fd_ = open(journal_path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+            if (get_save_durability() >= DURABILITY_FULL) {
+                fsync_directory(directory_of(journal_path_));
+            }
+        }
+        last_compaction_ = std::chrono::steady_clock::now();
+        return snapshot_version;
+    }
+
+    bool compaction_due() {
+        if (journal_fd_ < 0) {
+            return false;  // ジャーナルが無い場合は保存のたびに書き直している
+        }
+        struct stat st;
+        long long limit = get_config_int("CONFIG_SYNC", "JOURNAL_COMPACT_BYTES", 64 * 1024);
+        if (fstat(journal_fd_, &st) == 0 && st.st_size >= limit) {
+            return true;
+        }
+        int interval_sec = get_config_int("CONFIG_SYNC", "JOURNAL_COMPACT_INTERVAL_SEC", 300);
+        return interval_sec > 0 && std::chrono::steady_clock::now() - last_compaction_ >= std::chrono::seconds(interval_sec) &&
+               durable_version_ > read_config_file_version(filename_);
+    }
+
+    void run() {
+        // コミット側は設定のロックを持ったまま mutex_ を取るため、
+        // mutex_ を持ったまま設定（get_config_int）を読んではいけない
+        std::unique_lock<std::mutex> lock(mutex_, std::defer_lock);
+        while (true) {
+            int interval_sec = std::max(1, get_config_int("CONFIG_SYNC", "JOURNAL_COMPACT_INTERVAL_SEC", 300));
+            int window_ms = std::max(0, get_config_int("CONFIG_SYNC", "PERSIST_GROUP_COMMIT_MS", 10));
+
+            lock.lock();
+            cv_.wait_for(lock, std::chrono::seconds(interval_sec), [this]() {
+                return !pending_records_.empty() || requested_version_ > durable_version_ || compact_requested_ ||
+                       !running_;
+            });
+            bool stopping = !running_;
+
+            // グループコミット: 少し待って、その間の依頼を1回の書き込みにまとめる
+            if (!stopping && (!pending_records_.empty() || requested_version_ > durable_version_)) {
+                cv_.wait_for(lock, std::chrono::milliseconds(window_ms), [this]() { return !running_; });
+            }
+            std::vector<JournalRecord> records;
+            records.swap(pending_records_);
+            uint64_t target = requested_version_;
+            uint64_t already_durable = durable_version_;
+            bool compact_requested = compact_requested_;
+            uint64_t compact_ticket = compact_tickets_;
+            compact_requested_ = false;
+            lock.unlock();
+
+            bool ok = true;
+            uint64_t durable = already_durable;
+            if (!records.empty() && journal_fd_ >= 0) {
+                ok = append_records(records);
+                if (ok) {
+                    durable = records.back().version;
+                }
+            }
+            // ジャーナルで賄えない版（再読み込みなど）や圧縮が必要なら設定ファイルを書き直す
+            bool did_compact = false;
+            if (ok && (compact_requested || durable < target || compaction_due())) {
+                uint64_t saved = compact();
+                ok = saved > 0;
+                durable = std::max(durable, saved);
+                did_compact = ok;
+            }
+
+            lock.lock();
+            if (!records.empty() || did_compact || !ok) {
+                writes_++;
+            }
+            if (!records.empty() && journal_fd_ >= 0) {
+                journal_appends_++;
+            }
+            if (did_compact) {
+                compactions_++;
+            }
+            if (ok) {
+                durable_version_ = std::max(durable_version_, std::max(durable, did_compact ? target : 0));
+                if (did_compact) {
+                    compacted_ticket_ = std::max(compacted_ticket_, compact_ticket);
+                }
+            } else {
+                failures_++;
+                // 失敗したら少し待って再試行する（停止時は諦める）
+                if (running_) {
+                    compact_requested_ = true;
+                    cv_.wait_for(lock, std::chrono::seconds(1), [this]() { return !running_; });
+                } else {
+                    durable_version_ = requested_version_;
+                }
+            }
+            durable_cv_.notify_all();
+            if (stopping && pending_records_.empty()) {
+                break;
+            }
+            lock.unlock();
+        }
+        durable_cv_.notify_all();
+    }
+
+    std::string filename_;
+    std::string journal_path_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::condition_variable durable_cv_;
+    std::thread thread_;
+    bool running_;
+    int journal_fd_;  // 書き込みスレッドのみが触る
+    std::chrono::steady_clock::time_point last_compaction_;
+    std::vector<JournalRecord> pending_records_;
+    uint64_t requested_version_;
+    uint64_t durable_version_;
+    bool compact_requested_;
+    uint64_t compact_tickets_;   // 受け付けた明示的な書き直しの通し番号
+    uint64_t compacted_ticket_;  // 書き直しが終わった受付番号
+    uint64_t requests_;
+    uint64_t writes_;
+    uint64_t journal_appends_;
+    uint64_t compactions_;
+    uint64_t failures_;
+};
+
+PersistenceWriter g_persistence_writer;
+
+/**
+ * @brief 現在の設定の保存を書き込みスレッドに依頼する（待たない）
+ * @return 保存される版
+ */
+uint64_t request_config_save() {
+    return g_persistence_writer.request_save();
+}
+
+/**
+ * @brief 設定ファイル自体の書き直し（圧縮）を依頼する（待たない）
+ * @return 書き直しの受付番号（wait_config_compacted()に渡せる）
+ */
+uint64_t request_config_compaction() {
+    return g_persistence_writer.request_compaction();
+}
+
+/**
+ * @brief 依頼した書き直しが終わるまで待つ
+ * @return 書き直せていればtrue
+ */
+bool wait_config_compacted(uint64_t ticket, int timeout_ms) {
+    return g_persistence_writer.wait_compacted(ticket, timeout_ms);
+}
+
+/**
+ * @brief コミットされた変更をジャーナルに記録する（ConfigUpdateParser::commit()から呼ばれる）
+ */
+void journal_config_changes(const std::vector<ConfigChange>& changes) {
+    g_persistence_writer.journal_changes(changes);
+}
+
+/**
+ * @brief 指定した版が保存されるまで待つ
+ * @return 保存済みならtrue
+ */
+bool wait_config_durable(uint64_t version, int timeout_ms) {
+    return g_persistence_writer.wait_durable(version, timeout_ms);
+}
+
+/**
+ * @brief バックアップリングに記録されている版の一覧を表示用に整形する
+ */
+std::string format_config_backups() {
+    std::vector<ConfigBackupRing::Entry> entries;
+    {
+        std::lock_guard<std::mutex> save_lock(g_save_mutex);
+        entries = g_backup_ring.list(g_config_path);
+    }
+    std::stringstream out;
+    for (const auto& entry : entries) {
+        std::time_t seconds = (std::time_t)(entry.time_ms / 1000);
+        char time_buf[32];
+        std::strftime(time_buf, sizeof(time_buf), "%Y-%m-%d %H:%M:%S", std::localtime(&seconds));
+        out << "  版 " << entry.version << "  " << time_buf << "  断片 " << entry.chunks.size() << " 個\n";
+    }
+    return out.str();
+}
+
+/**
+ * @brief バックアップリングに記録された版へ設定を戻す
+ *
+ * 戻す内容は通常の更新としてコミットするため、新しい版としてジャーナルに記録され、
+ * 変更履歴にも残る。その版に無いキー（後から追加されたキー）はそのまま残る。
+ * @param version 戻す版
+ * @param applied 適用した変更を受け取る（WPFへの通知用）
+ * @return 変更した項目数、版が見つからない場合は-1
+ */
+int restore_config_backup(uint64_t version, std::vector<ConfigChange>* applied) {
+    std::string content;
+    {
+        std::lock_guard<std::mutex> save_lock(g_save_mutex);
+        if (!g_backup_ring.restore(g_config_path, version, content)) {
+            return -1;
+        }
+    }
+
+    // INIの内容を更新メッセージの形式（[セクション]キー=値）に直してコミットする
+    ConfigUpdateParser parser;
+    std::istringstream lines(content);
+    std::string line;
+    std::string section;
+    while (std::getline(lines, line)) {
+        size_t begin = line.find_first_not_of(" \t\r");
+        if (begin == std::string::npos || line[begin] == '#' || line[begin] == ';') {
+            continue;
+        }
+        size_t end = line.find_last_not_of(" \t\r") + 1;
+        if (line[begin] == '[') {
+            size_t close = line.find(']', begin);
+            if (close != std::string::npos) {
+                section = line.substr(begin + 1, close - begin - 1);
+            }
+            continue;
+        }
+        size_t equals = line.find('=', begin);
+        if (section.empty() || equals == std::string::npos) {
+            continue;
+        }
+        std::string key = line.substr(begin, equals - begin);
+        key.erase(key.find_last_not_of(" \t") + 1);
+        size_t value_begin = line.find_first_not_of(" \t", equals + 1);
+        std::string value = (value_begin == std::string::npos || value_begin >= end)
+                                ? std::string() : line.substr(value_begin, end - value_begin);
+        std::string update = "[" + section + "]" + key + "=" + value + "\n";
+        parser.feed(update.data(), update.size());
+    }
+    parser.finish();
+    return parser.commit(applied);
+}
+
+/**
+ * @brief 名前付きのプリセット（通常・ブーストなどの調整値のまとまり）
+ *
+ * config.ini と同じ場所の "<config.ini>.presets" から読み込む。セクション名を
+ * "[プリセット名:セクション]" と書き、その下に切り替えで適用する項目を並べる。
+ *   [boost:PWM]
+ *   PWM_NORMAL_MAX=1700
+ * 読み込み時に、そのままコミットできる変更のまとまりと、WPFへ送るフレーム済みの
+ * 更新を組み立てておく。適用は1回のロック・1つの版のコミットと1回の送信だけで、
+ * 途中の（一部の項目だけが切り替わった）状態は誰からも見えない。
+ */
+/**
+ * @brief 名前の大文字・小文字を区別せずに、読み込み済みの設定のセクション名を探す
+ *
+ * iniparser はセクション名を小文字にして返すため、プリセットに書かれた名前をそのまま使うと
+ * 同じセクションが別の名前で2つできてしまう。
+ * @param resolved 見つかったセクション名を受け取る
+ * @return 見つかればtrue
+ */
+bool resolve_config_section(const std::string& name, std::string& resolved) {
+    SiteLockGuard lock(g_config_mutex, LOCK_SITE());
+    for (const auto& section_pair : g_config_data) {
+        if (strcasecmp(section_pair.first.c_str(), name.c_str()) == 0) {
+            resolved = section_pair.first;
+            return true;
+        }
+    }
+    return false;
+}
+
+struct ConfigPreset {
+    std::string name;
+    StagedChanges changes;  // そのままコミットできる変更のまとまり
+    std::string payload;    // WPFへ送る更新（フレーム済み）
+};
+
+class PresetStore {
+public:
+    /**
+     * @brief プリセットファイルを読み込み、以前の内容と置き換える
+     * @return 読み込んだプリセットの数（ファイルが無ければ0）
+     */
+    size_t load(const std::string& path) {
+        std::map<std::string, std::shared_ptr<ConfigPreset>> presets;
+        std::ifstream file(path);
+        std::string line;
+        std::shared_ptr<ConfigPreset> current;
+        std::string section;
+        while (std::getline(file, line)) {
+            size_t begin = line.find_first_not_of(" \t\r");
+            if (begin == std::string::npos || line[begin] == '#' || line[begin] == ';') {
+                continue;
+            }
+            size_t end = line.find_last_not_of(" \t\r") + 1;
+            if (line[begin] == '[') {
+                size_t close = line.find(']', begin);
+                size_t colon = line.find(':', begin);
+                current.reset();
+                if (close == std::string::npos || colon == std::string::npos || colon > close) {
+                    LOG_WARN("警告: プリセットのセクション名は [プリセット名:セクション] の形にしてください: %s",
+                             line.substr(begin, end - begin));
+                    continue;
+                }
+                std::string name = line.substr(begin + 1, colon - begin - 1);
+                if (!resolve_config_section(line.substr(colon + 1, close - colon - 1), section)) {
+                    LOG_WARN("警告: プリセットのセクションが設定ファイルにありません。項目を無視します: %s",
+                             line.substr(begin, end - begin));
+                    continue;
+                }
+                std::shared_ptr<ConfigPreset>& preset = presets[name];
+                if (!preset) {
+                    preset.reset(new ConfigPreset());
+                    preset->name = name;
+                }
+                current = preset;
+                continue;
+            }
+            size_t equals = line.find('=', begin);
+            if (!current || equals == std::string::npos) {
+                continue;
+            }
+            std::string key = line.substr(begin, equals - begin);
+            key.erase(key.find_last_not_of(" \t") + 1);
+            size_t value_begin = line.find_first_not_of(" \t", equals + 1);
+            current->changes[std::make_pair(section, key)] =
+                (value_begin == std::string::npos || value_begin >= end) ? std::string()
+                                                                         : line.substr(value_begin, end - value_begin);
+        }
+
+        for (auto& preset : presets) {
+            std::string content;
+            for (const auto& entry : preset.second->changes) {
+                append_config_entry(content, entry.first.first, entry.first.second, entry.second);
+            }
+            preset.second->payload = frame_message(content);
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        presets_.clear();
+        for (auto& preset : presets) {
+            presets_[preset.first] = preset.second;
+        }
+        return presets_.size();
+    }
+
+    std::shared_ptr<const ConfigPreset> find(const std::string& name) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = presets_.find(name);
+        return it == presets_.end() ? std::shared_ptr<const ConfigPreset>() : it->second;
+    }
+
+    /**
+     * @brief "名前\t項目数" の一覧
+     */
+    std::string format_list() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::string list;
+        for (const auto& preset : presets_) {
+            list += preset.first + "\t" + std::to_string(preset.second->changes.size()) + "\n";
+        }
+        return list;
+    }
+
+private:
+    std::mutex mutex_;
+    std::map<std::string, std::shared_ptr<const ConfigPreset>> presets_;
+};
+
+PresetStore g_preset_store;
+
+/**
+ * @brief プリセットファイル（"<設定ファイル>.presets"）を読み込む
+ */
+void load_config_presets(const std::string& config_path) {
+    size_t count = g_preset_store.load(config_path + ".presets");
+    if (count > 0) {
+        LOG_INFO("プリセットを %d 個読み込みました: %s.presets", count, config_path);
+    }
+}
+
+std::string format_config_presets() {
+    return g_preset_store.format_list();
+}
+
+/**
+ * @brief プリセットを適用する
+ *
+ * 組み立て済みの変更を1つの版としてコミットし（購読者へは1回の "!CHANGED" で届く）、
+ * 組み立て済みの更新をまとめを待たずにWPFへ1回送る。
+ * 受信した更新と同じく、ROLLOUT_PEERS が設定されていれば全ノードと一斉に反映する。
+ * 値がすでにプリセットどおりなら何もしない。
+ * @param name プリセット名
+ * @param version 適用後の設定の版を受け取る
+ * @return 変更した項目数、プリセットが無い場合は-1、ロールアウトが中止された場合は-2
+ */
+int activate_config_preset(const std::string& name, uint64_t& version) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::shared_ptr<const ConfigPreset> preset = g_preset_store.find(name);
+    if (!preset) {
+        return -1;
+    }
+    std::vector<ConfigChange> changes;
+    std::string outcome;
+    int count = rollout_config_changes(preset->changes, &changes, &outcome);
+    if (count < 0) {
+        LOG_WARN("警告: プリセット %s を適用しませんでした（%s）", name, outcome);
+        return -2;
+    }
+    version = count > 0 ? changes[0].version : g_config_version.load();
+    if (count > 0) {
+        g_outbound_sender.send_payload(preset->payload, preset->changes);
+    }
+    int64_t elapsed_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    g_metrics.stage(STAGE_PRESET_ACTIVATE).record(elapsed_ns);
+    LOG_INFO("プリセット %s を適用しました（版 %d、%d 項目を変更、%d us）", name, version, count, elapsed_ns / 1000);
+    return count;
+}
+
+/*
+ * ノード間のレプリケーション（アンチエントロピー）
+ *
+ * 複数の機体や陸上局で、CONFIG_SYNC:REPLICATION_SECTIONS に挙げたセクションを同じ内容に揃える。
+ * 各ノードは REPLICATION_PEERS の相手と定期的に（変更があればすぐに）次の手順で突き合わせる。
+ *   1. ?AE_ROOT   ルートハッシュを送る。同じなら1往復で終わり、違えばセクションごとのハッシュを受け取る
+ *   2. ?AE_TREE   ハッシュの違う部分木について、子のハッシュ（項目が少なければ項目ごとの
+ *                 書き込み時刻と値のハッシュ）を受け取る。違う子だけをたどって繰り返す
+ *   3. ?AE_SYNC   こちらが新しい項目を送り、相手が新しい項目を受け取る
+ * 木はセクションごとに、キーのハッシュの16進表記の前方一致で16個ずつに分かれ、
+ * 葉は (キー, 値, 書き込み時刻) から作る。項目が REPLICA_LEAF_LIMIT 以下の部分木は
+ * 項目をそのまま返すので、数十項目のセクションなら3往復、1万項目でも5往復ほどで済む。
+ * 違いの無い部分木は送らないため、やり取りの量は設定の大きさではなく違いの大きさにほぼ比例する。
+ * 同じ項目の書き込みが競合した場合は、HLC（ハイブリッド論理時計）の後勝ちで決める。
+ * CONFIG_SYNC セクションはノードごとの設定なので、挙げても複製しない。
+ */
+
+// 書き込み時刻の文字列表現 "HLC.ノード"（16進）
+std::string stamp_text(const ReplicaStamp& stamp) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%llx.%x", (unsigned long long)stamp.hlc, stamp.node);
+    return buf;
+}
+
+bool parse_stamp(const std::string& text, ReplicaStamp& stamp) {
+    char* end = nullptr;
+    stamp.hlc = strtoull(text.c_str(), &end, 16);
+    if (end == text.c_str() || *end != '.') {
+        return false;
+    }
+    stamp.node = (uint32_t)strtoul(end + 1, nullptr, 16);
+    return true;
+}
+
+std::string hash_text(uint64_t hash) {
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)hash);
+    return buf;
+}
+
+std::string upper_case(std::string text) {
+    std::transform(text.begin(), text.end(), text.begin(), ::toupper);
+    return text;
+}
+
+// 複製するセクション名（大文字）の一覧。g_config_mutex を保持せずに呼ぶ
+std::set<std::string> replicated_sections() {
+    std::set<std::string> sections;
+    std::stringstream ss(get_config_value("CONFIG_SYNC", "REPLICATION_SECTIONS", ""));
+    std::string name;
+    while (std::getline(ss, name, ',')) {
+        name.erase(0, name.find_first_not_of(" \t"));
+        name.erase(name.find_last_not_of(" \t") + 1);
+        if (!name.empty() && upper_case(name) != "CONFIG_SYNC") {
+            sections.insert(upper_case(name));
+        }
+    }
+    return sections;
+}
+
+// "host:port" のカンマ区切りの一覧を分ける（REPLICATION_PEERS / ROLLOUT_PEERS）
+std::vector<std::pair<std::string, int>> parse_peer_list(const std::string& list) {
+    std::vector<std::pair<std::string, int>> peers;
+    std::stringstream ss(list);
+    std::string peer;
+    while (std::getline(ss, peer, ',')) {
+        peer.erase(0, peer.find_first_not_of(" \t"));
+        peer.erase(peer.find_last_not_of(" \t") + 1);
+        size_t colon = peer.rfind(':');
+        if (colon == std::string::npos) {
+            continue;
+        }
+        int port = atoi(peer.c_str() + colon + 1);
+        if (port > 0) {
+            peers.push_back(std::make_pair(peer.substr(0, colon), port));
+        }
+    }
+    return peers;
+}
+
+// 複製の相手
+std::vector<std::pair<std::string, int>> replication_peers() {
+    return parse_peer_list(get_config_value("CONFIG_SYNC", "REPLICATION_PEERS", ""));
+}
+
+const size_t REPLICA_LEAF_LIMIT = 16;  // これ以下の項目しか無い部分木は、子に分けずに項目を返す
+
+/**
+ * @brief 木の葉（1項目）。キーのハッシュ順に並べる
+ */
+struct ReplicaLeaf {
+    uint64_t key_hash;
+    std::string key;
+    std::string value;
+    ReplicaStamp stamp;
+    uint64_t leaf_hash;
+};
+
+bool replica_leaf_less(const ReplicaLeaf& a, const ReplicaLeaf& b) {
+    return a.key_hash != b.key_hash ? a.key_hash < b.key_hash : a.key < b.key;
+}
+
+/**
+ * @brief セクションの葉をキーのハッシュ順に並べる（g_config_mutex を保持して呼ぶ）
+ */
+std::vector<ReplicaLeaf> replica_leaves(const std::string& section) {
+    std::vector<ReplicaLeaf> leaves;
+    auto section_it = g_config_data.find(section);
+    if (section_it == g_config_data.end()) {
+        return leaves;
+    }
+    leaves.reserve(section_it->second.size());
+    for (const auto& key_value_pair : section_it->second) {
+        ReplicaLeaf leaf;
+        leaf.key_hash = fnv1a64(key_value_pair.first);
+        leaf.key = key_value_pair.first;
+        leaf.value = key_value_pair.second;
+        auto stamp_it = g_config_stamps.find(std::make_pair(section, key_value_pair.first));
+        if (stamp_it != g_config_stamps.end()) {
+            leaf.stamp = stamp_it->second;
+        }
+        leaf.leaf_hash = fnv1a64(leaf.key + '\0' + leaf.value + '\0' + stamp_text(leaf.stamp));
+        leaves.push_back(leaf);
+    }
+    std::sort(leaves.begin(), leaves.end(), replica_leaf_less);
+    return leaves;
+}
+
+/**
+ * @brief キーのハッシュが prefix（16進）で始まる葉の範囲 [begin, end)
+ */
+void replica_prefix_range(const std::vector<ReplicaLeaf>& leaves, const std::string& prefix, size_t& begin,
+                          size_t& end) {
+    uint64_t low = prefix.empty() ? 0 : strtoull((prefix + std::string(16 - prefix.size(), '0')).c_str(), nullptr, 16);
+    uint64_t high = prefix.empty() ? UINT64_MAX
+                                   : strtoull((prefix + std::string(16 - prefix.size(), 'f')).c_str(), nullptr, 16);
+    begin = std::lower_bound(leaves.begin(), leaves.end(), low,
+                             [](const ReplicaLeaf& leaf, uint64_t hash) { return leaf.key_hash < hash; }) -
+            leaves.begin();
+    end = std::upper_bound(leaves.begin(), leaves.end(), high,
+                           [](uint64_t hash, const ReplicaLeaf& leaf) { return hash < leaf.key_hash; }) -
+          leaves.begin();
+}
+
+uint64_t replica_range_hash(const std::vector<ReplicaLeaf>& leaves, size_t begin, size_t end) {
+    uint64_t hash = fnv1a64("");
+    for (size_t i = begin; i < end; i++) {
+        hash = fnv1a64(std::string(reinterpret_cast<const char*>(&leaves[i].leaf_hash), sizeof(uint64_t)), hash);
+    }
+    return hash;
+}
+
+/**
+ * @brief 部分木の子（次の16進1桁ごと）のハッシュ。空の子は含まない
+ */
+std::map<std::string, uint64_t> replica_child_hashes(const std::vector<ReplicaLeaf>& leaves,
+                                                     const std::string& prefix) {
+    std::map<std::string, uint64_t> children;
+    for (const char* digit = "0123456789abcdef"; *digit != '\0'; ++digit) {
+        std::string child = prefix + *digit;
+        size_t begin, end;
+        replica_prefix_range(leaves, child, begin, end);
+        if (begin < end) {
+            children[child] = replica_range_hash(leaves, begin, end);
+        }
+    }
+    return children;
+}
+
+/**
+ * @brief 複製するセクションごとのハッシュ（g_config_mutex を保持して呼ぶ）
+ */
+std::map<std::string, uint64_t> replica_section_hashes(const std::set<std::string>& sections) {
+    std::map<std::string, uint64_t> hashes;
+    for (const auto& section_pair : g_config_data) {
+        if (sections.count(upper_case(section_pair.first)) == 0 || section_pair.second.empty()) {
+            continue;
+        }
+        std::vector<ReplicaLeaf> leaves = replica_leaves(section_pair.first);
+        hashes[section_pair.first] = replica_range_hash(leaves, 0, leaves.size());
+    }
+    return hashes;
+}
+
+uint64_t replica_root_hash(const std::map<std::string, uint64_t>& section_hashes) {
+    uint64_t hash = fnv1a64("");
+    for (const auto& section : section_hashes) {
+        hash = fnv1a64(section.first + '\0' + hash_text(section.second), hash);
+    }
+    return hash;
+}
+
+// 相手の葉1つ分の書き込み時刻と値のハッシュ（?AE_TREE の応答の "L" 行）
+struct ReplicaKeyDigest {
+    ReplicaStamp stamp;
+    uint64_t value_hash;
+};
+
+// "+時刻\t[SECTION]KEY=VALUE" の行
+std::string replica_entry_line(const std::string& section, const std::string& key, const std::string& value,
+                               const ReplicaStamp& stamp) {
+    return "+" + stamp_text(stamp) + "\t[" + section + "]" + key + "=" + value + "\n";
+}
+
+bool parse_replica_entry_line(const std::string& line, std::pair<std::string, std::string>& section_key,
+                              std::string& value, ReplicaStamp& stamp) {
+    size_t tab = line.find('\t');
+    if (line.empty() || line[0] != '+' || tab == std::string::npos || !parse_stamp(line.substr(1, tab - 1), stamp)) {
+        return false;
+    }
+    std::string entry = line.substr(tab + 1);
+    size_t section_end = entry.find(']');
+    size_t equals = entry.find('=', section_end);
+    if (entry.empty() || entry[0] != '[' || section_end == std::string::npos || equals == std::string::npos) {
+        return false;
+    }
+    section_key.first = entry.substr(1, section_end - 1);
+    section_key.second = entry.substr(section_end + 1, equals - section_end - 1);
+    value = entry.substr(equals + 1);
+    return true;
+}
+
+/**
+ * @brief 届いた項目を後勝ちで反映する
+ * @return 値が変わった項目数
+ */
+int merge_replica_entries(const StagedChanges& staged, const ReplicaStamps& stamps) {
+    if (staged.empty()) {
+        return 0;
+    }
+    std::vector<ConfigChange> changes;
+    int count = ConfigUpdateParser::commit_changes(staged, &changes, &stamps);
+    if (count > 0) {
+        // 他のノードから届いた変更もWPFに知らせる
+        g_outbound_sender.push_changes(changes);
+    }
+    return count;
+}
+
+/**
+ * @brief 他のノードからの ?AE_ROOT / ?AE_TREE / ?AE_SYNC / ?AE_STATS に応える
+ * @param request 問い合わせの本体
+ * @param peer 相手のIPアドレス（?AE_SYNC で項目を受け取るのは REPLICATION_PEERS の相手だけ）
+ * @return フレーム化された応答
+ */
+std::string handle_replication_query(const std::string& request, const std::string& peer);
+
+/**
+ * @brief 複製の相手と定期的に突き合わせるスレッド
+ */
+class Replicator {
+public:
+    Replicator() : running_(false), rounds_(0), equal_rounds_(0), failures_(0), bytes_sent_(0),
+                   bytes_received_(0), keys_pushed_(0), keys_pulled_(0) {}
+    ~Replicator() { stop(); }
+
+    void start() {
+        if (running_.exchange(true)) {
+            return;
+        }
+        thread_ = std::thread(&Replicator::run, this);
+    }
+
+    void stop() {
+        if (!running_.exchange(false)) {
+            return;
+        }
+        g_change_feed.wake_all();
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+
+    /**
+     * @brief 統計（"名前=値" の行。root は現在のルートハッシュ）
+     */
+    std::string format_stats() {
+        std::set<std::string> sections = replicated_sections();
+        uint64_t root;
+        {
+            SiteLockGuard lock(g_config_mutex, LOCK_SITE());
+            root = replica_root_hash(replica_section_hashes(sections));
+        }
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        return "root=" + hash_text(root) + "\n" +
+               "rounds=" + std::to_string(rounds_) + "\n" +
+               "equal_rounds=" + std::to_string(equal_rounds_) + "\n" +
+               "failures=" + std::to_string(failures_) + "\n" +
+               "bytes_sent=" + std::to_string(bytes_sent_) + "\n" +
+               "bytes_received=" + std::to_string(bytes_received_) + "\n" +
+               "keys_pushed=" + std::to_string(keys_pushed_) + "\n" +
+               "keys_pulled=" + std::to_string(keys_pulled_) + "\n";
+    }
+
+    void print_stats() {
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        if (rounds_ == 0) {
+            return;
+        }
+        std::cout << "レプリケーション: " << rounds_ << " 回突き合わせ（一致 " << equal_rounds_ << " 回, 失敗 "
+                  << failures_ << " 回）, 送信 " << bytes_sent_ << " バイト, 受信 " << bytes_received_
+                  << " バイト, 送った項目 " << keys_pushed_ << ", 受け取った項目 " << keys_pulled_ << "\n";
+    }
+
+private:
+    static const int REQUEST_TIMEOUT_MS = 1000;
+    static const size_t MAX_SYNC_BODY = MAX_QUERY_MESSAGE_SIZE - 1024;  // ?AE_SYNC 1回分の上限
+
+    void run() {
+        uint64_t seen_version = g_config_version.load();
+        while (running_.load() && !g_shutdown_flag.load()) {
+            std::vector<std::pair<std::string, int>> peers = replication_peers();
+            std::set<std::string> sections = replicated_sections();
+            if (!peers.empty() && !sections.empty()) {
+                seen_version = g_config_version.load();
+                for (const auto& peer : peers) {
+                    if (!running_.load()) {
+                        break;
+                    }
+                    bool ok = sync_with(peer.first, peer.second, sections);
+                    std::lock_guard<std::mutex> lock(stats_mutex_);
+                    rounds_++;
+                    if (!ok) {
+                        failures_++;
+                    }
+                }
+            }
+            // 変更がコミットされればすぐに、無ければ間隔ごとに突き合わせる
+            int interval_ms = std::max(10, get_config_int("CONFIG_SYNC", "REPLICATION_INTERVAL_MS", 1000));
+            g_change_feed.wait_newer(seen_version, interval_ms);
+            seen_version = std::max(seen_version, g_config_version.load());
+        }
+    }
+
+    /**
+     * @brief 1つの相手と突き合わせる
+     * @return 通信できればtrue
+     */
+    bool sync_with(const std::string& host, int port, const std::set<std::string>& sections) {
+        // 1. ルートハッシュ
+        std::map<std::string, uint64_t> local_hashes;
+        {
+            SiteLockGuard lock(g_config_mutex, LOCK_SITE());
+            local_hashes = replica_section_hashes(sections);
+        }
+        std::string reply;
+        if (!request(host, port, "?AE_ROOT " + hash_text(replica_root_hash(local_hashes)) + "\n", reply)) {
+            return false;
+        }
+        if (reply.compare(0, 9, "!AE_EQUAL") == 0) {
+            std::lock_guard<std::mutex> lock(stats_mutex_);
+            equal_rounds_++;
+            return true;
+        }
+        if (reply.compare(0, 12, "!AE_SECTIONS") != 0) {
+            return false;
+        }
+
+        // 2. ハッシュの違うセクションから、違う部分木だけをたどる
+        std::set<std::string> remote_sections;
+        std::vector<std::pair<std::string, std::string>> frontier;  // (セクション, キーのハッシュの前方部分)
+        std::set<std::string> local_only;
+        std::stringstream lines(reply);
+        std::string line;
+        std::getline(lines, line);
+        while (std::getline(lines, line)) {
+            size_t tab = line.find('\t');
+            if (tab == std::string::npos) {
+                continue;
+            }
+            std::string section = line.substr(0, tab);
+            if (sections.count(upper_case(section)) == 0) {
+                continue;
+            }
+            remote_sections.insert(section);
+            auto local_it = local_hashes.find(section);
+            if (local_it == local_hashes.end() || hash_text(local_it->second) != line.substr(tab + 1)) {
+                frontier.push_back(std::make_pair(section, std::string()));
+            }
+        }
+        for (const auto& local : local_hashes) {
+            if (remote_sections.count(local.first) == 0) {
+                local_only.insert(local.first);  // 相手に無いセクションは全項目を送る
+            }
+        }
+
+        // 手元の葉はセクションごとに1回だけ集める（値も含むので、送る行はここから作る）
+        std::map<std::string, std::vector<ReplicaLeaf>> local_leaves;
+        {
+            SiteLockGuard lock(g_config_mutex, LOCK_SITE());
+            for (const auto& node : frontier) {
+                local_leaves[node.first] = replica_leaves(node.first);
+            }
+            for (const std::string& section : local_only) {
+                local_leaves[section] = replica_leaves(section);
+            }
+        }
+
+        std::vector<std::string> push_lines;
+        std::vector<std::string> pull_lines;
+        for (const std::string& section : local_only) {
+            const std::vector<ReplicaLeaf>& leaves = local_leaves[section];
+            for (const ReplicaLeaf& leaf : leaves) {
+                push_lines.push_back(replica_entry_line(section, leaf.key, leaf.value, leaf.stamp));
+            }
+        }
+
+        while (!frontier.empty()) {
+            std::string tree_request = "?AE_TREE\n";
+            for (const auto& node : frontier) {
+                tree_request += node.first + "\t" + node.second + "\n";
+            }
+            if (!request(host, port, tree_request, reply)) {
+                return false;
+            }
+            // "C\tSECTION\t子の前方部分\tハッシュ" または "L\tSECTION\t前方部分\tKEY\t時刻\t値のハッシュ"
+            std::map<std::pair<std::string, std::string>, std::map<std::string, uint64_t>> remote_children;
+            std::map<std::pair<std::string, std::string>, std::map<std::string, ReplicaKeyDigest>> remote_leaves;
+            std::stringstream tree_lines(reply);
+            while (std::getline(tree_lines, line)) {
+                std::vector<std::string> fields;
+                std::stringstream field_stream(line);
+                std::string field;
+                while (std::getline(field_stream, field, '\t')) {
+                    fields.push_back(field);
+                }
+                if (fields.size() == 4 && fields[0] == "C" && !fields[2].empty()) {
+                    std::string parent = fields[2].substr(0, fields[2].size() - 1);
+                    remote_children[std::make_pair(fields[1], parent)][fields[2]] =
+                        strtoull(fields[3].c_str(), nullptr, 16);
+                } else if (fields.size() == 6 && fields[0] == "L") {
+                    ReplicaKeyDigest digest;
+                    if (parse_stamp(fields[4], digest.stamp)) {
+                        digest.value_hash = strtoull(fields[5].c_str(), nullptr, 16);
+                        remote_leaves[std::make_pair(fields[1], fields[2])][fields[3]] = digest;
+                    }
+                }
+            }
+
+            std::vector<std::pair<std::string, std::string>> next;
+            for (const auto& node : frontier) {
+                const std::vector<ReplicaLeaf>& leaves = local_leaves[node.first];
+                auto children_it = remote_children.find(node);
+                if (children_it != remote_children.end()) {
+                    // 子に分かれている: 違う子だけを次にたどる。相手に無い子は全項目を送る
+                    std::map<std::string, uint64_t> local_children = replica_child_hashes(leaves, node.second);
+                    for (const auto& child : local_children) {
+                        auto remote_it = children_it->second.find(child.first);
+                        if (remote_it == children_it->second.end()) {
+                            size_t begin, end;
+                            replica_prefix_range(leaves, child.first, begin, end);
+                            for (size_t i = begin; i < end; i++) {
+                                push_lines.push_back(replica_entry_line(node.first, leaves[i].key, leaves[i].value,
+                                                                        leaves[i].stamp));
+                            }
+                        } else if (remote_it->second != child.second) {
+                            next.push_back(std::make_pair(node.first, child.first));
+                        }
+                    }
+                    for (const auto& remote_child : children_it->second) {
+                        if (local_children.count(remote_child.first) == 0) {
+                            next.push_back(std::make_pair(node.first, remote_child.first));
+                        }
+                    }
+                    continue;
+                }
+
+                // 葉が届いた（空の場合も含む）: 項目ごとに新しい方を決める
+                static const std::map<std::string, ReplicaKeyDigest> no_leaves;
+                auto leaves_it = remote_leaves.find(node);
+                const std::map<std::string, ReplicaKeyDigest>& remote =
+                    leaves_it == remote_leaves.end() ? no_leaves : leaves_it->second;
+                size_t begin, end;
+                replica_prefix_range(leaves, node.second, begin, end);
+                std::set<std::string> local_keys;
+                for (size_t i = begin; i < end; i++) {
+                    const ReplicaLeaf& leaf = leaves[i];
+                    local_keys.insert(leaf.key);
+                    auto remote_it = remote.find(leaf.key);
+                    if (remote_it == remote.end()) {
+                        push_lines.push_back(replica_entry_line(node.first, leaf.key, leaf.value, leaf.stamp));
+                    } else if (stamp_newer(leaf.stamp, fnv1a64(leaf.value), remote_it->second.stamp,
+                                           remote_it->second.value_hash)) {
+                        push_lines.push_back(replica_entry_line(node.first, leaf.key, leaf.value, leaf.stamp));
+                    } else if (stamp_newer(remote_it->second.stamp, remote_it->second.value_hash, leaf.stamp,
+                                           fnv1a64(leaf.value))) {
+                        pull_lines.push_back("-[" + node.first + "]" + leaf.key + "\n");
+                    }
+                }
+                for (const auto& remote_leaf : remote) {
+                    if (local_keys.count(remote_leaf.first) == 0) {
+                        pull_lines.push_back("-[" + node.first + "]" + remote_leaf.first + "\n");
+                    }
+                }
+            }
+            frontier.swap(next);
+        }
+
+        // ?AE_SYNC は問い合わせの大きさの上限に収まるよう分けて送る
+        size_t push_index = 0;
+        size_t pull_index = 0;
+        while (push_index < push_lines.size() || pull_index < pull_lines.size()) {
+            std::string body = "?AE_SYNC\n";
+            size_t pushed = 0;
+            while (push_index < push_lines.size() && body.size() + push_lines[push_index].size() < MAX_SYNC_BODY) {
+                body += push_lines[push_index++];
+                pushed++;
+            }
+            while (pull_index < pull_lines.size() && body.size() + pull_lines[pull_index].size() < MAX_SYNC_BODY) {
+                body += pull_lines[pull_index++];
+            }
+            if (body.size() == 9) {
+                break;  // 1行が上限を超える項目は送れない
+            }
+            if (!request(host, port, body, reply)) {
+                return false;
+            }
+            if (reply.compare(0, 10, "!AE_SYNCED") != 0) {
+                LOG_WARN("警告: %s:%d が複製の項目を受け付けませんでした: %s", host, port,
+                         reply.substr(0, reply.find('\n')));
+                return false;
+            }
+            StagedChanges staged;
+            ReplicaStamps stamps;
+            std::stringstream entry_lines(reply);
+            std::getline(entry_lines, line);
+            while (std::getline(entry_lines, line)) {
+                std::pair<std::string, std::string> section_key;
+                std::string value;
+                ReplicaStamp stamp;
+                if (parse_replica_entry_line(line, section_key, value, stamp) &&
+                    sections.count(upper_case(section_key.first)) != 0) {
+                    staged[section_key] = value;
+                    stamps[section_key] = stamp;
+                }
+            }
+            int merged = merge_replica_entries(staged, stamps);
+            if (pushed > 0 || merged > 0) {
+                LOG_DEBUG("%s:%d と複製しました（送った項目 %d、反映した項目 %d）", host, port, pushed, merged);
+            }
+            std::lock_guard<std::mutex> lock(stats_mutex_);
+            keys_pushed_ += pushed;
+            keys_pulled_ += staged.size();
+        }
+        return true;
+    }
+
+    /**
+     * @brief 1往復分の問い合わせ（接続ごとに1つの問い合わせを送り、応答を受け取る）
+     */
+    bool request(const std::string& host, int port, const std::string& body, std::string& reply) {
+        reply.clear();
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) <= 0) {
+            return false;
+        }
+        int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (sock < 0) {
+            return false;
+        }
+        struct timeval timeout;
+        timeout.tv_sec = REQUEST_TIMEOUT_MS / 1000;
+        timeout.tv_usec = (REQUEST_TIMEOUT_MS % 1000) * 1000;
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        int one = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            close(sock);
+            return false;
+        }
+        std::string message = frame_message(body);
+        size_t sent = send_message_on_existing_socket(sock, message);
+
+        // 応答 "<長さ>\n<本体>" を受け取る
+        std::string received;
+        size_t expected = 0;
+        size_t header_end = std::string::npos;
+        char buffer[4096];
+        while (header_end == std::string::npos || received.size() < header_end + 1 + expected) {
+            ssize_t n = recv(sock, buffer, sizeof(buffer), 0);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            received.append(buffer, n);
+            if (header_end == std::string::npos) {
+                header_end = received.find('\n');
+                if (header_end != std::string::npos) {
+                    expected = strtoull(received.c_str(), nullptr, 10);
+                    if (expected > MAX_UPDATE_MESSAGE_SIZE) {
+                        break;
+                    }
+                }
+            }
+        }
+        close(sock);
+        {
+            std::lock_guard<std::mutex> lock(stats_mutex_);
+            bytes_sent_ += sent;
+            bytes_received_ += received.size();
+        }
+        if (sent < message.size() || header_end == std::string::npos ||
+            received.size() < header_end + 1 + expected) {
+            return false;
+        }
+        reply = received.substr(header_end + 1, expected);
+        return true;
+    }
+
+    std::atomic<bool> running_;
+    std::thread thread_;
+    std::mutex stats_mutex_;
+    uint64_t rounds_;
+    uint64_t equal_rounds_;
+    uint64_t failures_;
+    uint64_t bytes_sent_;
+    uint64_t bytes_received_;
+    uint64_t keys_pushed_;
+    uint64_t keys_pulled_;
+};
+
+Replicator g_replicator;
+
+std::string handle_replication_query(const std::string& request, const std::string& peer) {
+    std::stringstream lines(request);
+    std::string first_line;
+    std::getline(lines, first_line);
+    first_line.erase(first_line.find_last_not_of(" \r\t") + 1);
+    std::set<std::string> sections = replicated_sections();
+
+    if (first_line.compare(0, 9, "?AE_STATS") == 0) {
+        return frame_message(g_replicator.format_stats());
+    }
+
+    if (first_line.compare(0, 8, "?AE_ROOT") == 0) {
+        std::string remote_root = first_line.size() > 9 ? first_line.substr(9) : std::string();
+        SiteLockGuard lock(g_config_mutex, LOCK_SITE());
+        std::map<std::string, uint64_t> hashes = replica_section_hashes(sections);
+        if (hash_text(replica_root_hash(hashes)) == remote_root) {
+            return frame_message("!AE_EQUAL\n");
+        }
+        std::string content = "!AE_SECTIONS\n";
+        for (const auto& section : hashes) {
+            content += section.first + "\t" + hash_text(section.second) + "\n";
+        }
+        return frame_message(content);
+    }
+
+    if (first_line.compare(0, 8, "?AE_TREE") == 0) {
+        // 1行に1つの部分木 "SECTION\t前方部分"。項目が少なければ葉を、多ければ子のハッシュを返す
+        std::string content;
+        std::string line;
+        std::map<std::string, std::vector<ReplicaLeaf>> leaves_by_section;
+        SiteLockGuard lock(g_config_mutex, LOCK_SITE());
+        while (std::getline(lines, line)) {
+            line.erase(line.find_last_not_of(" \r") + 1);
+            size_t tab = line.find('\t');
+            if (tab == std::string::npos) {
+                continue;
+            }
+            std::string section = line.substr(0, tab);
+            std::string prefix = line.substr(tab + 1);
+            if (sections.count(upper_case(section)) == 0 || prefix.size() > 16) {
+                continue;
+            }
+            auto cached = leaves_by_section.find(section);
+            if (cached == leaves_by_section.end()) {
+                cached = leaves_by_section.insert(std::make_pair(section, replica_leaves(section))).first;
+            }
+            const std::vector<ReplicaLeaf>& leaves = cached->second;
+            size_t begin, end;
+            replica_prefix_range(leaves, prefix, begin, end);
+            if (end - begin <= REPLICA_LEAF_LIMIT || prefix.size() == 16) {
+                for (size_t i = begin; i < end; i++) {
+                    content += "L\t" + section + "\t" + prefix + "\t" + leaves[i].key + "\t" +
+                               stamp_text(leaves[i].stamp) + "\t" + hash_text(fnv1a64(leaves[i].value)) + "\n";
+                }
+            } else {
+                for (const auto& child : replica_child_hashes(leaves, prefix)) {
+                    content += "C\t" + section + "\t" + child.first + "\t" + hash_text(child.second) + "\n";
+                }
+            }
+        }
+        return frame_message(content);
+    }
+
+    if (first_line.compare(0, 8, "?AE_SYNC") == 0) {
+        StagedChanges staged;
+        ReplicaStamps stamps;
+        std::vector<std::pair<std::string, std::string>> pulls;
+        std::string line;
+        while (std::getline(lines, line)) {
+            std::pair<std::string, std::string> section_key;
+            std::string value;
+            ReplicaStamp stamp;
+            if (parse_replica_entry_line(line, section_key, value, stamp)) {
+                if (sections.count(upper_case(section_key.first)) != 0) {
+                    staged[section_key] = value;
+                    stamps[section_key] = stamp;
+                }
+            } else if (line.size() > 1 && line[0] == '-' && split_section_key(line.substr(1), section_key.first,
+                                                                                section_key.second)) {
+                pulls.push_back(section_key);
+            }
+        }
+        if (!staged.empty()) {
+            // 項目を受け取るのは複製の相手からだけ。更新と同じレート制限も受ける
+            bool known_peer = false;
+            for (const auto& replication_peer : replication_peers()) {
+                known_peer = known_peer || replication_peer.first == peer;
+            }
+            if (!known_peer) {
+                LOG_WARN("警告: 複製の相手ではない %s からの項目を拒否しました。", peer);
+                return frame_message("!REJECTED NOT_A_PEER\n");
+            }
+            if (!g_admission.try_admit_update(peer)) {
+                return frame_message("!REJECTED RATE_LIMIT\n");
+            }
+        }
+        int merged = merge_replica_entries(staged, stamps);
+        std::string content = "!AE_SYNCED " + std::to_string(merged) + "\n";
+        SiteLockGuard lock(g_config_mutex, LOCK_SITE());
+        for (const auto& section_key : pulls) {
+            auto section_it = g_config_data.find(section_key.first);
+            if (sections.count(upper_case(section_key.first)) == 0 || section_it == g_config_data.end()) {
+                continue;
+            }
+            auto key_it = section_it->second.find(section_key.second);
+            if (key_it == section_it->second.end()) {
+                continue;
+            }
+            auto stamp_it = g_config_stamps.find(section_key);
+            content += replica_entry_line(section_key.first, section_key.second, key_it->second,
+                                          stamp_it == g_config_stamps.end() ? ReplicaStamp() : stamp_it->second);
+        }
+        return frame_message(content);
+    }
+
+    LOG_WARN("警告: 不明な複製の問い合わせです: %s", first_line);
+    return frame_message("");
+}
+
+/*
+ * 複数ノードへの一斉適用（2相コミットによるロールアウト）
+ *
+ * 複数の機体の制御で、PWMの上限などを全ノードで同時に切り替える（どれか1つでも反映できなければ
+ * どのノードにも反映しない）。CONFIG_SYNC:ROLLOUT_PEERS に他のノードを挙げると、このノードに届いた
+ * 更新（update_config_from_string、WPFからの更新、?ROLLOUT）は次の手順で反映する。
+ *   1. ?TX_PREPARE  全ノードへ同時に接続して変更を送り（応答を待たずに次のノードへ送る）、
+ *                   応答を待つ間に自分でも検証する。各ノードは検証して変更を預かり、!TX_YES か !TX_NO を返す
+ *   2. ?TX_COMMIT   全ノードが ROLLOUT_TIMEOUT_MS 以内に !TX_YES を返したら、準備と同じ接続で一斉に送り、
+ *                   自分もコミットする（1往復）。そうでなければ ?TX_ABORT を送って中止する
+ * 預かった側は、決定が届くまで接続を保ったまま待つ。準備で渡された時間（ROLLOUT_TIMEOUT_MS の2倍）の
+ * うちに決定が届かないか、接続が切れた場合は中止する。1つのノードが預かれる変更は一度に1つだけで、
+ * 預かっている間に届いた別の準備には !TX_NO BUSY を返す。
+ * 検証では、今の値と型（真偽値・整数・小数）の合わない値を拒否する。CONFIG_SYNC セクションは
+ * ノードごとの設定なので他のノードへは送らず、自分にだけ反映する。
+ * コミットを送った後で相手が応答しなくなった場合、その相手だけが中止していることがある（2相コミット自体の
+ * 限界）。その場合はエラーとして記録し、?TX_STATS の unconfirmed に数える（レプリケーションを併用していれば
+ * 後で揃う）。全ノードで互いを挙げれば、どのノードに届いた更新も同じように反映される。
+ * プリセットの適用も同じ手順でロールアウトする。レプリケーションで届いた変更だけは、これまでどおりこのノードだけに反映する。
+ */
+
+// ロールアウトの相手
+std::vector<std::pair<std::string, int>> rollout_peers() {
+    return parse_peer_list(get_config_value("CONFIG_SYNC", "ROLLOUT_PEERS", ""));
+}
+
+// 値の型（tools/config_codegen.cpp の推論と同じ規則）
+enum RolloutValueKind {
+    VALUE_BOOL,
+    VALUE_INT,
+    VALUE_DOUBLE,
+    VALUE_TEXT
+};
+
+RolloutValueKind rollout_value_kind(const std::string& value) {
+    if (strcasecmp(value.c_str(), "true") == 0 || strcasecmp(value.c_str(), "false") == 0) {
+        return VALUE_BOOL;
+    }
+    if (value.empty()) {
+        return VALUE_TEXT;
+    }
+    char* end = nullptr;
+    errno = 0;
+    long long integer = strtoll(value.c_str(), &end, 10);
+    if (*end == '\0' && errno == 0 && (long long)(int)integer == integer) {
+        return VALUE_INT;
+    }
+    strtod(value.c_str(), &end);
+    return *end == '\0' ? VALUE_DOUBLE : VALUE_TEXT;
+}
+
+/**
+ * @brief 預かる前の検証（g_config_mutex を保持して呼ぶ）
+ * @param reason 拒否する理由（空白を含まない1語）を受け取る
+ */
+bool validate_rollout_entry(const std::string& section, const std::string& key, const std::string& value,
+                            std::string& reason) {
+    if (key.empty() || upper_case(section) == "CONFIG_SYNC") {
+        reason = "LOCAL:[" + section + "]" + key;
+        return false;
+    }
+    auto section_it = g_config_data.find(section);
+    if (section_it == g_config_data.end()) {
+        return true;
+    }
+    auto key_it = section_it->second.find(key);
+    if (key_it == section_it->second.end()) {
+        return true;
+    }
+    RolloutValueKind current = rollout_value_kind(key_it->second);
+    RolloutValueKind incoming = rollout_value_kind(value);
+    if (current == VALUE_TEXT || current == incoming || (current == VALUE_DOUBLE && incoming == VALUE_INT)) {
+        return true;
+    }
+    reason = "TYPE:[" + section + "]" + key;
+    return false;
+}
+
+/**
+ * @brief ロールアウトで1つのノードとやり取りする接続（準備と決定で同じ接続を使う）
+ */
+struct RolloutLink {
+    std::string host;
+    int port = 0;
+    int sock = -1;
+    std::string out;      // 送るフレーム
+    size_t out_sent = 0;
+    std::string in;       // 受信途中の応答
+    bool replied = false;
+    std::string reply;    // 応答の本体
+
+    std::string name() const { return host + ":" + std::to_string(port); }
+
+    // 次に送るフレームを設定し、前の応答を消す
+    void expect(const std::string& message) {
+        out = message;
+        out_sent = 0;
+        in.clear();
+        replied = false;
+        reply.clear();
+    }
+
+    void close_link() {
+        if (sock >= 0) {
+            close(sock);
+            sock = -1;
+        }
+    }
+};
+
+/**
+ * @brief ノンブロッキングで接続を始める（完了は exchange_rollout_frames が待つ）
+ */
+bool open_rollout_link(RolloutLink& link) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(link.port);
+    if (inet_pton(AF_INET, link.host.c_str(), &addr.sin_addr) <= 0) {
+        return false;
+    }
+    link.sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (link.sock < 0) {
+        return false;
+    }
+    int one = 1;
+    setsockopt(link.sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(link.sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+        link.close_link();
+        return false;
+    }
+    return true;
+}
+
+// 送れるところまで送る（残りは exchange_rollout_frames が送る）
+void send_rollout_frame_now(RolloutLink& link) {
+    if (link.sock < 0 || link.out_sent >= link.out.size()) {
+        return;
+    }
+    ssize_t sent = send(link.sock, link.out.data() + link.out_sent, link.out.size() - link.out_sent, MSG_NOSIGNAL);
+    if (sent > 0) {
+        link.out_sent += sent;
+    } else if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        link.close_link();
+    }
+}
+
+/**
+ * @brief 全ての接続で、フレームを送り切って応答を1つずつ受け取る
+ *
+ * 全ノードを1つのpollで同時に進めるため、かかる時間はノード数ではなく最も遅いノードで決まる。
+ * 期限までに応答しなかった相手や接続が切れた相手は replied が false のまま残る。
+ */
+void exchange_rollout_frames(std::vector<RolloutLink>& links, std::chrono::steady_clock::time_point deadline) {
+    std::vector<struct pollfd> fds;
+    std::vector<size_t> owners;
+    while (!g_shutdown_flag.load()) {
+        fds.clear();
+        owners.clear();
+        for (size_t i = 0; i < links.size(); i++) {
+            if (links[i].sock < 0 || links[i].replied) {
+                continue;
+            }
+            struct pollfd fd;
+            fd.fd = links[i].sock;
+            fd.events = links[i].out_sent < links[i].out.size() ? POLLOUT : POLLIN;
+            fd.revents = 0;
+            fds.push_back(fd);
+            owners.push_back(i);
+        }
+        int64_t remaining_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - std::chrono::steady_clock::now()).count();
+        if (fds.empty() || remaining_ms <= 0) {
+            break;
+        }
+        int ready = poll(fds.data(), fds.size(), (int)std::min<int64_t>(remaining_ms, 100));
+        if (ready < 0 && errno != EINTR) {
+            break;
+        }
+        for (size_t i = 0; ready > 0 && i < fds.size(); i++) {
+            RolloutLink& link = links[owners[i]];
+            if (fds[i].revents == 0) {
+                continue;
+            }
+            if (fds[i].events == POLLOUT) {
+                send_rollout_frame_now(link);
+                continue;
+            }
+            char buffer[4096];
+            ssize_t received = recv(link.sock, buffer, sizeof(buffer), 0);
+            if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                continue;
+            }
+            if (received <= 0) {
+                link.close_link();
+                continue;
+            }
+            link.in.append(buffer, received);
+            size_t header_end = link.in.find('\n');
+            if (header_end == std::string::npos) {
+                continue;
+            }
+            size_t length = strtoull(link.in.c_str(), nullptr, 10);
+            if (length > MAX_QUERY_MESSAGE_SIZE) {
+                link.close_link();
+            } else if (link.in.size() >= header_end + 1 + length) {
+                link.reply = link.in.substr(header_end + 1, length);
+                link.replied = true;
+            }
+        }
+    }
+}
+
+/**
+ * @brief 接続から次のフレームを1つ受け取る（預かった変更の決定を待つのに使う）
+ * @return 期限までに受け取れればtrue（接続が切れた場合や終了時はfalse）
+ */
+bool read_rollout_frame(int sock, std::chrono::steady_clock::time_point deadline, std::string& body) {
+    std::string received;
+    while (!g_shutdown_flag.load()) {
+        int64_t remaining_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - std::chrono::steady_clock::now()).count();
+        if (remaining_ms <= 0) {
+            return false;
+        }
+        struct pollfd fd;
+        fd.fd = sock;
+        fd.events = POLLIN;
+        fd.revents = 0;
+        int ready = poll(&fd, 1, (int)std::min<int64_t>(remaining_ms, 100));
+        if (ready < 0 && errno != EINTR) {
+            return false;
+        }
+        if (ready <= 0) {
+            continue;
+        }
+        char buffer[1024];
+        ssize_t n = recv(sock, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        received.append(buffer, n);
+        size_t header_end = received.find('\n');
+        if (header_end == std::string::npos) {
+            continue;
+        }
+        size_t length = strtoull(received.c_str(), nullptr, 10);
+        if (length > MAX_QUERY_MESSAGE_SIZE) {
+            return false;
+        }
+        if (received.size() >= header_end + 1 + length) {
+            body = received.substr(header_end + 1, length);
+            return true;
+        }
+    }
+    return false;
+}
+
+// 応答の1行目の最後の語（"!TX_NO ID BUSY" → "BUSY"、"!REJECTED RATE_LIMIT" → "RATE_LIMIT"）
+std::string rollout_reply_reason(const std::string& reply) {
+    std::string first_line = reply.substr(0, reply.find('\n'));
+    first_line.erase(first_line.find_last_not_of(" \r\t") + 1);
+    size_t space = first_line.rfind(' ');
+    return space == std::string::npos ? first_line : first_line.substr(space + 1);
+}
+
+/**
+ * @brief ロールアウトの調整役（coordinate）と参加者（participate）の両方を受け持つ
+ */
+class ConfigRollout {
+public:
+    ConfigRollout() : next_sequence_(1), rollouts_(0), committed_(0), aborted_(0), unconfirmed_(0),
+                      last_rollout_us_(0), prepared_(0), prepare_rejected_(0), participant_committed_(0),
+                      participant_aborted_(0), participant_timeouts_(0) {}
+
+    /**
+     * @brief 変更のまとまりを ROLLOUT_PEERS の全ノードと一斉に反映する
+     *
+     * ROLLOUT_PEERS が空か、他のノードへ送る項目が無ければ、このノードだけでコミットする。
+     * @param applied このノードで実際に反映された変更を受け取る（省略可）
+     * @param outcome "!TX_COMMITTED ID 版 ノード数" か "!TX_ABORTED ID 理由" を受け取る（省略可）
+     * @return このノードで値が変わった項目数、中止した場合は-1
+     */
+    int coordinate(const StagedChanges& staged, std::vector<ConfigChange>* applied, std::string* outcome) {
+        std::vector<std::pair<std::string, int>> peers = rollout_peers();
+        StagedChanges shared;
+        for (const auto& entry : staged) {
+            if (upper_case(entry.first.first) != "CONFIG_SYNC") {
+                shared.insert(entry);
+            }
+        }
+        if (peers.empty() || shared.empty()) {
+            int count = ConfigUpdateParser::commit_changes(staged, applied);
+            if (outcome != nullptr) {
+                *outcome = "!TX_COMMITTED - " + std::to_string(g_config_version.load()) + " 1";
+            }
+            return count;
+        }
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        int timeout_ms = std::max(10, get_config_int("CONFIG_SYNC", "ROLLOUT_TIMEOUT_MS", 500));
+        char txid[48];
+        snprintf(txid, sizeof(txid), "%x-%llu", g_node_id.load(), (unsigned long long)next_sequence_.fetch_add(1));
+        std::string prepare_body = "?TX_PREPARE " + std::string(txid) + " " + std::to_string(timeout_ms * 2) + "\n";
+        for (const auto& entry : shared) {
+            append_config_entry(prepare_body, entry.first.first, entry.first.second, entry.second);
+        }
+        std::string prepare_message = frame_message(prepare_body);
+
+        // 1. 準備: 全ノードへの接続と送信を先に始め、応答を待つ間に自分でも検証する
+        std::vector<RolloutLink> links(peers.size());
+        for (size_t i = 0; i < peers.size(); i++) {
+            links[i].host = peers[i].first;
+            links[i].port = peers[i].second;
+            links[i].expect(prepare_message);
+            open_rollout_link(links[i]);
+        }
+        std::string reason;
+        bool local_ok = prepare(txid, shared, reason);
+        std::string failure = local_ok ? std::string() : "local:" + reason;
+        if (local_ok) {
+            exchange_rollout_frames(links, start + std::chrono::milliseconds(timeout_ms));
+            for (const RolloutLink& link : links) {
+                if (!link.replied) {
+                    failure = link.name() + ":" + (link.sock < 0 ? "UNREACHABLE" : "TIMEOUT");
+                } else if (link.reply.compare(0, 7, "!TX_YES") != 0) {
+                    failure = link.name() + ":" + rollout_reply_reason(link.reply);
+                }
+                if (!failure.empty()) {
+                    break;
+                }
+            }
+        }
+
+        if (!failure.empty()) {
+            // 中止: 準備を送り終えた相手には知らせる（届かなくても、相手は接続が切れるか期限で中止する）
+            std::string abort_message = frame_message("?TX_ABORT " + std::string(txid) + "\n");
+            for (RolloutLink& link : links) {
+                if (link.sock >= 0 && link.out_sent == link.out.size()) {
+                    link.expect(abort_message);
+                    send_rollout_frame_now(link);
+                }
+                link.close_link();
+            }
+            if (local_ok) {
+                release(txid);
+            }
+            int64_t elapsed_us = finish(start, false, 0);
+            LOG_WARN("警告: ロールアウト %s を中止しました（%s、%d us）。", txid, failure, elapsed_us);
+            if (outcome != nullptr) {
+                *outcome = "!TX_ABORTED " + std::string(txid) + " " + failure;
+            }
+            return -1;
+        }
+
+        // 2. コミット: 全ノードへ決定を送ってから自分もコミットし、確認を待つ（1往復）
+        std::string commit_message = frame_message("?TX_COMMIT " + std::string(txid) + "\n");
+        for (RolloutLink& link : links) {
+            link.expect(commit_message);
+            send_rollout_frame_now(link);
+        }
+        std::vector<ConfigChange> changes;
+        int count = commit(txid, staged, &changes);
+        exchange_rollout_frames(links, std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms));
+        size_t unconfirmed = 0;
+        std::string missing;
+        for (RolloutLink& link : links) {
+            if (!link.replied || link.reply.compare(0, 13, "!TX_COMMITTED") != 0) {
+                unconfirmed++;
+                missing += " " + link.name();
+            }
+            link.close_link();
+        }
+        uint64_t version = count > 0 ? changes[0].version : g_config_version.load();
+        int64_t elapsed_us = finish(start, true, unconfirmed);
+        if (unconfirmed > 0) {
+            LOG_ERROR("エラー: ロールアウト %s のコミットを %d ノードが確認できませんでした:%s", txid, unconfirmed,
+                      missing);
+        }
+        LOG_INFO("ロールアウト %s をコミットしました（版 %d、%d ノード、%d 項目を変更、%d us）", txid, version,
+                 peers.size() + 1, count, elapsed_us);
+        if (outcome != nullptr) {
+            *outcome = "!TX_COMMITTED " + std::string(txid) + " " + std::to_string(version) + " " +
+                       std::to_string(peers.size() + 1 - unconfirmed);
+        }
+        if (applied != nullptr) {
+            applied->swap(changes);
+        }
+        return count;
+    }
+
+    /**
+     * @brief 他のノードからの ?TX_PREPARE に応え、同じ接続で決定を待って反映する
+     * @param request 問い合わせの本体（1行目に続けて [SECTION]KEY=VALUE 行）
+     * @param peer 相手のIPアドレス（準備を受け付けるのは ROLLOUT_PEERS の相手だけ）
+     */
+    void participate(int sock, const std::string& request, const std::string& peer, PeerTraffic& traffic) {
+        size_t first_line_end = std::min(request.find('\n'), request.size());
+        std::stringstream words(request.substr(0, first_line_end));
+        std::string command, txid;
+        int ttl_ms = 0;
+        words >> command >> txid >> ttl_ms;
+
+        bool known_peer = false;
+        for (const auto& rollout_peer : rollout_peers()) {
+            known_peer = known_peer || rollout_peer.first == peer;
+        }
+        std::string reply;
+        std::string reason;
+        ConfigUpdateParser parser;
+        if (!known_peer) {
+            LOG_WARN("警告: ロールアウトの相手ではない %s からの準備を拒否しました。", peer);
+            reply = "!REJECTED NOT_A_PEER\n";
+        } else if (!g_admission.try_admit_update(peer)) {
+            reply = "!REJECTED RATE_LIMIT\n";
+        } else if (txid.empty() || ttl_ms <= 0) {
+            reply = "!TX_NO - MALFORMED\n";
+        } else if (!parser.feed(request.data() + first_line_end, request.size() - first_line_end) ||
+                   !parser.finish()) {
+            reply = "!TX_NO " + txid + " MALFORMED\n";
+        } else {
+            if (!prepare(txid, parser.staged(), reason)) {
+                reply = "!TX_NO " + txid + " " + reason + "\n";
+            }
+        }
+        if (!reply.empty()) {
+            {
+                std::lock_guard<std::mutex> lock(stats_mutex_);
+                prepare_rejected_++;
+            }
+            LOG_DEBUG("%s からのロールアウト %s を拒否しました: %s", peer, txid, reply);
+            traffic.sent(send_message_on_existing_socket(sock, frame_message(reply)));
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(stats_mutex_);
+            prepared_++;
+        }
+        std::chrono::steady_clock::time_point deadline =
+            std::chrono::steady_clock::now() + std::chrono::milliseconds(std::min(ttl_ms, 60000));
+        traffic.sent(send_message_on_existing_socket(sock, frame_message("!TX_YES " + txid + "\n")));
+
+        // 決定を待つ。期限切れ・切断・?TX_ABORT はすべて中止
+        std::string decision;
+        bool received = read_rollout_frame(sock, deadline, decision);
+        if (received) {
+            traffic.received(decision.size());
+            traffic.message_received();
+        }
+        if (received && decision.compare(0, 11 + txid.size(), "?TX_COMMIT " + txid) == 0) {
+            std::vector<ConfigChange> changes;
+            int count = commit(txid, parser.staged(), &changes);
+            if (count > 0) {
+                // 他のノードから届いた変更もWPFに知らせる
+                g_outbound_sender.push_changes(changes);
+            }
+            uint64_t version = count > 0 ? changes[0].version : g_config_version.load();
+            traffic.sent(send_message_on_existing_socket(
+                sock, frame_message("!TX_COMMITTED " + txid + " " + std::to_string(version) + "\n")));
+            std::lock_guard<std::mutex> lock(stats_mutex_);
+            participant_committed_++;
+            return;
+        }
+        release(txid);
+        if (received) {
+            traffic.sent(send_message_on_existing_socket(sock, frame_message("!TX_ABORTED " + txid + "\n")));
+        } else {
+            LOG_WARN("警告: ロールアウト %s の決定が %s から届かないため中止しました。", txid, peer);
+        }
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        participant_aborted_++;
+        if (!received) {
+            participant_timeouts_++;
+        }
+    }
+
+    /**
+     * @brief 統計（"名前=値" の行）
+     */
+    std::string format_stats() {
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        return "rollouts=" + std::to_string(rollouts_) + "\n" +
+               "committed=" + std::to_string(committed_) + "\n" +
+               "aborted=" + std::to_string(aborted_) + "\n" +
+               "unconfirmed=" + std::to_string(unconfirmed_) + "\n" +
+               "last_rollout_us=" + std::to_string(last_rollout_us_) + "\n" +
+               "prepared=" + std::to_string(prepared_) + "\n" +
+               "prepare_rejected=" + std::to_string(prepare_rejected_) + "\n" +
+               "participant_committed=" + std::to_string(participant_committed_) + "\n" +
+               "participant_aborted=" + std::to_string(participant_aborted_) + "\n" +
+               "participant_timeouts=" + std::to_string(participant_timeouts_) + "\n";
+    }
+
+    void print_stats() {
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        if (rollouts_ == 0 && prepared_ == 0 && prepare_rejected_ == 0) {
+            return;
+        }
+        std::cout << "ロールアウト: 調整 " << rollouts_ << " 回（コミット " << committed_ << ", 中止 " << aborted_
+                  << ", 未確認のノード " << unconfirmed_ << "）, 参加 " << prepared_ << " 回（コミット "
+                  << participant_committed_ << ", 中止 " << participant_aborted_ << "（うち期限切れ "
+                  << participant_timeouts_ << "）, 拒否 " << prepare_rejected_ << "）\n";
+    }
+
+private:
+    /**
+     * @brief 検証して変更を預かる（預かれるのは一度に1つだけ）
+     * @param reason 拒否する理由を受け取る
+     */
+    bool prepare(const std::string& txid, const StagedChanges& staged, std::string& reason) {
+        {
+            SiteLockGuard lock(g_config_mutex, LOCK_SITE());
+            for (const auto& entry : staged) {
+                if (!validate_rollout_entry(entry.first.first, entry.first.second, entry.second, reason)) {
+                    return false;
+                }
+            }
+        }
+        std::lock_guard<std::mutex> lock(prepared_mutex_);
+        if (!prepared_txid_.empty()) {
+            reason = "BUSY";
+            return false;
+        }
+        prepared_txid_ = txid;
+        return true;
+    }
+
+    int commit(const std::string& txid, const StagedChanges& staged, std::vector<ConfigChange>* applied) {
+        int count = ConfigUpdateParser::commit_changes(staged, applied);
+        release(txid);
+        return count;
+    }
+
+    void release(const std::string& txid) {
+        std::lock_guard<std::mutex> lock(prepared_mutex_);
+        if (prepared_txid_ == txid) {
+            prepared_txid_.clear();
+        }
+    }
+
+    // 調整1回分の統計と計測を記録し、かかった時間（マイクロ秒）を返す
+    int64_t finish(std::chrono::steady_clock::time_point start, bool committed, size_t unconfirmed) {
+        int64_t elapsed_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        g_metrics.stage(STAGE_ROLLOUT).record(elapsed_ns);
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        rollouts_++;
+        if (committed) {
+            committed_++;
+        } else {
+            aborted_++;
+        }
+        unconfirmed_ += unconfirmed;
+        last_rollout_us_ = elapsed_ns / 1000;
+        return last_rollout_us_;
+    }
+
+    std::atomic<uint64_t> next_sequence_;
+    std::mutex prepared_mutex_;
+    std::string prepared_txid_;  // 預かっている変更のID（空なら何も預かっていない）
+    std::mutex stats_mutex_;
+    uint64_t rollouts_;
+    uint64_t committed_;
+    uint64_t aborted_;
+    uint64_t unconfirmed_;
+    int64_t last_rollout_us_;
+    uint64_t prepared_;
+    uint64_t prepare_rejected_;
+    uint64_t participant_committed_;
+    uint64_t participant_aborted_;
+    uint64_t participant_timeouts_;
+};
+
+ConfigRollout g_rollout;
+
+int rollout_config_changes(const StagedChanges& staged, std::vector<ConfigChange>* applied, std::string* outcome) {
+    return g_rollout.coordinate(staged, applied, outcome);
+}
+
+void serve_rollout_request(int sock, const std::string& request, const std::string& peer, PeerTraffic& traffic) {
+    if (request.compare(0, 11, "?TX_PREPARE") == 0) {
+        g_rollout.participate(sock, request, peer, traffic);
+        return;
+    }
+    std::string reply;
+    if (request.compare(0, 9, "?TX_STATS") == 0) {
+        reply = g_rollout.format_stats();
+    } else if (request.compare(0, 8, "?ROLLOUT") == 0) {
+        // ?ROLLOUT は更新なので、更新と同じレート制限を受ける
+        if (!g_admission.try_admit_update(peer)) {
+            LOG_WARN("警告: %s からのロールアウトを拒否しました（更新レート超過）。", peer);
+            reply = "!REJECTED RATE_LIMIT\n";
+        } else {
+            ConfigUpdateParser parser;
+            size_t first_line_end = std::min(request.find('\n'), request.size());
+            parser.feed(request.data() + first_line_end, request.size() - first_line_end);
+            parser.finish();
+            std::vector<ConfigChange> changes;
+            int count = rollout_config_changes(parser.staged(), &changes, &reply);
+            if (count > 0) {
+                g_outbound_sender.push_changes(changes);
+            }
+            reply += "\n";
+        }
     } else {
-        std::cout << "設定を送信しました（" << total_sent << " バイト）\n";
+        // 準備と別の接続で届いた決定は受け付けない（預かった側は準備の接続で決定を待つ）
+        std::string command, txid;
+        std::stringstream(request.substr(0, request.find('\n'))) >> command >> txid;
+        reply = "!TX_UNKNOWN " + txid + "\n";
     }
-    
-    close(sock);
-    std::cout << "接続を閉じました。\n";
+    traffic.sent(send_message_on_existing_socket(sock, frame_message(reply)));
 }
 
 /**
- * @brief WPFからの設定更新を待ち受けるサーバーとして動作する (別スレッドで実行)
+ * @brief Prometheusのラベル値をエスケープする
  */
-void handle_client_connection(int client_sock, const std::string& config_path); // プロトタイプ宣言
-void save_config(const std::string& filename); // プロトタイプ宣言を追加
-
-void receive_config_updates(const std::string& config_path) {
-    std::string port_str = get_config_value("CONFIG_SYNC", "CPP_RECV_PORT", "12348");
-
-    int port;
-    try {
-        port = std::stoi(port_str);
-        if (port <= 0 || port > 65535) {
-            throw std::out_of_range("ポート番号が範囲外です");
+std::string escape_label_value(const std::string& value) {
+    std::string escaped;
+    for (char c : value) {
+        if (c == '\\' || c == '"') {
+            escaped += '\\';
+            escaped += c;
+        } else if (c == '\n') {
+            escaped += "\\n";
+        } else {
+            escaped += c;
         }
-    } catch (const std::exception& e) {
-        std::cerr << "エラー: 不正なポート番号: " << port_str << " (" << e.what() << ")" << std::endl;
-        return;
-    }
-
-    int listen_sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (listen_sock < 0) {
-        std::cerr << "エラー: 受信用ソケットを作成できませんでした。 " << strerror(errno) << std::endl;
-        return;
     }
+    return escaped;
+}
 
-    // ソケットオプション設定（アドレス再利用）
-    int opt = 1;
-    if (setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-        std::cerr << "エラー: SO_REUSEADDRの設定に失敗しました。 " << strerror(errno) << std::endl;
+/**
+ * @brief ヒストグラムを秒単位のsummaryとして書き出す
+ */
+void append_latency_summary(std::stringstream& out, const std::string& name, const std::string& labels,
+                            const LatencyHistogram& histogram) {
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    std::string separator = labels.empty() ? "" : ",";
+    for (double q : quantiles) {
+        out << name << "{" << labels << separator << "quantile=\"" << q << "\"} "
+            << histogram.quantile_ns(q) / 1e9 << "\n";
     }
+    std::string braces = labels.empty() ? "" : "{" + labels + "}";
+    out << name << "_sum" << braces << " " << histogram.sum_ns() / 1e9 << "\n";
+    out << name << "_count" << braces << " " << histogram.count() << "\n";
+}
 
-    struct sockaddr_in server_addr;
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(port);
+/**
+ * @brief 計測値をPrometheusのテキスト形式（version 0.0.4）で整形する
+ */
+std::string format_metrics() {
+    std::stringstream out;
+    out.precision(9);
 
-    if (bind(listen_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        std::cerr << "エラー: ポート " << port << " にバインドできませんでした。 " << strerror(errno) << std::endl;
-        close(listen_sock);
-        return;
+    out << "# HELP configsync_stage_duration_seconds 処理段階ごとの所要時間\n";
+    out << "# TYPE configsync_stage_duration_seconds summary\n";
+    for (int stage = 0; stage < STAGE_COUNT; ++stage) {
+        append_latency_summary(out, "configsync_stage_duration_seconds",
+                               std::string("stage=\"") + Metrics::stage_name(stage) + "\"",
+                               g_metrics.stage((MetricStage)stage));
     }
-
-    if (listen(listen_sock, 5) < 0) {
-        std::cerr << "エラー: listenに失敗しました。 " << strerror(errno) << std::endl;
-        close(listen_sock);
-        return;
+    out << "# HELP configsync_stage_duration_max_seconds 処理段階ごとの最大所要時間\n";
+    out << "# TYPE configsync_stage_duration_max_seconds gauge\n";
+    for (int stage = 0; stage < STAGE_COUNT; ++stage) {
+        out << "configsync_stage_duration_max_seconds{stage=\"" << Metrics::stage_name(stage) << "\"} "
+            << g_metrics.stage((MetricStage)stage).max_ns() / 1e9 << "\n";
     }
 
-    std::cout << "ポート " << port << " でWPFからの設定更新を待機しています...\n";
+    out << "# HELP configsync_config_lock_wait_seconds 設定ロックの待ち時間（競合したときのみ）\n";
+    out << "# TYPE configsync_config_lock_wait_seconds summary\n";
+    append_latency_summary(out, "configsync_config_lock_wait_seconds", "", g_config_mutex.wait_histogram());
+    out << "# HELP configsync_config_lock_acquisitions_total 設定ロックの取得回数\n";
+    out << "# TYPE configsync_config_lock_acquisitions_total counter\n";
+    out << "configsync_config_lock_acquisitions_total " << g_config_mutex.acquisitions() << "\n";
+    out << "# HELP configsync_config_lock_contended_total 設定ロックで待たされた回数\n";
+    out << "# TYPE configsync_config_lock_contended_total counter\n";
+    out << "configsync_config_lock_contended_total " << g_config_mutex.contended() << "\n";
 
-    while (!g_shutdown_flag.load()) {
-        fd_set readfds;
-        FD_ZERO(&readfds);
-        FD_SET(listen_sock, &readfds);
-        
-        struct timeval timeout;
-        timeout.tv_sec = 1;
-        timeout.tv_usec = 0;
-        
-        int activity = select(listen_sock + 1, &readfds, nullptr, nullptr, &timeout);
-        
-        if (activity < 0) {
-            if (errno != EINTR) {
-                std::cerr << "エラー: selectに失敗しました。 " << strerror(errno) << std::endl;
-            }
-            break;
-        }
-        
-        if (activity == 0) {
-            // タイムアウト、継続
-            continue;
+    std::map<std::string, Metrics::PeerCounters> peers = g_metrics.peers();
+    const char* const peer_metrics[][2] = {
+        {"configsync_peer_received_bytes_total", "接続相手から受信したバイト数"},
+        {"configsync_peer_sent_bytes_total", "接続相手へ送信したバイト数"},
+        {"configsync_peer_received_messages_total", "接続相手から受信したメッセージ数"},
+        {"configsync_peer_sent_messages_total", "接続相手へ送信したメッセージ数"},
+    };
+    for (int i = 0; i < 4; ++i) {
+        out << "# HELP " << peer_metrics[i][0] << " " << peer_metrics[i][1] << "\n";
+        out << "# TYPE " << peer_metrics[i][0] << " counter\n";
+        for (const auto& peer : peers) {
+            const Metrics::PeerCounters& c = peer.second;
+            uint64_t value = (i == 0) ? c.bytes_received : (i == 1) ? c.bytes_sent
+                           : (i == 2) ? c.messages_received : c.messages_sent;
+            out << peer_metrics[i][0] << "{peer=\"" << escape_label_value(peer.first) << "\"} " << value << "\n";
         }
-        
-        if (FD_ISSET(listen_sock, &readfds)) {
-            struct sockaddr_in client_addr;
-            socklen_t client_len = sizeof(client_addr);
-            int client_sock = accept(listen_sock, (struct sockaddr*)&client_addr, &client_len);
-            
-            if (client_sock < 0) {
-                if (!g_shutdown_flag.load()) {
-                    std::cerr << "エラー: acceptに失敗しました。 " << strerror(errno) << std::endl;
-                }
-                continue;
-            }
-
-            char client_ip[INET_ADDRSTRLEN];
-            inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
-            std::cout << "クライアント " << client_ip << ":" << ntohs(client_addr.sin_port) << " から接続を受信しました。\n";
+    }
 
-            // 接続処理を別関数に委譲
-            handle_client_connection(client_sock, config_path);
+    // ストアの使用メモリ（文字列の確保量とmapのノードの概算）
+    size_t store_bytes = 0;
+    size_t store_keys = 0;
+    {
+        SiteLockGuard lock(g_config_mutex, LOCK_SITE());
+        const size_t node_overhead = 4 * sizeof(void*);
+        for (const auto& section_pair : g_config_data) {
+            store_bytes += node_overhead + sizeof(section_pair) + section_pair.first.capacity();
+            for (const auto& key_value_pair : section_pair.second) {
+                store_bytes += node_overhead + sizeof(key_value_pair) + key_value_pair.first.capacity() +
+                               key_value_pair.second.capacity();
+                store_keys++;
+            }
         }
     }
+    out << "# HELP configsync_store_bytes 設定ストアの使用メモリ（概算）\n";
+    out << "# TYPE configsync_store_bytes gauge\n";
+    out << "configsync_store_bytes " << store_bytes << "\n";
+    out << "# HELP configsync_store_keys 設定ストアの項目数\n";
+    out << "# TYPE configsync_store_keys gauge\n";
+    out << "configsync_store_keys " << store_keys << "\n";
+    out << "# HELP configsync_config_version 現在の設定バージョン\n";
+    out << "# TYPE configsync_config_version gauge\n";
+    out << "configsync_config_version " << g_config_version.load() << "\n";
 
-    close(listen_sock);
-    std::cout << "設定更新受信スレッドを終了しました。\n";
+    long pages_total = 0;
+    long pages_resident = 0;
+    std::ifstream statm("/proc/self/statm");
+    if (statm >> pages_total >> pages_resident) {
+        out << "# HELP process_resident_memory_bytes プロセスの常駐メモリ\n";
+        out << "# TYPE process_resident_memory_bytes gauge\n";
+        out << "process_resident_memory_bytes " << pages_resident * sysconf(_SC_PAGESIZE) << "\n";
+    }
+    return out.str();
 }
 
 /**
- * @brief 既存のソケットを通じて現在の設定を送信する
- * @param sock 既に接続済みのクライアントソケット
+ * @brief 設定ロックの呼び出し元ごとの統計を、他を待たせた時間の長い順に整形する
+ *
+ * 「待たせ」はその呼び出し元が保持している間に他のスレッドが待った時間の合計で、
+ * 読み手を止めている経路を直接示す。同じなら保持時間の合計の長い順。
  */
-void send_config_on_existing_socket(int sock) {
-    std::string config_str = serialize_config();
-    
-    ssize_t total_sent = 0;
-    const char* data_ptr = config_str.c_str();
-    size_t data_len = config_str.length();
+std::string format_lock_profile() {
+    std::vector<const LockSite*> sites;
+    for (const LockSite* site = LockSite::head().load(); site != nullptr; site = site->next()) {
+        sites.push_back(site);
+    }
+    std::sort(sites.begin(), sites.end(), [](const LockSite* a, const LockSite* b) {
+        if (a->caused_wait_ns() != b->caused_wait_ns()) {
+            return a->caused_wait_ns() > b->caused_wait_ns();
+        }
+        return a->hold_histogram().sum_ns() > b->hold_histogram().sum_ns();
+    });
 
-    // handle_client_connectionではノンブロッキングに設定していないため、sendはブロックするはず
-    while (total_sent < (ssize_t)data_len && !g_shutdown_flag.load()) {
-        ssize_t bytes_sent = send(sock, data_ptr + total_sent, data_len - total_sent, 0);
-        if (bytes_sent < 0) {
-            // EAGAIN/EWOULDBLOCKはブロッキングソケットでは通常発生しないが、念のため
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                std::this_thread::sleep_for(std::chrono::milliseconds(10));
-                continue;
-            }
-            std::cerr << "エラー: 設定の返信に失敗しました。 " << strerror(errno) << std::endl;
-            return;
+    std::stringstream out;
+    out << "計測: " << (g_lock_profiling.load() ? "有効" : "無効")
+        << "（全体: 取得 " << g_config_mutex.acquisitions() << " 回, 競合 " << g_config_mutex.contended() << " 回）\n";
+    out << std::fixed;
+    int rank = 0;
+    for (const LockSite* site : sites) {
+        if (site->acquisitions() == 0) {
+            continue;
         }
-        total_sent += bytes_sent;
+        const LatencyHistogram& wait = site->wait_histogram();
+        const LatencyHistogram& hold = site->hold_histogram();
+        out << ++rank << ". " << site->function() << ":" << site->line() << "\n";
+        out.precision(3);
+        out << "     取得 " << site->acquisitions() << " 回, 競合 " << site->contended() << " 回, 他を待たせた時間 "
+            << site->caused_wait_ns() / 1e6 << " ms\n";
+        out << "     待ち 合計 " << wait.sum_ns() / 1e6 << " ms / 最大 ";
+        out.precision(1);
+        out << wait.max_ns() / 1e3 << " us";
+        out.precision(3);
+        out << ", 保持 合計 " << hold.sum_ns() / 1e6 << " ms / p99 ";
+        out.precision(1);
+        out << hold.quantile_ns(0.99) / 1e3 << " us / 最大 " << hold.max_ns() / 1e3 << " us\n";
     }
+    return out.str();
+}
 
-    if (g_shutdown_flag.load()) {
-        std::cout << "設定の返信がキャンセルされました。\n";
-    } else {
-        std::cout << "設定を返信しました（" << total_sent << " バイト）\n";
+/**
+ * @brief 呼び出し元ごとの統計を消す（変更の前後を比べるときに使う）
+ */
+void reset_lock_profile() {
+    for (LockSite* site = LockSite::head().load(); site != nullptr; site = site->next()) {
+        site->reset();
     }
 }
 
+// メトリクスの1件の応答（リクエストの読み込みと応答の送信を合わせて）にかける時間の上限
+const int METRICS_REQUEST_DEADLINE_MS = 1000;
+
 /**
- * @brief クライアントからの接続を処理し、完全なメッセージを受信する (改良版)
- * @param client_sock クライアントのソケットディスクリプタ
+ * @brief 期限までにソケットが読み書きできるようになるのを待つ
+ * @return 読み書きできるようになればtrue（期限切れ・エラーならfalse）
  */
-void handle_client_connection(int client_sock, const std::string& config_path) {
-    // クライアントソケットにもタイムアウトを設定
-    struct timeval timeout;
-    timeout.tv_sec = 10;  // 受信用は少し長めに設定
-    timeout.tv_usec = 0;
-    setsockopt(client_sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+static bool wait_metrics_socket(int sock, short events, std::chrono::steady_clock::time_point deadline) {
+    while (true) {
+        long long remaining_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                     deadline - std::chrono::steady_clock::now()).count();
+        if (remaining_ms <= 0) {
+            return false;
+        }
+        struct pollfd pfd;
+        pfd.fd = sock;
+        pfd.events = events;
+        pfd.revents = 0;
+        int ready = poll(&pfd, 1, (int)remaining_ms);
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+        return ready > 0;
+    }
+}
 
-    try {
-        // 1. ヘッダー（メッセージ長）を改行まで読み込む
-        std::string header;
-        char c;
-        int header_read_count = 0;
-        const int MAX_HEADER_LENGTH = 20; // ヘッダーの最大長を制限
+/**
+ * @brief メトリクス用ポートへのHTTPリクエストに応答する（GET /metrics のみ）
+ *
+ * 少しずつしか送ってこない・受け取らない相手で止まらないよう、読み込みと送信の全体に
+ * METRICS_REQUEST_DEADLINE_MS の期限を付ける。
+ */
+void serve_metrics_request(int sock) {
+    std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::now() + std::chrono::milliseconds(METRICS_REQUEST_DEADLINE_MS);
+    set_socket_non_blocking(sock, true);
 
-        while (recv(client_sock, &c, 1, 0) > 0 && !g_shutdown_flag.load()) {
-            if (c == '\n') {
-                break;
-            }
-            header += c;
-            header_read_count++;
-            
-            // 異常に長いヘッダーを防ぐ
-            if (header_read_count > MAX_HEADER_LENGTH) {
-                std::cerr << "エラー: ヘッダーが長すぎます。\n";
-                close(client_sock);
-                return;
-            }
+    std::string request;
+    char buffer[1024];
+    while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192) {
+        if (!wait_metrics_socket(sock, POLLIN, deadline)) {
+            break;
         }
-
-        if (header.empty() || g_shutdown_flag.load()) {
-            close(client_sock);
-            return;
+        ssize_t n = recv(sock, buffer, sizeof(buffer), 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            continue;
         }
-
-        // 2. メッセージ長をパースし、その長さのデータを受信する
-        size_t expected_length = std::stoull(header);
-        
-        // 0バイトデータは「設定要求」として扱う
-        if (expected_length == 0) {
-            std::cout << "\nWPFから設定要求（0バイト）を受信しました。現在の設定を返信します。\n";
-            send_config_on_existing_socket(client_sock);
-            close(client_sock);
-            return;
+        if (n <= 0) {
+            break;
         }
+        request.append(buffer, n);
+    }
 
-        // 異常に大きなメッセージサイズを防ぐ
-        const size_t MAX_MESSAGE_SIZE = 1024 * 1024; // 1MB
-        if (expected_length > MAX_MESSAGE_SIZE) {
-            std::cerr << "エラー: メッセージサイズが大きすぎます: " << expected_length << " bytes\n";
-            close(client_sock);
-            return;
+    std::string status = "200 OK";
+    std::string body;
+    if (request.compare(0, 13, "GET /metrics ") == 0 || request.compare(0, 6, "GET / ") == 0) {
+        body = format_metrics();
+    } else {
+        status = "404 Not Found";
+        body = "not found\n";
+    }
+    std::string response = "HTTP/1.0 " + status + "\r\n"
+                           "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                           "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                           "Connection: close\r\n\r\n" + body;
+    size_t sent = 0;
+    while (sent < response.size()) {
+        if (!wait_metrics_socket(sock, POLLOUT, deadline)) {
+            LOG_WARN("警告: メトリクスの応答を期限内に送り終えられませんでした（%d / %d バイト）", sent,
+                     response.size());
+            break;
         }
-        
-        std::string received_data;
-        received_data.reserve(expected_length);
-        
-        std::vector<char> buffer(4096);
-        size_t total_received = 0;
-
-        while (total_received < expected_length && !g_shutdown_flag.load()) {
-            size_t to_read = std::min(buffer.size(), expected_length - total_received);
-            ssize_t bytes_received = recv(client_sock, buffer.data(), to_read, 0);
-            
-            if (bytes_received <= 0) {
-                if (bytes_received == 0) {
-                    std::cerr << "エラー: クライアントが接続を閉じました。" << std::endl;
-                } else {
-                    std::cerr << "エラー: データ受信中にエラーが発生しました: " << strerror(errno) << std::endl;
-                }
-                close(client_sock);
-                return;
-            }
-            
-            received_data.append(buffer.data(), bytes_received);
-            total_received += bytes_received;
+        ssize_t n = send(sock, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            continue;
         }
-        
-        if (!g_shutdown_flag.load()) {
-            std::cout << "\nWPFから設定データを受信しました（" << total_received << " バイト）\n";
-            update_config_from_string(received_data);
-            save_config(config_path); // ★変更点: 受信後すぐにファイルに保存
+        if (n <= 0) {
+            break;
         }
-        
-    } catch (const std::exception& e) {
-        std::cerr << "エラー: クライアント接続処理中に例外が発生しました: " << e.what() << std::endl;
+        sent += n;
     }
-    
-    close(client_sock);
+    close(sock);
 }
 
 /**
- * @brief 設定ファイルに現在の設定を保存する (改良版)
- * @param filename 保存先ファイル名
+ * @brief メトリクス用ポートで接続を受け付け、1件ずつ応答する（専用スレッドで動く）
+ * @param listen_sock メトリクス用の待ち受けソケット
  */
-void save_config(const std::string& filename) {
-    std::lock_guard<std::mutex> lock(g_config_mutex);
-    
-    // バックアップファイルを作成
-    std::string backup_filename = filename + ".backup";
-    std::ifstream original(filename);
-    if (original.good()) {
-        std::ofstream backup(backup_filename);
-        backup << original.rdbuf();
-        original.close();
-        backup.close();
-        std::cout << "バックアップファイルを作成しました: " << backup_filename << "\n";
-    }
-    
-    std::ofstream file(filename);
-    if (!file.is_open()) {
-        std::cerr << "エラー: 設定ファイル " << filename << " を書き込み用に開けませんでした。\n";
-        return;
-    }
-
-    // コメントヘッダーを追加
-    file << "# Navigator C++制御アプリケーションの設定ファイル\n";
-    file << "# ConfigSynchronizerによって自動生成されました\n";
-    file << "# 生成日時: " << std::chrono::duration_cast<std::chrono::seconds>(
-        std::chrono::system_clock::now().time_since_epoch()).count() << "\n\n";
-
-    for (const auto& section_pair : g_config_data) {
-        file << "[" << section_pair.first << "]\n";
-        for (const auto& key_value_pair : section_pair.second) {
-            file << key_value_pair.first << "=" << key_value_pair.second << "\n";
+void run_metrics_listener(int listen_sock) {
+    while (!g_shutdown_flag.load()) {
+        struct pollfd pfd;
+        pfd.fd = listen_sock;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 500) <= 0) {
+            continue;
+        }
+        int client_sock = accept4(listen_sock, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client_sock >= 0) {
+            serve_metrics_request(client_sock);
         }
-        file << "\n";
     }
-    
-    file.close();
-    std::cout << "設定を " << filename << " に保存しました。\n";
 }
 
 /**
  * @brief 現在の設定を表示する (改良版)
  */
 void print_current_config() {
-    std::lock_guard<std::mutex> lock(g_config_mutex);
+    SiteLockGuard lock(g_config_mutex, LOCK_SITE());
     std::cout << "\n=== 現在の設定 ===\n";
     
     // セクション名をソートして表示
@@ -664,7 +6716,7 @@ void print_current_config() {
  * @brief 設定統計情報を表示する
  */
 void print_config_stats() {
-    std::lock_guard<std::mutex> lock(g_config_mutex);
+    SiteLockGuard lock(g_config_mutex, LOCK_SITE());
     std::cout << "\n=== 設定統計情報 ===\n";
     std::cout << "セクション数: " << g_config_data.size() << "\n";
     
@@ -675,13 +6727,110 @@ void print_config_stats() {
     }
     
     std::cout << "総キー数: " << total_keys << "\n";
+    std::cout << "設定バージョン: " << g_config_version.load() << "\n";
+    // 各部の統計はそれぞれのロックで守られ、そのロックを持ったまま設定を読む部分もあるため、
+    // ロックの順序が逆にならないよう設定のロックを放してから表示する
+    lock.unlock();
+    std::cout << "WPF接続状態: " << (g_outbound_sender.peer_alive() ? "応答あり" : "切断") << "\n";
+    {
+        std::lock_guard<std::mutex> rtt_lock(g_peer_rtt_mutex);
+        for (const auto& peer : g_peer_rtt) {
+            std::cout << "  RTT " << peer.first << ": " << peer.second.describe() << "\n";
+        }
+    }
+    g_admission.print_stats();
+    g_outbound_sender.print_push_stats();
+    g_replicator.print_stats();
+    g_rollout.print_stats();
+    g_persistence_writer.print_stats();
+    {
+        std::lock_guard<std::mutex> save_lock(g_save_mutex);
+        g_backup_ring.print_stats(g_config_path);
+    }
     std::cout << "================\n\n";
 }
 
+// 受信スレッド（start_config_server で開始する）
+std::thread g_receiver_thread;
+
+bool start_config_server(const std::string& config_path) {
+    g_logger.start();
+    g_shutdown_flag.store(false);
+
+    // 初期設定をファイルから読み込み、ジャーナルの続きを再生する
+    if (!load_config(config_path)) {
+        return false;
+    }
+    // 同じソケットで別のインスタンスが動いていれば起動しない
+    // （そのソケットを消して乗っ取ったり、同じジャーナルや設定ファイルを書き換えたりしないように）
+    std::string uds_path = get_config_value("CONFIG_SYNC", "UDS_PATH", "/tmp/config_sync.sock");
+    if (!uds_path.empty() && unix_socket_in_use(uds_path)) {
+        std::cerr << "エラー: " << uds_path << " で別のインスタンスが動作しています。起動を中止します。" << std::endl;
+        return false;
+    }
+    g_config_path = config_path;
+    if (journal_enabled()) {
+        replay_config_journal(config_path);
+    }
+    g_lock_profiling.store(get_config_int("CONFIG_SYNC", "LOCK_PROFILE", 0) != 0);
+    load_config_presets(config_path);
+
+    // レプリケーションで書き込み元を区別するノード番号（未設定ならホスト名と待ち受けポートから作る）
+    std::string node_name = get_config_value("CONFIG_SYNC", "NODE_ID", "");
+    if (node_name.empty()) {
+        char hostname[256] = {0};
+        gethostname(hostname, sizeof(hostname) - 1);
+        node_name = std::string(hostname) + ":" + get_config_value("CONFIG_SYNC", "CPP_RECV_PORT", "12348");
+    }
+    g_node_id.store(std::max<uint32_t>(1, (uint32_t)fnv1a64(node_name)));
+
+    // 設定ファイルへの保存を受け持つ書き込みスレッドを開始
+    g_persistence_writer.start(config_path);
+
+    // 外向きの送信を受け持つスレッドを開始
+    if (!g_outbound_sender.start()) {
+        g_persistence_writer.stop();
+        return false;
+    }
+
+    // WPFからの設定更新を待ち受けるスレッドを開始
+    g_receiver_thread = std::thread(receive_config_updates);
+
+    // 他のノードとの突き合わせ（REPLICATION_PEERS が空なら何もしない）
+    g_replicator.start();
+    return true;
+}
+
+void stop_config_server() {
+    g_shutdown_flag.store(true);
+    g_change_feed.wake_all();
+
+    if (g_receiver_thread.joinable()) {
+        std::cout << "受信スレッドの終了を待機中...\n";
+        g_receiver_thread.join();
+    }
+
+    g_replicator.stop();
+
+    std::cout << "送信スレッドの終了を待機中...\n";
+    g_outbound_sender.stop();
+
+    std::cout << "保存待ちの変更を書き出しています...\n";
+    g_persistence_writer.stop();
+    g_logger.stop();
+}
+
+uint64_t get_config_version() {
+    return g_config_version.load();
+}
+
+// ベンチマーク（tools/config_bench.cpp）はこのファイルを取り込むため、main()を除外できるようにする
+#ifndef CONFIGSYNC_NO_MAIN
 int main(int argc, char* argv[]) {
     // シグナルハンドラーを設定
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
+    g_logger.start();
     
     std::cout << "ConfigSynchronizer - Navigator制御システム設定同期ツール\n";
     std::cout << "============================================================\n";
@@ -694,17 +6843,14 @@ int main(int argc, char* argv[]) {
 
     std::cout << "設定ファイル: " << config_path << "\n\n";
 
-    // 初期設定をファイルから読み込む
-    if (!load_config(config_path)) {
+    // 設定を読み込み、保存・送信・受信の各スレッドを開始する
+    if (!start_config_server(config_path)) {
         return 1;
     }
 
     // 読み込んだ設定の統計を表示
     print_config_stats();
 
-    // WPFからの設定更新を待ち受けるスレッドを開始
-    std::thread receiver_thread(receive_config_updates, config_path);
-
     // 少し待ってから、最初の設定をWPFに送信
     std::this_thread::sleep_for(std::chrono::seconds(1));
     send_config_to_wpf();
@@ -716,6 +6862,11 @@ int main(int argc, char* argv[]) {
     std::cout << "  t: 設定統計を表示\n";
     std::cout << "  w: 現在の設定を " << config_path << " に上書き保存\n";
     std::cout << "  r: 設定ファイルを再読み込み\n";
+    std::cout << "  h: 変更履歴を表示\n";
+    std::cout << "  b: バックアップの版を一覧表示（b 版番号 でその版に戻す）\n";
+    std::cout << "  m: メトリクスを表示\n";
+    std::cout << "  l: 設定ロックの呼び出し元別統計を表示（l on / l off / l reset）\n";
+    std::cout << "  p: プリセットを一覧表示（p 名前 でそのプリセットを適用）\n";
     std::cout << "  q: 終了\n\n";
 
     // メインスレッドでは、他の処理を実行できる
@@ -734,15 +6885,69 @@ int main(int argc, char* argv[]) {
             print_current_config();
         } else if (line == "t") {
             print_config_stats();
+        } else if (line == "h") {
+            std::string history = format_config_history("", 20);
+            std::cout << "\n=== 変更履歴（新しい20件まで） ===\n" << (history.empty() ? "（履歴なし）\n" : history)
+                      << "==================\n\n";
+        } else if (line == "m") {
+            std::cout << "\n=== メトリクス ===\n" << format_metrics() << "==================\n\n";
+        } else if (line == "l") {
+            std::cout << "\n=== 設定ロック（他を待たせた時間の長い順） ===\n" << format_lock_profile()
+                      << "==================\n\n";
+        } else if (line == "l on" || line == "l off") {
+            g_lock_profiling.store(line == "l on");
+            std::cout << "ロックの呼び出し元別計測を" << (line == "l on" ? "有効" : "無効") << "にしました。\n";
+        } else if (line == "l reset") {
+            reset_lock_profile();
+            std::cout << "ロックの呼び出し元別統計を消去しました。\n";
+        } else if (line == "p") {
+            std::string presets = format_config_presets();
+            std::cout << "\n=== プリセット（名前・項目数） ===\n" << (presets.empty() ? "（プリセットなし）\n" : presets)
+                      << "==================\n\n";
+        } else if (line.compare(0, 2, "p ") == 0) {
+            std::string name = line.substr(2);
+            uint64_t version = 0;
+            int changed = activate_config_preset(name, version);
+            if (changed == -1) {
+                std::cout << "プリセット " << name << " はありません。\n";
+            } else if (changed < 0) {
+                std::cout << "プリセット " << name << " はロールアウトが中止されたため適用しませんでした。\n";
+            } else {
+                std::cout << "プリセット " << name << " を適用しました（版 " << version << "、" << changed
+                          << " 項目を変更）。\n";
+            }
+        } else if (line == "b") {
+            std::string backups = format_config_backups();
+            std::cout << "\n=== バックアップ（古い順） ===\n" << (backups.empty() ? "（バックアップなし）\n" : backups)
+                      << "==================\n\n";
+        } else if (line.compare(0, 2, "b ") == 0) {
+            uint64_t version = std::strtoull(line.c_str() + 2, nullptr, 10);
+            std::vector<ConfigChange> changes;
+            int restored = restore_config_backup(version, &changes);
+            if (restored < 0) {
+                std::cout << "版 " << version << " はバックアップにありません。\n";
+            } else {
+                std::cout << "版 " << version << " に戻しました（" << restored << " 項目を変更）。\n";
+                if (restored > 0) {
+                    g_outbound_sender.push_changes(changes);
+                }
+            }
         } else if (line == "w") {
-            save_config(config_path);
+            // 書き込みスレッド経由で設定ファイルを書き直し、ディスクに書かれるまで待つ
+            uint64_t ticket = request_config_compaction();
+            if (!wait_config_compacted(ticket, -1)) {
+                std::cout << "設定の保存に失敗しました。\n";
+            }
         } else if (line == "r") {
             std::cout << "設定ファイルを再読み込みしています...\n";
             if (load_config(config_path)) {
+                // 再読み込みした内容を基準にし、古いジャーナルが再生されないようにする
+                request_config_compaction();
+                load_config_presets(config_path);
                 std::cout << "設定ファイルの再読み込みが完了しました。\n";
                 print_config_stats();
-                // 再読み込み後、WPFに更新された設定を送信
-                send_config_to_wpf();
+                // 再読み込み後、WPFに更新された設定を送信（連続した再読み込みはまとめて送る）
+                g_outbound_sender.push_full();
             } else {
                 std::cout << "設定ファイルの再読み込みに失敗しました。\n";
             }
@@ -754,13 +6959,9 @@ int main(int argc, char* argv[]) {
 
     // 終了処理
     std::cout << "\n終了処理中...\n";
-    g_shutdown_flag.store(true);
-    
-    if (receiver_thread.joinable()) {
-        std::cout << "受信スレッドの終了を待機中...\n";
-        receiver_thread.join();
-    }
+    stop_config_server();
 
     std::cout << "プログラムを終了します。\n";
     return 0;
-}
\ No newline at end of file
+}
+#endif // CONFIGSYNC_NO_MAIN
@@ -0,0 +1,49 @@
+// configsync.h - 設定同期サーバー（libconfigsync）の公開インターフェース
+//
+// ConfigSynchronizer.cpp を main() 抜き（-DCONFIGSYNC_NO_MAIN）でビルドしたものが
+// libconfigsync.a / libconfigsync.so になる。別のプロセスにサーバーを組み込む場合に使う。
+// 設定を読むだけのプロセスは、サーバーに接続して手元に写しを持つ
+// クライアントSDK（configsync_client.h）を使う。
+//
+// ビルド方法:
+// make lib
+
+#ifndef CONFIGSYNC_H
+#define CONFIGSYNC_H
+
+#include <string>
+#include <stdint.h>
+
+/**
+ * @brief 設定ファイルを読み込み、保存・送信・受信の各スレッドを開始する
+ * @param config_path config.iniのパス
+ * @return 開始できた場合はtrue
+ */
+bool start_config_server(const std::string& config_path);
+
+/**
+ * @brief 受信・送信・保存の各スレッドを止める（保存待ちの変更は書き出してから戻る）
+ */
+void stop_config_server();
+
+bool load_config(const std::string& filename);
+std::string get_config_value(const std::string& section, const std::string& key, const std::string& default_value = "");
+int get_config_int(const std::string& section, const std::string& key, int default_value);
+
+/**
+ * @brief 設定値を1項目変更する（受信した更新と同じく、ROLLOUT_PEERS があれば全ノードへ一斉に反映する）
+ * @return 値が変わった場合は1、同じ値なら0、ロールアウトが中止されて反映されなかった場合は-1
+ */
+int set_config_value(const std::string& section, const std::string& key, const std::string& value);
+
+int update_config_from_string(const std::string& data);
+std::string serialize_config();
+std::string query_config(const std::string& request);
+void save_config(const std::string& filename);
+
+/**
+ * @brief 現在の設定の版（変更がコミットされるたびに増える）
+ */
+uint64_t get_config_version();
+
+#endif // CONFIGSYNC_H
@@ -0,0 +1,659 @@
+// configsync_client.cpp - 設定同期サーバーのクライアントSDKの実装
+//
+// 購読スレッドがサーバーから "<長さ>\n<本体>" のフレームを受け取り、
+// "!SNAPSHOT 版"（設定全体）または "!CHANGED 版"（変わった項目）に続く
+// "[SECTION]KEY=VALUE" の行を手元の写しに反映する。
+// 写しは (セクション, キー) で整列した配列で、読み出しは短いロックの中で二分探索するだけ。
+// ビューは写しを3面のバッファ（書き手・受け渡し・読み手）で持ち、受け渡し面の番号を
+// アトミックに交換して切り替える（トリプルバッファ）。書き手も読み手も相手を待たない。
+//
+// コンパイル方法:
+// make client
+
+#include "configsync_client.h"
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+
+namespace {
+
+// サーバーから受け取る1フレームの最大長（これを超える長さを名乗るフレームは壊れているとみなす）
+const size_t MAX_FRAME_SIZE = 16 * 1024 * 1024;
+// 長さヘッダー（"<長さ>\n"）の最大長
+const size_t MAX_FRAME_HEADER = 32;
+// configsync_client_set() で応答を待つ時間（ミリ秒）。ロールアウトの準備とコミットを待つ分を含む
+const int SET_REPLY_TIMEOUT_MS = 5000;
+
+struct Entry {
+    std::string section;
+    std::string key;
+    std::string value;
+};
+
+// セクション名は大文字小文字を区別しない（iniparserが小文字にするため）
+int compare_entry(const char* section_a, const char* key_a, const char* section_b, const char* key_b) {
+    int result = strcasecmp(section_a, section_b);
+    return result != 0 ? result : strcmp(key_a, key_b);
+}
+
+bool entry_less(const Entry& a, const Entry& b) {
+    return compare_entry(a.section.c_str(), a.key.c_str(), b.section.c_str(), b.key.c_str()) < 0;
+}
+
+typedef std::vector<Entry> Snapshot;
+
+const Entry* find_entry(const Snapshot& entries, const char* section, const char* key) {
+    size_t low = 0;
+    size_t high = entries.size();
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        int result = compare_entry(entries[middle].section.c_str(), entries[middle].key.c_str(), section, key);
+        if (result == 0) {
+            return &entries[middle];
+        }
+        if (result < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return nullptr;
+}
+
+// "[SECTION]KEY=VALUE" の1行を分解する
+bool parse_entry_line(const std::string& line, Entry& entry) {
+    if (line.empty() || line[0] != '[') {
+        return false;
+    }
+    size_t section_end = line.find(']');
+    if (section_end == std::string::npos) {
+        return false;
+    }
+    size_t equals_pos = line.find('=', section_end);
+    if (equals_pos == std::string::npos) {
+        return false;
+    }
+    entry.section = line.substr(1, section_end - 1);
+    entry.key = line.substr(section_end + 1, equals_pos - section_end - 1);
+    entry.value = line.substr(equals_pos + 1);
+    return true;
+}
+
+// コンポーネント（セクション）ごとの変更の影響（"!IMPACT SECTION 影響" の行）
+struct Impact {
+    std::string component;
+    int impact;
+};
+
+bool parse_impact_line(const std::string& line, Impact& impact) {
+    if (line.compare(0, 8, "!IMPACT ") != 0) {
+        return false;
+    }
+    size_t space = line.find(' ', 8);
+    if (space == std::string::npos) {
+        return false;
+    }
+    std::string name = line.substr(space + 1);
+    if (name == "live") {
+        impact.impact = CONFIGSYNC_IMPACT_LIVE;
+    } else if (name == "restart-component") {
+        impact.impact = CONFIGSYNC_IMPACT_RESTART_COMPONENT;
+    } else {
+        impact.impact = CONFIGSYNC_IMPACT_RESTART_PROCESS;  // 知らない分類は重い側に倒す
+    }
+    impact.component = line.substr(8, space - 8);
+    return true;
+}
+
+// 以下の読み出しは、client と view の両方から使う
+int copy_value(const Snapshot& entries, const char* section, const char* key, char* buffer, size_t size) {
+    const Entry* entry = find_entry(entries, section, key);
+    if (entry == nullptr) {
+        if (buffer != nullptr && size > 0) {
+            buffer[0] = '\0';
+        }
+        return -1;
+    }
+    if (buffer != nullptr && size > 0) {
+        size_t length = std::min(entry->value.size(), size - 1);
+        memcpy(buffer, entry->value.data(), length);
+        buffer[length] = '\0';
+    }
+    return (int)entry->value.size();
+}
+
+long long_value(const Snapshot& entries, const char* section, const char* key, long default_value) {
+    const Entry* entry = find_entry(entries, section, key);
+    if (entry == nullptr) {
+        return default_value;
+    }
+    char* end = nullptr;
+    long value = strtol(entry->value.c_str(), &end, 10);
+    return end == entry->value.c_str() ? default_value : value;
+}
+
+double double_value(const Snapshot& entries, const char* section, const char* key, double default_value) {
+    const Entry* entry = find_entry(entries, section, key);
+    if (entry == nullptr) {
+        return default_value;
+    }
+    char* end = nullptr;
+    double value = strtod(entry->value.c_str(), &end);
+    return end == entry->value.c_str() ? default_value : value;
+}
+
+int connect_address(const std::string& address) {
+    if (address.compare(0, 5, "unix:") == 0) {
+        int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (sock < 0) {
+            return -1;
+        }
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, address.c_str() + 5, sizeof(addr.sun_path) - 1);
+        if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            close(sock);
+            return -1;
+        }
+        return sock;
+    }
+
+    size_t colon = address.rfind(':');
+    if (colon == std::string::npos) {
+        return -1;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)atoi(address.c_str() + colon + 1));
+    if (inet_pton(AF_INET, address.substr(0, colon).c_str(), &addr.sin_addr) <= 0) {
+        return -1;
+    }
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        return -1;
+    }
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return sock;
+}
+
+bool send_all(int sock, const std::string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = send(sock, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        sent += n;
+    }
+    return true;
+}
+
+std::string frame(const std::string& body) {
+    return std::to_string(body.size()) + "\n" + body;
+}
+
+} // namespace
+
+struct configsync_view {
+    // middle の下位2ビットが受け渡し面の番号、FRESH は読み手がまだ受け取っていない印
+    static const uint8_t FRESH = 4;
+
+    configsync_client* client = nullptr;
+    Snapshot buffers[3];
+    uint64_t versions[3] = {0, 0, 0};
+    std::atomic<uint8_t> middle{1};
+    uint8_t back = 2;   // 書き手（購読スレッド）だけが触る
+    uint8_t front = 0;  // 読み手だけが触る
+
+    // 書き手: 裏の面に書いてから受け渡し面と入れ替える
+    void publish(const Snapshot& snapshot, uint64_t version) {
+        buffers[back] = snapshot;  // 面を使い回すので、文字列の領域も再利用される
+        versions[back] = version;
+        back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & 3;
+    }
+
+    // 読み手: 新しい面が届いていれば表の面と入れ替える
+    bool swap() {
+        if ((middle.load(std::memory_order_acquire) & FRESH) == 0) {
+            return false;
+        }
+        front = middle.exchange(front, std::memory_order_acq_rel) & 3;
+        return true;
+    }
+};
+
+struct configsync_client {
+    std::string address;
+
+    // 写し。読み出しはロックを取ったまま探索とコピーだけを行う
+    mutable std::mutex snapshot_mutex;
+    Snapshot snapshot;
+
+    std::atomic<uint64_t> version{0};
+    std::atomic<bool> connected{false};
+    std::mutex version_mutex;
+    std::condition_variable version_cv;
+
+    std::mutex callback_mutex;
+    configsync_change_fn callback = nullptr;
+    void* callback_user = nullptr;
+    configsync_impact_fn impact_callback = nullptr;
+    void* impact_callback_user = nullptr;
+
+    // 開いているビュー（購読スレッドが更新のたびに裏の面へ書く）
+    std::mutex views_mutex;
+    std::vector<configsync_view*> views;
+
+    // 購読スレッドの制御（sockは停止時にshutdownして受信を止めるため共有する）
+    std::mutex control_mutex;
+    std::condition_variable control_cv;
+    bool running = true;
+    int sock = -1;
+    std::thread thread;
+
+    void run();
+    bool read_frames(int fd);
+    void apply(const std::string& body);
+    void notify(const std::vector<Entry>& changed, const std::vector<Impact>& impacts, uint64_t new_version);
+};
+
+void configsync_client::run() {
+    int backoff_ms = 100;
+    while (true) {
+        int fd = connect_address(address);
+        {
+            std::unique_lock<std::mutex> lock(control_mutex);
+            if (!running) {
+                if (fd >= 0) close(fd);
+                return;
+            }
+            if (fd < 0) {
+                // サーバーが起動するまで、間隔を広げながら繋ぎ直す
+                control_cv.wait_for(lock, std::chrono::milliseconds(backoff_ms));
+                backoff_ms = std::min(backoff_ms * 2, 2000);
+                continue;
+            }
+            sock = fd;
+        }
+        bool rejected = false;
+        if (send_all(fd, frame("?SUBSCRIBE\n"))) {
+            connected.store(true);
+            rejected = read_frames(fd);
+            connected.store(false);
+        }
+        {
+            std::lock_guard<std::mutex> lock(control_mutex);
+            sock = -1;
+        }
+        close(fd);
+        if (rejected) {
+            // 購読数の上限などで断られた場合や、壊れたフレームを受け取った場合も、間隔を広げてから繋ぎ直す
+            std::unique_lock<std::mutex> lock(control_mutex);
+            control_cv.wait_for(lock, std::chrono::milliseconds(backoff_ms));
+            backoff_ms = std::min(backoff_ms * 2, 2000);
+        } else {
+            backoff_ms = 100;
+        }
+    }
+}
+
+// 切断されるまでフレームを受け取って反映する。サーバーに購読を断られた場合と、長さヘッダーが
+// 壊れているか MAX_FRAME_SIZE を超える場合はtrueを返す（間隔を空けてから繋ぎ直す）
+bool configsync_client::read_frames(int fd) {
+    std::string buffer;
+    char chunk[4096];
+    while (true) {
+        // 揃っているフレームをすべて処理する
+        while (true) {
+            size_t newline = buffer.find('\n');
+            if (newline == std::string::npos) {
+                if (buffer.size() > MAX_FRAME_HEADER) {
+                    return true;
+                }
+                break;
+            }
+            size_t length = strtoull(buffer.c_str(), nullptr, 10);
+            if (newline > MAX_FRAME_HEADER || length > MAX_FRAME_SIZE) {
+                return true;
+            }
+            if (buffer.size() < newline + 1 + length) {
+                break;
+            }
+            std::string body = buffer.substr(newline + 1, length);
+            if (body.compare(0, 10, "!REJECTED ") == 0) {
+                return true;
+            }
+            apply(body);
+            buffer.erase(0, newline + 1 + length);
+        }
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        buffer.append(chunk, n);
+    }
+}
+
+void configsync_client::apply(const std::string& body) {
+    size_t line_end = body.find('\n');
+    std::string first_line = body.substr(0, line_end);
+    bool full = first_line.compare(0, 10, "!SNAPSHOT ") == 0;
+    if (!full && first_line.compare(0, 9, "!CHANGED ") != 0) {
+        return;
+    }
+    uint64_t new_version = strtoull(first_line.c_str() + (full ? 10 : 9), nullptr, 10);
+
+    std::vector<Entry> received;
+    std::vector<Impact> impacts;
+    size_t pos = line_end == std::string::npos ? body.size() : line_end + 1;
+    while (pos < body.size()) {
+        size_t end = body.find('\n', pos);
+        if (end == std::string::npos) {
+            end = body.size();
+        }
+        std::string line = body.substr(pos, end - pos);
+        Entry entry;
+        Impact impact;
+        if (parse_entry_line(line, entry)) {
+            received.push_back(entry);
+        } else if (parse_impact_line(line, impact)) {
+            impacts.push_back(impact);
+        }
+        pos = end + 1;
+    }
+
+    // 新しい写しはロックの外で作り、差し替えだけをロックの中で行う
+    Snapshot next;
+    {
+        std::lock_guard<std::mutex> lock(snapshot_mutex);
+        if (!full) {
+            next = snapshot;
+        }
+    }
+    std::vector<Entry> changed;
+    if (full) {
+        std::stable_sort(received.begin(), received.end(), entry_less);
+        for (const Entry& entry : received) {
+            if (!next.empty() && !entry_less(next.back(), entry)) {
+                next.back() = entry;  // 同じ項目が重なっていたら後のものを採る
+            } else {
+                next.push_back(entry);
+            }
+        }
+        std::lock_guard<std::mutex> lock(snapshot_mutex);
+        for (const Entry& entry : next) {
+            const Entry* old = find_entry(snapshot, entry.section.c_str(), entry.key.c_str());
+            if (old == nullptr || old->value != entry.value) {
+                changed.push_back(entry);
+            }
+        }
+        // 送り直し（再接続・設定ファイルの読み直し）には分類が付かないため、
+        // 変わったセクションは作り直しが必要とみなす。最初の受信は起動時なので知らせない
+        if (version.load() != 0) {
+            for (const Entry& entry : changed) {
+                if (impacts.empty() || strcasecmp(impacts.back().component.c_str(), entry.section.c_str()) != 0) {
+                    Impact impact;
+                    impact.component = entry.section;
+                    impact.impact = CONFIGSYNC_IMPACT_RESTART_COMPONENT;
+                    impacts.push_back(impact);
+                }
+            }
+        }
+    } else {
+        for (const Entry& entry : received) {
+            Snapshot::iterator it = std::lower_bound(next.begin(), next.end(), entry, entry_less);
+            if (it != next.end() && !entry_less(entry, *it)) {
+                it->value = entry.value;
+            } else {
+                next.insert(it, entry);
+            }
+            changed.push_back(entry);
+        }
+    }
+    {
+        // ビューの登録と写しの差し替えの間に版が抜け落ちないよう、views_mutex を持ったまま進める
+        std::lock_guard<std::mutex> views_lock(views_mutex);
+        for (configsync_view* view : views) {
+            view->publish(next, new_version);
+        }
+        {
+            std::lock_guard<std::mutex> lock(snapshot_mutex);
+            snapshot.swap(next);
+        }
+        {
+            std::lock_guard<std::mutex> lock(version_mutex);
+            version.store(new_version);
+        }
+    }
+    version_cv.notify_all();
+    notify(changed, impacts, new_version);
+}
+
+void configsync_client::notify(const std::vector<Entry>& changed, const std::vector<Impact>& impacts,
+                               uint64_t new_version) {
+    configsync_change_fn fn;
+    void* user;
+    configsync_impact_fn impact_fn;
+    void* impact_user;
+    {
+        std::lock_guard<std::mutex> lock(callback_mutex);
+        fn = callback;
+        user = callback_user;
+        impact_fn = impact_callback;
+        impact_user = impact_callback_user;
+    }
+    if (fn != nullptr) {
+        for (const Entry& entry : changed) {
+            fn(user, entry.section.c_str(), entry.key.c_str(), entry.value.c_str(), new_version);
+        }
+    }
+    // 項目ごとの通知を済ませてから、コンポーネントごとに必要な対応を知らせる
+    if (impact_fn != nullptr) {
+        for (const Impact& impact : impacts) {
+            impact_fn(impact_user, impact.component.c_str(), impact.impact, new_version);
+        }
+    }
+}
+
+extern "C" {
+
+configsync_client* configsync_client_open(const char* address) {
+    if (address == nullptr || *address == '\0') {
+        return nullptr;
+    }
+    configsync_client* client = new configsync_client();
+    client->address = address;
+    client->thread = std::thread(&configsync_client::run, client);
+    return client;
+}
+
+void configsync_client_close(configsync_client* client) {
+    if (client == nullptr) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(client->control_mutex);
+        client->running = false;
+        if (client->sock >= 0) {
+            // 受信待ちのrecvを戻す
+            shutdown(client->sock, SHUT_RDWR);
+        }
+    }
+    client->control_cv.notify_all();
+    client->thread.join();
+    {
+        // 閉じ忘れたビューは、以降の更新が届かないだけにする
+        std::lock_guard<std::mutex> lock(client->views_mutex);
+        for (configsync_view* view : client->views) {
+            view->client = nullptr;
+        }
+    }
+    delete client;
+}
+
+int configsync_client_wait(configsync_client* client, uint64_t min_version, int timeout_ms) {
+    std::unique_lock<std::mutex> lock(client->version_mutex);
+    auto reached = [client, min_version]() { return client->version.load() >= min_version; };
+    if (timeout_ms < 0) {
+        client->version_cv.wait(lock, reached);
+        return 1;
+    }
+    return client->version_cv.wait_for(lock, std::chrono::milliseconds(timeout_ms), reached) ? 1 : 0;
+}
+
+uint64_t configsync_client_version(const configsync_client* client) {
+    return client->version.load();
+}
+
+int configsync_client_connected(const configsync_client* client) {
+    return client->connected.load() ? 1 : 0;
+}
+
+int configsync_client_get(const configsync_client* client, const char* section, const char* key, char* buffer,
+                          size_t size) {
+    std::lock_guard<std::mutex> lock(client->snapshot_mutex);
+    return copy_value(client->snapshot, section, key, buffer, size);
+}
+
+long configsync_client_get_long(const configsync_client* client, const char* section, const char* key,
+                                long default_value) {
+    std::lock_guard<std::mutex> lock(client->snapshot_mutex);
+    return long_value(client->snapshot, section, key, default_value);
+}
+
+double configsync_client_get_double(const configsync_client* client, const char* section, const char* key,
+                                    double default_value) {
+    std::lock_guard<std::mutex> lock(client->snapshot_mutex);
+    return double_value(client->snapshot, section, key, default_value);
+}
+
+int configsync_client_set(configsync_client* client, const char* section, const char* key, const char* value) {
+    int fd = connect_address(client->address);
+    if (fd < 0) {
+        return -1;
+    }
+    // サーバーが止まっていても呼び出し元（制御スレッドなど）を止め続けないよう、送受信に期限を付ける
+    struct timeval timeout;
+    timeout.tv_sec = SET_REPLY_TIMEOUT_MS / 1000;
+    timeout.tv_usec = (SET_REPLY_TIMEOUT_MS % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    std::string body = std::string("[") + section + "]" + key + "=" + value + "\n";
+    bool ok = send_all(fd, frame(body));
+    // 受理された更新には応答がなく、サーバーが閉じるだけ。拒否された場合は "!REJECTED" が返る
+    std::string reply;
+    char chunk[256];
+    while (ok) {
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            ok = false;  // 期限切れ（EAGAIN）を含む
+            break;
+        }
+        if (n == 0) {
+            break;
+        }
+        reply.append(chunk, n);
+        if (reply.size() > MAX_FRAME_HEADER + 256) {
+            break;  // 拒否の応答は短い
+        }
+    }
+    close(fd);
+    if (reply.find("!REJECTED") != std::string::npos) {
+        return -1;
+    }
+    return ok ? 0 : -1;
+}
+
+void configsync_client_set_callback(configsync_client* client, configsync_change_fn fn, void* user) {
+    std::lock_guard<std::mutex> lock(client->callback_mutex);
+    client->callback = fn;
+    client->callback_user = user;
+}
+
+void configsync_client_set_impact_callback(configsync_client* client, configsync_impact_fn fn, void* user) {
+    std::lock_guard<std::mutex> lock(client->callback_mutex);
+    client->impact_callback = fn;
+    client->impact_callback_user = user;
+}
+
+configsync_view* configsync_view_open(configsync_client* client) {
+    configsync_view* view = new configsync_view();
+    view->client = client;
+    // 購読スレッドは views_mutex を持って写しを差し替えるため、この間に版が進むことはない
+    std::lock_guard<std::mutex> views_lock(client->views_mutex);
+    {
+        std::lock_guard<std::mutex> lock(client->snapshot_mutex);
+        view->buffers[view->front] = client->snapshot;
+        view->versions[view->front] = client->version.load();
+    }
+    client->views.push_back(view);
+    return view;
+}
+
+void configsync_view_close(configsync_view* view) {
+    if (view == nullptr) {
+        return;
+    }
+    if (view->client != nullptr) {
+        std::lock_guard<std::mutex> lock(view->client->views_mutex);
+        std::vector<configsync_view*>& views = view->client->views;
+        views.erase(std::remove(views.begin(), views.end(), view), views.end());
+    }
+    delete view;
+}
+
+int configsync_view_swap(configsync_view* view) {
+    return view->swap() ? 1 : 0;
+}
+
+uint64_t configsync_view_version(const configsync_view* view) {
+    return view->versions[view->front];
+}
+
+int configsync_view_get(const configsync_view* view, const char* section, const char* key, char* buffer, size_t size) {
+    return copy_value(view->buffers[view->front], section, key, buffer, size);
+}
+
+long configsync_view_get_long(const configsync_view* view, const char* section, const char* key, long default_value) {
+    return long_value(view->buffers[view->front], section, key, default_value);
+}
+
+double configsync_view_get_double(const configsync_view* view, const char* section, const char* key,
+                                  double default_value) {
+    return double_value(view->buffers[view->front], section, key, default_value);
+}
+
+} // extern "C"
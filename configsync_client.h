@@ -0,0 +1,296 @@
+/* configsync_client.h - 設定同期サーバーのクライアントSDK（libconfigsync_client）
+ *
+ * 目的:
+ * スラスター制御やカメラなど、設定を読む側のプロセスが config.ini を読み直したり
+ * 生のTCPプロトコルを話したりせずに設定を参照できるようにする。
+ * サーバーへ購読（?SUBSCRIBE）接続を張り、設定全体の写しを手元に持つ。
+ * 変更はサーバーから押し込まれて写しに反映されるため、読み出しはメモリ上の
+ * 二分探索だけで済む（ネットワークには出ない）。
+ * 接続が切れている間は最後に受け取った値を返し続け、裏で再接続する。
+ *
+ * 制御ループのように、1周の途中で値が混ざってはいけない読み手には「ビュー」を使う。
+ * 変更はビューの裏側のバッファに入り、読み手は configsync_view_swap() を呼んだ時点で
+ * 新しい版に切り替わる。切り替えはアトミック変数1つの交換だけで、ロックも確保も行わない
+ * （待ちが発生しない）。2回の swap の間は、すべての読み出しが同じ版から返る。
+ *
+ * C から使えるようにC ABIで公開する。C++ では末尾の configsync::Client / configsync::View を使える。
+ *
+ * 使用例（C）:
+ *   configsync_client* client = configsync_client_open("unix:/tmp/config_sync.sock");
+ *   configsync_client_wait(client, 1, 2000);
+ *   double kp = configsync_client_get_double(client, "THRUSTER_CONTROL", "KP_ROLL", 0.0);
+ *   configsync_client_close(client);
+ *
+ * 使用例（制御ループ）:
+ *   configsync_view* view = configsync_view_open(client);
+ *   while (running) {
+ *       configsync_view_swap(view);  // 周回の先頭でだけ新しい版に切り替える
+ *       double kp = configsync_view_get_double(view, "THRUSTER_CONTROL", "KP_ROLL", 0.0);
+ *       double smoothing = configsync_view_get_double(view, "THRUSTER_CONTROL", "SMOOTHING_FACTOR_HORIZONTAL", 0.0);
+ *       ...
+ *   }
+ *   configsync_view_close(view);
+ *
+ * ビルド方法:
+ * make client（libconfigsync_client.a / libconfigsync_client.so、-lpthread のみ必要）
+ */
+
+#ifndef CONFIGSYNC_CLIENT_H
+#define CONFIGSYNC_CLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct configsync_client configsync_client;
+
+/* 変更通知。購読スレッド上で、写しに反映した後に1項目ずつ呼ばれる */
+typedef void (*configsync_change_fn)(void* user, const char* section, const char* key, const char* value,
+                                     uint64_t version);
+
+/*
+ * 変更の影響（サーバーの分類表による。値が大きいほど重い）
+ *   LIVE               そのまま反映できる（次に読んだ値を使えばよい）
+ *   RESTART_COMPONENT  そのセクションを使う部品（カメラのパイプラインなど）を作り直す
+ *   RESTART_PROCESS    プロセスを再起動する
+ */
+enum {
+    CONFIGSYNC_IMPACT_LIVE = 0,
+    CONFIGSYNC_IMPACT_RESTART_COMPONENT = 1,
+    CONFIGSYNC_IMPACT_RESTART_PROCESS = 2
+};
+
+/*
+ * 影響の通知。1回の更新で変わったコンポーネント（セクション）ごとに1回、
+ * その中で最も重い影響が、項目ごとの変更通知の後に呼ばれる
+ */
+typedef void (*configsync_impact_fn)(void* user, const char* component, int impact, uint64_t version);
+
+/**
+ * @brief サーバーへの購読を開始する（接続は裏のスレッドで行い、ここではブロックしない）
+ * @param address "unix:/tmp/config_sync.sock" または "127.0.0.1:12348"
+ * @return ハンドル（アドレスが不正な場合はNULL）
+ */
+configsync_client* configsync_client_open(const char* address);
+
+/**
+ * @brief 購読を止めてハンドルを解放する
+ */
+void configsync_client_close(configsync_client* client);
+
+/**
+ * @brief 写しの版が min_version 以上になるまで待つ（1を渡せば最初の受信を待てる）
+ * @param timeout_ms 負なら無期限
+ * @return 到達したら1、タイムアウトなら0
+ */
+int configsync_client_wait(configsync_client* client, uint64_t min_version, int timeout_ms);
+
+/**
+ * @brief 写しの版（まだ何も受け取っていなければ0）
+ */
+uint64_t configsync_client_version(const configsync_client* client);
+
+/**
+ * @brief サーバーと接続中なら1
+ */
+int configsync_client_connected(const configsync_client* client);
+
+/**
+ * @brief 値を文字列で取り出す（セクション名は大文字小文字を区別しない）
+ * @param buffer 値の書き込み先（常にNUL終端される）
+ * @param size bufferの大きさ
+ * @return 値の長さ（snprintfと同じく、切り詰められた場合も本来の長さ）。項目が無ければ-1
+ */
+int configsync_client_get(const configsync_client* client, const char* section, const char* key, char* buffer,
+                          size_t size);
+
+long configsync_client_get_long(const configsync_client* client, const char* section, const char* key,
+                                long default_value);
+
+double configsync_client_get_double(const configsync_client* client, const char* section, const char* key,
+                                    double default_value);
+
+/**
+ * @brief 値を変更する（サーバーへ更新を送る。写しへの反映は押し込みを待つ）
+ *
+ * サーバーの応答は最大5秒待つ。期限切れの場合も-1を返す（その後サーバーで反映されることはある）。
+ * @return 送信できたら0、接続できないか拒否された場合、応答が期限内に無い場合は-1
+ */
+int configsync_client_set(configsync_client* client, const char* section, const char* key, const char* value);
+
+/**
+ * @brief 変更通知を登録する（NULLで解除）
+ */
+void configsync_client_set_callback(configsync_client* client, configsync_change_fn fn, void* user);
+
+/**
+ * @brief 影響の通知を登録する（NULLで解除）
+ *
+ * 再接続や設定ファイルの読み直しで全体を受け取り直した場合は分類が届かないため、
+ * 変わったセクションを RESTART_COMPONENT として知らせる。
+ */
+void configsync_client_set_impact_callback(configsync_client* client, configsync_impact_fn fn, void* user);
+
+typedef struct configsync_view configsync_view;
+
+/**
+ * @brief ビューを作る（作った時点の写しが見える）。ビューは1つのスレッドから使う
+ * @return ハンドル。閉じるまで、以降の変更はビューの裏側のバッファに届く
+ */
+configsync_view* configsync_view_open(configsync_client* client);
+
+/**
+ * @brief ビューを閉じる（クライアントより先に閉じる）
+ */
+void configsync_view_close(configsync_view* view);
+
+/**
+ * @brief 届いている最新の版に切り替える（待ちなし・O(1)）
+ * @return 切り替わったら1、新しい版が無ければ0
+ */
+int configsync_view_swap(configsync_view* view);
+
+/**
+ * @brief ビューが今見せている版
+ */
+uint64_t configsync_view_version(const configsync_view* view);
+
+/* 読み出しは configsync_client_get* と同じ。ロックを取らず、今見せている版から返す */
+int configsync_view_get(const configsync_view* view, const char* section, const char* key, char* buffer, size_t size);
+
+long configsync_view_get_long(const configsync_view* view, const char* section, const char* key, long default_value);
+
+double configsync_view_get_double(const configsync_view* view, const char* section, const char* key,
+                                  double default_value);
+
+#ifdef __cplusplus
+}
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+namespace configsync {
+
+/**
+ * @brief C ABIの薄いC++ラッパー
+ */
+class Client {
+public:
+    explicit Client(const std::string& address) : client_(configsync_client_open(address.c_str())) {}
+    ~Client() {
+        if (client_ != nullptr) {
+            configsync_client_close(client_);
+        }
+    }
+
+    bool valid() const { return client_ != nullptr; }
+    bool wait(uint64_t min_version, int timeout_ms) { return configsync_client_wait(client_, min_version, timeout_ms) != 0; }
+    uint64_t version() const { return configsync_client_version(client_); }
+    bool connected() const { return configsync_client_connected(client_) != 0; }
+
+    std::string get(const char* section, const char* key, const std::string& default_value = "") const {
+        std::string value;
+        return lookup(section, key, value) ? value : default_value;
+    }
+
+    // 項目があればvalueに入れてtrueを返す（生成された load_typed_config にそのまま渡せる）
+    bool lookup(const char* section, const char* key, std::string& value) const {
+        char buffer[128];
+        int length = configsync_client_get(client_, section, key, buffer, sizeof(buffer));
+        if (length < 0) {
+            return false;
+        }
+        if ((size_t)length < sizeof(buffer)) {
+            value.assign(buffer, length);
+            return true;
+        }
+        std::vector<char> large(length + 1);
+        length = configsync_client_get(client_, section, key, large.data(), large.size());
+        if (length < 0) {
+            return false;
+        }
+        value.assign(large.data(), std::min<size_t>(length, large.size() - 1));
+        return true;
+    }
+
+    long get_long(const char* section, const char* key, long default_value) const {
+        return configsync_client_get_long(client_, section, key, default_value);
+    }
+
+    double get_double(const char* section, const char* key, double default_value) const {
+        return configsync_client_get_double(client_, section, key, default_value);
+    }
+
+    bool set(const char* section, const char* key, const std::string& value) {
+        return configsync_client_set(client_, section, key, value.c_str()) == 0;
+    }
+
+    void set_callback(configsync_change_fn fn, void* user) { configsync_client_set_callback(client_, fn, user); }
+
+    void set_impact_callback(configsync_impact_fn fn, void* user) {
+        configsync_client_set_impact_callback(client_, fn, user);
+    }
+
+private:
+    Client(const Client&);
+    Client& operator=(const Client&);
+
+    friend class View;
+
+    configsync_client* client_;
+};
+
+/**
+ * @brief configsync_view のC++ラッパー（制御ループのスレッドで使う）
+ */
+class View {
+public:
+    explicit View(Client& client) : view_(configsync_view_open(client.client_)) {}
+    ~View() {
+        if (view_ != nullptr) {
+            configsync_view_close(view_);
+        }
+    }
+
+    bool swap() { return configsync_view_swap(view_) != 0; }
+    uint64_t version() const { return configsync_view_version(view_); }
+
+    bool lookup(const char* section, const char* key, std::string& value) const {
+        char buffer[128];
+        int length = configsync_view_get(view_, section, key, buffer, sizeof(buffer));
+        if (length < 0) {
+            return false;
+        }
+        if ((size_t)length < sizeof(buffer)) {
+            value.assign(buffer, length);
+            return true;
+        }
+        std::vector<char> large(length + 1);
+        length = configsync_view_get(view_, section, key, large.data(), large.size());
+        value.assign(large.data(), std::min<size_t>(length, large.size() - 1));
+        return true;
+    }
+
+    long get_long(const char* section, const char* key, long default_value) const {
+        return configsync_view_get_long(view_, section, key, default_value);
+    }
+
+    double get_double(const char* section, const char* key, double default_value) const {
+        return configsync_view_get_double(view_, section, key, default_value);
+    }
+
+private:
+    View(const View&);
+    View& operator=(const View&);
+
+    configsync_view* view_;
+};
+
+} // namespace configsync
+#endif
+
+#endif /* CONFIGSYNC_CLIENT_H */
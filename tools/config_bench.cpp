@@ -0,0 +1,338 @@
+// config_bench.cpp - ConfigSynchronizerの主要な処理のマイクロベンチマーク
+//
+// 目的:
+// load_config()（小さいファイル・大きいファイル）、複数スレッドからのget_config_value()、
+// update_config_from_string()、serialize_config()、save_config() の所要時間を測り、
+// 1回あたりのナノ秒・メモリ確保回数・スループットをJSONで標準出力に書き出す。
+// 作業ファイルは tmpfs（既定では /dev/shm）に作るため、ディスクの速度には左右されない。
+//
+// 使用方法:
+// ./config_bench [作業ディレクトリ] [1ベンチあたりの最小計測時間(ms)] [最大スレッド数]
+//
+// コンパイル方法:
+// make bench
+
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+// 本体をそのまま取り込み、内部の関数を直接呼ぶ（main()は除外する）
+#define CONFIGSYNC_NO_MAIN
+#include "../ConfigSynchronizer.cpp"
+
+// ---------------------------------------------------------------------------
+// メモリ確保回数の計測（グローバルなoperator newを差し替える）
+// ---------------------------------------------------------------------------
+static std::atomic<uint64_t> g_allocations{0};
+
+// 差し替えたoperator newはmallocを使うため、operator deleteでfreeを呼ぶのは正しい組み合わせ
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new(std::size_t size) {
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    void* p = std::malloc(size ? size : 1);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* operator new[](std::size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void* p, std::size_t) noexcept {
+    std::free(p);
+}
+
+/**
+ * @brief 1つのベンチマークの結果
+ */
+struct BenchResult {
+    std::string name;
+    int threads;
+    uint64_t iterations;
+    double ns_per_op;
+    double allocs_per_op;
+    double ops_per_sec;
+    double bytes_per_op;  // 1回で扱うデータ量（0なら出力しない）
+};
+
+std::vector<BenchResult> g_results;
+int g_min_time_ms = 300;
+
+/**
+ * @brief 1回の処理を、最小計測時間を超えるまで倍々の回数で繰り返して測る
+ * @param op 1回分の処理
+ * @param bytes_per_op 1回で扱うデータ量（スループットの計算用、無ければ0）
+ */
+void run_bench(const std::string& name, const std::function<void()>& op, double bytes_per_op = 0) {
+    op();  // ウォームアップ
+    uint64_t iterations = 1;
+    while (true) {
+        uint64_t allocs_before = g_allocations.load();
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (uint64_t i = 0; i < iterations; ++i) {
+            op();
+        }
+        double elapsed_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        uint64_t allocs = g_allocations.load() - allocs_before;
+        if (elapsed_ns >= g_min_time_ms * 1e6 || iterations >= (1ULL << 30)) {
+            BenchResult result;
+            result.name = name;
+            result.threads = 1;
+            result.iterations = iterations;
+            result.ns_per_op = elapsed_ns / iterations;
+            result.allocs_per_op = (double)allocs / iterations;
+            result.ops_per_sec = iterations / (elapsed_ns / 1e9);
+            result.bytes_per_op = bytes_per_op;
+            g_results.push_back(result);
+            return;
+        }
+        iterations *= 2;
+    }
+}
+
+/**
+ * @brief 複数スレッドから同時に同じ処理を呼び、1スレッドあたりの所要時間と全体のスループットを測る
+ */
+void run_contended_bench(const std::string& name, int threads, const std::function<void(int)>& op) {
+    uint64_t per_thread = 1000;
+    while (true) {
+        std::atomic<int> ready{0};
+        std::atomic<bool> go{false};
+        std::vector<std::thread> workers;
+        uint64_t allocs_before = g_allocations.load();
+        for (int t = 0; t < threads; ++t) {
+            workers.push_back(std::thread([&, t]() {
+                ready.fetch_add(1);
+                while (!go.load()) {
+                }
+                for (uint64_t i = 0; i < per_thread; ++i) {
+                    op(t);
+                }
+            }));
+        }
+        while (ready.load() < threads) {
+        }
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        go.store(true);
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+        double elapsed_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        uint64_t allocs = g_allocations.load() - allocs_before;
+        if (elapsed_ns >= g_min_time_ms * 1e6 || per_thread >= (1ULL << 28)) {
+            uint64_t total = per_thread * threads;
+            BenchResult result;
+            result.name = name;
+            result.threads = threads;
+            result.iterations = total;
+            result.ns_per_op = elapsed_ns / per_thread;  // 各スレッドから見た1回の所要時間
+            // スレッド生成分を除く（生成が計数に現れない環境で負にならないよう0で止める）
+            result.allocs_per_op = std::max(0.0, ((double)allocs - threads) / total);
+            result.ops_per_sec = total / (elapsed_ns / 1e9);
+            result.bytes_per_op = 0;
+            g_results.push_back(result);
+            return;
+        }
+        per_thread *= 2;
+    }
+}
+
+/**
+ * @brief ベンチマーク用の設定ファイルを作る
+ * @param sections PWMなどの実際のセクションに加えて作る、ダミーのセクション数
+ */
+std::string make_config_file(const std::string& path, int sections) {
+    std::stringstream file;
+    file << "# ベンチマーク用の設定ファイル\n\n";
+    file << "[CONFIG_SYNC]\nWPF_HOST=127.0.0.1\nWPF_RECV_PORT=0\nCPP_RECV_PORT=0\nUDS_PATH=\n"
+         << "HEARTBEAT_INTERVAL_MS=0\nSAVE_DURABILITY=full\nJOURNAL_ENABLED=true\nBACKUP_RING_SIZE=8\n\n";
+    file << "[PWM]\nPWM_MIN=1100\nPWM_NEUTRAL=1500\nPWM_NORMAL_MAX=1500\nPWM_BOOST_MAX=1900\nPWM_FREQUENCY=50\n\n";
+    file << "[JOYSTICK]\nDEADZONE=6500\n\n";
+    file << "[THRUSTER_CONTROL]\nSMOOTHING_FACTOR_HORIZONTAL=0.05\nSMOOTHING_FACTOR_VERTICAL=0.05\n"
+         << "KP_ROLL=0.2\nKP_YAW=0.15\nYAW_THRESHOLD_DPS=0.5\nYAW_GAIN=50.0\n\n";
+    for (int i = 0; i < sections; ++i) {
+        // カメラのセクションと同じ形で、load_config()が読むキーを並べる
+        file << "[GSTREAMER_CAMERA_" << i << "]\n"
+             << "DEVICE=/dev/video" << i << "\nPORT=" << (5000 + i) << "\nWIDTH=1280\nHEIGHT=720\n"
+             << "FRAMERATE_NUM=30\nFRAMERATE_DEN=1\nIS_H264_NATIVE_SOURCE=false\nRTP_PAYLOAD_TYPE=96\n"
+             << "RTP_CONFIG_INTERVAL=1\nX264_BITRATE=2000\nX264_TUNE=zerolatency\nX264_SPEED_PRESET=ultrafast\n\n";
+    }
+    std::string content = file.str();
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out << content;
+    return content;
+}
+
+/**
+ * @brief 数値をJSONとして書き出す（非有限値はnullにする）
+ */
+void print_json_number(double value) {
+    if (std::isfinite(value)) {
+        std::printf("%.3f", value);
+    } else {
+        std::printf("null");
+    }
+}
+
+/**
+ * @brief 文字列をJSONの文字列リテラルの中身として書けるようにする（引用符・バックスラッシュ・制御文字）
+ */
+std::string escape_json_string(const std::string& value) {
+    std::string escaped;
+    for (char c : value) {
+        unsigned char uc = (unsigned char)c;
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+            escaped += c;
+        } else if (uc < 0x20) {
+            char buf[8];
+            std::snprintf(buf, sizeof(buf), "\\u%04x", uc);
+            escaped += buf;
+        } else {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+void print_results_json(const std::string& work_dir) {
+    std::printf("{\n  \"work_dir\": \"%s\",\n  \"min_time_ms\": %d,\n  \"benchmarks\": [\n",
+                escape_json_string(work_dir).c_str(), g_min_time_ms);
+    for (size_t i = 0; i < g_results.size(); ++i) {
+        const BenchResult& r = g_results[i];
+        std::printf("    {\"name\": \"%s\", \"threads\": %d, \"iterations\": %llu, \"ns_per_op\": ",
+                    escape_json_string(r.name).c_str(), r.threads, (unsigned long long)r.iterations);
+        print_json_number(r.ns_per_op);
+        std::printf(", \"allocs_per_op\": ");
+        print_json_number(r.allocs_per_op);
+        std::printf(", \"ops_per_sec\": ");
+        print_json_number(r.ops_per_sec);
+        if (r.bytes_per_op > 0) {
+            std::printf(", \"bytes_per_sec\": ");
+            print_json_number(r.bytes_per_op * r.ops_per_sec);
+        }
+        std::printf("}%s\n", i + 1 < g_results.size() ? "," : "");
+    }
+    std::printf("  ]\n}\n");
+}
+
+int main(int argc, char* argv[]) {
+    std::string work_dir = argc > 1 ? argv[1] : "/dev/shm";
+    if (argc > 2) {
+        g_min_time_ms = std::max(1, std::atoi(argv[2]));
+    }
+    int max_threads = argc > 3 ? std::max(1, std::atoi(argv[3]))
+                               : std::max(1, (int)std::thread::hardware_concurrency());
+
+    // 作業ディレクトリを作る
+    std::string dir_template = work_dir + "/config_bench.XXXXXX";
+    std::vector<char> dir_name(dir_template.begin(), dir_template.end());
+    dir_name.push_back('\0');
+    if (mkdtemp(dir_name.data()) == nullptr) {
+        std::fprintf(stderr, "エラー: 作業ディレクトリを作成できません: %s (%s)\n", dir_template.c_str(), strerror(errno));
+        return 1;
+    }
+    std::string dir = dir_name.data();
+    std::string small_path = dir + "/small.ini";
+    std::string large_path = dir + "/large.ini";
+    std::string config_path = dir + "/config.ini";
+    std::string small_content = make_config_file(small_path, 2);
+    std::string large_content = make_config_file(large_path, 1000);
+    make_config_file(config_path, 2);
+
+    // 本体のログは計測の邪魔になるので捨てる（整形のコストは計測に含まれる）
+    std::ofstream null_stream("/dev/null");
+    std::streambuf* cout_buf = std::cout.rdbuf(null_stream.rdbuf());
+    std::streambuf* cerr_buf = std::cerr.rdbuf(null_stream.rdbuf());
+    FILE* null_file = fopen("/dev/null", "w");
+    g_logger.start(null_file, null_file);
+
+    run_bench("load_config/small", [&]() { load_config(small_path); }, small_content.size());
+    run_bench("load_config/large", [&]() { load_config(large_path); }, large_content.size());
+
+    // 以降は小さい設定で、書き込みスレッドも動かした実際の構成で測る
+    load_config(config_path);
+    g_config_path = config_path;
+    g_persistence_writer.start(config_path);
+
+    // 1, 2, 4, ... スレッドと、最後に最大スレッド数で測る
+    std::vector<int> thread_counts;
+    for (int threads = 1; threads < max_threads; threads *= 2) {
+        thread_counts.push_back(threads);
+    }
+    thread_counts.push_back(max_threads);
+    for (int threads : thread_counts) {
+        run_contended_bench("get_config_value", threads, [](int t) {
+            static const char* const keys[] = {"PWM_MIN", "PWM_NEUTRAL", "PWM_BOOST_MAX", "PWM_FREQUENCY"};
+            std::string value = get_config_value("PWM", keys[t % 4], "0");
+            (void)value;
+        });
+    }
+
+    // WPFが送ってくる程度の更新（数項目）と、全設定を送り直す大きな更新
+    std::string small_update;
+    std::string full_update;
+    int counter = 0;
+    run_bench("update_config_from_string/5_keys", [&]() {
+        counter++;
+        small_update.clear();
+        append_config_entry(small_update, "PWM", "PWM_MIN", std::to_string(1000 + counter % 100));
+        append_config_entry(small_update, "PWM", "PWM_BOOST_MAX", std::to_string(1800 + counter % 100));
+        append_config_entry(small_update, "JOYSTICK", "DEADZONE", std::to_string(6000 + counter % 1000));
+        append_config_entry(small_update, "THRUSTER_CONTROL", "KP_ROLL", std::to_string(counter % 10 / 10.0));
+        append_config_entry(small_update, "THRUSTER_CONTROL", "KP_YAW", std::to_string(counter % 7 / 10.0));
+        update_config_from_string(small_update);
+    }, 5 * 30);
+    {
+        std::string body = serialize_config();
+        full_update = body.substr(body.find('\n') + 1);
+    }
+    run_bench("update_config_from_string/full_unchanged", [&]() {
+        update_config_from_string(full_update);
+    }, full_update.size());
+
+    std::string serialized = serialize_config();
+    run_bench("serialize_config", []() {
+        std::string body = serialize_config();
+        (void)body;
+    }, serialized.size());
+
+    // 毎回1項目を変えて保存する（変更が無いと書き込みを省略するため）
+    run_bench("save_config", [&]() {
+        counter++;
+        set_config_value("JOYSTICK", "DEADZONE", std::to_string(6000 + counter % 1000));
+        save_config(config_path);
+    }, serialized.size());
+
+    g_persistence_writer.stop();
+    g_logger.stop();
+    fclose(null_file);
+    std::cout.rdbuf(cout_buf);
+    std::cerr.rdbuf(cerr_buf);
+
+    print_results_json(dir);
+
+    // 作業ファイルを片付ける
+    std::string cleanup = "rm -rf '" + dir + "'";
+    if (std::system(cleanup.c_str()) != 0) {
+        std::fprintf(stderr, "警告: %s を削除できませんでした。\n", dir.c_str());
+    }
+    return 0;
+}
@@ -0,0 +1,693 @@
+// config_codegen.cpp - config.ini から型付きの設定構造体ヘッダーを生成する
+//
+// 目的:
+// 設定を読む側が ("THRUSTER_CONTROL", "KP_ROLL") のような文字列の組で値を引き、
+// その都度パースしなくて済むように、config.ini を元に次のものを持つヘッダーを生成する。
+// - セクションごとの構造体（値から型を推論: int / double / bool / std::string）
+//   [GSTREAMER_CAMERA_1], [GSTREAMER_CAMERA_2] のように番号で終わるセクションは
+//   std::array にまとめる（フィールドは全番号の和集合）
+// - load_typed_config(): (セクション, キー) から値を引く関数で読み込む
+// - parse_typed_config(): "[SECTION]KEY=VALUE" 形式の文字列から読み込む
+// - serialize_typed_config(): 同じ形式に書き出す（そのまま更新として送れる）
+// - diff_typed_config(): 2つの設定の違う項目を列挙する
+// 利用側はメンバーを直接読むだけで済み、config.ini から項目が消えたり型が変わったりすると
+// 生成し直したヘッダーでコンパイルが通らなくなる（スキーマのずれをビルド時に検出する）。
+//
+// 使用方法:
+// ./config_codegen [入力（既定: config.ini）] [出力（既定: 標準出力）]
+//
+// コンパイル方法:
+// make codegen（config_types.h を生成する）
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <stdint.h>
+
+enum FieldType {
+    TYPE_INT,
+    TYPE_DOUBLE,
+    TYPE_BOOL,
+    TYPE_STRING
+};
+
+struct IniEntry {
+    std::string key;
+    std::string value;
+    std::string comment;
+};
+
+struct IniSection {
+    std::string name;
+    std::vector<IniEntry> entries;
+};
+
+struct Field {
+    std::string key;
+    std::string member;
+    FieldType type;
+    std::string default_value;  // 最初に現れたセクションでの値
+    std::string comment;
+};
+
+// 1つのセクション、または番号付きセクションのまとまり
+struct Group {
+    std::string name;          // 番号を除いたセクション名
+    std::string struct_name;
+    std::string member;
+    bool is_array;
+    std::vector<const IniSection*> sections;
+    std::vector<Field> fields;  // 全セクションの和集合（現れた順）
+};
+
+std::string trim(const std::string& text) {
+    size_t begin = text.find_first_not_of(" \t\r\n");
+    if (begin == std::string::npos) {
+        return "";
+    }
+    size_t end = text.find_last_not_of(" \t\r\n");
+    return text.substr(begin, end - begin + 1);
+}
+
+std::string to_lower(std::string text) {
+    for (char& c : text) {
+        c = (char)tolower((unsigned char)c);
+    }
+    return text;
+}
+
+/**
+ * @brief iniファイルを読み込む（キーの直前のコメント行はそのキーの説明として残す）
+ */
+bool read_ini(const std::string& path, std::vector<IniSection>& sections) {
+    std::ifstream in(path.c_str());
+    if (!in) {
+        return false;
+    }
+    std::string line;
+    std::string comment;
+    while (std::getline(in, line)) {
+        line = trim(line);
+        if (line.empty()) {
+            comment.clear();
+            continue;
+        }
+        if (line[0] == '#' || line[0] == ';') {
+            std::string text = trim(line.substr(1));
+            comment = comment.empty() ? text : comment + "\n" + text;
+            continue;
+        }
+        if (line[0] == '[') {
+            size_t end = line.find(']');
+            IniSection section;
+            section.name = trim(line.substr(1, end == std::string::npos ? std::string::npos : end - 1));
+            sections.push_back(section);
+            comment.clear();
+            continue;
+        }
+        size_t equals_pos = line.find('=');
+        if (equals_pos == std::string::npos || sections.empty()) {
+            comment.clear();
+            continue;
+        }
+        IniEntry entry;
+        entry.key = trim(line.substr(0, equals_pos));
+        entry.value = trim(line.substr(equals_pos + 1));
+        entry.comment = comment;
+        sections.back().entries.push_back(entry);
+        comment.clear();
+    }
+    return true;
+}
+
+FieldType infer_type(const std::string& value) {
+    std::string lower = to_lower(value);
+    if (lower == "true" || lower == "false") {
+        return TYPE_BOOL;
+    }
+    if (value.empty()) {
+        return TYPE_STRING;
+    }
+    char* end = nullptr;
+    errno = 0;
+    long long integer = strtoll(value.c_str(), &end, 10);
+    if (*end == '\0' && errno == 0 && integer >= INT_MIN && integer <= INT_MAX) {
+        return TYPE_INT;
+    }
+    strtod(value.c_str(), &end);
+    if (*end == '\0') {
+        return TYPE_DOUBLE;
+    }
+    return TYPE_STRING;
+}
+
+// 番号付きセクションで型が食い違った場合は、両方を表せる型にする
+FieldType merge_type(FieldType a, FieldType b) {
+    if (a == b) {
+        return a;
+    }
+    if ((a == TYPE_INT && b == TYPE_DOUBLE) || (a == TYPE_DOUBLE && b == TYPE_INT)) {
+        return TYPE_DOUBLE;
+    }
+    return TYPE_STRING;
+}
+
+// 英数字以外を '_' にし、小文字の識別子にする
+std::string identifier_of(const std::string& name) {
+    std::string out;
+    for (char c : name) {
+        out += isalnum((unsigned char)c) ? (char)tolower((unsigned char)c) : '_';
+    }
+    if (out.empty() || isdigit((unsigned char)out[0])) {
+        out = "k_" + out;
+    }
+    return out;
+}
+
+// THRUSTER_CONTROL -> ThrusterControlConfig
+std::string struct_name_of(const std::string& name) {
+    std::string out;
+    bool upper = true;
+    for (char c : name) {
+        if (!isalnum((unsigned char)c)) {
+            upper = true;
+            continue;
+        }
+        out += upper ? (char)toupper((unsigned char)c) : (char)tolower((unsigned char)c);
+        upper = false;
+    }
+    if (out.empty() || isdigit((unsigned char)out[0])) {
+        out = "Section" + out;
+    }
+    return out + "Config";
+}
+
+/**
+ * @brief "NAME_数字" で終わるセクション名を分解する
+ * @return 番号付きならtrue
+ */
+bool split_indexed_name(const std::string& name, std::string& base, int& index) {
+    size_t underscore = name.rfind('_');
+    if (underscore == std::string::npos || underscore + 1 >= name.size() || underscore == 0) {
+        return false;
+    }
+    for (size_t i = underscore + 1; i < name.size(); ++i) {
+        if (!isdigit((unsigned char)name[i])) {
+            return false;
+        }
+    }
+    base = name.substr(0, underscore);
+    index = atoi(name.c_str() + underscore + 1);
+    return true;
+}
+
+/**
+ * @brief セクションを構造体の単位にまとめる（番号が1から連続するものは配列にする）
+ */
+std::vector<Group> build_groups(const std::vector<IniSection>& sections) {
+    std::map<std::string, std::map<int, const IniSection*> > indexed;
+    for (const IniSection& section : sections) {
+        std::string base;
+        int index;
+        if (split_indexed_name(section.name, base, index)) {
+            indexed[base][index] = &section;
+        }
+    }
+
+    std::vector<Group> groups;
+    std::map<std::string, size_t> group_of_base;
+    for (const IniSection& section : sections) {
+        std::string base;
+        int index = 0;
+        bool is_array = false;
+        if (split_indexed_name(section.name, base, index)) {
+            const std::map<int, const IniSection*>& members = indexed[base];
+            is_array = members.begin()->first == 1 && members.rbegin()->first == (int)members.size();
+        }
+        if (is_array) {
+            if (group_of_base.count(base) == 0) {
+                group_of_base[base] = groups.size();
+                Group group;
+                group.name = base;
+                group.is_array = true;
+                for (const auto& member : indexed[base]) {
+                    group.sections.push_back(member.second);
+                }
+                groups.push_back(group);
+            }
+            continue;
+        }
+        Group group;
+        group.name = section.name;
+        group.is_array = false;
+        group.sections.push_back(&section);
+        groups.push_back(group);
+    }
+
+    for (Group& group : groups) {
+        group.struct_name = struct_name_of(group.name);
+        group.member = identifier_of(group.name);
+        std::map<std::string, size_t> field_of_key;
+        for (const IniSection* section : group.sections) {
+            for (const IniEntry& entry : section->entries) {
+                FieldType type = infer_type(entry.value);
+                auto it = field_of_key.find(entry.key);
+                if (it != field_of_key.end()) {
+                    Field& field = group.fields[it->second];
+                    field.type = merge_type(field.type, type);
+                    continue;
+                }
+                field_of_key[entry.key] = group.fields.size();
+                Field field;
+                field.key = entry.key;
+                field.member = identifier_of(entry.key);
+                field.type = type;
+                field.default_value = entry.value;
+                field.comment = entry.comment;
+                group.fields.push_back(field);
+            }
+        }
+    }
+    return groups;
+}
+
+const char* cpp_type(FieldType type) {
+    switch (type) {
+    case TYPE_INT: return "int";
+    case TYPE_DOUBLE: return "double";
+    case TYPE_BOOL: return "bool";
+    default: return "std::string";
+    }
+}
+
+const char* type_tag(FieldType type) {
+    switch (type) {
+    case TYPE_INT: return "int";
+    case TYPE_DOUBLE: return "double";
+    case TYPE_BOOL: return "bool";
+    default: return "string";
+    }
+}
+
+std::string string_literal(const std::string& value) {
+    std::string out = "\"";
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+        }
+        out += c;
+    }
+    return out + "\"";
+}
+
+// iniの値を、その型のC++のリテラルにする
+std::string literal_of(FieldType type, const std::string& value) {
+    switch (type) {
+    case TYPE_INT:
+        return std::to_string(strtol(value.c_str(), nullptr, 10));
+    case TYPE_DOUBLE: {
+        std::string literal = value;
+        if (literal.find_first_of(".eE") == std::string::npos) {
+            literal += ".0";
+        }
+        return literal;
+    }
+    case TYPE_BOOL:
+        return to_lower(value) == "true" ? "true" : "false";
+    default:
+        return string_literal(value);
+    }
+}
+
+uint64_t fnv1a(const std::string& text, uint64_t hash = 1469598103934665603ULL) {
+    for (unsigned char c : text) {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+const IniEntry* find_entry(const IniSection& section, const std::string& key) {
+    for (const IniEntry& entry : section.entries) {
+        if (entry.key == key) {
+            return &entry;
+        }
+    }
+    return nullptr;
+}
+
+// 1セクション分の読み込み・書き出し・比較のコードを出力する（番号付きは番号ごとに展開する）
+void emit_section_load(std::ostream& out, const Group& group, const IniSection& section, const std::string& target) {
+    for (const Field& field : group.fields) {
+        if (find_entry(section, field.key) == nullptr) {
+            continue;  // この番号のセクションには無い項目
+        }
+        out << "    ok &= detail::load_field(get, \"" << section.name << "\", \"" << field.key << "\", " << target
+            << "." << field.member << ", errors);\n";
+    }
+}
+
+void emit_section_serialize(std::ostream& out, const Group& group, const IniSection& section,
+                            const std::string& target) {
+    for (const Field& field : group.fields) {
+        if (find_entry(section, field.key) == nullptr) {
+            continue;
+        }
+        out << "    detail::append_field(out, \"" << section.name << "\", \"" << field.key << "\", " << target << "."
+            << field.member << ");\n";
+    }
+}
+
+void emit_section_diff(std::ostream& out, const Group& group, const IniSection& section, const std::string& index) {
+    for (const Field& field : group.fields) {
+        if (find_entry(section, field.key) == nullptr) {
+            continue;
+        }
+        out << "    detail::diff_field(diffs, \"" << section.name << "\", \"" << field.key << "\", a." << group.member
+            << index << "." << field.member << ", b." << group.member << index << "." << field.member << ");\n";
+    }
+}
+
+void emit_comment(std::ostream& out, const std::string& comment, const char* indent) {
+    std::stringstream lines(comment);
+    std::string line;
+    while (std::getline(lines, line)) {
+        out << indent << "// " << line << "\n";
+    }
+}
+
+void emit_header(std::ostream& out, const std::string& source, const std::vector<Group>& groups) {
+    std::string schema;
+    size_t field_count = 0;
+    for (const Group& group : groups) {
+        for (const IniSection* section : group.sections) {
+            for (const Field& field : group.fields) {
+                if (find_entry(*section, field.key) != nullptr) {
+                    schema += section->name + "\t" + field.key + "\t" + type_tag(field.type) + "\n";
+                    field_count++;
+                }
+            }
+        }
+    }
+
+    out << "// config_types.h - " << source << " から tools/config_codegen で生成したファイル。直接編集しないこと\n"
+        << "//\n"
+        << "// 設定をセクションごとの型付き構造体として扱う。" << source << " の項目や型が変わったら\n"
+        << "// make codegen で生成し直す（利用側のコードが古い項目を参照していればコンパイルエラーになる）。\n"
+        << "//\n"
+        << "// 使用例（クライアントSDKから読み込む）:\n"
+        << "//   configsync::Client client(\"unix:/tmp/config_sync.sock\");\n"
+        << "//   client.wait(1, 2000);\n"
+        << "//   configsync::TypedConfig config;\n"
+        << "//   configsync::load_typed_config([&client](const char* section, const char* key, std::string& value) {\n"
+        << "//       return client.lookup(section, key, value);\n"
+        << "//   }, config);\n"
+        << "//   double kp = config.thruster_control.kp_roll;\n"
+        << "\n"
+        << "#ifndef CONFIGSYNC_CONFIG_TYPES_H\n"
+        << "#define CONFIGSYNC_CONFIG_TYPES_H\n"
+        << "\n"
+        << "#include <array>\n"
+        << "#include <map>\n"
+        << "#include <string>\n"
+        << "#include <vector>\n"
+        << "#include <cstdio>\n"
+        << "#include <cstdlib>\n"
+        << "#include <cctype>\n"
+        << "#include <stdint.h>\n"
+        << "\n"
+        << "namespace configsync {\n"
+        << "\n"
+        << "// 生成元の (セクション, キー, 型) の一覧から求めた値。利用側で static_assert すれば取り違えを検出できる\n"
+        << "const uint64_t TYPED_CONFIG_SCHEMA_HASH = 0x" << std::hex << fnv1a(schema) << std::dec << "ULL;\n"
+        << "const size_t TYPED_CONFIG_FIELD_COUNT = " << field_count << ";\n"
+        << "\n";
+
+    for (const Group& group : groups) {
+        out << "// [" << group.name << (group.is_array ? "_n" : "") << "]\n";
+        out << "struct " << group.struct_name << " {\n";
+        for (const Field& field : group.fields) {
+            emit_comment(out, field.comment, "    ");
+            out << "    " << cpp_type(field.type) << " " << field.member << " = "
+                << literal_of(field.type, field.default_value) << ";\n";
+        }
+        out << "};\n\n";
+    }
+
+    out << "struct TypedConfig {\n";
+    for (const Group& group : groups) {
+        if (group.is_array) {
+            out << "    std::array<" << group.struct_name << ", " << group.sections.size() << "> " << group.member
+                << ";  // [" << group.sections.front()->name << "] 〜 [" << group.sections.back()->name << "]\n";
+        } else {
+            out << "    " << group.struct_name << " " << group.member << ";\n";
+        }
+    }
+    // 番号付きセクションは番号ごとに既定値が違うことがあるため、コンストラクタで入れる
+    bool has_array = false;
+    for (const Group& group : groups) {
+        has_array |= group.is_array;
+    }
+    if (has_array) {
+        out << "\n    TypedConfig() {\n";
+        for (const Group& group : groups) {
+            if (!group.is_array) {
+                continue;
+            }
+            for (size_t i = 0; i < group.sections.size(); ++i) {
+                for (const Field& field : group.fields) {
+                    const IniEntry* entry = find_entry(*group.sections[i], field.key);
+                    if (entry == nullptr || entry->value == field.default_value) {
+                        continue;
+                    }
+                    out << "        " << group.member << "[" << i << "]." << field.member << " = "
+                        << literal_of(field.type, entry->value) << ";\n";
+                }
+            }
+        }
+        out << "    }\n";
+    }
+    out << "};\n\n";
+
+    out << "struct TypedConfigDiff {\n"
+        << "    const char* section;\n"
+        << "    const char* key;\n"
+        << "    std::string old_value;\n"
+        << "    std::string new_value;\n"
+        << "};\n\n";
+
+    out << R"(namespace detail {
+
+inline bool parse_value(const std::string& text, int& value) {
+    char* end = nullptr;
+    long parsed = strtol(text.c_str(), &end, 10);
+    if (end == text.c_str() || *end != '\0') return false;
+    value = (int)parsed;
+    return true;
+}
+
+inline bool parse_value(const std::string& text, double& value) {
+    char* end = nullptr;
+    double parsed = strtod(text.c_str(), &end);
+    if (end == text.c_str() || *end != '\0') return false;
+    value = parsed;
+    return true;
+}
+
+inline bool parse_value(const std::string& text, bool& value) {
+    std::string lower;
+    for (char c : text) lower += (char)tolower((unsigned char)c);
+    if (lower == "true" || lower == "1" || lower == "yes" || lower == "on") { value = true; return true; }
+    if (lower == "false" || lower == "0" || lower == "no" || lower == "off") { value = false; return true; }
+    return false;
+}
+
+inline bool parse_value(const std::string& text, std::string& value) {
+    value = text;
+    return true;
+}
+
+inline std::string format_value(int value) { return std::to_string(value); }
+inline std::string format_value(bool value) { return value ? "true" : "false"; }
+inline std::string format_value(const std::string& value) { return value; }
+
+// 読み戻して同じ値になる最短の桁数を求め（0.15 が 0.14999999999999999 にならないように）、
+// 指数を使わない小数で書く（50.0 が 5e+01 にならないように。整数値は "50.0" の形にする）
+inline std::string format_value(double value) {
+    char buffer[400];
+    int precision = 1;
+    for (; precision < 17; ++precision) {
+        snprintf(buffer, sizeof(buffer), "%.*e", precision - 1, value);
+        if (strtod(buffer, nullptr) == value) break;
+    }
+    snprintf(buffer, sizeof(buffer), "%.*e", precision - 1, value);
+    std::string text = buffer;
+    size_t e = text.find('e');
+    if (e == std::string::npos) return text; // inf, nan
+    int exponent = atoi(text.c_str() + e + 1);
+    int decimals = precision - 1 - exponent;
+    snprintf(buffer, sizeof(buffer), "%.*f", decimals > 0 ? decimals : 0, value);
+    text = buffer;
+    if (text.find('.') == std::string::npos) text += ".0";
+    return text;
+}
+
+template <typename Getter, typename T>
+bool load_field(Getter& get, const char* section, const char* key, T& field, std::vector<std::string>* errors) {
+    std::string text;
+    if (!get(section, key, text)) {
+        if (errors != nullptr) errors->push_back(std::string("[") + section + "]" + key + " がありません");
+        return false;
+    }
+    if (!parse_value(text, field)) {
+        if (errors != nullptr) errors->push_back(std::string("[") + section + "]" + key + " の値 \"" + text + "\" を解釈できません");
+        return false;
+    }
+    return true;
+}
+
+template <typename T>
+void append_field(std::string& out, const char* section, const char* key, const T& field) {
+    out += '[';
+    out += section;
+    out += ']';
+    out += key;
+    out += '=';
+    out += format_value(field);
+    out += '\n';
+}
+
+template <typename T>
+void diff_field(std::vector<TypedConfigDiff>& diffs, const char* section, const char* key, const T& a, const T& b) {
+    if (a == b) return;
+    TypedConfigDiff diff;
+    diff.section = section;
+    diff.key = key;
+    diff.old_value = format_value(a);
+    diff.new_value = format_value(b);
+    diffs.push_back(diff);
+}
+
+inline std::string upper_section(const std::string& section) {
+    std::string out;
+    for (char c : section) out += (char)toupper((unsigned char)c);
+    return out;
+}
+
+} // namespace detail
+
+/**
+ * @brief (セクション, キー) から値を引く関数で読み込む
+ * @param get bool get(const char* section, const char* key, std::string& value)。見つかればtrue
+ * @param errors 欠けている項目や解釈できない値の説明を受け取る（省略可）
+ * @return すべての項目を読めた場合はtrue（読めなかった項目は元の値のまま）
+ */
+template <typename Getter>
+bool load_typed_config(Getter get, TypedConfig& config, std::vector<std::string>* errors = nullptr) {
+    bool ok = true;
+)";
+    for (const Group& group : groups) {
+        for (size_t i = 0; i < group.sections.size(); ++i) {
+            std::string target = "config." + group.member;
+            if (group.is_array) {
+                target += "[" + std::to_string(i) + "]";
+            }
+            emit_section_load(out, group, *group.sections[i], target);
+        }
+    }
+    out << "    return ok;\n"
+        << "}\n\n";
+
+    out << R"(/**
+ * @brief "[SECTION]KEY=VALUE" 形式の行（serialize_config や ?SNAPSHOT の本体）から読み込む
+ * セクション名の大文字小文字は区別しない。
+ */
+inline bool parse_typed_config(const std::string& text, TypedConfig& config, std::vector<std::string>* errors = nullptr) {
+    std::map<std::string, std::string> values;
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t end = text.find('\n', pos);
+        if (end == std::string::npos) end = text.size();
+        std::string line = text.substr(pos, end - pos);
+        pos = end + 1;
+        size_t section_end = line.find(']');
+        size_t equals_pos = line.find('=', section_end == std::string::npos ? 0 : section_end);
+        if (line.empty() || line[0] != '[' || section_end == std::string::npos || equals_pos == std::string::npos) {
+            continue;
+        }
+        values[detail::upper_section(line.substr(1, section_end - 1)) + "\n" +
+               line.substr(section_end + 1, equals_pos - section_end - 1)] = line.substr(equals_pos + 1);
+    }
+    return load_typed_config([&values](const char* section, const char* key, std::string& value) {
+        auto it = values.find(detail::upper_section(section) + "\n" + key);
+        if (it == values.end()) return false;
+        value = it->second;
+        return true;
+    }, config, errors);
+}
+
+/**
+ * @brief "[SECTION]KEY=VALUE" 形式に書き出す（フレームを付ければそのまま更新として送れる）
+ */
+inline std::string serialize_typed_config(const TypedConfig& config) {
+    std::string out;
+)";
+    for (const Group& group : groups) {
+        for (size_t i = 0; i < group.sections.size(); ++i) {
+            std::string target = "config." + group.member;
+            if (group.is_array) {
+                target += "[" + std::to_string(i) + "]";
+            }
+            emit_section_serialize(out, group, *group.sections[i], target);
+        }
+    }
+    out << "    return out;\n"
+        << "}\n\n";
+
+    out << "/**\n"
+        << " * @brief a から b で値が変わった項目を、生成元の並び順で返す\n"
+        << " */\n"
+        << "inline std::vector<TypedConfigDiff> diff_typed_config(const TypedConfig& a, const TypedConfig& b) {\n"
+        << "    std::vector<TypedConfigDiff> diffs;\n";
+    for (const Group& group : groups) {
+        for (size_t i = 0; i < group.sections.size(); ++i) {
+            emit_section_diff(out, group, *group.sections[i],
+                              group.is_array ? "[" + std::to_string(i) + "]" : std::string());
+        }
+    }
+    out << "    return diffs;\n"
+        << "}\n\n"
+        << "} // namespace configsync\n\n"
+        << "#endif // CONFIGSYNC_CONFIG_TYPES_H\n";
+}
+
+int main(int argc, char* argv[]) {
+    std::string input = argc > 1 ? argv[1] : "config.ini";
+    std::vector<IniSection> sections;
+    if (!read_ini(input, sections)) {
+        std::cerr << "エラー: " << input << " を読み込めません。\n";
+        return 1;
+    }
+    std::vector<Group> groups = build_groups(sections);
+
+    std::stringstream header;
+    emit_header(header, input, groups);
+    if (argc > 2) {
+        std::ofstream out(argv[2]);
+        if (!out || !(out << header.str())) {
+            std::cerr << "エラー: " << argv[2] << " に書き込めません。\n";
+            return 1;
+        }
+    } else {
+        std::cout << header.str();
+    }
+    return 0;
+}
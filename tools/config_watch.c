@@ -0,0 +1,123 @@
+/* config_watch.c - クライアントSDKのC ABIを使って設定の変化を表示する
+ *
+ * 目的:
+ * 設定を読む側のプロセスの見本として、サーバーを購読し、
+ * 押し込まれた変更を1項目1行で表示する。
+ * --bench を付けると、手元の写しとビューからの読み出し、ビューの切り替えにかかる時間を測って終了する。
+ *
+ * 使用方法:
+ * ./config_watch [アドレス（既定: unix:/tmp/config_sync.sock）] [--bench]
+ *
+ * コンパイル方法:
+ * make config-watch
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "../configsync_client.h"
+
+static volatile sig_atomic_t g_stop = 0;
+
+static void on_signal(int signum) {
+    (void)signum;
+    g_stop = 1;
+}
+
+static void on_change(void* user, const char* section, const char* key, const char* value, uint64_t version) {
+    (void)user;
+    printf("版 %llu: [%s] %s = %s\n", (unsigned long long)version, section, key, value);
+    fflush(stdout);
+}
+
+static void on_impact(void* user, const char* component, int impact, uint64_t version) {
+    static const char* const names[] = {"そのまま反映", "コンポーネントの作り直し", "プロセスの再起動"};
+    (void)user;
+    printf("版 %llu: [%s] の影響 = %s\n", (unsigned long long)version, component,
+           names[impact >= 0 && impact <= 2 ? impact : 2]);
+    fflush(stdout);
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void run_bench(configsync_client* client) {
+    const int iterations = 10000000;
+    char buffer[64];
+    double sum = 0.0;
+    double start = now_ns();
+    for (int i = 0; i < iterations; i++) {
+        sum += configsync_client_get_double(client, "THRUSTER_CONTROL", "KP_ROLL", 0.0);
+    }
+    double get_double_ns = (now_ns() - start) / iterations;
+    start = now_ns();
+    for (int i = 0; i < iterations; i++) {
+        sum += configsync_client_get(client, "PWM", "PWM_MIN", buffer, sizeof(buffer));
+    }
+    double get_ns = (now_ns() - start) / iterations;
+    printf("読み出し（%d 回の平均）: get_double %.1f ns, get %.1f ns (checksum %.0f)\n", iterations, get_double_ns,
+           get_ns, sum);
+
+    /* 制御ループの1周を模して、周回の先頭で swap してからビューで読む */
+    configsync_view* view = configsync_view_open(client);
+    int swapped = 0;
+    start = now_ns();
+    for (int i = 0; i < iterations; i++) {
+        swapped += configsync_view_swap(view);
+    }
+    double swap_ns = (now_ns() - start) / iterations;
+    start = now_ns();
+    for (int i = 0; i < iterations; i++) {
+        sum += configsync_view_get_double(view, "THRUSTER_CONTROL", "KP_ROLL", 0.0);
+    }
+    double view_get_double_ns = (now_ns() - start) / iterations;
+    printf("ビュー（%d 回の平均）: swap %.1f ns, get_double %.1f ns (切り替え %d 回, 版 %llu)\n", iterations, swap_ns,
+           view_get_double_ns, swapped, (unsigned long long)configsync_view_version(view));
+    configsync_view_close(view);
+}
+
+int main(int argc, char* argv[]) {
+    const char* address = "unix:/tmp/config_sync.sock";
+    int bench = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--bench") == 0) {
+            bench = 1;
+        } else {
+            address = argv[i];
+        }
+    }
+
+    configsync_client* client = configsync_client_open(address);
+    if (client == NULL) {
+        fprintf(stderr, "エラー: アドレス %s が不正です。\n", address);
+        return 1;
+    }
+    if (!configsync_client_wait(client, 1, 3000)) {
+        fprintf(stderr, "エラー: %s から設定を受け取れませんでした。\n", address);
+        configsync_client_close(client);
+        return 1;
+    }
+    printf("%s を購読しました（版 %llu）\n", address, (unsigned long long)configsync_client_version(client));
+
+    if (bench) {
+        run_bench(client);
+        configsync_client_close(client);
+        return 0;
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    configsync_client_set_callback(client, on_change, NULL);
+    configsync_client_set_impact_callback(client, on_impact, NULL);
+    while (!g_stop) {
+        pause();
+    }
+    configsync_client_close(client);
+    return 0;
+}
@@ -0,0 +1,158 @@
+// latency_compare.cpp - ループバックTCPとUNIXドメインソケットの往復遅延を比較する
+//
+// 目的:
+// 実行中のConfigSynchronizerに対して、同じフレーム化プロトコルで
+// 取得要求（?GET）と更新要求をTCP(127.0.0.1)とUNIXソケットの両方から送り、
+// 接続から応答受信（更新の場合は切断）までの往復時間を比較する。
+//
+// 使用方法:
+// ./latency_compare [回数] [TCPポート] [UNIXソケットのパス]
+//
+// コンパイル方法:
+// make latency-compare
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <iomanip>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <cstring>
+#include <errno.h>
+
+/**
+ * @brief TCPで127.0.0.1の指定ポートに接続する
+ */
+int connect_tcp(int port) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return sock;
+}
+
+/**
+ * @brief UNIXドメインソケットに接続する
+ */
+int connect_unix(const std::string& path) {
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/**
+ * @brief 1回の要求を送り、サーバーが接続を閉じるまで応答を読み切る
+ * @return 成功時true
+ */
+bool round_trip(int sock, const std::string& body) {
+    std::string message = std::to_string(body.size()) + "\n" + body;
+    size_t sent = 0;
+    while (sent < message.size()) {
+        ssize_t n = send(sock, message.data() + sent, message.size() - sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        sent += n;
+    }
+    char buffer[4096];
+    while (true) {
+        ssize_t n = recv(sock, buffer, sizeof(buffer), 0);
+        if (n == 0) return true;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+    }
+}
+
+struct Summary {
+    double mean_us;
+    double p50_us;
+    double p99_us;
+    int failures;
+};
+
+/**
+ * @brief 指定回数の往復時間を測定して要約する
+ */
+template <typename Connect>
+Summary measure(Connect connect_fn, int iterations, bool is_update) {
+    std::vector<double> samples;
+    samples.reserve(iterations);
+    int failures = 0;
+    for (int i = 0; i < iterations; i++) {
+        std::string body = is_update
+            ? "[JOYSTICK]DEADZONE=" + std::to_string(6500 + (i % 2)) + "\n"
+            : "?GET [PWM]PWM_MIN\n";
+        auto start = std::chrono::steady_clock::now();
+        int sock = connect_fn();
+        bool ok = sock >= 0 && round_trip(sock, body);
+        if (sock >= 0) close(sock);
+        auto end = std::chrono::steady_clock::now();
+        if (!ok) {
+            failures++;
+            continue;
+        }
+        samples.push_back(std::chrono::duration<double, std::micro>(end - start).count());
+    }
+
+    Summary summary = {0.0, 0.0, 0.0, failures};
+    if (samples.empty()) return summary;
+    std::sort(samples.begin(), samples.end());
+    double total = 0.0;
+    for (double s : samples) total += s;
+    summary.mean_us = total / samples.size();
+    summary.p50_us = samples[samples.size() / 2];
+    summary.p99_us = samples[std::min(samples.size() - 1, samples.size() * 99 / 100)];
+    return summary;
+}
+
+void print_summary(const std::string& label, const Summary& s) {
+    std::cout << std::left << std::setw(14) << label << std::right << std::fixed << std::setprecision(1)
+              << std::setw(10) << s.mean_us << std::setw(10) << s.p50_us << std::setw(10) << s.p99_us
+              << std::setw(8) << s.failures << "\n";
+}
+
+int main(int argc, char* argv[]) {
+    int iterations = argc > 1 ? std::atoi(argv[1]) : 1000;
+    int port = argc > 2 ? std::atoi(argv[2]) : 12348;
+    std::string uds_path = argc > 3 ? argv[3] : "/tmp/config_sync.sock";
+
+    std::cout << "往復遅延の比較（" << iterations << " 回, 単位: マイクロ秒）\n";
+    std::cout << std::left << std::setw(14) << "経路/要求" << std::right << std::setw(10) << "平均"
+              << std::setw(10) << "p50" << std::setw(10) << "p99" << std::setw(8) << "失敗" << "\n";
+
+    auto tcp = [port]() { return connect_tcp(port); };
+    auto uds = [&uds_path]() { return connect_unix(uds_path); };
+
+    print_summary("TCP get", measure(tcp, iterations, false));
+    print_summary("UDS get", measure(uds, iterations, false));
+    print_summary("TCP update", measure(tcp, iterations, true));
+    print_summary("UDS update", measure(uds, iterations, true));
+    return 0;
+}
@@ -0,0 +1,396 @@
+// replication_bench.cpp - 複数のConfigSynchronizerを起動し、レプリケーションの収束にかかる通信量を測る
+//
+// 目的:
+// localhostでN個のノード（それぞれ別ポート・別ディレクトリ）を起動し、全ノードを互いの
+// REPLICATION_PEERS に登録する。設定の大きさ（複製するセクションの項目数）ごとに
+//   1. 初回: 1つのノードに全項目を書き込み、全ノードのルートハッシュが揃うまで
+//   2. 差分: 別のノードで一部の項目を書き換え、再び揃うまで
+// の時間と、ノード間でやり取りしたバイト数（各ノードの ?AE_STATS の合計）を測る。
+// 比較のため、同じ変更のたびに全設定を他の全ノードへ送った場合のバイト数も表示する。
+//
+// 項目は config.ini から読まず、更新メッセージで [BENCH] セクションに書き込む
+// （load_config が読むキーは決まっているため）。
+//
+// 使用方法:
+// ./replication_bench [--binary ./ConfigSynchronizer] [--nodes 4] [--sizes 10,100,1000,10000]
+//                     [--changes 5] [--base-port 22400] [--interval 200] [--timeout 30]
+//
+// コンパイル方法:
+// make replication-bench
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <fstream>
+#include <chrono>
+#include <thread>
+#include <iomanip>
+#include <cstdlib>
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <cstring>
+#include <errno.h>
+
+typedef std::chrono::steady_clock Clock;
+
+struct Options {
+    std::string binary = "./ConfigSynchronizer";
+    int nodes = 4;
+    std::vector<int> sizes = {10, 100, 1000, 10000};
+    int changes = 5;
+    int base_port = 22400;
+    int interval_ms = 200;
+    double timeout_sec = 30.0;
+};
+
+/**
+ * @brief 起動したノード1つ分
+ */
+struct Node {
+    pid_t pid = -1;
+    int stdin_fd = -1;  // "q" を書いて終了させる（閉じると対話ループが空行を読み続けるため開けておく）
+    int port = 0;
+    std::string dir;
+};
+
+/**
+ * @brief 127.0.0.1の指定ポートへ1つのメッセージを送り、応答本体を受け取る
+ */
+bool request(int port, const std::string& body, std::string& reply) {
+    reply.clear();
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return false;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    struct timeval timeout = {5, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return false;
+    }
+    std::string message = std::to_string(body.size()) + "\n" + body;
+    size_t sent = 0;
+    while (sent < message.size()) {
+        ssize_t n = send(sock, message.data() + sent, message.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) {
+            close(sock);
+            return false;
+        }
+        sent += n;
+    }
+    std::string received;
+    char buffer[4096];
+    ssize_t n;
+    while ((n = recv(sock, buffer, sizeof(buffer), 0)) > 0) {
+        received.append(buffer, n);
+    }
+    close(sock);
+    size_t newline = received.find('\n');
+    if (newline != std::string::npos) {
+        reply = received.substr(newline + 1);
+    }
+    return true;
+}
+
+/**
+ * @brief ?AE_STATS の "名前=値" から1つを取り出す
+ */
+std::string stat_value(const std::string& stats, const std::string& name) {
+    std::stringstream lines(stats);
+    std::string line;
+    while (std::getline(lines, line)) {
+        if (line.compare(0, name.size() + 1, name + "=") == 0) {
+            return line.substr(name.size() + 1);
+        }
+    }
+    return "";
+}
+
+/**
+ * @brief 全ノードのルートハッシュと、やり取りしたバイト数の合計
+ */
+bool collect(const std::vector<Node>& nodes, std::vector<std::string>& roots, uint64_t& bytes) {
+    roots.clear();
+    bytes = 0;
+    for (const Node& node : nodes) {
+        std::string stats;
+        if (!request(node.port, "?AE_STATS\n", stats)) {
+            return false;
+        }
+        roots.push_back(stat_value(stats, "root"));
+        bytes += strtoull(stat_value(stats, "bytes_sent").c_str(), nullptr, 10);
+        bytes += strtoull(stat_value(stats, "bytes_received").c_str(), nullptr, 10);
+    }
+    return true;
+}
+
+bool all_equal(const std::vector<std::string>& roots) {
+    for (const std::string& root : roots) {
+        if (root.empty() || root != roots[0]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief 全ノードのルートハッシュが揃うまで待つ
+ * @param elapsed_ms 揃うまでの時間
+ * @param bytes 揃った時点のバイト数の合計
+ * @return 時間内に揃えばtrue
+ */
+bool wait_converged(const std::vector<Node>& nodes, double timeout_sec, double& elapsed_ms, uint64_t& bytes) {
+    Clock::time_point start = Clock::now();
+    std::vector<std::string> roots;
+    while (std::chrono::duration<double>(Clock::now() - start).count() < timeout_sec) {
+        if (collect(nodes, roots, bytes) && all_equal(roots)) {
+            elapsed_ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    return false;
+}
+
+bool wait_port(int port, double timeout_sec) {
+    Clock::time_point start = Clock::now();
+    std::string reply;
+    while (std::chrono::duration<double>(Clock::now() - start).count() < timeout_sec) {
+        if (request(port, "?PING ready\n", reply)) {
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    return false;
+}
+
+/**
+ * @brief ノードの設定ファイルを書き、プロセスを起動する
+ */
+bool start_node(const Options& options, int index, Node& node) {
+    node.port = options.base_port + index;
+    char dir_template[] = "/tmp/replication_bench_XXXXXX";
+    if (mkdtemp(dir_template) == nullptr) {
+        return false;
+    }
+    node.dir = dir_template;
+
+    std::string peers;
+    for (int i = 0; i < options.nodes; i++) {
+        if (i != index) {
+            peers += (peers.empty() ? "" : ",") + std::string("127.0.0.1:") + std::to_string(options.base_port + i);
+        }
+    }
+    std::ofstream ini(node.dir + "/config.ini");
+    ini << "[CONFIG_SYNC]\n"
+        << "WPF_HOST=127.0.0.1\n"
+        << "WPF_RECV_PORT=1\n"  // WPFは居ない（送信は接続拒否で終わる）
+        << "CPP_RECV_PORT=" << node.port << "\n"
+        << "UDS_PATH=\n"
+        << "METRICS_PORT=0\n"
+        << "HEARTBEAT_INTERVAL_MS=0\n"
+        << "JOURNAL_ENABLED=false\n"
+        << "SAVE_DURABILITY=none\n"
+        << "ADMISSION_MAX_CONNECTIONS=256\n"
+        << "ADMISSION_PEER_CONNECT_RATE=100000\n"
+        << "ADMISSION_PEER_UPDATE_RATE=100000\n"
+        << "ADMISSION_GLOBAL_UPDATE_RATE=100000\n"
+        << "NODE_ID=node" << index << "\n"
+        << "REPLICATION_PEERS=" << peers << "\n"
+        << "REPLICATION_SECTIONS=BENCH\n"
+        << "REPLICATION_INTERVAL_MS=" << options.interval_ms << "\n";
+    ini.close();
+
+    int pipe_fds[2];
+    if (pipe(pipe_fds) != 0) {
+        return false;
+    }
+    std::string binary = options.binary;
+    if (!binary.empty() && binary[0] != '/') {
+        char cwd[4096];
+        if (getcwd(cwd, sizeof(cwd)) != nullptr) {
+            binary = std::string(cwd) + "/" + binary;
+        }
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        return false;
+    }
+    if (pid == 0) {
+        dup2(pipe_fds[0], STDIN_FILENO);
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        int log_fd = open((node.dir + "/node.log").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (log_fd >= 0) {
+            dup2(log_fd, STDOUT_FILENO);
+            dup2(log_fd, STDERR_FILENO);
+            close(log_fd);
+        }
+        if (chdir(node.dir.c_str()) != 0) {
+            _exit(127);
+        }
+        execl(binary.c_str(), binary.c_str(), "config.ini", (char*)nullptr);
+        _exit(127);
+    }
+    close(pipe_fds[0]);
+    node.pid = pid;
+    node.stdin_fd = pipe_fds[1];
+    return true;
+}
+
+void stop_node(Node& node) {
+    if (node.pid > 0) {
+        ssize_t ret = write(node.stdin_fd, "q\n", 2);
+        (void)ret;
+        close(node.stdin_fd);
+        int status;
+        for (int i = 0; i < 100 && waitpid(node.pid, &status, WNOHANG) == 0; i++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+        if (waitpid(node.pid, &status, WNOHANG) == 0) {
+            kill(node.pid, SIGKILL);
+            waitpid(node.pid, &status, 0);
+        }
+        node.pid = -1;
+    }
+    if (!node.dir.empty()) {
+        std::string command = "rm -rf '" + node.dir + "'";
+        int ret = system(command.c_str());
+        (void)ret;
+        node.dir.clear();
+    }
+}
+
+/**
+ * @brief 項目 [BENCH]KEY_i の値（round ごとに変える）
+ */
+std::string bench_entry(int i, int round) {
+    char key[32];
+    snprintf(key, sizeof(key), "KEY_%05d", i);
+    return "[BENCH]" + std::string(key) + "=value_" + std::to_string(round) + "_" + std::to_string(i * 7919 % 10007) +
+           "\n";
+}
+
+bool parse_args(int argc, char* argv[], Options& options) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            std::cerr << "エラー: " << arg << " に値がありません。\n";
+            return false;
+        }
+        std::string value = argv[++i];
+        if (arg == "--binary") {
+            options.binary = value;
+        } else if (arg == "--nodes") {
+            options.nodes = std::max(2, atoi(value.c_str()));
+        } else if (arg == "--sizes") {
+            options.sizes.clear();
+            std::stringstream ss(value);
+            std::string size;
+            while (std::getline(ss, size, ',')) {
+                options.sizes.push_back(std::max(1, atoi(size.c_str())));
+            }
+        } else if (arg == "--changes") {
+            options.changes = std::max(1, atoi(value.c_str()));
+        } else if (arg == "--base-port") {
+            options.base_port = atoi(value.c_str());
+        } else if (arg == "--interval") {
+            options.interval_ms = atoi(value.c_str());
+        } else if (arg == "--timeout") {
+            options.timeout_sec = atof(value.c_str());
+        } else {
+            std::cerr << "エラー: 不明なオプションです: " << arg << "\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    Options options;
+    if (!parse_args(argc, argv, options)) {
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    std::cout << "ノード数 " << options.nodes << "（全ノードが互いに複製）、突き合わせ間隔 " << options.interval_ms
+              << "ms、差分の項目数 " << options.changes << "\n\n";
+    std::cout << std::left << std::setw(8) << "items" << std::setw(12) << "dump_bytes" << std::setw(12)
+              << "initial_ms" << std::setw(14) << "initial_bytes" << std::setw(10) << "delta_ms" << std::setw(13)
+              << "delta_bytes" << std::setw(17) << "full_push_bytes" << "ratio\n";
+
+    int exit_code = 0;
+    for (int size : options.sizes) {
+        std::vector<Node> nodes(options.nodes);
+        bool ok = true;
+        for (int i = 0; i < options.nodes && ok; i++) {
+            ok = start_node(options, i, nodes[i]);
+        }
+        for (int i = 0; i < options.nodes && ok; i++) {
+            ok = wait_port(nodes[i].port, 10.0);
+        }
+        if (!ok) {
+            std::cerr << "エラー: ノードを起動できませんでした（" << options.binary << "）。\n";
+            for (Node& node : nodes) stop_node(node);
+            return 1;
+        }
+
+        // 1. 初回: ノード0に全項目を書き込む
+        std::string seed;
+        for (int i = 0; i < size; i++) {
+            seed += bench_entry(i, 0);
+        }
+        std::vector<std::string> roots;
+        uint64_t before = 0;
+        uint64_t after = 0;
+        double initial_ms = 0;
+        double delta_ms = 0;
+        std::string reply;
+        collect(nodes, roots, before);
+        request(nodes[0].port, seed, reply);
+        bool initial_ok = wait_converged(nodes, options.timeout_sec, initial_ms, after);
+        uint64_t initial_bytes = after - before;
+
+        // 2. 差分: 最後のノードで一部の項目を書き換える
+        std::string delta;
+        int changes = std::min(options.changes, size);
+        for (int i = 0; i < changes; i++) {
+            delta += bench_entry((int)((long long)i * size / changes), 1);
+        }
+        collect(nodes, roots, before);
+        request(nodes[options.nodes - 1].port, delta, reply);
+        bool delta_ok = wait_converged(nodes, options.timeout_sec, delta_ms, after);
+        uint64_t delta_bytes = after - before;
+
+        // 変更のたびに全設定を他の全ノードへ送った場合
+        uint64_t dump_bytes = std::to_string(seed.size()).size() + 1 + seed.size();
+        uint64_t full_push_bytes = dump_bytes * (options.nodes - 1);
+
+        std::cout << std::left << std::setw(8) << size << std::setw(12) << dump_bytes << std::setw(12)
+                  << (initial_ok ? std::to_string((long long)initial_ms) : "timeout") << std::setw(14)
+                  << initial_bytes << std::setw(10) << (delta_ok ? std::to_string((long long)delta_ms) : "timeout")
+                  << std::setw(13) << delta_bytes << std::setw(17) << full_push_bytes << std::fixed
+                  << std::setprecision(3) << (double)delta_bytes / full_push_bytes << "\n";
+        if (!initial_ok || !delta_ok) {
+            exit_code = 1;
+        }
+        for (Node& node : nodes) {
+            stop_node(node);
+        }
+    }
+    std::cout << "\ninitial/delta_bytes: 収束までに全ノードがやり取りしたバイト数（揃った後の突き合わせも含む）\n"
+              << "full_push_bytes: 変更のたびに全設定を他の全ノードへ送る場合の1回分\n";
+    return exit_code;
+}
@@ -0,0 +1,370 @@
+// rollout_bench.cpp - 複数のConfigSynchronizerを起動し、2相コミットによるロールアウトの遅延を測る
+//
+// 目的:
+// localhostでN個のノード（それぞれ別ポート・別ディレクトリ）を起動し、ノード0を調整役として
+// 他の全ノードを ROLLOUT_PEERS に登録する（他のノードにはノード0を登録する）。ノード数ごとに
+//   1. ノード0へ ?ROLLOUT を繰り返し送り、!TX_COMMITTED が返るまでの時間（準備とコミットの2往復）
+//   2. 終了後、全ノードの値が最後のロールアウトの値と揃っているか
+//   3. 型の合わない値のロールアウトが検証で中止され、どのノードにも反映されないか
+//   4. 1つのノードを止めた（SIGSTOP）状態で、ROLLOUT_TIMEOUT_MS で中止され、再開後も反映されないか
+// を確かめる。
+//
+// 使用方法:
+// ./rollout_bench [--binary ./ConfigSynchronizer] [--nodes 2,4,8,16,32] [--rounds 100]
+//                 [--base-port 22600] [--timeout-ms 500]
+//
+// コンパイル方法:
+// make rollout-bench
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <fstream>
+#include <chrono>
+#include <thread>
+#include <iomanip>
+#include <algorithm>
+#include <cstdlib>
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <cstring>
+#include <errno.h>
+
+typedef std::chrono::steady_clock Clock;
+
+struct Options {
+    std::string binary = "./ConfigSynchronizer";
+    std::vector<int> nodes = {2, 4, 8, 16, 32};
+    int rounds = 100;
+    int base_port = 22600;
+    int timeout_ms = 500;
+};
+
+/**
+ * @brief 起動したノード1つ分
+ */
+struct Node {
+    pid_t pid = -1;
+    int stdin_fd = -1;  // "q" を書いて終了させる（閉じると対話ループが空行を読み続けるため開けておく）
+    int port = 0;
+    std::string dir;
+};
+
+/**
+ * @brief 127.0.0.1の指定ポートへ1つのメッセージを送り、応答本体を受け取る
+ */
+bool request(int port, const std::string& body, std::string& reply) {
+    reply.clear();
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return false;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    struct timeval timeout = {5, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return false;
+    }
+    std::string message = std::to_string(body.size()) + "\n" + body;
+    size_t sent = 0;
+    while (sent < message.size()) {
+        ssize_t n = send(sock, message.data() + sent, message.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) {
+            close(sock);
+            return false;
+        }
+        sent += n;
+    }
+    std::string received;
+    char buffer[4096];
+    ssize_t n;
+    while ((n = recv(sock, buffer, sizeof(buffer), 0)) > 0) {
+        received.append(buffer, n);
+    }
+    close(sock);
+    size_t newline = received.find('\n');
+    if (newline != std::string::npos) {
+        reply = received.substr(newline + 1);
+    }
+    return true;
+}
+
+bool wait_port(int port, double timeout_sec) {
+    Clock::time_point start = Clock::now();
+    std::string reply;
+    while (std::chrono::duration<double>(Clock::now() - start).count() < timeout_sec) {
+        if (request(port, "?PING ready\n", reply)) {
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    return false;
+}
+
+/**
+ * @brief ノードの設定ファイルを書き、プロセスを起動する
+ */
+bool start_node(const Options& options, int count, int index, Node& node) {
+    node.port = options.base_port + index;
+    char dir_template[] = "/tmp/rollout_bench_XXXXXX";
+    if (mkdtemp(dir_template) == nullptr) {
+        return false;
+    }
+    node.dir = dir_template;
+
+    // ノード0が調整役。他のノードはノード0からの準備だけを受け付ける
+    std::string peers;
+    if (index == 0) {
+        for (int i = 1; i < count; i++) {
+            peers += (peers.empty() ? "" : ",") + std::string("127.0.0.1:") + std::to_string(options.base_port + i);
+        }
+    } else {
+        peers = "127.0.0.1:" + std::to_string(options.base_port);
+    }
+    std::ofstream ini(node.dir + "/config.ini");
+    ini << "[PWM]\n"
+        << "PWM_NORMAL_MAX=1500\n"
+        << "PWM_BOOST_MAX=1900\n"
+        << "PWM_FREQUENCY=50.0\n"
+        << "[CONFIG_SYNC]\n"
+        << "WPF_HOST=127.0.0.1\n"
+        << "WPF_RECV_PORT=1\n"  // WPFは居ない（送信は接続拒否で終わる）
+        << "CPP_RECV_PORT=" << node.port << "\n"
+        << "UDS_PATH=\n"
+        << "METRICS_PORT=0\n"
+        << "HEARTBEAT_INTERVAL_MS=0\n"
+        << "JOURNAL_ENABLED=false\n"
+        << "SAVE_DURABILITY=none\n"
+        << "ADMISSION_MAX_CONNECTIONS=256\n"
+        << "ADMISSION_PEER_CONNECT_RATE=100000\n"
+        << "ADMISSION_PEER_UPDATE_RATE=100000\n"
+        << "ADMISSION_GLOBAL_UPDATE_RATE=100000\n"
+        << "NODE_ID=node" << index << "\n"
+        << "ROLLOUT_PEERS=" << peers << "\n"
+        << "ROLLOUT_TIMEOUT_MS=" << options.timeout_ms << "\n";
+    ini.close();
+
+    int pipe_fds[2];
+    if (pipe(pipe_fds) != 0) {
+        return false;
+    }
+    std::string binary = options.binary;
+    if (!binary.empty() && binary[0] != '/') {
+        char cwd[4096];
+        if (getcwd(cwd, sizeof(cwd)) != nullptr) {
+            binary = std::string(cwd) + "/" + binary;
+        }
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        return false;
+    }
+    if (pid == 0) {
+        dup2(pipe_fds[0], STDIN_FILENO);
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        int log_fd = open((node.dir + "/node.log").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (log_fd >= 0) {
+            dup2(log_fd, STDOUT_FILENO);
+            dup2(log_fd, STDERR_FILENO);
+            close(log_fd);
+        }
+        if (chdir(node.dir.c_str()) != 0) {
+            _exit(127);
+        }
+        execl(binary.c_str(), binary.c_str(), "config.ini", (char*)nullptr);
+        _exit(127);
+    }
+    close(pipe_fds[0]);
+    node.pid = pid;
+    node.stdin_fd = pipe_fds[1];
+    return true;
+}
+
+void stop_node(Node& node) {
+    if (node.pid > 0) {
+        kill(node.pid, SIGCONT);
+        ssize_t ret = write(node.stdin_fd, "q\n", 2);
+        (void)ret;
+        close(node.stdin_fd);
+        int status;
+        for (int i = 0; i < 100 && waitpid(node.pid, &status, WNOHANG) == 0; i++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+        if (waitpid(node.pid, &status, WNOHANG) == 0) {
+            kill(node.pid, SIGKILL);
+            waitpid(node.pid, &status, 0);
+        }
+        node.pid = -1;
+    }
+    if (!node.dir.empty()) {
+        std::string command = "rm -rf '" + node.dir + "'";
+        int ret = system(command.c_str());
+        (void)ret;
+        node.dir.clear();
+    }
+}
+
+/**
+ * @brief ノード0で1回ロールアウトする
+ * @param elapsed_ms 応答までの時間
+ * @return 応答の1行目（"!TX_COMMITTED ..." / "!TX_ABORTED ..."。通信できなければ空）
+ */
+std::string rollout(const std::vector<Node>& nodes, const std::string& entries, double& elapsed_ms) {
+    std::string reply;
+    Clock::time_point start = Clock::now();
+    request(nodes[0].port, "?ROLLOUT\n" + entries, reply);
+    elapsed_ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    return reply.substr(0, reply.find('\n'));
+}
+
+/**
+ * @brief 全ノードの値が expected と同じか
+ */
+bool all_nodes_have(const std::vector<Node>& nodes, const std::string& entry, const std::string& expected) {
+    for (const Node& node : nodes) {
+        std::string reply;
+        if (!request(node.port, "?GET " + entry + "\n", reply) || reply != entry + "=" + expected + "\n") {
+            return false;
+        }
+    }
+    return true;
+}
+
+double percentile(std::vector<double> samples, double p) {
+    if (samples.empty()) return 0;
+    std::sort(samples.begin(), samples.end());
+    size_t index = std::min(samples.size() - 1, (size_t)(p / 100.0 * samples.size()));
+    return samples[index];
+}
+
+bool parse_args(int argc, char* argv[], Options& options) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            std::cerr << "エラー: " << arg << " に値がありません。\n";
+            return false;
+        }
+        std::string value = argv[++i];
+        if (arg == "--binary") {
+            options.binary = value;
+        } else if (arg == "--nodes") {
+            options.nodes.clear();
+            std::stringstream ss(value);
+            std::string count;
+            while (std::getline(ss, count, ',')) {
+                options.nodes.push_back(std::max(2, atoi(count.c_str())));
+            }
+        } else if (arg == "--rounds") {
+            options.rounds = std::max(1, atoi(value.c_str()));
+        } else if (arg == "--base-port") {
+            options.base_port = atoi(value.c_str());
+        } else if (arg == "--timeout-ms") {
+            options.timeout_ms = std::max(10, atoi(value.c_str()));
+        } else {
+            std::cerr << "エラー: 不明なオプションです: " << arg << "\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    Options options;
+    if (!parse_args(argc, argv, options)) {
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    std::cout << "調整役はノード0、ロールアウト " << options.rounds << " 回、ROLLOUT_TIMEOUT_MS " << options.timeout_ms
+              << "ms\n\n";
+    std::cout << std::left << std::setw(7) << "nodes" << std::setw(10) << "p50_ms" << std::setw(10) << "p99_ms"
+              << std::setw(10) << "max_ms" << std::setw(10) << "agreed" << std::setw(12) << "validation"
+              << std::setw(14) << "stalled_abort" << "stalled_ms\n";
+
+    int exit_code = 0;
+    for (int count : options.nodes) {
+        std::vector<Node> nodes(count);
+        bool ok = true;
+        for (int i = 0; i < count && ok; i++) {
+            ok = start_node(options, count, i, nodes[i]);
+        }
+        for (int i = 0; i < count && ok; i++) {
+            ok = wait_port(nodes[i].port, 10.0);
+        }
+        if (!ok) {
+            std::cerr << "エラー: ノードを起動できませんでした（" << options.binary << "）。\n";
+            for (Node& node : nodes) stop_node(node);
+            return 1;
+        }
+
+        // 1. 毎回値を変えてロールアウトする（最初の数回は接続の準備運動として数えない）
+        const int warmup = 3;
+        std::vector<double> latencies;
+        int failures = 0;
+        int last_value = 0;
+        for (int round = 0; round < warmup + options.rounds; round++) {
+            last_value = 1500 + round % 400;
+            std::string entries = "[PWM]PWM_NORMAL_MAX=" + std::to_string(last_value) + "\n" +
+                                  "[PWM]PWM_BOOST_MAX=" + std::to_string(1900 - round % 400) + "\n";
+            double elapsed_ms = 0;
+            std::string reply = rollout(nodes, entries, elapsed_ms);
+            if (reply.compare(0, 13, "!TX_COMMITTED") != 0) {
+                failures++;
+                std::cerr << count << " ノード: ロールアウトがコミットされませんでした: " << reply << "\n";
+            } else if (round >= warmup) {
+                latencies.push_back(elapsed_ms);
+            }
+        }
+
+        // 2. 全ノードが最後の値に揃っているか
+        bool agreed = all_nodes_have(nodes, "[PWM]PWM_NORMAL_MAX", std::to_string(last_value));
+
+        // 3. 型の合わない値（整数の項目に文字列）は検証で中止され、どこにも反映されない
+        double elapsed_ms = 0;
+        std::string invalid = rollout(nodes, "[PWM]PWM_NORMAL_MAX=1234\n[PWM]PWM_BOOST_MAX=fast\n", elapsed_ms);
+        bool validation = invalid.compare(0, 11, "!TX_ABORTED") == 0 &&
+                          all_nodes_have(nodes, "[PWM]PWM_NORMAL_MAX", std::to_string(last_value));
+
+        // 4. 最後のノードを止めると、準備の応答が来ないまま ROLLOUT_TIMEOUT_MS で中止される。
+        //    再開したノードは準備を受け取っても決定が届かないため中止し、どのノードにも反映されない
+        kill(nodes[count - 1].pid, SIGSTOP);
+        double stalled_ms = 0;
+        std::string stalled = rollout(nodes, "[PWM]PWM_NORMAL_MAX=1111\n", stalled_ms);
+        kill(nodes[count - 1].pid, SIGCONT);
+        std::this_thread::sleep_for(std::chrono::milliseconds(options.timeout_ms * 2 + 200));
+        bool stalled_abort = stalled.compare(0, 11, "!TX_ABORTED") == 0 &&
+                             all_nodes_have(nodes, "[PWM]PWM_NORMAL_MAX", std::to_string(last_value));
+
+        std::cout << std::left << std::fixed << std::setprecision(2) << std::setw(7) << count << std::setw(10)
+                  << percentile(latencies, 50) << std::setw(10) << percentile(latencies, 99) << std::setw(10)
+                  << percentile(latencies, 100) << std::setw(10) << (agreed ? "yes" : "NO") << std::setw(12)
+                  << (validation ? "aborted" : "NOT_ABORTED") << std::setw(14)
+                  << (stalled_abort ? "aborted" : "NOT_ABORTED") << stalled_ms << "\n";
+        if (failures > 0 || !agreed || !validation || !stalled_abort) {
+            exit_code = 1;
+        }
+        for (Node& node : nodes) {
+            stop_node(node);
+        }
+    }
+    std::cout << "\np50/p99/max_ms: ?ROLLOUT を送ってから !TX_COMMITTED が返るまで（全ノードの準備とコミットの確認を含む）\n"
+              << "agreed: 全ノードの値が最後のロールアウトの値と揃っているか\n"
+              << "validation: 型の合わない値を含むロールアウトが中止され、どこにも反映されないか\n"
+              << "stalled_abort/stalled_ms: 1ノードを止めたときに中止されるか、中止までの時間\n";
+    return exit_code;
+}
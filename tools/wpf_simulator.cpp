@@ -0,0 +1,513 @@
+// wpf_simulator.cpp - WPFアプリケーションの代わりを務める負荷生成・受信ツール
+//
+// 目的:
+// Linux上でWPFアプリケーションを動かさずに、ConfigSynchronizerの受信側と送信側を
+// localhostでまとめて負荷試験する。
+// - クライアント役: CPP_RECV_PORT へN本の接続を並行して張り、0バイトの設定要求と
+//   更新を指定した割合・目標レートで送る。
+// - サーバー役: WPF_RECV_PORT で待ち受け、ConfigSynchronizerからの送信を受け取って
+//   形式を検証する。?PING には !PONG で応える。
+// 最後に、種類ごとのスループット・エラー率・p50/p99/p999の遅延を表示する。
+//
+// 更新を送信側の経路まで通すには、WPF_HOST 以外のアドレスから送る必要がある
+// （WPFからの更新はWPFへ送り返されないため）。例えば WPF_HOST=127.0.0.1 のとき
+// --source 127.0.0.2 を指定すると、更新がWPF役（このツール）まで届くまでの時間も測れる。
+//
+// 使用方法:
+// ./wpf_simulator [--host 127.0.0.1] [--port 12348] [--listen-port 12347]
+//                 [--connections 4] [--rate 200] [--update-ratio 0.2] [--duration 10]
+//                 [--key [JOYSTICK]DEADZONE] [--source 127.0.0.2] [--mode both|client|server]
+//   --rate はクライアント全体の目標レート（要求/秒）。0なら応答を待つだけで全力で送る。
+//   --listen-port 0 でサーバー役を無効にする。
+//
+// コンパイル方法:
+// make wpf-simulator
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <iomanip>
+#include <cstdlib>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <cstring>
+#include <errno.h>
+
+typedef std::chrono::steady_clock Clock;
+
+/**
+ * @brief 種類ごとの遅延の標本と失敗数
+ */
+struct Stats {
+    std::vector<double> samples_us;
+    uint64_t errors = 0;
+    uint64_t rejected = 0;  // !REJECTED で断られた更新
+    uint64_t bytes = 0;
+
+    void merge(const Stats& other) {
+        samples_us.insert(samples_us.end(), other.samples_us.begin(), other.samples_us.end());
+        errors += other.errors;
+        rejected += other.rejected;
+        bytes += other.bytes;
+    }
+};
+
+struct Options {
+    std::string host = "127.0.0.1";
+    int port = 12348;
+    int listen_port = 12347;
+    int connections = 4;
+    double rate = 200.0;
+    double update_ratio = 0.2;
+    double duration_sec = 10.0;
+    std::string key = "[JOYSTICK]DEADZONE";
+    std::string source;
+    std::string mode = "both";
+};
+
+std::atomic<bool> g_stop_clients{false};
+std::atomic<bool> g_stop_server{false};
+
+// 更新で送った値（連番）と送信時刻。サーバー役が受け取ったときの伝播時間の計算に使う
+std::mutex g_sent_mutex;
+std::map<uint64_t, Clock::time_point> g_sent_values;
+std::atomic<uint64_t> g_next_value{1000000};
+
+/**
+ * @brief サーバー役が受け取った送信の集計
+ */
+struct PushStats {
+    uint64_t pushes = 0;
+    uint64_t lines = 0;
+    uint64_t bytes = 0;
+    uint64_t malformed = 0;
+    uint64_t pings = 0;
+    std::string last_value;  // 最後に届いた、対象キーの値
+    Stats propagation;       // 更新を送ってから届くまでの時間
+};
+
+/**
+ * @brief 全部送る
+ */
+bool send_all(int sock, const std::string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = send(sock, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        sent += n;
+    }
+    return true;
+}
+
+/**
+ * @brief "<長さ>\n<本体>" 形式のメッセージを1つ読む
+ * @return 読めた場合true（相手が何も送らずに閉じた場合はfalseで、errnoは0）
+ */
+bool read_frame(int sock, std::string& body) {
+    std::string header;
+    char c;
+    while (true) {
+        ssize_t n = recv(sock, &c, 1, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n == 0) errno = 0;
+        if (n <= 0) return false;
+        if (c == '\n') break;
+        header += c;
+        if (header.size() > 20) return false;
+    }
+    size_t length = std::strtoull(header.c_str(), nullptr, 10);
+    body.resize(length);
+    size_t received = 0;
+    while (received < length) {
+        ssize_t n = recv(sock, &body[received], length - received, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        received += n;
+    }
+    return true;
+}
+
+/**
+ * @brief 本体が [SECTION]KEY=VALUE 行だけでできているか確かめる
+ * @return 行数（形式が崩れていれば-1）
+ */
+int count_config_lines(const std::string& body) {
+    int lines = 0;
+    size_t pos = 0;
+    while (pos < body.size()) {
+        size_t end = body.find('\n', pos);
+        if (end == std::string::npos) end = body.size();
+        if (end > pos) {
+            size_t close = body.find(']', pos);
+            size_t equals = body.find('=', pos);
+            if (body[pos] != '[' || close == std::string::npos || close >= end ||
+                equals == std::string::npos || equals >= end || equals < close) {
+                return -1;
+            }
+            lines++;
+        }
+        pos = end + 1;
+    }
+    return lines;
+}
+
+int connect_to(const Options& options) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    struct timeval timeout = {10, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (!options.source.empty()) {
+        struct sockaddr_in local;
+        memset(&local, 0, sizeof(local));
+        local.sin_family = AF_INET;
+        inet_pton(AF_INET, options.source.c_str(), &local.sin_addr);
+        if (bind(sock, (struct sockaddr*)&local, sizeof(local)) < 0) {
+            close(sock);
+            return -1;
+        }
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(options.port);
+    if (inet_pton(AF_INET, options.host.c_str(), &addr.sin_addr) <= 0 ||
+        connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/**
+ * @brief クライアント役の1接続分。目標レートの予定時刻どおりに要求を送る
+ *
+ * 遅延は予定時刻から測る（遅れて送った分も遅延に含め、詰まりを見逃さない）。
+ */
+void client_worker(const Options& options, int index, Stats& requests, Stats& updates) {
+    double per_worker_rate = options.rate / options.connections;
+    Clock::duration interval = per_worker_rate > 0
+        ? std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / per_worker_rate))
+        : Clock::duration::zero();
+    Clock::time_point scheduled = Clock::now() + interval * index / options.connections;
+    unsigned int seed = 12345u + index;
+
+    while (!g_stop_clients.load()) {
+        if (interval > Clock::duration::zero()) {
+            std::this_thread::sleep_until(scheduled);
+            if (g_stop_clients.load()) break;
+        } else {
+            scheduled = Clock::now();
+        }
+
+        bool is_update = (rand_r(&seed) % 10000) < options.update_ratio * 10000;
+        Stats& stats = is_update ? updates : requests;
+        std::string message;
+        uint64_t value = 0;
+        if (is_update) {
+            value = g_next_value.fetch_add(1);
+            std::string body = options.key + "=" + std::to_string(value) + "\n";
+            message = std::to_string(body.size()) + "\n" + body;
+        } else {
+            message = "0\n";
+        }
+
+        bool ok = false;
+        bool rejected = false;
+        int sock = connect_to(options);
+        if (sock >= 0) {
+            if (is_update) {
+                std::lock_guard<std::mutex> lock(g_sent_mutex);
+                g_sent_values[value] = Clock::now();
+            }
+            if (send_all(sock, message)) {
+                std::string reply;
+                bool got_frame = read_frame(sock, reply);
+                if (is_update) {
+                    // 更新には応答が無い。レート超過なら !REJECTED が返り、
+                    // 受付制限で本体を読まずに閉じられた場合はRSTになる
+                    if (got_frame && reply.compare(0, 9, "!REJECTED") == 0) {
+                        rejected = true;
+                    } else {
+                        ok = got_frame || errno == 0;
+                    }
+                } else {
+                    ok = got_frame && count_config_lines(reply) > 0;
+                    stats.bytes += reply.size();
+                }
+            }
+            close(sock);
+        }
+
+        if (ok) {
+            stats.samples_us.push_back(std::chrono::duration<double, std::micro>(Clock::now() - scheduled).count());
+        } else if (rejected) {
+            stats.rejected++;
+        } else {
+            stats.errors++;
+        }
+        scheduled += interval;
+    }
+}
+
+/**
+ * @brief サーバー役の1接続分。メッセージを読み、形式を検証する
+ */
+void handle_push(int sock, const Options& options, std::mutex& stats_mutex, PushStats& stats) {
+    std::string body;
+    if (!read_frame(sock, body)) {
+        close(sock);
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        stats.malformed++;
+        return;
+    }
+    Clock::time_point now = Clock::now();
+    if (body.compare(0, 5, "?PING") == 0) {
+        std::string token = body.substr(std::min<size_t>(6, body.size()));
+        token.erase(token.find_last_not_of("\r\n") + 1);
+        std::string reply = "!PONG " + token + "\n";
+        send_all(sock, std::to_string(reply.size()) + "\n" + reply);
+        close(sock);
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        stats.pings++;
+        return;
+    }
+    close(sock);
+
+    int lines = count_config_lines(body);
+    std::string needle = options.key + "=";
+    size_t found = body.find(needle);
+    std::string value;
+    if (found != std::string::npos) {
+        size_t end = body.find('\n', found);
+        value = body.substr(found + needle.size(), end == std::string::npos ? std::string::npos
+                                                                            : end - found - needle.size());
+    }
+
+    double propagation_us = -1;
+    if (!value.empty()) {
+        std::lock_guard<std::mutex> lock(g_sent_mutex);
+        auto it = g_sent_values.find(std::strtoull(value.c_str(), nullptr, 10));
+        if (it != g_sent_values.end()) {
+            propagation_us = std::chrono::duration<double, std::micro>(now - it->second).count();
+            // まとめられて届かなかった古い値の記録も、ここで捨てる
+            g_sent_values.erase(g_sent_values.begin(), ++it);
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    if (lines < 0) {
+        stats.malformed++;
+        return;
+    }
+    stats.pushes++;
+    stats.lines += lines;
+    stats.bytes += body.size();
+    if (!value.empty()) {
+        stats.last_value = value;
+    }
+    if (propagation_us >= 0) {
+        stats.propagation.samples_us.push_back(propagation_us);
+    }
+}
+
+/**
+ * @brief ConfigSynchronizerに対象キーの現在値を問い合わせる（?GET）
+ */
+std::string query_value(const Options& options) {
+    int sock = connect_to(options);
+    if (sock < 0) return "";
+    std::string body = "?GET " + options.key + "\n";
+    std::string reply;
+    if (!send_all(sock, std::to_string(body.size()) + "\n" + body) || !read_frame(sock, reply)) {
+        reply.clear();
+    }
+    close(sock);
+    size_t equals = reply.find('=');
+    if (equals == std::string::npos) return "";
+    std::string value = reply.substr(equals + 1);
+    value.erase(value.find_last_not_of("\r\n") + 1);
+    return value;
+}
+
+int open_listener(int port) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+    int one = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(sock, 64) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+double percentile(const std::vector<double>& sorted, double q) {
+    if (sorted.empty()) return 0.0;
+    size_t index = std::min(sorted.size() - 1, (size_t)(q * sorted.size()));
+    return sorted[index];
+}
+
+void print_latency(const std::string& label, Stats stats, double elapsed_sec) {
+    std::sort(stats.samples_us.begin(), stats.samples_us.end());
+    uint64_t total = stats.samples_us.size() + stats.errors + stats.rejected;
+    double error_rate = total ? 100.0 * stats.errors / total : 0.0;
+    std::cout << std::left << std::setw(12) << label << std::right << std::fixed << std::setprecision(1)
+              << std::setw(10) << stats.samples_us.size() / elapsed_sec
+              << std::setw(10) << percentile(stats.samples_us, 0.50)
+              << std::setw(10) << percentile(stats.samples_us, 0.99)
+              << std::setw(10) << percentile(stats.samples_us, 0.999)
+              << std::setw(10) << (stats.samples_us.empty() ? 0.0 : stats.samples_us.back())
+              << std::setw(8) << stats.errors << std::setw(8) << stats.rejected
+              << std::setw(8) << std::setprecision(2) << error_rate << "%\n";
+}
+
+bool parse_options(int argc, char* argv[], Options& options) {
+    for (int i = 1; i < argc; ++i) {
+        std::string name = argv[i];
+        if (i + 1 >= argc) {
+            std::cerr << "エラー: " << name << " に値がありません。\n";
+            return false;
+        }
+        std::string value = argv[++i];
+        if (name == "--host") options.host = value;
+        else if (name == "--port") options.port = std::atoi(value.c_str());
+        else if (name == "--listen-port") options.listen_port = std::atoi(value.c_str());
+        else if (name == "--connections") options.connections = std::max(1, std::atoi(value.c_str()));
+        else if (name == "--rate") options.rate = std::max(0.0, std::atof(value.c_str()));
+        else if (name == "--update-ratio") options.update_ratio = std::min(1.0, std::max(0.0, std::atof(value.c_str())));
+        else if (name == "--duration") options.duration_sec = std::max(0.1, std::atof(value.c_str()));
+        else if (name == "--key") options.key = value;
+        else if (name == "--source") options.source = value;
+        else if (name == "--mode") options.mode = value;
+        else {
+            std::cerr << "エラー: 不明なオプション " << name << "\n";
+            return false;
+        }
+    }
+    return options.mode == "both" || options.mode == "client" || options.mode == "server";
+}
+
+int main(int argc, char* argv[]) {
+    Options options;
+    if (!parse_options(argc, argv, options)) {
+        std::cerr << "使用方法: " << argv[0] << " [--host H] [--port P] [--listen-port P] [--connections N] [--rate R]"
+                  << " [--update-ratio X] [--duration SEC] [--key [S]K] [--source ADDR] [--mode both|client|server]\n";
+        return 1;
+    }
+    bool run_client = options.mode != "server";
+    bool run_server = options.mode != "client" && options.listen_port > 0;
+
+    // サーバー役: WPF_RECV_PORT で待ち受ける
+    std::mutex server_mutex;
+    PushStats pushes;
+    int listen_sock = -1;
+    std::thread server_thread;
+    if (run_server) {
+        listen_sock = open_listener(options.listen_port);
+        if (listen_sock < 0) {
+            std::cerr << "エラー: ポート " << options.listen_port << " で待ち受けできません: " << strerror(errno) << "\n";
+            return 1;
+        }
+        server_thread = std::thread([&]() {
+            while (!g_stop_server.load()) {
+                fd_set readfds;
+                FD_ZERO(&readfds);
+                FD_SET(listen_sock, &readfds);
+                struct timeval timeout = {0, 100 * 1000};
+                if (select(listen_sock + 1, &readfds, nullptr, nullptr, &timeout) <= 0) {
+                    continue;
+                }
+                int sock = accept(listen_sock, nullptr, nullptr);
+                if (sock < 0) continue;
+                struct timeval recv_timeout = {5, 0};
+                setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &recv_timeout, sizeof(recv_timeout));
+                std::thread(handle_push, sock, std::cref(options), std::ref(server_mutex), std::ref(pushes)).detach();
+            }
+        });
+    }
+
+    std::cout << "WPFシミュレーター: " << (run_client ? "クライアント役 " + options.host + ":" + std::to_string(options.port) : "")
+              << (run_client && run_server ? ", " : "")
+              << (run_server ? "サーバー役 :" + std::to_string(options.listen_port) : "") << "\n";
+    if (run_client) {
+        std::cout << "  接続数 " << options.connections << ", 目標レート "
+                  << (options.rate > 0 ? std::to_string((int)options.rate) + " 要求/秒" : std::string("無制限"))
+                  << ", 更新の割合 " << options.update_ratio << ", " << options.duration_sec << " 秒\n";
+    }
+
+    Clock::time_point start = Clock::now();
+    std::vector<Stats> request_stats(options.connections);
+    std::vector<Stats> update_stats(options.connections);
+    std::vector<std::thread> workers;
+    if (run_client) {
+        for (int i = 0; i < options.connections; ++i) {
+            workers.push_back(std::thread(client_worker, std::cref(options), i, std::ref(request_stats[i]),
+                                          std::ref(update_stats[i])));
+        }
+    }
+    std::this_thread::sleep_for(std::chrono::duration<double>(options.duration_sec));
+    g_stop_clients.store(true);
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    double elapsed_sec = std::chrono::duration<double>(Clock::now() - start).count();
+    if (run_client && run_server) {
+        // まとめて送られる最後の更新が届くのを待つ
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+    }
+    g_stop_server.store(true);
+    if (server_thread.joinable()) {
+        server_thread.join();
+        close(listen_sock);
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));  // 処理中の接続を待つ
+    }
+
+    std::cout << "\n" << std::left << std::setw(12) << "種類" << std::right << std::setw(10) << "件/秒"
+              << std::setw(10) << "p50" << std::setw(10) << "p99" << std::setw(10) << "p999"
+              << std::setw(10) << "最大" << std::setw(8) << "失敗" << std::setw(8) << "拒否"
+              << std::setw(9) << "エラー率" << "\n";
+    if (run_client) {
+        Stats requests;
+        Stats updates;
+        for (int i = 0; i < options.connections; ++i) {
+            requests.merge(request_stats[i]);
+            updates.merge(update_stats[i]);
+        }
+        print_latency("設定要求", requests, elapsed_sec);
+        print_latency("更新", updates, elapsed_sec);
+        std::cout << "  （遅延の単位はマイクロ秒。設定要求の受信量 " << requests.bytes << " バイト）\n";
+    }
+    if (run_server) {
+        std::lock_guard<std::mutex> lock(server_mutex);
+        print_latency("更新の伝播", pushes.propagation, elapsed_sec);
+        std::cout << "  送信の受信 " << pushes.pushes << " 件（" << pushes.lines << " 項目, " << pushes.bytes
+                  << " バイト, 形式エラー " << pushes.malformed << " 件）, ハートビート " << pushes.pings << " 件\n";
+        if (run_client && !pushes.last_value.empty()) {
+            // 最後に届いた値が、ConfigSynchronizerの現在値と同じなら取りこぼしは無い
+            std::string current = query_value(options);
+            std::cout << "  " << options.key << ": 現在値 " << current << " / 最後に届いた値 " << pushes.last_value
+                      << (current == pushes.last_value ? "（一致）" : "（不一致）") << "\n";
+        }
+    }
+    return 0;
+}